@@ -0,0 +1,28 @@
+-- A crowd of generated puppets for scaling tests
+--
+-- The sizes come from the environment, so the same file serves every
+-- run of a sweep:
+--
+--   PUPPETS=100 JOINTS=50 FANOUT=3 DEPTH=8 GEOMETRY=2 MATERIALS=8 SEED=7 ./puppeteer crowd.lua
+--
+-- SHARED=1 makes every puppet an instance of the same rig, so they all
+-- share one pose.
+
+local scenegen = require 'scenegen'
+
+local function param( name, default )
+  return tonumber( os.getenv( name ) ) or default
+end
+
+return scenegen.crowd{
+  puppets = param( 'PUPPETS', 10 ),
+  shared = param( 'SHARED', 0 ) ~= 0,
+  rig = {
+    seed = param( 'SEED', 1 ),
+    joints = param( 'JOINTS', 40 ),
+    depth = param( 'DEPTH', 8 ),
+    fanout = param( 'FANOUT', 3 ),
+    geometry = param( 'GEOMETRY', 1 ),
+    materials = param( 'MATERIALS', 4 ),
+  },
+}
@@ -0,0 +1,143 @@
+-- Synthetic scenes for scaling tests
+--
+-- Builds rigs of any size out of joints and spheres, and crowds of
+-- them. Everything is chosen by a generator seeded from the options,
+-- so the same options always give the same scene.
+--
+--   local scenegen = require 'scenegen'
+--   return scenegen.crowd{ puppets = 100, rig = { joints = 50, seed = 7 } }
+--
+-- import_lua lets scenes require libraries kept next to them.
+
+local scenegen = {}
+
+-- Park-Miller minimal standard generator. The products stay below
+-- 2^53, so doubles give the same sequence on every platform, which
+-- math.random does not
+local Random = {}
+Random.__index = Random
+
+function scenegen.random( seed )
+  local state = math.floor( seed or 1 ) % 2147483647
+  if state <= 0 then state = state + 2147483646 end
+  return setmetatable( { state = state }, Random )
+end
+
+-- Uniform in [0, 1)
+function Random:next()
+  self.state = ( self.state * 16807 ) % 2147483647
+  return ( self.state - 1 ) / 2147483646
+end
+
+-- Uniform in [lo, hi)
+function Random:range( lo, hi )
+  return lo + ( hi - lo ) * self:next()
+end
+
+-- Integer in [lo, hi]
+function Random:int( lo, hi )
+  return math.min( hi, lo + math.floor( ( hi - lo + 1 ) * self:next() ) )
+end
+
+-- Rig defaults
+local defaults = {
+  name = 'rig',
+  seed = 1,
+  joints = 100,      -- Joints in the rig
+  depth = 8,         -- Most joints from the root to a leaf
+  fanout = 3,        -- Most joints hanging off any one joint
+  geometry = 1,      -- Spheres on each joint
+  materials = 4,     -- Different materials to pick from
+  limit = 45.0,      -- Joints turn at most this far either way
+}
+
+local function with_defaults( options )
+  local result = {}
+  for k, v in pairs( defaults ) do result[k] = v end
+  for k, v in pairs( options or {} ) do result[k] = v end
+  return result
+end
+
+-- A rig of options.joints joints, filled in breadth first so it is
+-- as shallow as fanout allows. Stops early if depth and fanout can't
+-- hold that many joints.
+function scenegen.rig( options )
+  local o = with_defaults( options )
+  local random = scenegen.random( o.seed )
+
+  local materials = {}
+  for i = 1, o.materials do
+    materials[i] = gr.material( { random:next(), random:next(), random:next() }, { 0.1, 0.1, 0.1 }, 10 )
+  end
+
+  local root = gr.node( o.name )
+  local queue = { { node = root, depth = 0 } }
+  local first, made = 1, 0
+  while made < o.joints and first <= #queue do
+    local parent = queue[first]
+    first = first + 1
+    if parent.depth < o.depth then
+      local children = math.min( o.fanout, o.joints - made )
+      for c = 1, children do
+        made = made + 1
+        local name = o.name .. '_joint' .. made
+        local init_x = random:range( -o.limit, o.limit ) * 0.25
+        local init_y = random:range( -o.limit, o.limit ) * 0.25
+        local joint = gr.joint( name, { -o.limit, init_x, o.limit }, { -o.limit, init_y, o.limit } )
+        -- Spread siblings out and hang them below their parent
+        joint:translate( ( c - ( children + 1 ) / 2 ) * 1.2, -1.0, 0.0 )
+        joint:scale( 0.85, 0.85, 0.85 )
+        parent.node:add_child( joint )
+
+        for g = 1, o.geometry do
+          local part = gr.sphere( name .. '_part' .. g )
+          part:translate( random:range( -0.2, 0.2 ), -0.5 + random:range( -0.2, 0.2 ), random:range( -0.2, 0.2 ) )
+          part:scale( random:range( 0.2, 0.4 ), random:range( 0.4, 0.6 ), random:range( 0.2, 0.4 ) )
+          part:set_material( materials[random:int( 1, o.materials )] )
+          joint:add_child( part )
+        end
+
+        table.insert( queue, { node = joint, depth = parent.depth + 1 } )
+      end
+    end
+  end
+
+  if made < o.joints then
+    print( 'scenegen: ' .. o.name .. ' only has room for ' .. made .. ' joints' )
+  end
+  return root
+end
+
+-- options.puppets rigs on a square grid, options.spacing apart, made
+-- from options.rig. Each puppet gets a seed of its own unless shared
+-- is set, in which case they are all instances of one rig, sharing its
+-- joints, so posing one poses them all.
+function scenegen.crowd( options )
+  options = options or {}
+  local puppets = options.puppets or 10
+  local spacing = options.spacing or 4.0
+  local side = math.ceil( math.sqrt( puppets ) )
+  local rig = with_defaults( options.rig )
+
+  local crowd = gr.node( options.name or 'crowd' )
+  local shared = options.shared and scenegen.rig( rig )
+  for i = 0, puppets - 1 do
+    local puppet
+    if shared then
+      puppet = gr.instance( shared, 'puppet' .. ( i + 1 ) )
+    else
+      rig.name = 'puppet' .. ( i + 1 )
+      rig.seed = ( options.rig and options.rig.seed or defaults.seed ) + i
+      puppet = scenegen.rig( rig )
+    end
+    local row, column = math.floor( i / side ), i % side
+    puppet:translate( ( column - ( side - 1 ) / 2 ) * spacing, 0.0, -row * spacing )
+    crowd:add_child( puppet )
+  end
+
+  -- Far enough back for the whole crowd to be in view
+  crowd:translate( 0.0, 2.0, -10.0 - side * spacing )
+  return crowd
+end
+
+return scenegen
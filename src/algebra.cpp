@@ -141,3 +141,20 @@ Matrix4x4 Matrix4x4::invert() const
 
   return ret;
 }
+
+void rotation_of(const Matrix4x4& m, double r[3][3])
+{
+  Vector3D x(m[0][0], m[1][0], m[2][0]);
+  Vector3D y(m[0][1], m[1][1], m[2][1]);
+  double length = sqrt(x.dot(x));
+  x = Vector3D(x[0] / length, x[1] / length, x[2] / length);
+  y = y - x.dot(y) * x;
+  length = sqrt(y.dot(y));
+  y = Vector3D(y[0] / length, y[1] / length, y[2] / length);
+  Vector3D z = cross(x, y);
+  for(int i = 0; i < 3; ++i) {
+    r[i][0] = x[i];
+    r[i][1] = y[i];
+    r[i][2] = z[i];
+  }
+}
@@ -487,4 +487,7 @@ inline std::ostream& operator <<(std::ostream& os, const Colour& c)
   return os << "c<" << c.R() << "," << c.G() << "," << c.B() << ">";
 }
 
+// The rotation left of the linear part of m, by Gram-Schmidt on its columns
+void rotation_of(const Matrix4x4& m, double r[3][3]);
+
 #endif // CS488_ALGEBRA_HPP
@@ -1,6 +1,7 @@
 #include "appwindow.hpp"
 
-AppWindow::AppWindow()
+AppWindow::AppWindow( SceneLoader& loader )
+	: m_load_cancel( "Cancel" ), m_following( false ), m_loader( loader ), m_failed( false )
 {
 	set_title("Advanced Ergonomics Laboratory");
 
@@ -33,6 +34,9 @@ AppWindow::AppWindow()
 	m_menu_mode.items().push_back(Gtk::Menu_Helpers::RadioMenuElem( m_mode_group, "_Joints",
 																	Gtk::AccelKey("J"),
 																	sigc::bind(mode_slot, Viewer::JOINTS)));
+	m_menu_mode.items().push_back(Gtk::Menu_Helpers::RadioMenuElem( m_mode_group, "_Inverse Kinematics",
+																	Gtk::AccelKey("K"),
+																	sigc::bind(mode_slot, Viewer::IK)));
 	// Set initial mode to POS_ORIENT 
 	m_viewer.setMode( Viewer::POS_ORIENT);
 
@@ -42,6 +46,17 @@ AppWindow::AppWindow()
 										   sigc::mem_fun(m_viewer, &Viewer::undo)));
 	m_menu_edit.items().push_back(MenuElem("_Redo", Gtk::AccelKey("R"),
 										   sigc::mem_fun(m_viewer, &Viewer::redo)));
+	m_menu_edit.items().push_back(Gtk::Menu_Helpers::SeparatorElem());
+	sigc::slot1<void, Viewer::Select> select_slot =
+		sigc::mem_fun( m_viewer, &Viewer::select);
+	m_menu_edit.items().push_back(MenuElem("_Select All", Gtk::AccelKey("S"),
+										   sigc::bind(select_slot, Viewer::SELECT_ALL)));
+	m_menu_edit.items().push_back(MenuElem("Select _None", Gtk::AccelKey("X"),
+										   sigc::bind(select_slot, Viewer::SELECT_NONE)));
+	m_menu_edit.items().push_back(MenuElem("_Invert Selection", Gtk::AccelKey("V"),
+										   sigc::bind(select_slot, Viewer::SELECT_INVERT)));
+	m_menu_edit.items().push_back(MenuElem("Select Su_btrees", Gtk::AccelKey("H"),
+										   sigc::bind(select_slot, Viewer::SELECT_SUBTREE)));
 
 	// Set up the option menu
 	sigc::slot1<void, Viewer::Options> option_slot =
@@ -54,6 +69,18 @@ AppWindow::AppWindow()
 																	  sigc::bind(option_slot, Viewer::BACK_CULL)));
 	m_menu_options.items().push_back(Gtk::Menu_Helpers::CheckMenuElem("_Frontface Cull", Gtk::AccelKey("F"),
 																	  sigc::bind(option_slot, Viewer::FRONT_CULL)));
+	m_menu_options.items().push_back(Gtk::Menu_Helpers::CheckMenuElem("_Timing", Gtk::AccelKey("T"),
+																	  sigc::bind(option_slot, Viewer::PROFILER)));
+	m_menu_options.items().push_back(Gtk::Menu_Helpers::CheckMenuElem("_Lasso Selection", Gtk::AccelKey("L"),
+																	  sigc::bind(option_slot, Viewer::LASSO)));
+	m_menu_options.items().push_back(Gtk::Menu_Helpers::CheckMenuElem("Stop at _Contact", Gtk::AccelKey("G"),
+																	  sigc::bind(option_slot, Viewer::CONTACT)));
+	m_menu_options.items().push_back(Gtk::Menu_Helpers::CheckMenuElem("_Ragdoll", Gtk::AccelKey("Y"),
+																	  sigc::bind(option_slot, Viewer::RAGDOLL)));
+	m_menu_options.items().push_back(Gtk::Menu_Helpers::CheckMenuElem("Play _Motion", Gtk::AccelKey("M"),
+																	  sigc::bind(option_slot, Viewer::PLAY)));
+	m_menu_options.items().push_back(MenuElem("_Dump Timing", Gtk::AccelKey("D"),
+											  sigc::mem_fun(m_viewer, &Viewer::dumpProfile)));
 
 	// Set up the menu bar
 	m_menubar.items().push_back(Gtk::Menu_Helpers::MenuElem("_Application", m_menu_app));
@@ -72,7 +99,82 @@ AppWindow::AppWindow()
 	// Put the viewer below the menubar. pack_start "grows" the widget
 	// by default, so it'll take up the rest of the window.
 	m_viewer.set_size_request(500, 500);
+	m_viewer.set_loader(&m_loader);
 	m_vbox.pack_start(m_viewer);
 
+	// Loading progress goes at the bottom until the scene is in
+	m_load_box.pack_start(m_load_progress);
+	m_load_box.pack_start(m_load_cancel, Gtk::PACK_SHRINK);
+	m_vbox.pack_start(m_load_box, Gtk::PACK_SHRINK);
+	m_load_cancel.signal_clicked().connect(sigc::mem_fun(*this, &AppWindow::on_load_cancel));
+	Glib::signal_timeout().connect(sigc::mem_fun(*this, &AppWindow::on_load_poll), 100);
+
+	// The timeline stays hidden until there is a clip
+	m_timeline.set_digits( 0 );
+	m_timeline.set_increments( 1, 10 );
+	m_timeline.signal_value_changed().connect(sigc::mem_fun(*this, &AppWindow::on_scrub));
+	m_vbox.pack_start(m_timeline, Gtk::PACK_SHRINK);
+
 	show_all();
+	m_timeline.hide();
+}
+
+void AppWindow::set_clip( BvhClip* clip )
+{
+	m_viewer.set_clip( clip );
+	if ( clip->frames() == 0 ) return;
+	m_timeline.set_range( 0, clip->frames() - 1 );
+	m_timeline.show();
+	Glib::signal_timeout().connect(sigc::mem_fun(*this, &AppWindow::on_timeline_poll), 50);
+}
+
+void AppWindow::on_scrub()
+{
+	if ( !m_following ) m_viewer.seek( int( m_timeline.get_value() ) );
+}
+
+bool AppWindow::on_timeline_poll()
+{
+	// Timeouts run outside of the GDK lock
+	gdk_threads_enter();
+	int frame = m_viewer.clipFrame();
+	if ( int( m_timeline.get_value() ) != frame ) {
+		m_following = true;
+		m_timeline.set_value( frame );
+		m_following = false;
+	}
+	gdk_threads_leave();
+	return true;
+}
+
+bool AppWindow::on_load_poll()
+{
+	// Timeouts run outside of the GDK lock
+	gdk_threads_enter();
+
+	bool loading = !m_loader.done();
+	m_load_progress.set_fraction( m_loader.fraction() );
+	if ( loading ) {
+		// Show whatever has been built since last time
+		m_viewer.invalidate();
+	} else {
+		root = m_loader.get_scene();
+		if ( root ) {
+			m_load_box.hide();
+			m_viewer.loaded();
+		} else {
+			// Same as failing to load before the window came up
+			m_failed = true;
+			hide();
+		}
+	}
+
+	gdk_threads_leave();
+	return loading;
+}
+
+void AppWindow::on_load_cancel()
+{
+	m_load_cancel.set_sensitive( false );
+	m_loader.cancel();
 }
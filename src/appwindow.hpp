@@ -3,14 +3,30 @@
 
 #include <gtkmm.h>
 #include "viewer.hpp"
+#include "scene_loader.hpp"
 
 class AppWindow : public Gtk::Window {
 public:
-	AppWindow();
+	AppWindow( SceneLoader& loader );
+
+	// True if the window closed because the scene failed to load
+	bool failed() const { return m_failed; }
+
+	Viewer& get_viewer() { return m_viewer; }
+
+	// Play clip in the viewer, with a timeline to scrub through it
+	void set_clip( BvhClip* clip );
   
 protected:
 
 private:
+	// Called periodically while the scene loads
+	bool on_load_poll();
+	void on_load_cancel();
+	// The timeline being dragged, and following the clip as it plays
+	void on_scrub();
+	bool on_timeline_poll();
+
 	// A "vertical box" which holds everything in our window
 	Gtk::VBox m_vbox;
 
@@ -27,6 +43,18 @@ private:
 
 	// The main OpenGL area
 	Viewer m_viewer;
+
+	// Shown at the bottom while the scene loads
+	Gtk::HBox m_load_box;
+	Gtk::ProgressBar m_load_progress;
+	Gtk::Button m_load_cancel;
+
+	// Frames of the clip, at the bottom once there is one
+	Gtk::HScale m_timeline;
+	bool m_following;				// Moving the timeline ourselves, not a scrub
+
+	SceneLoader& m_loader;
+	bool m_failed;
 };
 
 #endif
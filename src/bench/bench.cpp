@@ -0,0 +1,622 @@
+// Microbenchmarks for the hot paths of the viewer: matrix and vector
+// math, scene traversal, picking, scene import, pose sampling,
+// collision detection, ragdoll steps and retargeting.
+//
+//   bench/bench [options] [scene.lua ...]
+//
+//   --joints N      size of the generated rig, default 1000
+//   --fanout N      children per joint in the generated rig, default 3
+//   --samples N     timed samples per benchmark, default 20
+//   --min-time MS   least time one sample may take, default 10
+//   --cpu N         CPU to pin to, default the one we start on, -1 for none
+//   --filter TEXT   only run benchmarks whose name contains TEXT
+//   --json FILE     also write the results as JSON
+//   --check         check retargeting gets known poses right, then exit
+//
+// Without scenes puppet.lua, a3mark.lua and crowd.lua are used, found
+// next to the sources relative to the bench binary rather than the
+// working directory, the last sized by its environment variables. Traversal and
+// picking need an X display for their GL context and are skipped
+// without one.
+
+#include "algebra.hpp"
+#include "scene.hpp"
+#include "scene_lua.hpp"
+#include "primitive.hpp"
+#include "material.hpp"
+#include "viewer.hpp"
+#include "profiler.hpp"
+#include "offscreen_gl.hpp"
+#include "pose_sampler.hpp"
+#include "collision.hpp"
+#include "ragdoll.hpp"
+#include "retarget.hpp"
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+
+// The viewer's puppet, unused here but needed to link viewer.o
+SceneNode *root = NULL;
+
+#define BENCH_WIDTH 500
+#define BENCH_HEIGHT 500
+#define BENCH_PICK_BUFFER 65536
+
+// Results are written here so the compiler can't drop the work
+static volatile double sink;
+
+// Something to time. run() does the work n times over
+class Benchmark {
+public:
+	Benchmark( const std::string& name ) : m_name( name ) {}
+	virtual ~Benchmark() {}
+
+	const std::string& get_name() const { return m_name; }
+	virtual void run( long n ) = 0;
+	// Undo whatever run left behind, after the sample is timed
+	virtual void finish() {}
+
+private:
+	std::string m_name;
+};
+
+// Per operation, in nanoseconds
+struct Result {
+	std::string name;
+	long iterations;			// Per sample
+	std::vector<double> samples;
+	double min, median, mean, p95, stddev;
+};
+
+/*
+ * Math
+ */
+
+// A varied set of invertible matrices, so nothing is constant folded
+static std::vector<Matrix4x4> make_matrices()
+{
+	std::vector<Matrix4x4> matrices;
+	srand( 488 );
+	for ( int i = 0; i < 64; i++ ) {
+		Vector3D t( rand() % 100 / 10.0, rand() % 100 / 10.0, rand() % 100 / 10.0 );
+		Vector3D s( 0.5 + rand() % 100 / 50.0, 0.5 + rand() % 100 / 50.0, 0.5 + rand() % 100 / 50.0 );
+		matrices.push_back( translation_matrix( t ) * rotation_matrix( 'x', rand() % 360 ) *
+							rotation_matrix( 'y', rand() % 360 ) * scaling_matrix( s ) );
+	}
+	return matrices;
+}
+
+class MatrixMultiply : public Benchmark {
+public:
+	MatrixMultiply() : Benchmark( "matrix_multiply" ), m_matrices( make_matrices() ) {}
+	virtual void run( long n ) {
+		Matrix4x4 m;
+		for ( long i = 0; i < n; i++ ) m = m_matrices[i & 63] * m_matrices[( i + 1 ) & 63];
+		sink = m[0][0];
+	}
+private:
+	std::vector<Matrix4x4> m_matrices;
+};
+
+class MatrixInvert : public Benchmark {
+public:
+	MatrixInvert() : Benchmark( "matrix_invert" ), m_matrices( make_matrices() ) {}
+	virtual void run( long n ) {
+		double sum = 0.0;
+		for ( long i = 0; i < n; i++ ) sum += m_matrices[i & 63].invert()[0][0];
+		sink = sum;
+	}
+private:
+	std::vector<Matrix4x4> m_matrices;
+};
+
+class VectorNormalize : public Benchmark {
+public:
+	VectorNormalize() : Benchmark( "vector_normalize" ) {
+		srand( 488 );
+		for ( int i = 0; i < 64; i++ ) m_vectors.push_back( Vector3D( rand() % 100 + 1, rand() % 100, rand() % 100 ) );
+	}
+	virtual void run( long n ) {
+		double sum = 0.0;
+		for ( long i = 0; i < n; i++ ) {
+			Vector3D v = m_vectors[i & 63];
+			sum += v.normalize();
+		}
+		sink = sum;
+	}
+private:
+	std::vector<Vector3D> m_vectors;
+};
+
+/*
+ * Scenes
+ */
+
+// A rig of joints, each holding a sphere and up to fanout more joints
+static SceneNode* make_rig( int joints, int fanout )
+{
+	Sphere* sphere = new Sphere();
+	PhongMaterial* materials[4] = {
+		new PhongMaterial( Colour( 1.0, 0.0, 0.0 ), Colour( 0.1, 0.1, 0.1 ), 10 ),
+		new PhongMaterial( Colour( 0.0, 1.0, 0.0 ), Colour( 0.1, 0.1, 0.1 ), 10 ),
+		new PhongMaterial( Colour( 0.0, 0.0, 1.0 ), Colour( 0.1, 0.1, 0.1 ), 10 ),
+		new PhongMaterial( Colour( 1.0, 1.0, 1.0 ), Colour( 0.1, 0.1, 0.1 ), 10 ),
+	};
+
+	SceneNode* rig = new SceneNode( "rig" );
+	rig->translate( Vector3D( 0.0, 0.0, -20.0 ) );
+	std::vector<SceneNode*> nodes( 1, rig );
+	for ( int i = 0; i < joints; i++ ) {
+		std::ostringstream name;
+		name << "joint" << i;
+		JointNode* joint = new JointNode( name.str() );
+		joint->set_joint_x( -45.0, 0.0, 45.0 );
+		joint->set_joint_y( -45.0, 0.0, 45.0 );
+		joint->translate( Vector3D( ( i % fanout ) - ( fanout - 1 ) / 2.0, -1.0, 0.0 ) );
+		joint->scale( Vector3D( 0.9, 0.9, 0.9 ) );
+
+		GeometryNode* geometry = new GeometryNode( name.str() + "_geometry", sphere );
+		geometry->scale( Vector3D( 0.3, 0.5, 0.3 ) );
+		geometry->set_material( materials[i % 4] );
+		joint->add_child( geometry );
+
+		// Breadth first, so the rig is as shallow as the fanout allows
+		nodes[i / fanout]->add_child( joint );
+		nodes.push_back( joint );
+	}
+	return rig;
+}
+
+// The same view as the viewer, into an offscreen context, so drawing
+// and picking can be timed without a window
+static bool make_gl_context()
+{
+	if ( !make_offscreen_gl_context( BENCH_WIDTH, BENCH_HEIGHT ) ) return false;
+
+	glViewport( 0, 0, BENCH_WIDTH, BENCH_HEIGHT );
+	glMatrixMode( GL_PROJECTION );
+	glLoadIdentity();
+	gluPerspective( 40.0, (GLfloat)BENCH_WIDTH / (GLfloat)BENCH_HEIGHT, 0.1, 1000.0 );
+	glMatrixMode( GL_MODELVIEW );
+	glLoadIdentity();
+	glEnable( GL_DEPTH_TEST );
+	Primitive::set_pixels_per_unit( BENCH_HEIGHT / ( 2.0 * tan( 20.0 * M_PI / 180.0 ) ) );
+	return true;
+}
+
+class WalkGl : public Benchmark {
+public:
+	WalkGl( const std::string& name, SceneNode* scene ) : Benchmark( "walk_gl/" + name ), m_scene( scene ) {}
+	virtual void run( long n ) {
+		for ( long i = 0; i < n; i++ ) {
+			glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+			m_scene->walk_gl( m_scene->get_transform(), false );
+		}
+		glFinish();
+	}
+private:
+	SceneNode* m_scene;
+};
+
+// A selection pass through the middle of the view, as a click there
+// would make, and the joint it picks
+class Pick : public Benchmark {
+public:
+	Pick( const std::string& name, SceneNode* scene ) : Benchmark( "pick/" + name ), m_scenes( 1, scene ) {}
+	virtual void run( long n ) {
+		long picked = 0;
+		for ( long i = 0; i < n; i++ ) {
+			int hits = Viewer::selectionPass( m_buffer, BENCH_PICK_BUFFER, BENCH_WIDTH / 2, BENCH_HEIGHT / 2,
+											  BENCH_WIDTH, BENCH_HEIGHT, Matrix4x4(), m_scenes );
+			if ( Viewer::pickedJoint( m_buffer, hits ) ) picked++;
+		}
+		sink = picked;
+	}
+private:
+	std::vector<SceneNode*> m_scenes;
+	GLuint m_buffer[BENCH_PICK_BUFFER];
+};
+
+class ImportLua : public Benchmark {
+public:
+	ImportLua( const std::string& name, const std::string& filename )
+		: Benchmark( "import_lua/" + name ), m_filename( filename ) {}
+	virtual void run( long n ) {
+		for ( long i = 0; i < n; i++ ) {
+			SceneNode* scene = import_lua( m_filename );
+			if ( scene ) m_scenes.push_back( scene );
+		}
+		sink = m_scenes.size();
+	}
+	// Every scene imported goes again, numbers and names with it, so
+	// the registry stays the size one import makes it
+	virtual void finish() {
+		for ( size_t i = 0; i < m_scenes.size(); i++ ) {
+			std::vector<bool> reached( SceneNode::id_limit(), false );
+			m_scenes[i]->mark_subtree( reached );
+			std::vector<NodeId> ids;
+			for ( NodeId id = 0; id < reached.size(); id++ ) {
+				if ( reached[id] ) ids.push_back( id );
+			}
+			SceneNode::destroy( ids );
+		}
+		m_scenes.clear();
+	}
+private:
+	std::string m_filename;
+	std::vector<SceneNode*> m_scenes;
+};
+
+// Random poses of a scene's rig, with their projections, a chunk at a time
+class SamplePoses : public Benchmark {
+public:
+	SamplePoses( const std::string& name, SceneNode* scene )
+		: Benchmark( "sample_poses/" + name ), m_sampler( scene ), m_next( 0 )
+	{
+		m_sampler.set_projection( BENCH_WIDTH, BENCH_HEIGHT );
+		m_records.resize( SAMPLE_CHUNK * m_sampler.record_size() );
+	}
+	virtual void run( long n ) {
+		for ( long done = 0; done < n; done += SAMPLE_CHUNK ) {
+			size_t count = std::min( n - done, (long)SAMPLE_CHUNK );
+			m_sampler.sample( 1, m_next, count, &m_records[0] );
+			m_next += count;
+		}
+		sink = m_records[0];
+	}
+private:
+	PoseSampler m_sampler;
+	unsigned long long m_next;
+	std::vector<float> m_records;
+};
+
+// A joint halfway down a rig turning back and forth, as a drag with
+// Stop at Contact on does, and the contacts found after every turn
+class Collide : public Benchmark {
+public:
+	Collide( const std::string& name, SceneNode* scene ) : Benchmark( "collide/" + name ), m_turn( 1.0 )
+	{
+		std::vector<NodeId> joints;
+		scene->findJoints( joints );
+		m_joint = JointNode::by_id( joints[joints.size() / 2] );
+		m_world.build( scene );
+	}
+	virtual void run( long n ) {
+		size_t contacts = 0;
+		for ( long i = 0; i < n; i++ ) {
+			m_joint->rotate_limited( m_turn, m_turn );
+			if ( m_joint->get_rotation()[0] >= 40.0 || m_joint->get_rotation()[0] <= -40.0 ) m_turn = -m_turn;
+			contacts += m_world.update();
+		}
+		sink = contacts;
+	}
+private:
+	CollisionWorld m_world;
+	JointNode* m_joint;
+	double m_turn;
+};
+
+// Steps of a scene's puppets falling limp and then lying there, on
+// this thread alone
+class Simulate : public Benchmark {
+public:
+	Simulate( const std::string& name, SceneNode* scene ) : Benchmark( "simulate/" + name )
+	{
+		m_ragdoll.build( scene );
+	}
+	virtual void run( long n ) {
+		m_ragdoll.run( n, 1 );
+		sink = m_ragdoll.steps();
+	}
+private:
+	Ragdoll m_ragdoll;
+};
+
+// A scene's own rig retargeted onto itself, every joint of it turning,
+// so every instance in a crowd of the joint a name finds is a target
+class RetargetPose : public Benchmark {
+public:
+	RetargetPose( const std::string& name, SceneNode* scene ) : Benchmark( "retarget/" + name ), m_angle( 0.0 )
+	{
+		std::vector<NodeId> joints;
+		m_retarget.add_sources( scene, joints );
+		m_retarget.build( scene, JointMap() );
+	}
+	virtual void run( long n ) {
+		for ( long i = 0; i < n; i++ ) {
+			m_angle = m_angle >= 40.0 ? -40.0 : m_angle + 1.0;
+			for ( size_t s = 0; s < m_retarget.sources(); s++ ) m_retarget.set_angles( s, m_angle, -m_angle );
+			m_retarget.run();
+			m_retarget.apply();
+		}
+		sink = m_retarget.targets();
+	}
+private:
+	Retarget m_retarget;
+	double m_angle;
+};
+
+/*
+ * Checks
+ */
+
+// A shoulder and an elbow under root, a unit apart
+static void make_arm( SceneNode* root, double shoulder_x, double elbow_x, double arm_z,
+					  JointNode*& shoulder, JointNode*& elbow )
+{
+	shoulder = new JointNode( "shoulder" );
+	shoulder->set_joint_x( -170.0, shoulder_x, 170.0 );
+	shoulder->set_joint_y( -80.0, 0.0, 80.0 );
+	SceneNode* arm = new SceneNode( "arm" );
+	arm->translate( Vector3D( 0.0, -1.0, 0.0 ) );
+	arm->rotate( 'z', arm_z );
+	elbow = new JointNode( "elbow" );
+	elbow->set_joint_x( -170.0, elbow_x, 170.0 );
+	elbow->set_joint_y( -80.0, 0.0, 80.0 );
+	root->add_child( shoulder );
+	shoulder->add_child( arm );
+	arm->add_child( elbow );
+}
+
+// Retarget known poses between two arms with different rest poses, and
+// check each joint of the target comes out turned as the source was,
+// seen from the world. Returns non-zero if any doesn't
+static int retarget_check()
+{
+	// The source's elbow rests bent 10 degrees, the target's straight,
+	// with its shoulder raised 20 degrees and its forearm a quarter turn
+	// about z, so a turn about the source elbow's x is one about the
+	// target elbow's -y
+	JointNode *shoulder, *elbow;
+	SceneNode* source = new SceneNode( "source" );
+	make_arm( source, 0.0, 10.0, 0.0, shoulder, elbow );
+	SceneNode* target = new SceneNode( "target" );
+	make_arm( target, 20.0, 0.0, 90.0, shoulder, elbow );
+
+	Retarget retarget;
+	std::vector<NodeId> joints;
+	retarget.add_sources( source, joints );
+	JointMap map;
+	map["shoulder"] = "target/shoulder";
+	map["elbow"] = "target/shoulder/arm/elbow";
+	if ( retarget.build( target, map ) != 2 ) {
+		std::cerr << "The arms did not map joint to joint" << std::endl;
+		return 1;
+	}
+
+	// Source shoulder and elbow angles, then the target's expected
+	const double poses[][8] = {
+		{ 0.0, 0.0, 10.0, 0.0,    20.0, 0.0, 0.0, 0.0 },
+		{ 15.0, 0.0, 10.0, 0.0,   35.0, 0.0, 0.0, 0.0 },
+		{ 0.0, 0.0, 40.0, 0.0,    20.0, 0.0, 0.0, -30.0 },
+		{ 15.0, 0.0, 40.0, 0.0,   35.0, 0.0, 0.0, -30.0 },
+		{ -25.0, 0.0, -20.0, 0.0, -5.0, 0.0, 0.0, 30.0 },
+	};
+	const double tolerance = 1e-3;
+	int failed = 0;
+	for ( size_t p = 0; p < sizeof( poses ) / sizeof( poses[0] ); p++ ) {
+		for ( size_t j = 0; j < joints.size(); j++ ) {
+			int s = JointNode::by_id( joints[j] )->get_name() == "shoulder" ? 0 : 2;
+			retarget.set_angles( j, poses[p][s], poses[p][s + 1] );
+		}
+		retarget.run();
+		retarget.apply();
+
+		const double* expected = poses[p] + 4;
+		const Vector3D& got_shoulder = shoulder->get_rotation();
+		const Vector3D& got_elbow = elbow->get_rotation();
+		bool ok = fabs( got_shoulder[0] - expected[0] ) < tolerance && fabs( got_shoulder[1] - expected[1] ) < tolerance &&
+				  fabs( got_elbow[0] - expected[2] ) < tolerance && fabs( got_elbow[1] - expected[3] ) < tolerance;
+		std::cout << "shoulder " << poses[p][0] << "," << poses[p][1] << " elbow " << poses[p][2] << "," << poses[p][3]
+				  << " -> shoulder " << got_shoulder[0] << "," << got_shoulder[1]
+				  << " elbow " << got_elbow[0] << "," << got_elbow[1] << ( ok ? "" : "  WRONG" ) << std::endl;
+		if ( !ok ) failed++;
+	}
+	std::cout << ( failed ? "FAILED" : "ok" ) << std::endl;
+	return failed ? 1 : 0;
+}
+
+/*
+ * Harness
+ */
+
+static double sample( Benchmark& benchmark, long n )
+{
+	double start = Profiler::now();
+	benchmark.run( n );
+	double time = Profiler::now() - start;
+	benchmark.finish();
+	return time;
+}
+
+static Result measure( Benchmark& benchmark, int samples, double min_time )
+{
+	Result result;
+	result.name = benchmark.get_name();
+
+	// Double the iterations until one sample is long enough to time well,
+	// which also warms up the caches
+	long n = 1;
+	while ( sample( benchmark, n ) < min_time && n < ( 1L << 40 ) ) n *= 2;
+	result.iterations = n;
+
+	for ( int s = 0; s < samples; s++ ) result.samples.push_back( sample( benchmark, n ) * 1e9 / n );
+
+	std::vector<double> sorted( result.samples );
+	std::sort( sorted.begin(), sorted.end() );
+	double sum = 0.0;
+	for ( size_t i = 0; i < sorted.size(); i++ ) sum += sorted[i];
+	result.min = sorted.front();
+	result.median = sorted[sorted.size() / 2];
+	result.mean = sum / sorted.size();
+	result.p95 = sorted[( sorted.size() - 1 ) * 95 / 100];
+	double squares = 0.0;
+	for ( size_t i = 0; i < sorted.size(); i++ ) squares += ( sorted[i] - result.mean ) * ( sorted[i] - result.mean );
+	result.stddev = sqrt( squares / sorted.size() );
+	return result;
+}
+
+static bool write_json( const std::string& filename, const std::vector<Result>& results, int cpu )
+{
+	std::ofstream out( filename.c_str() );
+	if ( !out ) return false;
+
+	char host[256] = "";
+	gethostname( host, sizeof( host ) - 1 );
+	out << "{" << std::endl;
+	out << "  \"context\": { \"host\": \"" << host << "\", \"time\": " << time( NULL )
+		<< ", \"cpu\": " << cpu << " }," << std::endl;
+	out << "  \"benchmarks\": [" << std::endl;
+	for ( size_t r = 0; r < results.size(); r++ ) {
+		const Result& result = results[r];
+		out << "    { \"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+			<< ", \"unit\": \"ns\", \"min\": " << result.min << ", \"median\": " << result.median
+			<< ", \"mean\": " << result.mean << ", \"p95\": " << result.p95
+			<< ", \"stddev\": " << result.stddev << ", \"samples\": [";
+		for ( size_t s = 0; s < result.samples.size(); s++ ) out << ( s ? ", " : "" ) << result.samples[s];
+		out << "] }" << ( r + 1 < results.size() ? "," : "" ) << std::endl;
+	}
+	out << "  ]" << std::endl << "}" << std::endl;
+	return out.good();
+}
+
+static std::string scene_name( const std::string& filename )
+{
+	std::string name = filename.substr( filename.find_last_of( '/' ) + 1 );
+	return name.substr( 0, name.find( '.' ) );
+}
+
+static bool exists( const std::string& filename )
+{
+	struct stat st;
+	return stat( filename.c_str(), &st ) == 0;
+}
+
+// The directory holding this binary, with a trailing slash
+static std::string executable_dir( const char* argv0 )
+{
+	char path[4096];
+	ssize_t length = readlink( "/proc/self/exe", path, sizeof( path ) - 1 );
+	std::string exe = length > 0 ? std::string( path, length ) : std::string( argv0 );
+	std::string::size_type slash = exe.find_last_of( '/' );
+	return slash == std::string::npos ? std::string( "./" ) : exe.substr( 0, slash + 1 );
+}
+
+int main( int argc, char** argv )
+{
+	int joints = 1000, fanout = 3, samples = 20, cpu = sched_getcpu();
+	double min_time = 0.01;
+	std::string filter, json;
+	std::vector<std::string> scenes;
+	bool check = false;
+
+	for ( int i = 1; i < argc; i++ ) {
+		std::string arg = argv[i];
+		bool value = i + 1 < argc;
+		if ( arg == "--joints" && value ) joints = std::max( 1, atoi( argv[++i] ) );
+		else if ( arg == "--fanout" && value ) fanout = std::max( 1, atoi( argv[++i] ) );
+		else if ( arg == "--samples" && value ) samples = std::max( 1, atoi( argv[++i] ) );
+		else if ( arg == "--min-time" && value ) min_time = atof( argv[++i] ) / 1000.0;
+		else if ( arg == "--cpu" && value ) cpu = atoi( argv[++i] );
+		else if ( arg == "--filter" && value ) filter = argv[++i];
+		else if ( arg == "--json" && value ) json = argv[++i];
+		else if ( arg == "--check" ) check = true;
+		else if ( arg[0] == '-' ) {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return 1;
+		} else {
+			scenes.push_back( arg );
+		}
+	}
+	if ( check ) return retarget_check();
+	if ( scenes.empty() ) {
+		// The binary lives in src/bench
+		std::string dir = executable_dir( argv[0] );
+		const char* defaults[] = { "../../puppet.lua", "../a3mark.lua", "../../crowd.lua" };
+		for ( size_t i = 0; i < sizeof( defaults ) / sizeof( defaults[0] ); i++ ) {
+			if ( exists( dir + defaults[i] ) ) scenes.push_back( dir + defaults[i] );
+			else std::cerr << "Default scene " << dir + defaults[i] << " not found, skipping" << std::endl;
+		}
+	}
+
+	// Stay on one CPU, so migrations don't show up in the samples
+	if ( cpu >= 0 ) {
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		CPU_SET( cpu, &set );
+		if ( sched_setaffinity( 0, sizeof( set ), &set ) != 0 ) {
+			std::cerr << "Unable to pin to CPU " << cpu << std::endl;
+			cpu = -1;
+		}
+	}
+
+	if ( !Glib::thread_supported() ) Glib::thread_init();
+
+	std::vector<Benchmark*> benchmarks;
+	benchmarks.push_back( new MatrixMultiply() );
+	benchmarks.push_back( new MatrixInvert() );
+	benchmarks.push_back( new VectorNormalize() );
+	{
+		std::ostringstream rig;
+		rig << "rig" << joints << "x" << fanout;
+		benchmarks.push_back( new Collide( rig.str(), make_rig( joints, fanout ) ) );
+		benchmarks.push_back( new Simulate( rig.str(), make_rig( joints, fanout ) ) );
+	}
+	for ( size_t i = 0; i < scenes.size(); i++ ) {
+		benchmarks.push_back( new ImportLua( scene_name( scenes[i] ), scenes[i] ) );
+		SceneNode* scene = import_lua( scenes[i] );
+		if ( !scene ) continue;
+		benchmarks.push_back( new SamplePoses( scene_name( scenes[i] ), scene ) );
+		benchmarks.push_back( new Simulate( scene_name( scenes[i] ), scene ) );
+		benchmarks.push_back( new RetargetPose( scene_name( scenes[i] ), scene ) );
+	}
+
+	if ( make_gl_context() ) {
+		std::ostringstream rig;
+		rig << "rig" << joints << "x" << fanout;
+		std::vector<std::pair<std::string, SceneNode*> > loaded;
+		loaded.push_back( std::make_pair( rig.str(), make_rig( joints, fanout ) ) );
+		for ( size_t i = 0; i < scenes.size(); i++ ) {
+			SceneNode* scene = import_lua( scenes[i] );
+			if ( !scene ) continue;
+			// Pull the scene into view, as the viewer's camera does
+			scene->translate( Vector3D( 0.0, 0.0, -10.0 ) );
+			loaded.push_back( std::make_pair( scene_name( scenes[i] ), scene ) );
+		}
+		for ( size_t i = 0; i < loaded.size(); i++ ) {
+			benchmarks.push_back( new WalkGl( loaded[i].first, loaded[i].second ) );
+			benchmarks.push_back( new Pick( loaded[i].first, loaded[i].second ) );
+		}
+	} else {
+		std::cerr << "No GL context, skipping traversal and picking" << std::endl;
+	}
+
+	std::vector<Result> results;
+	printf( "%-28s %12s %12s %12s %12s %10s\n", "benchmark", "min ns", "median ns", "p95 ns", "stddev", "iters" );
+	for ( size_t i = 0; i < benchmarks.size(); i++ ) {
+		if ( benchmarks[i]->get_name().find( filter ) == std::string::npos ) continue;
+		Result result = measure( *benchmarks[i], samples, min_time );
+		printf( "%-28s %12.1f %12.1f %12.1f %12.1f %10ld\n", result.name.c_str(),
+				result.min, result.median, result.p95, result.stddev, result.iterations );
+		fflush( stdout );
+		results.push_back( result );
+	}
+
+	if ( !json.empty() && !write_json( json, results, cpu ) ) {
+		std::cerr << "Unable to write " << json << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,252 @@
+#include "bvh.hpp"
+#include "text_parse.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+// The next run of characters up to a space or line end, false at the end
+static bool next_word( const char*& p, const char* end, std::string& word )
+{
+	p = skip_blank( p, end );
+	const char* start = p;
+	while ( p < end && !is_space( *p ) && *p != '\n' ) p++;
+	word.assign( start, p );
+	return p > start;
+}
+
+BvhClip::BvhClip()
+	: m_channels( 0 ), m_frames( 0 ), m_frame_time( 0.0 ), m_next_frame( -1 ), m_next( NULL )
+{
+}
+
+bool BvhClip::open( const std::string& filename )
+{
+	close();
+	if ( !m_file.open( filename ) ) {
+		std::cerr << "Error loading " << filename << ": can't open file" << std::endl;
+		return false;
+	}
+
+	const char* p = m_file.begin();
+	std::string error;
+	if ( !parse_hierarchy( p, error ) ) {
+		std::cerr << "Error loading " << filename << ": " << error << std::endl;
+		close();
+		return false;
+	}
+	m_index.push_back( p );
+	m_values.resize( m_channels );
+	return true;
+}
+
+void BvhClip::close()
+{
+	m_file.close();
+	m_joints.clear();
+	m_channels = 0;
+	m_frames = 0;
+	m_frame_time = 0.0;
+	m_index.clear();
+	m_next_frame = -1;
+	m_next = NULL;
+	m_retarget.clear();
+	m_source.clear();
+}
+
+bool BvhClip::parse_hierarchy( const char*& p, std::string& error )
+{
+	const char* end = m_file.end();
+	std::string word;
+	if ( !next_word( p, end, word ) || word != "HIERARCHY" ) {
+		error = "not a BVH file";
+		return false;
+	}
+
+	// Joints still open, -1 for an end site, which has an offset but no
+	// channels and is of no use to us
+	std::vector<int> open;
+	for ( ;; ) {
+		if ( !next_word( p, end, word ) ) {
+			error = "the hierarchy ends early";
+			return false;
+		}
+		if ( word == "MOTION" && open.empty() && !m_joints.empty() ) break;
+
+		if ( ( word == "ROOT" && open.empty() ) || ( word == "JOINT" && !open.empty() && open.back() >= 0 ) ) {
+			Joint joint;
+			joint.parent = open.empty() ? -1 : open.back();
+			joint.offset[0] = joint.offset[1] = joint.offset[2] = 0.0;
+			joint.rotations = 0;
+			if ( !next_word( p, end, joint.name ) ) {
+				error = "a joint has no name";
+				return false;
+			}
+			open.push_back( m_joints.size() );
+			m_joints.push_back( joint );
+		} else if ( word == "End" && !open.empty() && open.back() >= 0 ) {
+			next_word( p, end, word );
+			open.push_back( -1 );
+		} else if ( word == "{" && !open.empty() ) {
+			continue;
+		} else if ( word == "}" && !open.empty() ) {
+			open.pop_back();
+		} else if ( word == "OFFSET" && !open.empty() ) {
+			for ( int i = 0; i < 3; i++ ) {
+				float value;
+				p = skip_blank( p, end );
+				if ( !parse_float( p, end, value ) ) {
+					error = "an offset is not three numbers";
+					return false;
+				}
+				if ( open.back() >= 0 ) m_joints[open.back()].offset[i] = value;
+			}
+		} else if ( word == "CHANNELS" && !open.empty() && open.back() >= 0 ) {
+			Joint& joint = m_joints[open.back()];
+			long count;
+			p = skip_blank( p, end );
+			if ( !parse_int( p, end, count ) || count < 0 ) {
+				error = "bad channel count for " + joint.name;
+				return false;
+			}
+			for ( long i = 0; i < count; i++, m_channels++ ) {
+				next_word( p, end, word );
+				std::transform( word.begin(), word.end(), word.begin(), ::tolower );
+				if ( word.size() != 9 || word[0] < 'x' || word[0] > 'z' ) {
+					error = "unknown channel " + word + " of " + joint.name;
+					return false;
+				}
+				if ( word.compare( 1, 8, "rotation" ) == 0 ) {
+					if ( joint.rotations == 3 ) {
+						error = "more than three rotations for " + joint.name;
+						return false;
+					}
+					joint.channel[joint.rotations] = m_channels;
+					joint.axis[joint.rotations] = word[0];
+					joint.rotations++;
+				} else if ( word.compare( 1, 8, "position" ) != 0 ) {
+					error = "unknown channel " + word + " of " + joint.name;
+					return false;
+				}
+			}
+		} else {
+			error = "unexpected " + word + " in the hierarchy";
+			return false;
+		}
+	}
+
+	long frames;
+	float frame_time;
+	if ( !next_word( p, end, word ) || word != "Frames:" || ( p = skip_blank( p, end ), !parse_int( p, end, frames ) ) ||
+		 !next_word( p, end, word ) || word != "Frame" || !next_word( p, end, word ) || word != "Time:" ||
+		 ( p = skip_blank( p, end ), !parse_float( p, end, frame_time ) ) ) {
+		error = "no frame count and time after MOTION";
+		return false;
+	}
+	if ( frames < 0 || frame_time <= 0.0 ) {
+		error = "bad frame count or time";
+		return false;
+	}
+	m_frames = frames;
+	m_frame_time = frame_time;
+	return true;
+}
+
+// Past the frame at p, without decoding it. NULL if the file ends first
+const char* BvhClip::skip_frame( const char* p ) const
+{
+	const char* end = m_file.end();
+	for ( size_t c = 0; c < m_channels; c++ ) {
+		p = skip_blank( p, end );
+		if ( p == end ) return NULL;
+		while ( p < end && !is_space( *p ) && *p != '\n' ) p++;
+	}
+	return p;
+}
+
+// Frame has been read up to p, the start of the frame after it
+void BvhClip::passed( int frame, const char* p )
+{
+	m_next_frame = frame + 1;
+	m_next = p;
+	if ( m_next_frame % BVH_INDEX_STRIDE != 0 ) return;
+
+	int known = m_next_frame / BVH_INDEX_STRIDE;
+	if ( known == (int)m_index.size() ) m_index.push_back( p );
+	// Done with the stretch before, unless a seek comes back for it
+	m_file.release( m_index[known - 1], p );
+}
+
+// Where frame starts, NULL if the file ends first
+const char* BvhClip::find( int frame )
+{
+	if ( frame == m_next_frame ) return m_next;
+
+	// Read forward from the nearest known place before it
+	int known = std::min( frame / BVH_INDEX_STRIDE, (int)m_index.size() - 1 );
+	int f = known * BVH_INDEX_STRIDE;
+	const char* p = m_index[known];
+	if ( m_next_frame > f && m_next_frame < frame ) {
+		f = m_next_frame;
+		p = m_next;
+	}
+	for ( ; f < frame; f++ ) {
+		p = skip_frame( p );
+		if ( !p ) return NULL;
+		passed( f, p );
+	}
+	return p;
+}
+
+bool BvhClip::decode( int frame, std::vector<float>& values )
+{
+	if ( frame < 0 || frame >= m_frames ) return false;
+	const char* p = find( frame );
+	if ( !p ) return false;
+
+	const char* end = m_file.end();
+	values.resize( m_channels );
+	for ( size_t c = 0; c < m_channels; c++ ) {
+		p = skip_blank( p, end );
+		if ( !parse_float( p, end, values[c] ) ) return false;
+	}
+	passed( frame, p );
+	return true;
+}
+
+void BvhClip::joint_rotation( const Joint& joint, const float* values, double r[3][3] )
+{
+	// The turns in the order given
+	Matrix4x4 m;
+	for ( int i = 0; i < joint.rotations; i++ ) m = m * rotation_matrix( joint.axis[i], values[joint.channel[i]] );
+	for ( int i = 0; i < 3; i++ ) {
+		for ( int j = 0; j < 3; j++ ) r[i][j] = m[i][j];
+	}
+}
+
+size_t BvhClip::bind( const SceneNode* root )
+{
+	// At rest, a BVH skeleton has every joint lined up with the world
+	const double identity[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+	m_retarget.clear();
+	m_source.assign( m_joints.size(), -1 );
+	for ( size_t j = 0; j < m_joints.size(); j++ ) {
+		if ( m_joints[j].rotations > 0 ) m_source[j] = m_retarget.add_source( m_joints[j].name, identity, identity );
+	}
+	return m_retarget.build( root, m_map );
+}
+
+bool BvhClip::pose( int frame )
+{
+	if ( !decode( frame, m_values ) ) return false;
+
+	double r[3][3];
+	for ( size_t j = 0; j < m_source.size(); j++ ) {
+		if ( m_source[j] < 0 ) continue;
+		joint_rotation( m_joints[j], &m_values[0], r );
+		m_retarget.set_rotation( m_source[j], r );
+	}
+	m_retarget.run();
+	m_retarget.apply();
+	return true;
+}
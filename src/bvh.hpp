@@ -0,0 +1,102 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include "scene.hpp"
+#include "mapped_file.hpp"
+#include "retarget.hpp"
+#include <string>
+#include <vector>
+
+// Frames between the places in the motion data a clip remembers, so
+// that a seek only has to read forward from the one before it. A take
+// costs a word of memory for every this many frames
+#define BVH_INDEX_STRIDE 64
+
+// A motion capture take in Biovision's BVH format, posing the joints
+// of a scene.
+//
+// The file is mapped and only its hierarchy is parsed up front. Frames
+// are decoded straight from the mapping as they are asked for, so a
+// take of any length plays in the memory of a frame: the pages of each
+// BVH_INDEX_STRIDE frames are let go once playing has read past them.
+// A seek leaves the pages it read resident until then. The next frame
+// after the last carries on from where that one ended, and any other
+// reads forward from the nearest place remembered before it.
+//
+// Each BVH joint with rotation channels poses the joints of the scene
+// its name finds, or that a map gives for it, through a Retarget from
+// a rest pose with every joint lined up with the world. Position
+// channels are dropped, as there is no joint to move.
+class BvhClip {
+public:
+	BvhClip();
+
+	// Map filename and parse its hierarchy. Returns false, saying why,
+	// if it can't be read or isn't BVH
+	bool open( const std::string& filename );
+	void close();
+
+	int frames() const { return m_frames; }
+	double frame_time() const { return m_frame_time; }	// Seconds
+	size_t channels() const { return m_channels; }
+
+	// Use map for the joints it names, rather than their own names.
+	// Call before bind
+	void set_map( const JointMap& map ) { m_map = map; }
+
+	// Find the joints under root each BVH joint poses. Returns how many
+	// BVH joints found any
+	size_t bind( const SceneNode* root );
+	bool bound() const { return m_retarget.targets() > 0; }
+
+	// Every channel of frame, in the order of the file. Returns false
+	// if there is no such frame, or it is malformed
+	bool decode( int frame, std::vector<float>& values );
+
+	// Pose the bound joints as frame has them. Returns false as decode
+	bool pose( int frame );
+
+	// A joint of the hierarchy, in the order of the file, so that a
+	// parent comes before its children
+	struct Joint {
+		std::string name;
+		int parent;							// -1 for a root
+		double offset[3];					// From the parent, at rest
+		int rotations;						// Rotation channels, up to 3
+		int channel[3];						// Index of each among all the channels
+		char axis[3];						// 'x', 'y' or 'z', in the order they apply
+	};
+	const std::vector<Joint>& joints() const { return m_joints; }
+
+	// The rotation the rotation channels of joint in values come to
+	static void joint_rotation( const Joint& joint, const float* values, double r[3][3] );
+
+private:
+	// Not copyable, the mapping has a single owner
+	BvhClip( const BvhClip& );
+	BvhClip& operator=( const BvhClip& );
+
+	MappedFile m_file;
+	std::vector<Joint> m_joints;
+	size_t m_channels;
+	int m_frames;
+	double m_frame_time;
+
+	// Where every BVH_INDEX_STRIDE'th frame starts, as far as has been
+	// read, and where the frame after the last decoded starts
+	std::vector<const char*> m_index;
+	int m_next_frame;
+	const char* m_next;
+
+	JointMap m_map;
+	Retarget m_retarget;
+	std::vector<int> m_source;				// Of each joint in m_retarget, -1 for none
+	std::vector<float> m_values;			// The frame pose decodes into
+
+	bool parse_hierarchy( const char*& p, std::string& error );
+	const char* find( int frame );
+	const char* skip_frame( const char* p ) const;
+	void passed( int frame, const char* p );
+};
+
+#endif
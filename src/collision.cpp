@@ -0,0 +1,317 @@
+#include "collision.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstring>
+#include <math.h>
+
+void diagonalize( double a[3][3], double v[3][3] )
+{
+	for ( int i = 0; i < 3; i++ ) {
+		for ( int j = 0; j < 3; j++ ) v[i][j] = i == j ? 1.0 : 0.0;
+	}
+	for ( int sweep = 0; sweep < 16; sweep++ ) {
+		double diagonal = a[0][0] * a[0][0] + a[1][1] * a[1][1] + a[2][2] * a[2][2];
+		double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+		if ( off <= 1e-30 * diagonal ) return;
+
+		for ( int p = 0; p < 2; p++ ) {
+			for ( int q = p + 1; q < 3; q++ ) {
+				if ( a[p][q] == 0.0 ) continue;
+				double theta = ( a[q][q] - a[p][p] ) / ( 2.0 * a[p][q] );
+				double t = ( theta >= 0.0 ? 1.0 : -1.0 ) / ( fabs( theta ) + sqrt( theta * theta + 1.0 ) );
+				double c = 1.0 / sqrt( t * t + 1.0 ), s = t * c;
+				for ( int k = 0; k < 3; k++ ) {
+					double kp = a[k][p], kq = a[k][q];
+					a[k][p] = c * kp - s * kq;
+					a[k][q] = s * kp + c * kq;
+				}
+				for ( int k = 0; k < 3; k++ ) {
+					double pk = a[p][k], qk = a[q][k];
+					a[p][k] = c * pk - s * qk;
+					a[q][k] = s * pk + c * qk;
+				}
+				for ( int k = 0; k < 3; k++ ) {
+					double kp = v[k][p], kq = v[k][q];
+					v[k][p] = c * kp - s * kq;
+					v[k][q] = s * kp + c * kq;
+				}
+			}
+		}
+	}
+}
+
+bool ellipsoids_touch( const Matrix4x4& a, const Matrix4x4& b )
+{
+	// Map a back onto the unit sphere. The question is then whether b,
+	// mapped the same way, comes within 1 of the origin
+	double inverse[3][3];
+	inverse[0][0] = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+	inverse[0][1] = a[0][2] * a[2][1] - a[0][1] * a[2][2];
+	inverse[0][2] = a[0][1] * a[1][2] - a[0][2] * a[1][1];
+	inverse[1][0] = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+	inverse[1][1] = a[0][0] * a[2][2] - a[0][2] * a[2][0];
+	inverse[1][2] = a[0][2] * a[1][0] - a[0][0] * a[1][2];
+	inverse[2][0] = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+	inverse[2][1] = a[0][1] * a[2][0] - a[0][0] * a[2][1];
+	inverse[2][2] = a[0][0] * a[1][1] - a[0][1] * a[1][0];
+	double det = a[0][0] * inverse[0][0] + a[0][1] * inverse[1][0] + a[0][2] * inverse[2][0];
+	if ( fabs( det ) < 1e-300 ) return false;
+
+	double k[3][3], d[3];
+	for ( int i = 0; i < 3; i++ ) {
+		d[i] = 0.0;
+		for ( int j = 0; j < 3; j++ ) {
+			d[i] += inverse[i][j] * ( b[j][3] - a[j][3] ) / det;
+			k[i][j] = 0.0;
+			for ( int m = 0; m < 3; m++ ) k[i][j] += inverse[i][m] * b[m][j] / det;
+		}
+	}
+
+	// Its axes are the eigenvectors of k k^T, the square roots of the
+	// eigenvalues how far it reaches along them
+	double s[3][3], v[3][3];
+	for ( int i = 0; i < 3; i++ ) {
+		for ( int j = 0; j < 3; j++ ) s[i][j] = k[i][0] * k[j][0] + k[i][1] * k[j][1] + k[i][2] * k[j][2];
+	}
+	diagonalize( s, v );
+
+	// The origin in those axes, relative to its centre
+	double e[3], q[3], inside = 0.0, shortest = HUGE_VAL, longest = 0.0;
+	for ( int i = 0; i < 3; i++ ) {
+		e[i] = sqrt( std::max( s[i][i], 1e-24 ) );
+		q[i] = -( v[0][i] * d[0] + v[1][i] * d[1] + v[2][i] * d[2] );
+		inside += ( q[i] / e[i] ) * ( q[i] / e[i] );
+		shortest = std::min( shortest, e[i] );
+		longest = std::max( longest, e[i] );
+	}
+	double distance = sqrt( d[0] * d[0] + d[1] * d[1] + d[2] * d[2] );
+	if ( inside <= 1.0 || distance <= 1.0 + shortest ) return true;
+	if ( distance > 1.0 + longest ) return false;
+
+	// The nearest point is e_i^2 q_i / ( t + e_i^2 ) for the t that puts
+	// it on the surface. Newton's method comes up on t from below
+	double t = 0.0;
+	for ( int iteration = 0; iteration < 64; iteration++ ) {
+		double f = -1.0, df = 0.0;
+		for ( int i = 0; i < 3; i++ ) {
+			double r = e[i] * q[i] / ( t + e[i] * e[i] );
+			f += r * r;
+			df -= 2.0 * r * r / ( t + e[i] * e[i] );
+		}
+		if ( f < 1e-12 ) break;
+		t -= f / df;
+	}
+	double nearest = 0.0;
+	for ( int i = 0; i < 3; i++ ) {
+		double r = t * q[i] / ( t + e[i] * e[i] );
+		nearest += r * r;
+	}
+	return nearest <= 1.0;
+}
+
+void sweep_pairs( const std::vector<double>& min, const std::vector<double>& max, int axis,
+				  std::vector<int>& order, std::vector<std::pair<int, int> >& pairs )
+{
+	for ( size_t i = 1; i < order.size(); i++ ) {
+		int moving = order[i];
+		size_t j = i;
+		for ( ; j > 0 && min[3 * order[j - 1] + axis] > min[3 * moving + axis]; j-- ) order[j] = order[j - 1];
+		order[j] = moving;
+	}
+
+	// Sweep along that axis, then check the others
+	const int other = ( axis + 1 ) % 3, third = ( axis + 2 ) % 3;
+	pairs.clear();
+	for ( size_t i = 0; i < order.size(); i++ ) {
+		int a = order[i];
+		for ( size_t j = i + 1; j < order.size() && min[3 * order[j] + axis] <= max[3 * a + axis]; j++ ) {
+			int b = order[j];
+			if ( min[3 * a + other] > max[3 * b + other] || min[3 * b + other] > max[3 * a + other] ) continue;
+			if ( min[3 * a + third] > max[3 * b + third] || min[3 * b + third] > max[3 * a + third] ) continue;
+			pairs.push_back( std::make_pair( std::min( a, b ), std::max( a, b ) ) );
+		}
+	}
+}
+
+CollisionWorld::CollisionWorld()
+	: m_axis( 0 )
+{
+}
+
+// Sorting along the axis the centres vary most on leaves the fewest
+// pairs overlapping along it
+int CollisionWorld::widest_axis() const
+{
+	double sum[3] = { 0.0, 0.0, 0.0 }, squares[3] = { 0.0, 0.0, 0.0 };
+	for ( size_t i = 0; i < m_shapes.size(); i++ ) {
+		for ( int a = 0; a < 3; a++ ) {
+			double centre = m_shapes[i][a][3];
+			sum[a] += centre;
+			squares[a] += centre * centre;
+		}
+	}
+	int widest = 0;
+	double n = std::max( m_shapes.size(), (size_t)1 ), variance = -1.0;
+	for ( int a = 0; a < 3; a++ ) {
+		double v = squares[a] / n - ( sum[a] / n ) * ( sum[a] / n );
+		if ( v > variance ) {
+			variance = v;
+			widest = a;
+		}
+	}
+	return widest;
+}
+
+void CollisionWorld::build( SceneNode* root )
+{
+	TraceScope trace( "build collision" );
+	m_nodes.clear();
+	m_parents.clear();
+	root->flatten( -1, m_nodes, m_parents );
+
+	const size_t n = m_nodes.size();
+	m_ends.resize( n );
+	for ( size_t i = 0; i < n; i++ ) m_ends[i] = i + 1;
+	for ( size_t i = n; i-- > 1; ) m_ends[m_parents[i]] = std::max( m_ends[m_parents[i]], m_ends[i] );
+
+	m_frames.resize( n );
+	m_joints.resize( n );
+	m_part_place.clear();
+	m_owner.clear();
+	m_scale.clear();
+	m_joint_above.assign( n, -1 );
+	m_node_part.assign( n, -1 );
+	m_first_place.assign( SceneNode::id_limit(), -1 );
+	m_next_place.assign( n, -1 );
+	std::vector<int> moved_by( n, -1 );		// The node itself if it is a joint
+	for ( size_t i = 0; i < n; i++ ) {
+		const SceneNode* node = m_nodes[i];
+		int parent = m_parents[i];
+		m_joints[i] = node->get_transform();
+		m_frames[i] = parent < 0 ? node->get_transform() : m_frames[parent] * node->get_transform();
+		m_joint_above[i] = parent < 0 ? -1 : moved_by[parent];
+		moved_by[i] = node->is_joint() ? (int)i : m_joint_above[i];
+		// Kept in reverse, which is as good for finding them all
+		m_next_place[i] = m_first_place[node->get_id()];
+		m_first_place[node->get_id()] = i;
+
+		if ( !node->is_geometry() ) continue;
+		const GeometryNode* geometry = (const GeometryNode*)node;
+		if ( !geometry->get_primitive() ) continue;
+		m_node_part[i] = m_part_place.size();
+		m_part_place.push_back( i );
+		m_owner.push_back( moved_by[i] );
+		m_scale.push_back( geometry->get_primitive()->get_radius() );
+	}
+
+	const size_t parts = m_part_place.size();
+	m_shapes.resize( parts );
+	m_min.resize( 3 * parts );
+	m_max.resize( 3 * parts );
+	m_order.resize( parts );
+	for ( size_t i = 0; i < parts; i++ ) {
+		move_part( i );
+		m_order[i] = i;
+	}
+
+	// Whatever touches as modelled is meant to
+	m_ignored.clear();
+	update();
+	for ( size_t c = 0; c < m_contacts.size(); c++ ) m_ignored.insert( key( m_contacts[c].first, m_contacts[c].second ) );
+	m_contacts.clear();
+}
+
+void CollisionWorld::move_part( int i )
+{
+	double r = m_scale[i];
+	m_shapes[i] = m_frames[m_part_place[i]] * scaling_matrix( Vector3D( r, r, r ) );
+	const Matrix4x4& m = m_shapes[i];
+	for ( int a = 0; a < 3; a++ ) {
+		double extent = sqrt( m[a][0] * m[a][0] + m[a][1] * m[a][1] + m[a][2] * m[a][2] );
+		m_min[3 * i + a] = m[a][3] - extent;
+		m_max[3 * i + a] = m[a][3] + extent;
+	}
+}
+
+// Recompute the frame of node i, and move the part there if it is one
+void CollisionWorld::move_node( size_t i )
+{
+	int parent = m_parents[i];
+	m_frames[i] = parent < 0 ? m_nodes[i]->get_transform() : m_frames[parent] * m_nodes[i]->get_transform();
+	if ( m_node_part[i] >= 0 ) move_part( m_node_part[i] );
+}
+
+size_t CollisionWorld::update()
+{
+	TraceScope trace( "collide" );
+
+	// Recompute the frames below every joint that turned, and move the
+	// parts there
+	size_t dirty_end = 0;
+	for ( size_t i = 0; i < m_nodes.size(); i++ ) {
+		const SceneNode* node = m_nodes[i];
+		if ( node->is_joint() && memcmp( node->get_transform().begin(), m_joints[i].begin(), 16 * sizeof( double ) ) != 0 ) {
+			m_joints[i] = node->get_transform();
+			dirty_end = std::max( dirty_end, (size_t)m_ends[i] );
+		}
+		if ( i < dirty_end ) move_node( i );
+	}
+	return sweep();
+}
+
+size_t CollisionWorld::update( const std::vector<NodeId>& turned )
+{
+	TraceScope trace( "collide" );
+
+	m_turned.clear();
+	for ( size_t t = 0; t < turned.size(); t++ ) {
+		if ( turned[t] >= m_first_place.size() ) continue;
+		for ( int i = m_first_place[turned[t]]; i >= 0; i = m_next_place[i] ) {
+			m_joints[i] = m_nodes[i]->get_transform();
+			m_turned.push_back( i );
+		}
+	}
+	// Subtrees in tree order, each node once where they nest
+	std::sort( m_turned.begin(), m_turned.end() );
+	size_t done = 0;
+	for ( size_t t = 0; t < m_turned.size(); t++ ) {
+		for ( size_t i = std::max( done, (size_t)m_turned[t] ); i < (size_t)m_ends[m_turned[t]]; i++ ) move_node( i );
+		done = std::max( done, (size_t)m_ends[m_turned[t]] );
+	}
+	return sweep();
+}
+
+size_t CollisionWorld::sweep()
+{
+	// Insertion sort, as parts move little between updates. Only if
+	// they have spread out along another axis do they need sorting anew
+	int axis = widest_axis();
+	if ( axis != m_axis ) {
+		m_axis = axis;
+		for ( size_t i = 0; i < m_order.size(); i++ ) m_order[i] = i;
+	}
+	sweep_pairs( m_min, m_max, axis, m_order, m_overlaps );
+
+	// Test what is left exactly
+	m_contacts.clear();
+	for ( size_t c = 0; c < m_overlaps.size(); c++ ) {
+		const Contact& pair = m_overlaps[c];
+		if ( linked( pair.first, pair.second ) || m_ignored.count( key( pair.first, pair.second ) ) ) continue;
+		Metrics::add( METRIC_COLLISION_TESTS );
+		if ( ellipsoids_touch( m_shapes[pair.first], m_shapes[pair.second] ) ) m_contacts.push_back( pair );
+	}
+	std::sort( m_contacts.begin(), m_contacts.end() );
+	return m_contacts.size();
+}
+
+bool CollisionWorld::linked( int a, int b ) const
+{
+	int p = m_owner[a], q = m_owner[b];
+	return p == q || ( p >= 0 && m_joint_above[p] == q ) || ( q >= 0 && m_joint_above[q] == p );
+}
+
+bool CollisionWorld::new_contact( const std::vector<Contact>& before ) const
+{
+	return !std::includes( before.begin(), before.end(), m_contacts.begin(), m_contacts.end() );
+}
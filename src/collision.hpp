@@ -0,0 +1,98 @@
+#ifndef COLLISION_HPP
+#define COLLISION_HPP
+
+#include "scene.hpp"
+#include <vector>
+#include <utility>
+#include <tr1/unordered_set>
+
+// Whether the ellipsoids a and b take the unit sphere to overlap,
+// found exactly rather than from their bounds
+bool ellipsoids_touch( const Matrix4x4& a, const Matrix4x4& b );
+
+// Rotate the symmetric a to diagonal by Jacobi's method, with the
+// eigenvectors left in the columns of v
+void diagonalize( double a[3][3], double v[3][3] );
+
+// Sweep and prune over boxes given as 3 minima and 3 maxima each.
+// order holds the boxes to look at and is insertion sorted by their
+// minima along axis, so keeping it from call to call makes the sort
+// cheap while boxes move little. Every pair of them whose boxes
+// overlap on all three axes is put in pairs, the lower index first
+void sweep_pairs( const std::vector<double>& min, const std::vector<double>& max, int axis,
+				  std::vector<int>& order, std::vector<std::pair<int, int> >& pairs );
+
+// Contact between the parts of a puppet. Every part is taken to be the
+// ellipsoid its transformations make of the sphere bounding its
+// primitive, which for a sphere is the part itself.
+//
+// Parts are sorted by their world bounds along the axis they are most
+// spread out on, and pairs whose bounds overlap on all three axes are
+// tested exactly. Only parts
+// below joints that turned since the last update are moved, and the
+// sort starts from the order the last one left, so a drag that moves
+// a few parts costs little more than a pass over the bounds. Told
+// which joints turned, an update doesn't even look at the rest.
+class CollisionWorld {
+public:
+	CollisionWorld();
+
+	// Take the parts under root. Pairs of parts that no joint moves
+	// apart, or only the one joint between them, are left out: they
+	// meet at that joint however it turns. So are pairs that touch in
+	// the pose root is in now, which were modelled that way, so build
+	// with the scene at rest, as its script left it
+	void build( SceneNode* root );
+	bool built() const { return !m_nodes.empty(); }
+
+	// Catch up with whatever joints turned since the last call, and
+	// find the pairs that touch. Returns how many there are
+	size_t update();
+	// The same when only the joints numbered turned can have turned
+	size_t update( const std::vector<NodeId>& turned );
+
+	// Pairs of parts that touched at the last update, as indices
+	// into the parts, the lower first, in order
+	typedef std::pair<int, int> Contact;
+	const std::vector<Contact>& contacts() const { return m_contacts; }
+
+	// Whether any pair touches now that did not in before
+	bool new_contact( const std::vector<Contact>& before ) const;
+
+	NodeId part( int i ) const { return m_nodes[m_part_place[i]]->get_id(); }
+
+private:
+	// Every node, in tree order, so a parent comes before its children
+	std::vector<const SceneNode*> m_nodes;
+	std::vector<int> m_parents;
+	std::vector<int> m_ends;				// One past the last node below
+	std::vector<Matrix4x4> m_frames;		// Where each node draws its children
+	std::vector<Matrix4x4> m_joints;		// Joint transforms as of the last update
+	std::vector<int> m_joint_above;			// Nearest joint above each node, -1 for none
+	std::vector<int> m_node_part;			// Part at each node, -1 for none
+	std::vector<int> m_first_place;			// By ID, the first node index of each, -1 for none
+	std::vector<int> m_next_place;			// Where the same node is next, instancing shares it
+	std::vector<int> m_turned;				// Node indices of the joints an update was told of
+
+	// Parts
+	std::vector<int> m_part_place;			// Index into the nodes
+	std::vector<int> m_owner;				// Joint that moves it, -1 for none
+	std::vector<double> m_scale;			// Radius of the primitive
+	std::vector<Matrix4x4> m_shapes;		// Unit sphere to the part
+	std::vector<double> m_min, m_max;		// World bounds, 3 per part
+	std::vector<int> m_order;				// Sorted by m_min along m_axis
+	int m_axis;
+
+	std::tr1::unordered_set<unsigned long long> m_ignored;
+	std::vector<Contact> m_overlaps;		// Pairs whose bounds meet
+	std::vector<Contact> m_contacts;
+
+	void move_part( int i );
+	void move_node( size_t i );
+	size_t sweep();
+	int widest_axis() const;
+	bool linked( int a, int b ) const;
+	unsigned long long key( int a, int b ) const { return (unsigned long long)a * m_owner.size() + b; }
+};
+
+#endif
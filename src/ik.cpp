@@ -0,0 +1,59 @@
+#include "ik.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+
+bool IKChain::attach( SceneNode* root, NodeId effector )
+{
+	m_path.clear();
+	m_moved = false;
+	return root->find_path( effector, m_path );
+}
+
+void IKChain::update_frames( const Matrix4x4& camera )
+{
+	// The world transformation goes through the root, as in draw_puppet
+	m_frames.resize( m_path.size() );
+	m_frames[0] = m_path[0]->get_transform() * camera;
+	for ( size_t i = 1; i < m_path.size(); i++ ) m_frames[i] = m_frames[i - 1] * m_path[i]->get_transform();
+}
+
+Point3D IKChain::effector( const Matrix4x4& camera ) const
+{
+	Matrix4x4 frame = m_path[0]->get_transform() * camera;
+	for ( size_t i = 1; i < m_path.size(); i++ ) frame = frame * m_path[i]->get_transform();
+	return frame * Point3D();
+}
+
+bool IKChain::solve( const Matrix4x4& camera, const Point3D& target, double budget )
+{
+	TraceScope trace( "ik solve" );
+	double start = Profiler::now();
+
+	update_frames( camera );
+	double distance = ( m_frames.back() * Point3D() - target ).length();
+	for ( int iteration = 0; iteration < IK_MAX_ITERATIONS; iteration++ ) {
+		if ( distance < IK_TOLERANCE ) return true;
+
+		// Turn each joint from the effector up, with the effector and
+		// target in the joint's own frame. The frames above a joint
+		// don't change until it has been turned.
+		Matrix4x4 below;			// From the frame after m_path[i] to the effector
+		for ( size_t i = m_path.size() - 1; i > 0; i-- ) {
+			if ( m_path[i]->is_joint() ) {
+				Vector3D before = m_path[i]->get_rotation();
+				((JointNode*)m_path[i])->turn_towards( below * Point3D(), m_frames[i].invert() * target );
+				const Vector3D& after = m_path[i]->get_rotation();
+				if ( after[0] != before[0] || after[1] != before[1] ) m_moved = true;
+			}
+			below = m_path[i]->get_transform() * below;
+		}
+
+		update_frames( camera );
+		double now = ( m_frames.back() * Point3D() - target ).length();
+		bool stuck = now > distance - IK_TOLERANCE * 0.01;
+		distance = now;
+		if ( stuck ) return true;
+		if ( budget > 0.0 && Profiler::now() - start > budget ) break;
+	}
+	return distance < IK_TOLERANCE;
+}
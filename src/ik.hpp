@@ -0,0 +1,49 @@
+#ifndef IK_HPP
+#define IK_HPP
+
+#include <vector>
+#include "scene.hpp"
+
+// Sweeps of the solver there can be in one call to solve
+#define IK_MAX_ITERATIONS 64
+// How close the effector has to get to its target, in world units
+#define IK_TOLERANCE 0.01
+
+// Moves an end effector towards a target by cyclic coordinate descent
+// over the joints between it and the root, keeping each joint within
+// its limits. Every call starts from the pose the last one left, so
+// while the target is dragged about the solver only has to make up for
+// the distance it moved since the last frame.
+class IKChain {
+public:
+	IKChain() : m_moved( false ) {}
+
+	// Solve for node effector, the first place it is found below root.
+	// Returns false if it is not there
+	bool attach( SceneNode* root, NodeId effector );
+	void detach() { m_path.clear(); }
+	bool attached() const { return !m_path.empty(); }
+	// Whether solve has turned a joint since attach
+	bool moved() const { return m_moved; }
+
+	// Where the effector is, with the world transformation camera
+	// applied as Viewer::draw_puppet does
+	Point3D effector( const Matrix4x4& camera ) const;
+
+	// Move the effector towards target, in the same space as effector(),
+	// until it is within IK_TOLERANCE, it stops getting closer, or after
+	// IK_MAX_ITERATIONS sweeps. With a budget, in seconds, stop after the
+	// first sweep to go over it. Returns true if there is no more to do.
+	bool solve( const Matrix4x4& camera, const Point3D& target, double budget = 0.0 );
+
+private:
+	// From the root down to the effector
+	std::vector<SceneNode*> m_path;
+	// Frame of each node on the path, after its own transformation
+	std::vector<Matrix4x4> m_frames;
+	bool m_moved;
+
+	void update_frames( const Matrix4x4& camera );
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "input_record.hpp"
+#include "mapped_file.hpp"
+#include "profiler.hpp"
+#include <iostream>
+#include <cstring>
+
+#define INPUT_RECORD_MAGIC "PUPREC1\n"
+#define INPUT_RECORD_SIZE 14
+
+static const char* kind_names[InputEvent::KINDS] = {
+	"configure", "press", "release", "motion", "mode", "option", "reset", "undo", "redo", "select", "seek"
+};
+
+const char* InputEvent::get_name( Kind kind )
+{
+	return kind_names[kind];
+}
+
+InputRecorder::InputRecorder()
+	: m_file( NULL ), m_start( 0.0 )
+{
+}
+
+InputRecorder::~InputRecorder()
+{
+	close();
+}
+
+bool InputRecorder::open( const std::string& filename )
+{
+	close();
+	m_file = fopen( filename.c_str(), "wb" );
+	if ( !m_file ) return false;
+	fwrite( INPUT_RECORD_MAGIC, 1, strlen( INPUT_RECORD_MAGIC ), m_file );
+	m_start = Profiler::now();
+	return true;
+}
+
+void InputRecorder::close()
+{
+	if ( m_file ) fclose( m_file );
+	m_file = NULL;
+}
+
+void InputRecorder::record( InputEvent::Kind kind, int arg, double x, double y )
+{
+	if ( !m_file ) return;
+
+	InputEvent event;
+	event.time = (unsigned int)( ( Profiler::now() - m_start ) * 1000.0 );
+	event.kind = kind;
+	event.arg = arg;
+	event.x = x;
+	event.y = y;
+
+	// Field by field, so the size doesn't depend on the struct's padding
+	char buffer[INPUT_RECORD_SIZE];
+	memcpy( buffer, &event.time, 4 );
+	buffer[4] = event.kind;
+	buffer[5] = event.arg;
+	memcpy( buffer + 6, &event.x, 4 );
+	memcpy( buffer + 10, &event.y, 4 );
+	fwrite( buffer, 1, INPUT_RECORD_SIZE, m_file );
+}
+
+bool load_recording( const std::string& filename, std::vector<InputEvent>& events )
+{
+	MappedFile file;
+	if ( !file.open( filename ) ) {
+		std::cerr << "Error loading " << filename << ": can't open file" << std::endl;
+		return false;
+	}
+
+	size_t header = strlen( INPUT_RECORD_MAGIC );
+	if ( file.size() < header || memcmp( file.begin(), INPUT_RECORD_MAGIC, header ) != 0 ) {
+		std::cerr << "Error loading " << filename << ": not a recording" << std::endl;
+		return false;
+	}
+
+	// A recording cut short by a crash still replays up to its last whole event
+	events.clear();
+	for ( const char* p = file.begin() + header; p + INPUT_RECORD_SIZE <= file.end(); p += INPUT_RECORD_SIZE ) {
+		InputEvent event;
+		memcpy( &event.time, p, 4 );
+		event.kind = p[4];
+		event.arg = p[5];
+		memcpy( &event.x, p + 6, 4 );
+		memcpy( &event.y, p + 10, 4 );
+		if ( event.kind >= InputEvent::KINDS ) {
+			std::cerr << "Error loading " << filename << ": bad event at byte " << ( p - file.begin() ) << std::endl;
+			return false;
+		}
+		events.push_back( event );
+	}
+	return true;
+}
@@ -0,0 +1,45 @@
+#ifndef INPUT_RECORD_HPP
+#define INPUT_RECORD_HPP
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+// One thing the user did to the viewer
+struct InputEvent {
+	enum Kind { CONFIGURE, PRESS, RELEASE, MOTION, MODE, OPTION, RESET, UNDO, REDO, SELECT, SEEK, KINDS };
+
+	unsigned int time;			// Milliseconds since recording started
+	unsigned char kind;
+	unsigned char arg;			// Button, mode, option, reset or selection
+	float x, y;					// Pointer position, the new size for CONFIGURE, or the frame for SEEK
+
+	static const char* get_name( Kind kind );
+};
+
+// Writes the viewer's input to a file as it happens. The file is a
+// header followed by 14 bytes per event, in the machine's byte order.
+class InputRecorder {
+public:
+	InputRecorder();
+	~InputRecorder();
+
+	// Start a new recording, returns false if the file can't be written
+	bool open( const std::string& filename );
+	void close();
+
+	void record( InputEvent::Kind kind, int arg = 0, double x = 0.0, double y = 0.0 );
+
+private:
+	// Not copyable, the file has a single owner
+	InputRecorder( const InputRecorder& );
+	InputRecorder& operator=( const InputRecorder& );
+
+	FILE *m_file;
+	double m_start;
+};
+
+// Read back a whole recording, returns false if it can't be read
+bool load_recording( const std::string& filename, std::vector<InputEvent>& events );
+
+#endif
@@ -0,0 +1,93 @@
+#include "latency.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+LatencyHistogram::LatencyHistogram()
+{
+	clear();
+}
+
+void LatencyHistogram::clear()
+{
+	std::fill( m_buckets, m_buckets + LATENCY_BUCKETS, 0 );
+	m_count = 0;
+	m_sum = m_max = 0.0;
+}
+
+void LatencyHistogram::add( double seconds )
+{
+	double us = seconds * 1e6;
+	int bucket = us > 1.0 ? (int)( log( us ) / log( 2.0 ) * LATENCY_STEPS ) : 0;
+	m_buckets[std::min( bucket, LATENCY_BUCKETS - 1 )]++;
+	m_count++;
+	m_sum += seconds;
+	m_max = std::max( m_max, seconds );
+}
+
+double LatencyHistogram::percentile( double p ) const
+{
+	if ( m_count == 0 ) return 0.0;
+
+	long rank = (long)ceil( p / 100.0 * m_count );
+	long seen = 0;
+	for ( int b = 0; b < LATENCY_BUCKETS; b++ ) {
+		seen += m_buckets[b];
+		if ( seen >= rank && m_buckets[b] ) {
+			// The middle of the bucket, but never past the largest seen
+			return std::min( m_max, pow( 2.0, ( b + 0.5 ) / LATENCY_STEPS ) * 1e-6 );
+		}
+	}
+	return m_max;
+}
+
+void LatencyHistogram::print( std::ostream& out, const std::string& name, bool bars ) const
+{
+	char line[256];
+	snprintf( line, sizeof( line ), "%-10s %8ld events  p50 %8s  p90 %8s  p99 %8s  max %8s", name.c_str(), m_count,
+			  format_latency( percentile( 50 ) ).c_str(), format_latency( percentile( 90 ) ).c_str(),
+			  format_latency( percentile( 99 ) ).c_str(), format_latency( m_max ).c_str() );
+	out << line << std::endl;
+	if ( !bars || m_count == 0 ) return;
+
+	long octaves[LATENCY_OCTAVES] = { 0 };
+	long most = 0;
+	int first = LATENCY_OCTAVES, last = 0;
+	for ( int b = 0; b < LATENCY_BUCKETS; b++ ) {
+		int o = b / LATENCY_STEPS;
+		octaves[o] += m_buckets[b];
+		most = std::max( most, octaves[o] );
+		if ( m_buckets[b] ) {
+			first = std::min( first, o );
+			last = std::max( last, o );
+		}
+	}
+	for ( int o = first; o <= last; o++ ) {
+		int width = (int)( 40.0 * octaves[o] / most + 0.5 );
+		snprintf( line, sizeof( line ), "  < %8s %8ld ", format_latency( pow( 2.0, o + 1 ) * 1e-6 ).c_str(), octaves[o] );
+		out << line << std::string( width, '#' ) << std::endl;
+	}
+}
+
+double InputClock::event_time( unsigned int server_time, double now )
+{
+	// Subtract unsigned so that it comes out right when the 32 bits
+	// wrap. Rounding can put the event a millisecond or so after now
+	unsigned int age = (unsigned int)(unsigned long long)( now * 1000.0 ) - server_time;
+	if ( m_base == UNKNOWN ) m_base = ( (int)age >= -10 && (int)age < 1000 ) ? SERVER : ARRIVAL;
+	if ( m_base == ARRIVAL || (int)age < 0 ) return now;
+	return now - age / 1000.0;
+}
+
+std::string format_latency( double seconds )
+{
+	char text[32];
+	if ( seconds < 1e-3 ) {
+		snprintf( text, sizeof( text ), "%.0fus", seconds * 1e6 );
+	} else if ( seconds < 1.0 ) {
+		snprintf( text, sizeof( text ), "%.2fms", seconds * 1e3 );
+	} else {
+		snprintf( text, sizeof( text ), "%.2fs", seconds );
+	}
+	return text;
+}
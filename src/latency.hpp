@@ -0,0 +1,58 @@
+#ifndef LATENCY_HPP
+#define LATENCY_HPP
+
+#include <string>
+#include <iostream>
+
+// Sub-buckets per doubling of the latency, and how many doublings
+// above a microsecond are kept. Percentiles are good to about 9%.
+#define LATENCY_STEPS 8
+#define LATENCY_OCTAVES 24
+#define LATENCY_BUCKETS ( LATENCY_STEPS * LATENCY_OCTAVES )
+
+// Distribution of latencies in logarithmic buckets, so it takes the
+// same space however many samples go into it.
+class LatencyHistogram {
+public:
+	LatencyHistogram();
+
+	void add( double seconds );
+	void clear();
+
+	long count() const { return m_count; }
+	double max() const { return m_max; }
+	double mean() const { return m_count ? m_sum / m_count : 0.0; }
+	// In seconds, p from 0 to 100
+	double percentile( double p ) const;
+
+	// One line of percentiles, then a bar for each doubling if bars is set
+	void print( std::ostream& out, const std::string& name, bool bars = true ) const;
+
+private:
+	long m_buckets[LATENCY_BUCKETS];
+	long m_count;
+	double m_sum, m_max;
+};
+
+// Puts the X server timestamps of input events on the same clock as
+// Profiler::now(). The server usually counts milliseconds on the
+// monotonic clock too. Whether this one does is decided once, from the
+// first event of the session: if that can't be from the last second
+// the server is on some other clock, and every event is taken to have
+// happened when it arrived. Otherwise every timestamp is trusted, so
+// an event that waited a long time shows up as the stall it was.
+class InputClock {
+public:
+	InputClock() : m_base( UNKNOWN ) {}
+
+	double event_time( unsigned int server_time, double now );
+
+private:
+	enum Base { UNKNOWN, SERVER, ARRIVAL };
+	Base m_base;
+};
+
+// Latency with units to suit, e.g. 850us or 12.3ms
+std::string format_latency( double seconds );
+
+#endif
@@ -1,34 +1,671 @@
 #include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <X11/Xlib.h>
 #include <gtkmm.h>
 #include <gtkglmm.h>
 #include "appwindow.hpp"
+#include "scene_loader.hpp"
+#include "trace.hpp"
 #include "scene_lua.hpp"
+#include "mesh.hpp"
+#include "mesh_optimize.hpp"
+#include "input_record.hpp"
+#include "offscreen_gl.hpp"
+#include "latency.hpp"
+#include "profiler.hpp"
+#include "metrics.hpp"
+#include "pose_sampler.hpp"
+#include "ragdoll.hpp"
+#include "pose_feed.hpp"
+#include "bvh.hpp"
+#include <fstream>
+#include <cstdlib>
+#include <cmath>
+#include <csignal>
+#include <cerrno>
+#include <ctime>
+#include <sys/resource.h>
 
 SceneNode *root;
 
+// Optimize a mesh offline and save it as a PLY that loads without
+// needing the optimization pass again
+static int optimize_mesh_file(const std::string& in, const std::string& out)
+{
+  Mesh* mesh = import_mesh(in, false);
+  if (!mesh) {
+    return 1;
+  }
+
+  double before, after;
+  optimize_mesh(mesh->get_data(), before, after);
+  std::cout << in << ": " << mesh->get_data().triangle_count() << " triangles, ACMR "
+            << before << " -> " << after << std::endl;
+
+  return export_ply(mesh->get_data(), out) ? 0 : 1;
+}
+
+// Apply a pose given as path=x,y: every joint of scene SceneNode::glob
+// finds for path turns x degrees about x and y about y, within its limits
+static bool pose_joints(const SceneNode* scene, const std::string& pose)
+{
+  std::string::size_type equals = pose.rfind('=');
+  double x, y;
+  char extra;
+  if (equals == std::string::npos ||
+      sscanf(pose.c_str() + equals + 1, "%lf,%lf%c", &x, &y, &extra) != 2) {
+    std::cerr << "Bad pose " << pose << ", expected joint=x,y" << std::endl;
+    return false;
+  }
+
+  std::vector<NodeId> ids;
+  SceneNode::glob(pose.substr(0, equals), scene->get_scope(), ids);
+  int joints = 0;
+  for (size_t i = 0; i < ids.size(); i++) {
+    JointNode* joint = JointNode::by_id(ids[i]);
+    if (joint) {
+      joint->rotate_limited(x, y);
+      joints++;
+    }
+  }
+  if (joints == 0) {
+    std::cerr << "No joint matches " << pose.substr(0, equals) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Play a recorded session back as fast as it will go, without a
+// window, then report how long each kind of event took to draw and a
+// checksum of where the puppet ended up. The poses are applied to the
+// scene first
+static int replay_session(const std::string& recording, const std::string& filename,
+                          const std::vector<std::string>& poses)
+{
+  std::vector<InputEvent> events;
+  if (!load_recording(recording, events)) {
+    return 1;
+  }
+
+  root = import_lua(filename);
+  if (!root) {
+    std::cerr << "Could not open " << filename << std::endl;
+    return 1;
+  }
+  for (size_t i = 0; i < poses.size(); i++) {
+    if (!pose_joints(root, poses[i])) {
+      return 1;
+    }
+  }
+
+  // Big enough for every size the window was while recording
+  int width = 500, height = 500;
+  for (size_t i = 0; i < events.size(); i++) {
+    if (events[i].kind == InputEvent::CONFIGURE) {
+      width = std::max(width, (int)events[i].x);
+      height = std::max(height, (int)events[i].y);
+    }
+  }
+  if (!make_offscreen_gl_context(width, height)) {
+    std::cerr << "Unable to create an offscreen OpenGL context" << std::endl;
+    return 1;
+  }
+
+  Viewer viewer;
+  viewer.startHeadless();
+  viewer.loaded();
+  viewer.drawHeadless();
+
+  LatencyHistogram latency[InputEvent::KINDS];
+  double start = Profiler::now();
+  for (size_t i = 0; i < events.size(); i++) {
+    double t0 = Profiler::now();
+    viewer.replay(events[i]);
+    viewer.drawHeadless();
+    latency[events[i].kind].add(Profiler::now() - t0);
+  }
+
+  std::cout << recording << ": " << events.size() << " events in "
+            << format_latency(Profiler::now() - start) << std::endl;
+  for (int k = 0; k < InputEvent::KINDS; k++) {
+    if (latency[k].count()) {
+      latency[k].print(std::cout, InputEvent::get_name((InputEvent::Kind)k));
+    }
+  }
+  std::cout << "pose checksum " << std::hex << viewer.poseChecksum() << std::dec << std::endl;
+  return 0;
+}
+
+// Write random poses of the scene's rig, as PoseSampler lays them out,
+// to a file or stdout. Takes the options after --sample
+static int sample_poses(int argc, char** argv)
+{
+  unsigned long long poses = 0, seed = 1;
+  int threads = 0, width = 0, height = 0;
+  std::string output, filename;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool value = i + 1 < argc;
+    if (arg == "--seed" && value) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if (arg == "--threads" && value) {
+      threads = atoi(argv[++i]);
+    } else if (arg == "--project" && value) {
+      if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+        std::cerr << "Bad window size " << argv[i] << ", expected WxH" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--output" && value) {
+      output = argv[++i];
+    } else if (arg[0] != '-' && poses == 0) {
+      poses = strtoull(arg.c_str(), NULL, 10);
+    } else if (arg[0] != '-' && filename.empty()) {
+      filename = arg;
+    } else {
+      poses = 0;
+      break;
+    }
+  }
+  if (poses == 0 || filename.empty()) {
+    std::cerr << "Usage: " << argv[0] << " --sample N [--seed S] [--threads T] [--project WxH] [--output poses.bin] scene.lua" << std::endl;
+    return 1;
+  }
+
+  root = import_lua(filename);
+  if (!root) {
+    std::cerr << "Could not open " << filename << std::endl;
+    return 1;
+  }
+  PoseSampler sampler(root);
+  sampler.set_projection(width, height);
+
+  std::ofstream file;
+  if (!output.empty()) {
+    file.open(output.c_str(), std::ios::binary);
+    if (!file) {
+      std::cerr << "Unable to write " << output << std::endl;
+      return 1;
+    }
+  }
+
+  double start = Profiler::now();
+  if (!sampler.write(output.empty() ? std::cout : file, poses, seed, threads)) {
+    std::cerr << "Unable to write " << (output.empty() ? "poses" : output) << std::endl;
+    return 1;
+  }
+  double seconds = Profiler::now() - start;
+  std::cerr << poses << " poses of " << sampler.joints() << " joints in "
+            << format_latency(seconds) << ", " << (long long)(poses / seconds) << " a second" << std::endl;
+  return 0;
+}
+
+// Draw every frame of a motion clip over the scene without a window,
+// as fast as it will go, then report how long that took, the most
+// memory it ever used and a checksum of the last pose. Takes the
+// options after --render-bvh
+static int render_clip(int argc, char** argv)
+{
+  int every = 1, width = 500, height = 500;
+  std::string take, map_file, filename;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool value = i + 1 < argc;
+    if (arg == "--map" && value) {
+      map_file = argv[++i];
+    } else if (arg == "--every" && value) {
+      every = atoi(argv[++i]);
+    } else if (arg == "--size" && value) {
+      if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+        std::cerr << "Bad window size " << argv[i] << ", expected WxH" << std::endl;
+        return 1;
+      }
+    } else if (arg[0] != '-' && take.empty()) {
+      take = arg;
+    } else if (arg[0] != '-' && filename.empty()) {
+      filename = arg;
+    } else {
+      take.clear();
+      break;
+    }
+  }
+  if (take.empty() || filename.empty() || every <= 0) {
+    std::cerr << "Usage: " << argv[0] << " --render-bvh take.bvh [--map map.txt] [--every N] [--size WxH] scene.lua" << std::endl;
+    return 1;
+  }
+
+  BvhClip clip;
+  JointMap map;
+  if (!clip.open(take) || (!map_file.empty() && !load_joint_map(map_file, map))) {
+    return 1;
+  }
+  clip.set_map(map);
+  root = import_lua(filename);
+  if (!root) {
+    std::cerr << "Could not open " << filename << std::endl;
+    return 1;
+  }
+  if (!make_offscreen_gl_context(width, height)) {
+    std::cerr << "Unable to create an offscreen OpenGL context" << std::endl;
+    return 1;
+  }
+
+  Viewer viewer;
+  viewer.startHeadless();
+  viewer.set_clip(&clip);
+  viewer.loaded();
+  InputEvent configure;
+  configure.time = 0;
+  configure.kind = InputEvent::CONFIGURE;
+  configure.arg = 0;
+  configure.x = width;
+  configure.y = height;
+  viewer.replay(configure);
+  viewer.drawHeadless();
+
+  long drawn = 0;
+  double start = Profiler::now();
+  for (int frame = 0; frame < clip.frames(); frame += every, drawn++) {
+    viewer.seek(frame);
+    viewer.drawHeadless();
+  }
+  double seconds = Profiler::now() - start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::cout << take << ": " << drawn << " of " << clip.frames() << " frames in " << format_latency(seconds)
+            << ", " << (long)(drawn / seconds) << " a second, " << usage.ru_maxrss / 1024 << " MB at most" << std::endl;
+  std::cout << "pose checksum " << std::hex << viewer.poseChecksum() << std::dec << std::endl;
+  return 0;
+}
+
+// Let the scene's puppets fall for a while, as fast as it will go,
+// then report how that compared with real time and a checksum of where
+// they ended up. Takes the options after --simulate
+static int simulate_scene(int argc, char** argv)
+{
+  double seconds = 0.0;
+  int threads = 0;
+  std::string filename;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--threads" && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (arg[0] != '-' && seconds == 0.0) {
+      seconds = atof(arg.c_str());
+    } else if (arg[0] != '-' && filename.empty()) {
+      filename = arg;
+    } else {
+      seconds = 0.0;
+      break;
+    }
+  }
+  if (seconds <= 0.0 || filename.empty()) {
+    std::cerr << "Usage: " << argv[0] << " --simulate SECONDS [--threads T] scene.lua" << std::endl;
+    return 1;
+  }
+
+  root = import_lua(filename);
+  if (!root) {
+    std::cerr << "Could not open " << filename << std::endl;
+    return 1;
+  }
+  Ragdoll ragdoll;
+  ragdoll.build(root);
+  int steps = (int)(seconds / RAGDOLL_STEP + 0.5);
+
+  double start = Profiler::now();
+  ragdoll.run(steps, threads);
+  double wall = Profiler::now() - start;
+  ragdoll.apply();
+
+  unsigned long long hash = 14695981039346656037ULL;
+  root->hash_pose(hash);
+  std::cout << ragdoll.bodies() << " bodies in " << ragdoll.islands() << " puppets, "
+            << steps * RAGDOLL_STEP << " s in " << format_latency(wall) << ", "
+            << steps * RAGDOLL_STEP / wall << "x real time" << std::endl;
+  std::cout << "pose checksum " << std::hex << hash << std::dec << std::endl;
+  return 0;
+}
+
+// Send a feed of every joint of the scene swinging through its range,
+// at a steady rate, for --feed to pose a viewer of the same scene with.
+// Takes the options after --feed-test
+static int feed_test(int argc, char** argv)
+{
+  double rate = 1000.0, seconds = 10.0;
+  std::string sink, filename;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool value = i + 1 < argc;
+    if (arg == "--rate" && value) {
+      rate = atof(argv[++i]);
+    } else if (arg == "--seconds" && value) {
+      seconds = atof(argv[++i]);
+    } else if ((arg[0] != '-' || arg == "-") && sink.empty()) {
+      sink = arg;
+    } else if (arg[0] != '-' && filename.empty()) {
+      filename = arg;
+    } else {
+      sink.clear();
+      break;
+    }
+  }
+  if (sink.empty() || filename.empty() || rate <= 0.0 || seconds <= 0.0) {
+    std::cerr << "Usage: " << argv[0] << " --feed-test SINK [--rate HZ] [--seconds S] scene.lua" << std::endl;
+    return 1;
+  }
+
+  root = import_lua(filename);
+  if (!root) {
+    std::cerr << "Could not open " << filename << std::endl;
+    return 1;
+  }
+  std::vector<NodeId> joints;
+  root->findJoints(joints);
+
+  // Sent by path, which finds the same joints in the reader's scene
+  PoseFeed::JointTable paths(joints.size());
+  for (size_t j = 0; j < joints.size(); j++) {
+    std::vector<SceneNode*> path;
+    root->find_path(joints[j], path);
+    for (size_t n = 0; n < path.size(); n++) {
+      paths[j] += "/" + path[n]->get_name();
+    }
+  }
+
+  // A reader that goes away ends the test, rather than the process
+  signal(SIGPIPE, SIG_IGN);
+  PoseFeedWriter writer;
+  if (!writer.open(sink, paths)) {
+    return 1;
+  }
+
+  std::vector<PoseFeed::Angles> angles(joints.size());
+  long frames = (long)(seconds * rate), sent = 0, late = 0;
+  double start = Profiler::now();
+  for (; sent < frames; sent++) {
+    // Each frame at its own time from the start, so a late one does not
+    // push back the rest
+    double due = start + sent / rate;
+    struct timespec until;
+    until.tv_sec = (time_t)due;
+    until.tv_nsec = (long)((due - until.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+    double now = Profiler::now();
+    if (now > due + 1.0 / rate) {
+      late++;
+    }
+
+    // Every joint swings through its range about once a second, each a
+    // little behind the one before
+    for (size_t j = 0; j < joints.size(); j++) {
+      JointNode* joint = JointNode::by_id(joints[j]);
+      const JointNode::JointRange& x = joint->get_joint_x();
+      const JointNode::JointRange& y = joint->get_joint_y();
+      double phase = 2.0 * M_PI * (now - start) - 0.5 * j;
+      angles[j].joint = j;
+      angles[j].x = x.min + (x.max - x.min) * 0.5 * (1.0 + sin(phase));
+      angles[j].y = y.min + (y.max - y.min) * 0.5 * (1.0 + cos(phase));
+    }
+    if (!writer.write(angles)) {
+      std::cerr << "The reader went away" << std::endl;
+      break;
+    }
+  }
+  double wall = Profiler::now() - start;
+  std::cerr << sent << " frames of " << joints.size() << " joints in " << format_latency(wall) << ", "
+            << (long)(sent / wall) << " a second, " << late << " late" << std::endl;
+  return sent == frames ? 0 : 1;
+}
+
+// Pose the joints of the scene from a motion clip, looping it for as
+// many seconds of its own time as asked, as fast as it will go and
+// without drawing, then report how long that took and a checksum of
+// the last pose. Takes the options after --retarget
+static int retarget_scene(int argc, char** argv)
+{
+  double seconds = 10.0;
+  std::string take, map_file, filename;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool value = i + 1 < argc;
+    if (arg == "--map" && value) {
+      map_file = argv[++i];
+    } else if (arg == "--seconds" && value) {
+      seconds = atof(argv[++i]);
+    } else if (arg[0] != '-' && take.empty()) {
+      take = arg;
+    } else if (arg[0] != '-' && filename.empty()) {
+      filename = arg;
+    } else {
+      take.clear();
+      break;
+    }
+  }
+  if (take.empty() || filename.empty() || seconds <= 0.0) {
+    std::cerr << "Usage: " << argv[0] << " --retarget take.bvh [--map map.txt] [--seconds S] scene.lua" << std::endl;
+    return 1;
+  }
+
+  BvhClip clip;
+  JointMap map;
+  if (!clip.open(take) || (!map_file.empty() && !load_joint_map(map_file, map))) {
+    return 1;
+  }
+  if (clip.frames() == 0) {
+    std::cerr << take << " has no frames" << std::endl;
+    return 1;
+  }
+  clip.set_map(map);
+  root = import_lua(filename);
+  if (!root) {
+    std::cerr << "Could not open " << filename << std::endl;
+    return 1;
+  }
+  size_t bound = clip.bind(root);
+  if (bound == 0) {
+    std::cerr << "No joint of " << take << " is in " << filename << std::endl;
+    return 1;
+  }
+
+  long frames = (long)(seconds / clip.frame_time() + 0.5);
+  double start = Profiler::now();
+  for (long frame = 0; frame < frames; frame++) {
+    if (!clip.pose(frame % clip.frames())) {
+      std::cerr << "Frame " << frame % clip.frames() << " of " << take << " is malformed" << std::endl;
+      return 1;
+    }
+  }
+  double wall = Profiler::now() - start;
+
+  unsigned long long hash = 14695981039346656037ULL;
+  root->hash_pose(hash);
+  std::cout << take << ": " << frames << " frames of " << bound << " of its " << clip.joints().size()
+            << " joints in " << format_latency(wall) << ", " << (long)(frames / wall) << " a second, "
+            << frames * clip.frame_time() / wall << "x real time" << std::endl;
+  std::cout << "pose checksum " << std::hex << hash << std::dec << std::endl;
+  return 0;
+}
+
 int main(int argc, char** argv)
 {
+  // puppeteer --optimize-mesh in.obj out.ply runs without a window
+  if (argc == 4 && std::string(argv[1]) == "--optimize-mesh") {
+    return optimize_mesh_file(argv[2], argv[3]);
+  }
+
+  // Levels of detail are built on worker threads, and the viewer
+  // renders from a thread of its own, so Xlib and GDK must be made
+  // thread safe before anything else touches them
+  XInitThreads();
+  if (!Glib::thread_supported()) {
+    Glib::thread_init();
+  }
+  gdk_threads_init();
+
+  // puppeteer --sample N scene.lua generates N random poses of the
+  // scene's rig on every core, without a window or a display
+  if (argc >= 2 && std::string(argv[1]) == "--sample") {
+    return sample_poses(argc, argv);
+  }
+
+  // puppeteer --simulate SECONDS scene.lua lets its puppets fall limp
+  // for that long of simulated time, islands on every core
+  if (argc >= 2 && std::string(argv[1]) == "--simulate") {
+    return simulate_scene(argc, argv);
+  }
+
+  // puppeteer --feed-test SINK scene.lua sends a pose feed for another
+  // puppeteer started with --feed to follow
+  if (argc >= 2 && std::string(argv[1]) == "--feed-test") {
+    return feed_test(argc, argv);
+  }
+
+  // puppeteer --retarget take.bvh scene.lua poses the scene from a
+  // motion clip as fast as it can, without a window or a display
+  if (argc >= 2 && std::string(argv[1]) == "--retarget") {
+    return retarget_scene(argc, argv);
+  }
+
   // Construct our main loop
   Gtk::Main kit(argc, argv);
 
   // Initialize OpenGL
   Gtk::GL::init(argc, argv);
 
+  // puppeteer --replay session.rec scene.lua plays back a session
+  // recorded with --record. It opens no window, but still needs an X
+  // display to draw on (Xvfb will do). Any number of --pose joint=x,y
+  // options before the scene turn the joints they name before the
+  // replay starts.
+  if (argc >= 4 && std::string(argv[1]) == "--replay") {
+    std::vector<std::string> poses;
+    int arg = 3;
+    while (argc >= arg + 3 && std::string(argv[arg]) == "--pose") {
+      poses.push_back(argv[arg + 1]);
+      arg += 2;
+    }
+    if (arg != argc - 1) {
+      std::cerr << "Usage: " << argv[0] << " --replay session.rec [--pose joint=x,y]... scene.lua" << std::endl;
+      return 1;
+    }
+    return replay_session(argv[2], argv[arg], poses);
+  }
+
+  // puppeteer --render-bvh take.bvh scene.lua draws every frame of a
+  // motion capture take over the scene, without a window
+  if (argc >= 2 && std::string(argv[1]) == "--render-bvh") {
+    return render_clip(argc, argv);
+  }
+
+  // puppeteer --trace trace.json scene.lua records a trace of the
+  // session, to be opened in chrome://tracing or ui.perfetto.dev
+  int arg = 1;
+  if (argc >= arg + 2 && std::string(argv[arg]) == "--trace") {
+    Trace::start(argv[arg + 1]);
+    Trace::set_thread_name("main");
+    arg += 2;
+  }
+
+  // puppeteer --metrics metrics.json scene.lua appends the runtime
+  // counters to a file every few seconds, a JSON object per line
+  if (argc >= arg + 2 && std::string(argv[arg]) == "--metrics") {
+    if (!Metrics::start(argv[arg + 1])) {
+      return 1;
+    }
+    arg += 2;
+  }
+
+  // puppeteer --record session.rec scene.lua saves all the input of
+  // the session, for --replay
+  InputRecorder recorder;
+  bool recording = false;
+  if (argc >= arg + 2 && std::string(argv[arg]) == "--record") {
+    if (!recorder.open(argv[arg + 1])) {
+      return 1;
+    }
+    recording = true;
+    arg += 2;
+  }
+
+  // puppeteer --feed SOURCE scene.lua poses the joints from a stream of
+  // frames as well as the mouse: "-" for stdin, unix:PATH for a socket,
+  // or a named pipe. It lives until the window has gone
+  PoseFeed feed;
+  bool feeding = false;
+  if (argc >= arg + 2 && std::string(argv[arg]) == "--feed") {
+    if (!feed.open(argv[arg + 1])) {
+      return 1;
+    }
+    feeding = true;
+    arg += 2;
+  }
+
+  // puppeteer --bvh take.bvh [--bvh-map map.txt] scene.lua plays a
+  // motion capture take over the scene, its joints found by name or
+  // through the map
+  BvhClip clip;
+  bool clipped = false;
+  if (argc >= arg + 2 && std::string(argv[arg]) == "--bvh") {
+    if (!clip.open(argv[arg + 1])) {
+      return 1;
+    }
+    clipped = true;
+    arg += 2;
+    if (argc >= arg + 2 && std::string(argv[arg]) == "--bvh-map") {
+      JointMap map;
+      if (!load_joint_map(argv[arg + 1], map)) {
+        return 1;
+      }
+      clip.set_map(map);
+      arg += 2;
+    }
+  }
+
   std::string filename = "puppet.lua";
-  if (argc >= 2) {
-    filename = argv[1];
+  if (argc > arg) {
+    filename = argv[arg];
   }
-  // This is how you might import a scene.
-  root = import_lua(filename);
-  if (!root) {
+
+  bool failed;
+  {
+    // The scene is imported in the background while the window comes
+    // up, and drawn as it is built
+    SceneLoader loader(filename);
+    loader.start();
+
+    // The main loop runs holding the GDK lock, the render thread takes
+    // it only around the calls it makes into GDK
+    gdk_threads_enter();
+    {
+      // Construct our (only) window
+      AppWindow window(loader);
+      if (recording) {
+        window.get_viewer().set_recorder(&recorder);
+      }
+      if (feeding) {
+        window.get_viewer().set_feed(&feed);
+      }
+      if (clipped) {
+        window.set_clip(&clip);
+      }
+
+      // And run the application!
+      Gtk::Main::run(window);
+      failed = window.failed();
+    }
+    gdk_threads_leave();
+  }
+
+  // Every other thread has finished by now, but the feed's reader
+  feed.close();
+  Trace::finish();
+  Metrics::finish();
+
+  if (failed) {
     std::cerr << "Could not open " << filename << std::endl;
     return 1;
   }
-  
-  // Construct our (only) window
-  AppWindow window;
-
-  // And run the application!
-  Gtk::Main::run(window);
 }
 
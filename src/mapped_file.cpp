@@ -0,0 +1,62 @@
+#include "mapped_file.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile()
+	: m_fd(-1), m_data(0), m_size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const std::string& filename)
+{
+	close();
+
+	m_fd = ::open( filename.c_str(), O_RDONLY );
+	if ( m_fd < 0 ) return false;
+
+	struct stat st;
+	if ( fstat( m_fd, &st ) != 0 ) {
+		close();
+		return false;
+	}
+	m_size = st.st_size;
+
+	// An empty file can't be mapped, but it is still a valid (empty) range
+	if ( m_size == 0 ) return true;
+
+	void* data = mmap( 0, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0 );
+	if ( data == MAP_FAILED ) {
+		m_size = 0;
+		close();
+		return false;
+	}
+	m_data = (const char*)data;
+
+	// We always parse front to back, let the kernel read ahead
+	madvise( data, m_size, MADV_SEQUENTIAL );
+	return true;
+}
+
+void MappedFile::release(const char* from, const char* to)
+{
+	size_t page = sysconf( _SC_PAGESIZE );
+	size_t first = ( from - m_data ) / page * page;
+	size_t last = ( to - m_data ) / page * page;
+	if ( last > first ) madvise( (void*)( m_data + first ), last - first, MADV_DONTNEED );
+}
+
+void MappedFile::close()
+{
+	if ( m_data ) munmap( (void*)m_data, m_size );
+	if ( m_fd >= 0 ) ::close( m_fd );
+	m_fd = -1;
+	m_data = 0;
+	m_size = 0;
+}
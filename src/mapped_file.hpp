@@ -0,0 +1,37 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+#include <cstddef>
+
+// A read-only memory mapping of a whole file, so that large inputs can
+// be parsed in place without reading them into buffers first.
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Map the file, returns false if it can't be opened or mapped
+	bool open(const std::string& filename);
+	void close();
+
+	const char* begin() const { return m_data; }
+	const char* end() const { return m_data + m_size; }
+	size_t size() const { return m_size; }
+
+	// Drop the pages from the one from is on up to the one to is on,
+	// until they are next read, so that what has been read through
+	// doesn't stay resident
+	void release(const char* from, const char* to);
+
+private:
+	// Not copyable, the mapping has a single owner
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	int m_fd;
+	const char* m_data;
+	size_t m_size;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "material.hpp"
+#include "metrics.hpp"
 
 Material::~Material()
 {
@@ -25,6 +26,7 @@ void PhongMaterial::apply_gl() const
 	glShadeModel(GL_SMOOTH);
 	glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
 	glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+	Metrics::add( METRIC_MATERIALS, 2 );
 	glLightfv(GL_LIGHT0, GL_POSITION, light_position);
 	
     glEnable(GL_LIGHTING);
@@ -0,0 +1,541 @@
+#include "mesh.hpp"
+#include "mapped_file.hpp"
+#include "mesh_optimize.hpp"
+#include "mesh_simplify.hpp"
+#include "text_parse.hpp"
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+
+// Every index has to name a vertex that exists
+static bool check_indices(const MeshData& data, std::string& error)
+{
+	size_t count = data.vertex_count();
+	for ( size_t i = 0; i < data.indices.size(); i++ ) {
+		if ( data.indices[i] >= count ) {
+			error = "face refers to a missing vertex";
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Wavefront OBJ. Only "v" and "f" lines matter to us, faces are
+ * triangulated as fans and texture/normal references are skipped since
+ * normals are recomputed anyway.
+ */
+static bool parse_obj(const char* p, const char* end, MeshData& data, std::string& error)
+{
+	std::vector<GLfloat>& vertices = data.vertices;
+	std::vector<GLuint>& indices = data.indices;
+	long line = 0;
+
+	for ( ; p < end; p = skip_line( p, end ) ) {
+		line++;
+		p = skip_space( p, end );
+		if ( p + 1 >= end || !is_space( p[1] ) ) continue;
+
+		if ( p[0] == 'v' ) {
+			p += 2;
+			float xyz[3];
+			for ( int i = 0; i < 3; i++ ) {
+				p = skip_space( p, end );
+				if ( !parse_float( p, end, xyz[i] ) ) {
+					std::ostringstream os;
+					os << "bad vertex on line " << line;
+					error = os.str();
+					return false;
+				}
+			}
+			vertices.push_back( xyz[0] );
+			vertices.push_back( xyz[1] );
+			vertices.push_back( xyz[2] );
+			vertices.push_back( 0.0f );
+			vertices.push_back( 0.0f );
+			vertices.push_back( 0.0f );
+		} else if ( p[0] == 'f' ) {
+			p += 2;
+			long count = vertices.size() / 6;
+			GLuint first = 0, previous = 0;
+			int corners = 0;
+			for ( ;; ) {
+				p = skip_space( p, end );
+				if ( p >= end || *p == '\n' || *p == '#' ) break;
+
+				long i;
+				if ( !parse_int( p, end, i ) || i == 0 ) {
+					std::ostringstream os;
+					os << "bad face on line " << line;
+					error = os.str();
+					return false;
+				}
+				// Negative indices count back from the last vertex read
+				long index = i > 0 ? i - 1 : count + i;
+				if ( index < 0 ) {
+					std::ostringstream os;
+					os << "bad face on line " << line;
+					error = os.str();
+					return false;
+				}
+				// Skip the "/texture/normal" part of the reference
+				while ( p < end && !is_space( *p ) && *p != '\n' ) p++;
+
+				if ( corners == 0 ) {
+					first = index;
+				} else if ( corners >= 2 ) {
+					indices.push_back( first );
+					indices.push_back( previous );
+					indices.push_back( index );
+				}
+				previous = index;
+				corners++;
+			}
+		}
+	}
+	return check_indices( data, error );
+}
+
+/*
+ * Binary PLY, either endianness. Elements other than "vertex" and
+ * "face" are read and thrown away.
+ */
+
+// Header comment marking files written by export_ply, which are already optimized
+#define PLY_OPTIMIZED_COMMENT "vertex_cache_optimized"
+
+enum PlyType { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+			   PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+struct PlyProperty {
+	PlyType type;
+	PlyType count_type;			// PLY_NONE unless this is a list
+	int role;					// 0 ignored, 1-3 for x y z, 4 for the vertex indices
+};
+
+struct PlyElement {
+	std::string name;
+	long count;
+	std::vector<PlyProperty> properties;
+};
+
+static PlyType ply_type(const std::string& name)
+{
+	if ( name == "char" || name == "int8" ) return PLY_INT8;
+	if ( name == "uchar" || name == "uint8" ) return PLY_UINT8;
+	if ( name == "short" || name == "int16" ) return PLY_INT16;
+	if ( name == "ushort" || name == "uint16" ) return PLY_UINT16;
+	if ( name == "int" || name == "int32" ) return PLY_INT32;
+	if ( name == "uint" || name == "uint32" ) return PLY_UINT32;
+	if ( name == "float" || name == "float32" ) return PLY_FLOAT32;
+	if ( name == "double" || name == "float64" ) return PLY_FLOAT64;
+	return PLY_NONE;
+}
+
+static size_t ply_size(PlyType type)
+{
+	switch ( type ) {
+	case PLY_INT8: case PLY_UINT8: return 1;
+	case PLY_INT16: case PLY_UINT16: return 2;
+	case PLY_INT32: case PLY_UINT32: case PLY_FLOAT32: return 4;
+	case PLY_FLOAT64: return 8;
+	default: return 0;
+	}
+}
+
+// Read one value, the caller makes sure there are enough bytes left
+static double ply_read(const char*& p, PlyType type, bool swap)
+{
+	unsigned char b[8];
+	size_t n = ply_size( type );
+	memcpy( b, p, n );
+	p += n;
+	if ( swap ) std::reverse( b, b + n );
+
+	switch ( type ) {
+	case PLY_INT8: return (signed char)b[0];
+	case PLY_UINT8: return b[0];
+	case PLY_INT16: { short v; memcpy( &v, b, 2 ); return v; }
+	case PLY_UINT16: { unsigned short v; memcpy( &v, b, 2 ); return v; }
+	case PLY_INT32: { int v; memcpy( &v, b, 4 ); return v; }
+	case PLY_UINT32: { unsigned int v; memcpy( &v, b, 4 ); return v; }
+	case PLY_FLOAT32: { float v; memcpy( &v, b, 4 ); return v; }
+	case PLY_FLOAT64: { double v; memcpy( &v, b, 8 ); return v; }
+	default: return 0.0;
+	}
+}
+
+// Split the next header line into words
+static void ply_words(const char*& p, const char* end, std::vector<std::string>& words)
+{
+	words.clear();
+	const char* eol = (const char*)memchr( p, '\n', end - p );
+	if ( !eol ) eol = end;
+	while ( p < eol ) {
+		p = skip_space( p, eol );
+		const char* q = p;
+		while ( q < eol && !is_space( *q ) ) q++;
+		if ( q > p ) words.push_back( std::string( p, q ) );
+		p = q;
+	}
+	p = eol < end ? eol + 1 : end;
+}
+
+static bool parse_ply(const char* p, const char* end, MeshData& data, bool& optimized,
+					  std::string& error)
+{
+	std::vector<std::string> words;
+	std::vector<PlyElement> elements;
+	bool little_endian = true;
+
+	ply_words( p, end, words );
+	if ( words.size() != 1 || words[0] != "ply" ) {
+		error = "not a PLY file";
+		return false;
+	}
+	for ( ;; ) {
+		if ( p >= end ) {
+			error = "header has no end_header";
+			return false;
+		}
+		ply_words( p, end, words );
+		if ( words.empty() ) continue;
+		if ( words[0] == "end_header" ) break;
+
+		if ( words[0] == "comment" && words.size() == 2 && words[1] == PLY_OPTIMIZED_COMMENT ) {
+			optimized = true;
+		}
+
+		if ( words[0] == "format" && words.size() >= 2 ) {
+			if ( words[1] == "binary_little_endian" ) {
+				little_endian = true;
+			} else if ( words[1] == "binary_big_endian" ) {
+				little_endian = false;
+			} else {
+				error = "only binary PLY files are supported";
+				return false;
+			}
+		} else if ( words[0] == "element" && words.size() == 3 ) {
+			PlyElement element;
+			element.name = words[1];
+			element.count = atol( words[2].c_str() );
+			elements.push_back( element );
+		} else if ( words[0] == "property" && !elements.empty() ) {
+			PlyElement& element = elements.back();
+			PlyProperty property;
+			property.count_type = PLY_NONE;
+			property.role = 0;
+			std::string name;
+			if ( words.size() == 5 && words[1] == "list" ) {
+				property.count_type = ply_type( words[2] );
+				property.type = ply_type( words[3] );
+				name = words[4];
+				if ( property.count_type == PLY_NONE ) property.type = PLY_NONE;
+			} else if ( words.size() == 3 ) {
+				property.type = ply_type( words[1] );
+				name = words[2];
+			} else {
+				property.type = PLY_NONE;
+			}
+			if ( property.type == PLY_NONE ) {
+				error = "unknown property type";
+				return false;
+			}
+			if ( element.name == "vertex" && property.count_type == PLY_NONE ) {
+				if ( name == "x" ) property.role = 1;
+				if ( name == "y" ) property.role = 2;
+				if ( name == "z" ) property.role = 3;
+			}
+			if ( element.name == "face" && property.count_type != PLY_NONE &&
+				 ( name == "vertex_indices" || name == "vertex_index" ) ) {
+				property.role = 4;
+			}
+			element.properties.push_back( property );
+		}
+	}
+
+	unsigned short one = 1;
+	bool swap = ( *(unsigned char*)&one == 1 ) != little_endian;
+
+	for ( size_t e = 0; e < elements.size(); e++ ) {
+		const PlyElement& element = elements[e];
+		bool vertex = element.name == "vertex";
+		if ( vertex ) data.vertices.reserve( data.vertices.size() + 6 * element.count );
+		if ( element.name == "face" ) data.indices.reserve( data.indices.size() + 3 * element.count );
+
+		for ( long i = 0; i < element.count; i++ ) {
+			float xyz[3] = { 0.0f, 0.0f, 0.0f };
+			for ( size_t k = 0; k < element.properties.size(); k++ ) {
+				const PlyProperty& property = element.properties[k];
+				size_t size = ply_size( property.type );
+				if ( property.count_type == PLY_NONE ) {
+					if ( p + size > end ) {
+						error = "file is truncated";
+						return false;
+					}
+					double v = ply_read( p, property.type, swap );
+					if ( property.role ) xyz[property.role - 1] = v;
+					continue;
+				}
+
+				if ( p + ply_size( property.count_type ) > end ) {
+					error = "file is truncated";
+					return false;
+				}
+				long n = (long)ply_read( p, property.count_type, swap );
+				if ( n < 0 || p + n * size > end ) {
+					error = "file is truncated";
+					return false;
+				}
+				if ( property.role != 4 ) {
+					p += n * size;
+					continue;
+				}
+				// Triangulate the polygon as a fan
+				GLuint first = 0, previous = 0;
+				for ( long c = 0; c < n; c++ ) {
+					GLuint index = (GLuint)ply_read( p, property.type, swap );
+					if ( c == 0 ) {
+						first = index;
+					} else if ( c >= 2 ) {
+						data.indices.push_back( first );
+						data.indices.push_back( previous );
+						data.indices.push_back( index );
+					}
+					previous = index;
+				}
+			}
+			if ( vertex ) {
+				data.vertices.push_back( xyz[0] );
+				data.vertices.push_back( xyz[1] );
+				data.vertices.push_back( xyz[2] );
+				data.vertices.push_back( 0.0f );
+				data.vertices.push_back( 0.0f );
+				data.vertices.push_back( 0.0f );
+			}
+		}
+	}
+	return check_indices( data, error );
+}
+
+void MeshData::compute_normals()
+{
+	size_t count = vertex_count();
+	for ( size_t i = 0; i < count; i++ ) {
+		vertices[6 * i + 3] = vertices[6 * i + 4] = vertices[6 * i + 5] = 0.0f;
+	}
+
+	// The cross product is twice the triangle area, which is the weight we want
+	for ( size_t t = 0; t + 2 < indices.size(); t += 3 ) {
+		const GLfloat* a = &vertices[6 * indices[t]];
+		const GLfloat* b = &vertices[6 * indices[t + 1]];
+		const GLfloat* c = &vertices[6 * indices[t + 2]];
+		GLfloat u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		GLfloat v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+		GLfloat n[3] = { u[1] * v[2] - u[2] * v[1],
+						 u[2] * v[0] - u[0] * v[2],
+						 u[0] * v[1] - u[1] * v[0] };
+		for ( int k = 0; k < 3; k++ ) {
+			GLfloat* normal = &vertices[6 * indices[t + k] + 3];
+			normal[0] += n[0];
+			normal[1] += n[1];
+			normal[2] += n[2];
+		}
+	}
+
+	for ( size_t i = 0; i < count; i++ ) {
+		GLfloat* normal = &vertices[6 * i + 3];
+		GLfloat length = sqrt( normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2] );
+		if ( length > 0.0f ) {
+			normal[0] /= length;
+			normal[1] /= length;
+			normal[2] /= length;
+		}
+	}
+}
+
+void MeshData::draw(bool picking) const
+{
+	if ( indices.empty() ) return;
+
+	const GLsizei stride = 6 * sizeof(GLfloat);
+	glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glEnableClientState( GL_NORMAL_ARRAY );
+	glVertexPointer( 3, GL_FLOAT, stride, &vertices[0] );
+	glNormalPointer( GL_FLOAT, stride, &vertices[3] );
+
+	// Picked parts will be drawn using only line
+	if ( picking ) {
+		glPushAttrib( GL_POLYGON_BIT );
+		glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
+	}
+	glDrawElements( GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, &indices[0] );
+	if ( picking ) glPopAttrib();
+
+	glPopClientAttrib();
+}
+
+Mesh::Mesh()
+	: m_levels(1), m_radius(-1.0), m_file_size(0), m_file_time(0)
+{
+}
+
+Mesh::~Mesh()
+{
+}
+
+void Mesh::walk_gl(bool picking) const
+{
+	walk_gl_lod( picking, 0 );
+}
+
+int Mesh::lod_count() const
+{
+	return m_levels.size();
+}
+
+size_t Mesh::lod_triangles(int level) const
+{
+	return m_levels[level].triangle_count();
+}
+
+void Mesh::walk_gl_lod(bool picking, int level) const
+{
+	m_levels[level].draw( picking );
+	changed = false;
+}
+
+double Mesh::get_radius() const
+{
+	if ( m_radius < 0.0 ) {
+		const std::vector<GLfloat>& v = m_levels[0].vertices;
+		double r2 = 0.0;
+		for ( size_t i = 0; i < v.size(); i += 6 ) {
+			r2 = std::max( r2, (double)( v[i] * v[i] + v[i + 1] * v[i + 1] + v[i + 2] * v[i + 2] ) );
+		}
+		m_radius = sqrt( r2 );
+	}
+	return m_radius;
+}
+
+void Mesh::build_lods(std::vector<MeshData>& levels) const
+{
+	levels.clear();
+	size_t target = m_levels[0].triangle_count() / MESH_LOD_RATIO;
+	while ( levels.size() + 1 < MESH_LOD_MAX && target >= MESH_LOD_MIN_TRIANGLES ) {
+		// Each level is simplified from the previous one, which is much cheaper
+		const MeshData& previous = levels.empty() ? m_levels[0] : levels.back();
+		MeshData level;
+		simplify_mesh( previous, level, target );
+
+		// Stop once the simplifier can't make any real progress
+		if ( level.triangle_count() * 2 > previous.triangle_count() ) break;
+
+		double before, after;
+		optimize_mesh( level, before, after );
+		levels.push_back( level );
+		target = level.triangle_count() / MESH_LOD_RATIO;
+	}
+}
+
+void Mesh::set_lods(std::vector<MeshData>& levels)
+{
+	// Level 0 moves over rather than being copied
+	levels.insert( levels.begin(), MeshData() );
+	levels[0].vertices.swap( m_levels[0].vertices );
+	levels[0].indices.swap( m_levels[0].indices );
+	m_levels.swap( levels );
+	levels.clear();
+}
+
+void Mesh::set_source(const std::string& filename, long long size, long long time)
+{
+	m_filename = filename;
+	m_file_size = size;
+	m_file_time = time;
+}
+
+Mesh* import_mesh(const std::string& filename, bool optimize)
+{
+	std::string extension;
+	std::string::size_type dot = filename.rfind( '.' );
+	if ( dot != std::string::npos ) extension = filename.substr( dot + 1 );
+	std::transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+
+	MappedFile file;
+	if ( !file.open( filename ) ) {
+		std::cerr << "Error loading " << filename << ": Unable to open the file." << std::endl;
+		return 0;
+	}
+
+	Mesh* mesh = new Mesh();
+	std::string error;
+	bool ok, optimized = false;
+	if ( extension == "obj" ) {
+		ok = parse_obj( file.begin(), file.end(), mesh->get_data(), error );
+	} else if ( extension == "ply" ) {
+		ok = parse_ply( file.begin(), file.end(), mesh->get_data(), optimized, error );
+	} else {
+		ok = false;
+		error = "only .obj and .ply meshes are supported";
+	}
+	if ( !ok ) {
+		std::cerr << "Error loading " << filename << ": " << error << std::endl;
+		delete mesh;
+		return 0;
+	}
+
+	struct stat st;
+	if ( stat( filename.c_str(), &st ) == 0 ) mesh->set_source( filename, st.st_size, st.st_mtime );
+
+	MeshData& data = mesh->get_data();
+	data.compute_normals();
+	if ( optimize && !optimized ) {
+		double before, after;
+		optimize_mesh( data, before, after );
+	}
+	return mesh;
+}
+
+bool export_ply(const MeshData& data, const std::string& filename)
+{
+	std::ofstream out( filename.c_str(), std::ios::out | std::ios::binary );
+	if ( !out ) {
+		std::cerr << "Error writing " << filename << ": Unable to open the file." << std::endl;
+		return false;
+	}
+
+	unsigned short one = 1;
+	bool little_endian = *(unsigned char*)&one == 1;
+	out << "ply\n"
+		<< "format " << ( little_endian ? "binary_little_endian" : "binary_big_endian" ) << " 1.0\n"
+		<< "comment " << PLY_OPTIMIZED_COMMENT << "\n"
+		<< "element vertex " << data.vertex_count() << "\n"
+		<< "property float x\nproperty float y\nproperty float z\n"
+		<< "property float nx\nproperty float ny\nproperty float nz\n"
+		<< "element face " << data.triangle_count() << "\n"
+		<< "property list uchar uint vertex_indices\n"
+		<< "end_header\n";
+
+	if ( !data.vertices.empty() ) {
+		out.write( (const char*)&data.vertices[0], data.vertices.size() * sizeof(GLfloat) );
+	}
+	const unsigned char three = 3;
+	for ( size_t t = 0; t < data.triangle_count(); t++ ) {
+		out.write( (const char*)&three, 1 );
+		out.write( (const char*)&data.indices[3 * t], 3 * sizeof(GLuint) );
+	}
+
+	if ( !out ) {
+		std::cerr << "Error writing " << filename << ": Write failed." << std::endl;
+		return false;
+	}
+	return true;
+}
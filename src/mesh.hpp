@@ -0,0 +1,76 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include "primitive.hpp"
+#include <string>
+#include <vector>
+
+// Indexed triangles laid out the way glDrawElements wants them
+struct MeshData {
+	// Interleaved position and normal of every vertex: x y z nx ny nz
+	std::vector<GLfloat> vertices;
+	// Three vertex indices per triangle
+	std::vector<GLuint> indices;
+
+	size_t vertex_count() const { return vertices.size() / 6; }
+	size_t triangle_count() const { return indices.size() / 3; }
+
+	// Recompute smooth vertex normals, weighted by triangle area
+	void compute_normals();
+	// Draw with vertex arrays, as lines if picked
+	void draw(bool picking) const;
+};
+
+// Coarser levels of detail each have about this fraction of the triangles of the previous one
+#define MESH_LOD_RATIO 4
+// No level is made smaller than this
+#define MESH_LOD_MIN_TRIANGLES 64
+#define MESH_LOD_MAX 6
+
+// A triangle mesh loaded from an OBJ or binary PLY file
+class Mesh : public Primitive {
+public:
+	Mesh();
+	virtual ~Mesh();
+	virtual void walk_gl(bool picking) const;
+
+	// The full resolution data, level 0
+	MeshData& get_data() { return m_levels[0]; }
+	const MeshData& get_data() const { return m_levels[0]; }
+
+	virtual int lod_count() const;
+	virtual size_t lod_triangles(int level) const;
+	virtual void walk_gl_lod(bool picking, int level) const;
+	virtual double get_radius() const;
+
+	// Simplify level 0 into the coarser levels, without changing the
+	// mesh, so it can be drawn meanwhile
+	void build_lods(std::vector<MeshData>& levels) const;
+	// Replace the coarser levels with levels, leaving it empty
+	void set_lods(std::vector<MeshData>& levels);
+	// Every level, for saving them
+	const std::vector<MeshData>& get_levels() const { return m_levels; }
+
+	// The file the mesh came from, and its size and modification time
+	// when it was read, so cached data can be checked against it
+	void set_source(const std::string& filename, long long size, long long time);
+	const std::string& get_filename() const { return m_filename; }
+	long long get_file_size() const { return m_file_size; }
+	long long get_file_time() const { return m_file_time; }
+
+private:
+	std::vector<MeshData> m_levels;
+	mutable double m_radius;	// Negative until computed
+	std::string m_filename;
+	long long m_file_size, m_file_time;
+};
+
+// Load a mesh from filename, picking the parser from the extension,
+// and optimize it for the vertex cache unless asked not to. Returns 0
+// and reports the problem on std::cerr if it can't be read.
+Mesh* import_mesh(const std::string& filename, bool optimize = true);
+
+// Write a binary PLY that import_mesh will load without optimizing again
+bool export_ply(const MeshData& data, const std::string& filename);
+
+#endif
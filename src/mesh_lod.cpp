@@ -0,0 +1,244 @@
+#include "mesh_lod.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <glibmm.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+
+#define LOD_CACHE_MAGIC "PUPLOD1\n"
+
+// Consume size bytes from the cache, false if there aren't that many left
+static bool read_bytes(const char*& p, const char* end, void* out, size_t size)
+{
+	if ( (size_t)( end - p ) < size ) return false;
+	memcpy( out, p, size );
+	p += size;
+	return true;
+}
+
+template <class T>
+static bool read_value(const char*& p, const char* end, T& value)
+{
+	return read_bytes( p, end, &value, sizeof(T) );
+}
+
+template <class T>
+static void write_value(std::ostream& out, const T& value)
+{
+	out.write( (const char*)&value, sizeof(T) );
+}
+
+// Replace the coarser levels of mesh, holding lock if there is one
+static void install_lods(Mesh* mesh, std::vector<MeshData>& levels, Glib::Mutex* lock)
+{
+	if ( lock ) lock->lock();
+	mesh->set_lods( levels );
+	if ( lock ) lock->unlock();
+}
+
+// Restore the levels of any mesh found in the cache, returns how many were
+static size_t load_cache(const std::vector<Mesh*>& meshes, std::vector<char>& done,
+						 const std::string& cache, Glib::Mutex* lock)
+{
+	MappedFile file;
+	if ( !file.open( cache ) ) return 0;
+	const char* p = file.begin();
+	const char* end = file.end();
+
+	char magic[8];
+	if ( !read_bytes( p, end, magic, 8 ) || memcmp( magic, LOD_CACHE_MAGIC, 8 ) != 0 ) return 0;
+
+	size_t found = 0;
+	unsigned int entries;
+	if ( !read_value( p, end, entries ) ) return 0;
+	for ( unsigned int e = 0; e < entries; e++ ) {
+		unsigned int length, count;
+		long long size, time;
+		if ( !read_value( p, end, length ) || (size_t)( end - p ) < length ) return found;
+		std::string filename( p, length );
+		p += length;
+		if ( !read_value( p, end, size ) || !read_value( p, end, time ) ||
+			 !read_value( p, end, count ) ) return found;
+
+		// Every count is checked against what is left of the file before
+		// anything is allocated for it, so a broken cache can't ask for more
+		if ( count > (size_t)( end - p ) / ( 2 * sizeof(unsigned int) ) ) return found;
+		std::vector<MeshData> levels( count );
+		for ( unsigned int l = 0; l < count; l++ ) {
+			unsigned int vertices, indices;
+			if ( !read_value( p, end, vertices ) || !read_value( p, end, indices ) ) return found;
+			if ( vertices % 6 != 0 || indices % 3 != 0 ) return found;
+			if ( (size_t)( end - p ) / sizeof(GLfloat) < vertices ||
+				 (size_t)( end - p - vertices * sizeof(GLfloat) ) / sizeof(GLuint) < indices ) return found;
+			levels[l].vertices.resize( vertices );
+			levels[l].indices.resize( indices );
+			if ( vertices ) read_bytes( p, end, &levels[l].vertices[0], vertices * sizeof(GLfloat) );
+			if ( indices ) read_bytes( p, end, &levels[l].indices[0], indices * sizeof(GLuint) );
+
+			// Nor draw past the end of its vertices
+			for ( unsigned int i = 0; i < indices; i++ ) {
+				if ( levels[l].indices[i] >= vertices / 6 ) return found;
+			}
+		}
+
+		for ( size_t m = 0; m < meshes.size(); m++ ) {
+			Mesh* mesh = meshes[m];
+			if ( done[m] || mesh->get_filename() != filename ||
+				 mesh->get_file_size() != size || mesh->get_file_time() != time ) continue;
+			std::vector<MeshData> copy( levels );
+			install_lods( mesh, copy, lock );
+			done[m] = 1;
+			found++;
+		}
+	}
+	return found;
+}
+
+static void save_cache(const std::vector<Mesh*>& meshes, const std::string& cache)
+{
+	// Write a temporary file first so an interrupted save can't leave a broken cache
+	std::string temporary = cache + ".tmp";
+	std::ofstream out( temporary.c_str(), std::ios::out | std::ios::binary );
+	if ( !out ) {
+		std::cerr << "Error writing " << cache << ": Unable to open the file." << std::endl;
+		return;
+	}
+
+	out.write( LOD_CACHE_MAGIC, 8 );
+	write_value( out, (unsigned int)meshes.size() );
+	for ( size_t m = 0; m < meshes.size(); m++ ) {
+		Mesh* mesh = meshes[m];
+		const std::vector<MeshData>& levels = mesh->get_levels();
+		write_value( out, (unsigned int)mesh->get_filename().size() );
+		out.write( mesh->get_filename().data(), mesh->get_filename().size() );
+		write_value( out, mesh->get_file_size() );
+		write_value( out, mesh->get_file_time() );
+		write_value( out, (unsigned int)( levels.size() - 1 ) );	// Level 0 is the mesh file itself
+		for ( size_t l = 1; l < levels.size(); l++ ) {
+			write_value( out, (unsigned int)levels[l].vertices.size() );
+			write_value( out, (unsigned int)levels[l].indices.size() );
+			if ( !levels[l].vertices.empty() ) {
+				out.write( (const char*)&levels[l].vertices[0], levels[l].vertices.size() * sizeof(GLfloat) );
+			}
+			if ( !levels[l].indices.empty() ) {
+				out.write( (const char*)&levels[l].indices[0], levels[l].indices.size() * sizeof(GLuint) );
+			}
+		}
+	}
+	out.close();
+
+	if ( !out || rename( temporary.c_str(), cache.c_str() ) != 0 ) {
+		std::cerr << "Error writing " << cache << ": Write failed." << std::endl;
+		unlink( temporary.c_str() );
+	}
+}
+
+// Meshes loaded from the same file, unchanged since, have the same
+// levels. The first of each group is built and the rest get copies
+typedef std::vector<Mesh*> MeshGroup;
+
+// Hands out groups to the worker threads until none are left
+class LodBuilder {
+public:
+	LodBuilder(const std::vector<MeshGroup>& work, Glib::Mutex* install)
+		: m_work(work), m_next(0), m_install(install) {}
+
+	void run()
+	{
+		for ( ;; ) {
+			const MeshGroup* group;
+			{
+				Glib::Mutex::Lock lock( m_lock );
+				if ( m_next >= m_work.size() ) return;
+				group = &m_work[m_next++];
+			}
+			TraceScope trace( "build mesh lods" );
+			std::vector<MeshData> levels;
+			(*group)[0]->build_lods( levels );
+			for ( size_t m = 1; m < group->size(); m++ ) {
+				std::vector<MeshData> copy( levels );
+				install_lods( (*group)[m], copy, m_install );
+			}
+			install_lods( (*group)[0], levels, m_install );
+		}
+	}
+
+	void run_worker()
+	{
+		Trace::set_thread_name( "lod worker" );
+		run();
+	}
+
+private:
+	const std::vector<MeshGroup>& m_work;
+	size_t m_next;
+	Glib::Mutex m_lock;
+	Glib::Mutex* m_install;
+};
+
+void build_mesh_lods(const std::vector<Mesh*>& meshes, const std::string& cache, Glib::Mutex* lock)
+{
+	if ( meshes.empty() ) return;
+
+	// Group the meshes by file, so each is simplified and saved once.
+	// A mesh with no file is a group of its own
+	std::vector<MeshGroup> groups;
+	std::map<std::pair<std::string, std::pair<long long, long long> >, size_t> by_file;
+	std::set<Mesh*> seen;
+	for ( size_t m = 0; m < meshes.size(); m++ ) {
+		Mesh* mesh = meshes[m];
+		if ( !seen.insert( mesh ).second ) continue;
+		size_t group = groups.size();
+		if ( !mesh->get_filename().empty() ) {
+			group = by_file.insert( std::make_pair( std::make_pair( mesh->get_filename(),
+				std::make_pair( mesh->get_file_size(), mesh->get_file_time() ) ), group ) ).first->second;
+		}
+		if ( group == groups.size() ) groups.push_back( MeshGroup() );
+		groups[group].push_back( mesh );
+	}
+
+	std::vector<Mesh*> unique;
+	for ( size_t g = 0; g < groups.size(); g++ ) unique.push_back( groups[g][0] );
+	std::vector<char> done( unique.size(), 0 );
+	std::vector<MeshGroup> work;
+	{
+		TraceScope trace( "load lod cache" );
+		load_cache( unique, done, cache, lock );
+	}
+	for ( size_t g = 0; g < groups.size(); g++ ) {
+		if ( !done[g] ) {
+			work.push_back( groups[g] );
+		} else {
+			// The cache only gave the first of the group its levels
+			for ( size_t m = 1; m < groups[g].size(); m++ ) {
+				std::vector<MeshData> copy( unique[g]->get_levels().begin() + 1, unique[g]->get_levels().end() );
+				install_lods( groups[g][m], copy, lock );
+			}
+		}
+	}
+	if ( work.empty() ) return;
+
+	LodBuilder builder( work, lock );
+	long cores = sysconf( _SC_NPROCESSORS_ONLN );
+	size_t threads = std::min( work.size(), (size_t)( cores > 0 ? cores : 1 ) );
+	if ( threads <= 1 || !Glib::thread_supported() ) {
+		builder.run();
+	} else {
+		// This thread takes a share of the work too
+		std::vector<Glib::Thread*> workers;
+		for ( size_t t = 1; t < threads; t++ ) {
+			workers.push_back( Glib::Thread::create( sigc::mem_fun( builder, &LodBuilder::run_worker ), true ) );
+		}
+		builder.run();
+		for ( size_t t = 0; t < workers.size(); t++ ) workers[t]->join();
+	}
+
+	TraceScope trace( "save lod cache" );
+	save_cache( unique, cache );
+}
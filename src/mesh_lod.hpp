@@ -0,0 +1,18 @@
+#ifndef MESH_LOD_HPP
+#define MESH_LOD_HPP
+
+#include "mesh.hpp"
+#include <glibmm.h>
+#include <string>
+#include <vector>
+
+// Give every mesh its levels of detail. Levels saved in the cache file
+// are reused as long as the mesh file has not changed since; the rest
+// are built in parallel, one file per thread, and the cache rewritten.
+// Meshes loaded from the same file share one build and one entry.
+// Meshes are only changed holding lock, if there is one, each as its
+// levels are ready, so they can be drawn all the while.
+void build_mesh_lods(const std::vector<Mesh*>& meshes, const std::string& cache,
+					 Glib::Mutex* lock = 0);
+
+#endif
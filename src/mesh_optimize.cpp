@@ -0,0 +1,262 @@
+#include "mesh_optimize.hpp"
+#include <algorithm>
+#include <cmath>
+
+double compute_acmr(const std::vector<GLuint>& indices, size_t vertex_count, int cache_size)
+{
+	if ( indices.size() < 3 ) return 0.0;
+
+	// A vertex is in the FIFO if fewer than cache_size misses happened since it was loaded
+	std::vector<long> loaded( vertex_count, -1 );
+	long misses = 0;
+	for ( size_t i = 0; i < indices.size(); i++ ) {
+		long& t = loaded[indices[i]];
+		if ( t < 0 || misses - t >= cache_size ) {
+			t = misses;
+			misses++;
+		}
+	}
+	return (double)misses / ( indices.size() / 3 );
+}
+
+/*
+ * Tipsify
+ */
+
+// Triangles using each vertex, as offsets into one flat array
+struct Adjacency {
+	std::vector<size_t> offsets;
+	std::vector<size_t> triangles;
+
+	Adjacency(const std::vector<GLuint>& indices, size_t vertex_count)
+		: offsets( vertex_count + 1, 0 ), triangles( indices.size() )
+	{
+		for ( size_t i = 0; i < indices.size(); i++ ) offsets[indices[i] + 1]++;
+		for ( size_t v = 0; v < vertex_count; v++ ) offsets[v + 1] += offsets[v];
+		std::vector<size_t> fill( offsets.begin(), offsets.end() - 1 );
+		for ( size_t i = 0; i < indices.size(); i++ ) triangles[fill[indices[i]]++] = i / 3;
+	}
+};
+
+// Pick the next fanning vertex when the current one has no triangles left
+static long skip_dead_end(const std::vector<int>& live, std::vector<GLuint>& dead_end,
+						  size_t& cursor)
+{
+	// Recently used vertices first, they may still be in the cache
+	while ( !dead_end.empty() ) {
+		GLuint d = dead_end.back();
+		dead_end.pop_back();
+		if ( live[d] > 0 ) return d;
+	}
+	// Otherwise the next vertex in input order that still has triangles
+	for ( ; cursor < live.size(); cursor++ ) {
+		if ( live[cursor] > 0 ) return cursor;
+	}
+	return -1;
+}
+
+void optimize_vertex_cache(MeshData& data, std::vector<size_t>& clusters, int cache_size)
+{
+	const std::vector<GLuint>& indices = data.indices;
+	size_t vertex_count = data.vertex_count();
+	size_t triangle_count = data.triangle_count();
+	clusters.clear();
+	if ( triangle_count == 0 ) return;
+
+	Adjacency adjacency( indices, vertex_count );
+	std::vector<int> live( vertex_count );
+	for ( size_t v = 0; v < vertex_count; v++ ) live[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+
+	std::vector<long> stamp( vertex_count, 0 );	// Time each vertex last entered the cache
+	std::vector<char> emitted( triangle_count, 0 );
+	std::vector<GLuint> dead_end;
+	std::vector<GLuint> candidates;
+	std::vector<GLuint> output;
+	output.reserve( indices.size() );
+
+	long time = cache_size + 1;
+	size_t cursor = 0;
+	long fanning = skip_dead_end( live, dead_end, cursor );
+	clusters.push_back( 0 );
+
+	while ( fanning >= 0 ) {
+		candidates.clear();
+		for ( size_t a = adjacency.offsets[fanning]; a < adjacency.offsets[fanning + 1]; a++ ) {
+			size_t t = adjacency.triangles[a];
+			if ( emitted[t] ) continue;
+			for ( int k = 0; k < 3; k++ ) {
+				GLuint v = indices[3 * t + k];
+				output.push_back( v );
+				dead_end.push_back( v );
+				candidates.push_back( v );
+				live[v]--;
+				if ( time - stamp[v] > cache_size ) {
+					stamp[v] = time;
+					time++;
+				}
+			}
+			emitted[t] = 1;
+		}
+
+		// Prefer the candidate that has been in the cache longest but
+		// will still be there after all its triangles are emitted
+		long best = -1, best_priority = 0;
+		for ( size_t c = 0; c < candidates.size(); c++ ) {
+			GLuint v = candidates[c];
+			if ( live[v] <= 0 ) continue;
+			long priority = 0;
+			if ( time - stamp[v] + 2 * live[v] <= cache_size ) priority = time - stamp[v];
+			if ( priority > best_priority ) {
+				best_priority = priority;
+				best = v;
+			}
+		}
+		if ( best < 0 ) {
+			best = skip_dead_end( live, dead_end, cursor );
+			if ( best >= 0 ) clusters.push_back( output.size() / 3 );
+		}
+		fanning = best;
+	}
+
+	data.indices.swap( output );
+}
+
+/*
+ * Overdraw
+ */
+
+struct Cluster {
+	size_t begin, end;			// Triangle range
+	double sort_key;
+};
+
+static bool draw_first(const Cluster& a, const Cluster& b)
+{
+	return a.sort_key > b.sort_key;
+}
+
+void optimize_overdraw(MeshData& data, const std::vector<size_t>& clusters,
+					   double threshold, int cache_size)
+{
+	const std::vector<GLuint>& indices = data.indices;
+	const std::vector<GLfloat>& vertices = data.vertices;
+	size_t triangle_count = data.triangle_count();
+	if ( triangle_count == 0 || clusters.empty() ) return;
+
+	// Split the hard clusters wherever a piece already has a good enough ACMR
+	double target = threshold * compute_acmr( indices, data.vertex_count(), cache_size );
+	std::vector<long> loaded( data.vertex_count(), -1 );
+	std::vector<Cluster> pieces;
+	long misses = 0, start = 0;
+	for ( size_t c = 0; c < clusters.size(); c++ ) {
+		size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangle_count;
+		Cluster piece;
+		piece.begin = clusters[c];
+		start = misses + cache_size;
+		misses = start;
+		for ( size_t t = clusters[c]; t < end; t++ ) {
+			for ( int k = 0; k < 3; k++ ) {
+				long& s = loaded[indices[3 * t + k]];
+				if ( s < start || misses - s >= cache_size ) {
+					s = misses;
+					misses++;
+				}
+			}
+			// Starting a new piece is treated as flushing the cache
+			size_t n = t + 1 - piece.begin;
+			if ( t + 1 < end && n >= 8 && ( misses - start ) <= target * n ) {
+				piece.end = t + 1;
+				pieces.push_back( piece );
+				piece.begin = t + 1;
+				start = misses + cache_size;
+				misses = start;
+			}
+		}
+		piece.end = end;
+		pieces.push_back( piece );
+	}
+
+	// Centroid of the whole mesh, by vertex
+	double centre[3] = { 0.0, 0.0, 0.0 };
+	size_t vertex_count = data.vertex_count();
+	for ( size_t v = 0; v < vertex_count; v++ ) {
+		for ( int k = 0; k < 3; k++ ) centre[k] += vertices[6 * v + k];
+	}
+	for ( int k = 0; k < 3; k++ ) centre[k] /= vertex_count ? vertex_count : 1;
+
+	// Clusters facing away from the centre are likely to hide the rest
+	for ( size_t c = 0; c < pieces.size(); c++ ) {
+		double position[3] = { 0.0, 0.0, 0.0 }, normal[3] = { 0.0, 0.0, 0.0 };
+		double area = 0.0;
+		for ( size_t t = pieces[c].begin; t < pieces[c].end; t++ ) {
+			const GLfloat* a = &vertices[6 * indices[3 * t]];
+			const GLfloat* b = &vertices[6 * indices[3 * t + 1]];
+			const GLfloat* p = &vertices[6 * indices[3 * t + 2]];
+			double u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+			double w[3] = { p[0] - a[0], p[1] - a[1], p[2] - a[2] };
+			double n[3] = { u[1] * w[2] - u[2] * w[1],
+							u[2] * w[0] - u[0] * w[2],
+							u[0] * w[1] - u[1] * w[0] };
+			double s = sqrt( n[0] * n[0] + n[1] * n[1] + n[2] * n[2] );
+			for ( int k = 0; k < 3; k++ ) {
+				position[k] += s * ( a[k] + b[k] + p[k] ) / 3.0;
+				normal[k] += n[k];
+			}
+			area += s;
+		}
+		double length = sqrt( normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2] );
+		double key = 0.0;
+		if ( area > 0.0 && length > 0.0 ) {
+			for ( int k = 0; k < 3; k++ ) {
+				key += ( position[k] / area - centre[k] ) * normal[k] / length;
+			}
+		}
+		pieces[c].sort_key = key;
+	}
+
+	std::stable_sort( pieces.begin(), pieces.end(), draw_first );
+
+	std::vector<GLuint> output;
+	output.reserve( indices.size() );
+	for ( size_t c = 0; c < pieces.size(); c++ ) {
+		output.insert( output.end(), indices.begin() + 3 * pieces[c].begin,
+					   indices.begin() + 3 * pieces[c].end );
+	}
+	data.indices.swap( output );
+}
+
+/*
+ * Vertex fetch
+ */
+
+void optimize_vertex_fetch(MeshData& data)
+{
+	const GLuint unused = ~0u;
+	std::vector<GLuint> remap( data.vertex_count(), unused );
+	std::vector<GLfloat> vertices;
+	vertices.reserve( data.vertices.size() );
+
+	GLuint next = 0;
+	for ( size_t i = 0; i < data.indices.size(); i++ ) {
+		GLuint& r = remap[data.indices[i]];
+		if ( r == unused ) {
+			r = next++;
+			const GLfloat* v = &data.vertices[6 * data.indices[i]];
+			vertices.insert( vertices.end(), v, v + 6 );
+		}
+		data.indices[i] = r;
+	}
+	data.vertices.swap( vertices );
+}
+
+void optimize_mesh(MeshData& data, double& acmr_before, double& acmr_after)
+{
+	acmr_before = compute_acmr( data.indices, data.vertex_count() );
+
+	std::vector<size_t> clusters;
+	optimize_vertex_cache( data, clusters );
+	optimize_overdraw( data, clusters );
+	optimize_vertex_fetch( data );
+
+	acmr_after = compute_acmr( data.indices, data.vertex_count() );
+}
@@ -0,0 +1,36 @@
+#ifndef MESH_OPTIMIZE_HPP
+#define MESH_OPTIMIZE_HPP
+
+#include "mesh.hpp"
+#include <vector>
+
+// Size of the post-transform vertex cache we optimize for
+#define VERTEX_CACHE_SIZE 16
+
+// Average cache miss ratio: vertices transformed per triangle drawn,
+// simulating a FIFO cache of the given size. 3.0 is the worst possible,
+// around 0.6 the best for a regular mesh.
+double compute_acmr(const std::vector<GLuint>& indices, size_t vertex_count,
+					int cache_size = VERTEX_CACHE_SIZE);
+
+// Reorder triangles for vertex cache locality (Sander et al., "Fast
+// Triangle Reordering for Vertex Locality and Reduced Overdraw", the
+// Tipsify algorithm). The start of every cluster, where the algorithm
+// had to jump away from the previous triangles, is stored in clusters.
+void optimize_vertex_cache(MeshData& data, std::vector<size_t>& clusters,
+						   int cache_size = VERTEX_CACHE_SIZE);
+
+// Sort the clusters so that triangles likely to occlude others are
+// drawn first. Clusters are first split further wherever that keeps
+// the ACMR within threshold times its current value.
+void optimize_overdraw(MeshData& data, const std::vector<size_t>& clusters,
+					   double threshold = 1.05, int cache_size = VERTEX_CACHE_SIZE);
+
+// Renumber vertices in the order they are first used, so vertex
+// fetches walk memory forward. Unreferenced vertices are dropped.
+void optimize_vertex_fetch(MeshData& data);
+
+// All of the above, in order. Returns the ACMR before and after.
+void optimize_mesh(MeshData& data, double& acmr_before, double& acmr_after);
+
+#endif
@@ -0,0 +1,309 @@
+#include "mesh_simplify.hpp"
+#include <algorithm>
+#include <queue>
+#include <cmath>
+
+// Symmetric 4x4 error quadric, stored as its 10 distinct coefficients
+struct Quadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+	Quadric()
+		: a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0)
+	{
+	}
+
+	// Squared distance to the plane ax + by + cz + d = 0, times weight
+	void add_plane(double a, double b, double c, double d, double weight)
+	{
+		a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+		b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+		c2 += weight * c * c; cd += weight * c * d;
+		d2 += weight * d * d;
+	}
+
+	Quadric& operator+=(const Quadric& q)
+	{
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+		return *this;
+	}
+
+	double error(const double* p) const
+	{
+		double x = p[0], y = p[1], z = p[2];
+		return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+			+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+			+ c2 * z * z + 2 * cd * z
+			+ d2;
+	}
+
+	// Point of least error, false if the quadric is too close to singular
+	bool optimum(double* p) const
+	{
+		double det = a2 * ( b2 * c2 - bc * bc ) - ab * ( ab * c2 - bc * ac ) + ac * ( ab * bc - b2 * ac );
+		if ( fabs( det ) < 1e-12 ) return false;
+		// Cramer's rule on A p = -b
+		double bx = -ad, by = -bd, bz = -cd;
+		p[0] = ( bx * ( b2 * c2 - bc * bc ) - ab * ( by * c2 - bc * bz ) + ac * ( by * bc - b2 * bz ) ) / det;
+		p[1] = ( a2 * ( by * c2 - bc * bz ) - bx * ( ab * c2 - bc * ac ) + ac * ( ab * bz - by * ac ) ) / det;
+		p[2] = ( a2 * ( b2 * bz - by * bc ) - ab * ( ab * bz - by * ac ) + bx * ( ab * bc - b2 * ac ) ) / det;
+		return true;
+	}
+};
+
+struct Collapse {
+	double cost;
+	GLuint v0, v1;
+	unsigned int stamp0, stamp1;	// Versions of the endpoints when this was computed
+	double target[3];
+
+	bool operator<(const Collapse& other) const
+	{
+		// The priority queue is a max heap, we want the cheapest first
+		return cost > other.cost;
+	}
+};
+
+// Working state of one simplification
+class Simplifier {
+public:
+	Simplifier(const MeshData& in);
+	void run(size_t target);
+	void output(MeshData& out) const;
+
+private:
+	size_t vertex_count;
+	std::vector<double> position;		// 3 per vertex
+	std::vector<Quadric> quadric;
+	std::vector<unsigned int> stamp;	// Bumped whenever a vertex moves
+	std::vector<char> alive;
+	std::vector<char> boundary;
+
+	std::vector<GLuint> triangles;		// 3 per triangle, rewritten by collapses
+	std::vector<char> live_triangle;
+	size_t live_triangles;
+	std::vector< std::vector<size_t> > faces;	// Triangles around each vertex
+
+	std::priority_queue<Collapse> heap;
+
+	const double* p(GLuint v) const { return &position[3 * v]; }
+	void push(GLuint v0, GLuint v1);
+	bool flips(GLuint v, GLuint other, const double* target) const;
+	void collapse(const Collapse& c);
+};
+
+Simplifier::Simplifier(const MeshData& in)
+	: vertex_count( in.vertex_count() ),
+	  position( 3 * vertex_count ),
+	  quadric( vertex_count ),
+	  stamp( vertex_count, 0 ),
+	  alive( vertex_count, 1 ),
+	  boundary( vertex_count, 0 ),
+	  triangles( in.indices ),
+	  live_triangle( in.triangle_count(), 1 ),
+	  live_triangles( in.triangle_count() ),
+	  faces( vertex_count )
+{
+	for ( size_t v = 0; v < vertex_count; v++ ) {
+		for ( int k = 0; k < 3; k++ ) position[3 * v + k] = in.vertices[6 * v + k];
+	}
+
+	// Every vertex starts with the planes of the triangles around it
+	for ( size_t t = 0; t < live_triangle.size(); t++ ) {
+		const double* a = p( triangles[3 * t] );
+		const double* b = p( triangles[3 * t + 1] );
+		const double* c = p( triangles[3 * t + 2] );
+		double u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		double w[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+		double n[3] = { u[1] * w[2] - u[2] * w[1], u[2] * w[0] - u[0] * w[2], u[0] * w[1] - u[1] * w[0] };
+		double length = sqrt( n[0] * n[0] + n[1] * n[1] + n[2] * n[2] );
+		if ( length > 0.0 ) {
+			for ( int k = 0; k < 3; k++ ) n[k] /= length;
+			double d = -( n[0] * a[0] + n[1] * a[1] + n[2] * a[2] );
+			Quadric q;
+			q.add_plane( n[0], n[1], n[2], d, 0.5 * length );
+			for ( int k = 0; k < 3; k++ ) quadric[triangles[3 * t + k]] += q;
+		}
+		for ( int k = 0; k < 3; k++ ) faces[triangles[3 * t + k]].push_back( t );
+	}
+
+	// Find the edges, each once, and the boundary ones among them
+	std::vector< std::pair<GLuint, GLuint> > edges;
+	edges.reserve( triangles.size() );
+	for ( size_t t = 0; t < live_triangle.size(); t++ ) {
+		for ( int k = 0; k < 3; k++ ) {
+			GLuint a = triangles[3 * t + k], b = triangles[3 * t + ( k + 1 ) % 3];
+			edges.push_back( std::make_pair( std::min( a, b ), std::max( a, b ) ) );
+		}
+	}
+	std::sort( edges.begin(), edges.end() );
+	for ( size_t e = 0; e < edges.size(); ) {
+		size_t run = e + 1;
+		while ( run < edges.size() && edges[run] == edges[e] ) run++;
+		GLuint a = edges[e].first, b = edges[e].second;
+		if ( run - e == 1 ) {
+			// Keep open boundaries where they are
+			boundary[a] = boundary[b] = 1;
+		}
+		if ( a != b ) push( a, b );
+		e = run;
+	}
+}
+
+void Simplifier::push(GLuint v0, GLuint v1)
+{
+	// Boundary vertices stay put, so only an interior vertex may move onto one
+	if ( boundary[v0] && boundary[v1] ) return;
+
+	Quadric q = quadric[v0];
+	q += quadric[v1];
+
+	Collapse c;
+	c.v0 = v0;
+	c.v1 = v1;
+	c.stamp0 = stamp[v0];
+	c.stamp1 = stamp[v1];
+
+	if ( boundary[v0] || boundary[v1] ) {
+		const double* fixed = p( boundary[v0] ? v0 : v1 );
+		std::copy( fixed, fixed + 3, c.target );
+	} else if ( !q.optimum( c.target ) ) {
+		// Fall back to the best of the endpoints and their midpoint
+		const double* a = p( v0 );
+		const double* b = p( v1 );
+		double mid[3] = { ( a[0] + b[0] ) / 2, ( a[1] + b[1] ) / 2, ( a[2] + b[2] ) / 2 };
+		const double* best = a;
+		if ( q.error( b ) < q.error( best ) ) best = b;
+		if ( q.error( mid ) < q.error( best ) ) best = mid;
+		std::copy( best, best + 3, c.target );
+	}
+	c.cost = q.error( c.target );
+	heap.push( c );
+}
+
+// Would moving v to target turn any of its triangles (not shared with other) over?
+bool Simplifier::flips(GLuint v, GLuint other, const double* target) const
+{
+	const std::vector<size_t>& around = faces[v];
+	for ( size_t i = 0; i < around.size(); i++ ) {
+		size_t t = around[i];
+		if ( !live_triangle[t] ) continue;
+		const GLuint* tri = &triangles[3 * t];
+		if ( tri[0] == other || tri[1] == other || tri[2] == other ) continue;
+
+		const double* before[3] = { p( tri[0] ), p( tri[1] ), p( tri[2] ) };
+		const double* after[3] = { before[0], before[1], before[2] };
+		for ( int k = 0; k < 3; k++ ) {
+			if ( tri[k] == v ) after[k] = target;
+		}
+		double n[2][3];
+		const double** corners[2] = { before, after };
+		for ( int s = 0; s < 2; s++ ) {
+			const double** c = corners[s];
+			double u[3] = { c[1][0] - c[0][0], c[1][1] - c[0][1], c[1][2] - c[0][2] };
+			double w[3] = { c[2][0] - c[0][0], c[2][1] - c[0][1], c[2][2] - c[0][2] };
+			n[s][0] = u[1] * w[2] - u[2] * w[1];
+			n[s][1] = u[2] * w[0] - u[0] * w[2];
+			n[s][2] = u[0] * w[1] - u[1] * w[0];
+		}
+		if ( n[0][0] * n[1][0] + n[0][1] * n[1][1] + n[0][2] * n[1][2] <= 0.0 ) return true;
+	}
+	return false;
+}
+
+void Simplifier::collapse(const Collapse& c)
+{
+	// Move v1 into v0 so that v0 is always the one that survives
+	GLuint v0 = c.v0, v1 = c.v1;
+	if ( boundary[v1] ) std::swap( v0, v1 );
+
+	std::copy( c.target, c.target + 3, &position[3 * v0] );
+	quadric[v0] += quadric[v1];
+	alive[v1] = 0;
+	stamp[v0]++;
+	stamp[v1]++;
+
+	std::vector<size_t>& around = faces[v1];
+	for ( size_t i = 0; i < around.size(); i++ ) {
+		size_t t = around[i];
+		if ( !live_triangle[t] ) continue;
+		GLuint* tri = &triangles[3 * t];
+		bool shared = tri[0] == v0 || tri[1] == v0 || tri[2] == v0;
+		if ( shared ) {
+			// The collapsed edge belonged to this triangle, it is gone now
+			live_triangle[t] = 0;
+			live_triangles--;
+		} else {
+			for ( int k = 0; k < 3; k++ ) {
+				if ( tri[k] == v1 ) tri[k] = v0;
+			}
+			faces[v0].push_back( t );
+		}
+	}
+	around.clear();
+
+	// Drop dead triangles from v0's list and requeue its edges
+	std::vector<size_t>& kept = faces[v0];
+	std::vector<GLuint> neighbours;
+	size_t n = 0;
+	for ( size_t i = 0; i < kept.size(); i++ ) {
+		size_t t = kept[i];
+		if ( !live_triangle[t] ) continue;
+		kept[n++] = t;
+		for ( int k = 0; k < 3; k++ ) {
+			GLuint v = triangles[3 * t + k];
+			if ( v != v0 ) neighbours.push_back( v );
+		}
+	}
+	kept.resize( n );
+	std::sort( neighbours.begin(), neighbours.end() );
+	neighbours.erase( std::unique( neighbours.begin(), neighbours.end() ), neighbours.end() );
+	for ( size_t i = 0; i < neighbours.size(); i++ ) push( v0, neighbours[i] );
+}
+
+void Simplifier::run(size_t target)
+{
+	while ( live_triangles > target && !heap.empty() ) {
+		Collapse c = heap.top();
+		heap.pop();
+
+		// Skip anything computed before one of the endpoints changed
+		if ( !alive[c.v0] || !alive[c.v1] ) continue;
+		if ( c.stamp0 != stamp[c.v0] || c.stamp1 != stamp[c.v1] ) continue;
+
+		if ( flips( c.v0, c.v1, c.target ) || flips( c.v1, c.v0, c.target ) ) continue;
+		collapse( c );
+	}
+}
+
+void Simplifier::output(MeshData& out) const
+{
+	const GLuint unused = ~0u;
+	std::vector<GLuint> remap( vertex_count, unused );
+	out.vertices.clear();
+	out.indices.clear();
+
+	for ( size_t t = 0; t < live_triangle.size(); t++ ) {
+		if ( !live_triangle[t] ) continue;
+		for ( int k = 0; k < 3; k++ ) {
+			GLuint v = triangles[3 * t + k];
+			if ( remap[v] == unused ) {
+				remap[v] = out.vertex_count();
+				const double* q = p( v );
+				GLfloat vertex[6] = { (GLfloat)q[0], (GLfloat)q[1], (GLfloat)q[2], 0.0f, 0.0f, 0.0f };
+				out.vertices.insert( out.vertices.end(), vertex, vertex + 6 );
+			}
+			out.indices.push_back( remap[v] );
+		}
+	}
+	out.compute_normals();
+}
+
+void simplify_mesh(const MeshData& in, MeshData& out, size_t target)
+{
+	Simplifier simplifier( in );
+	simplifier.run( target );
+	simplifier.output( out );
+}
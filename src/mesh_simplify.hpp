@@ -0,0 +1,13 @@
+#ifndef MESH_SIMPLIFY_HPP
+#define MESH_SIMPLIFY_HPP
+
+#include "mesh.hpp"
+
+// Simplify a mesh down to about target triangles by collapsing edges
+// in order of their quadric error (Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics"). Open boundaries are
+// kept in place and collapses that would flip a triangle are refused,
+// so the result may stop short of the target.
+void simplify_mesh(const MeshData& in, MeshData& out, size_t target);
+
+#endif
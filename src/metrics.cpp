@@ -0,0 +1,127 @@
+#include "metrics.hpp"
+#include "profiler.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <sstream>
+
+volatile int Metrics::s_current[METRICS];
+
+static const char* metric_names[METRICS] = {
+	"nodes_visited", "call_lists", "materials", "list_rebuilds", "inversions", "allocations", "undo_bytes",
+	"collision_tests", "feed_frames", "feed_dropped", "feed_stale"
+};
+
+// Only end_frame changes this, get reads it from any thread
+static Glib::StaticMutex snapshot_lock = GLIBMM_STATIC_MUTEX_INIT;
+static Metrics::Snapshot snapshot;
+
+static FILE* dump_file = NULL;
+static double last_dump = 0.0;
+
+void Metrics::end_frame()
+{
+	Snapshot copy;
+	{
+		Glib::StaticMutex::Lock lock( snapshot_lock );
+		for ( int i = 0; i < METRICS; i++ ) {
+			int value = g_atomic_int_get( &s_current[i] );
+			if ( is_level( Metric( i ) ) ) {
+				snapshot.total[i] = value;
+			} else {
+				// Take away only what was read, anything added since stays
+				g_atomic_int_add( &s_current[i], -value );
+				snapshot.total[i] += value;
+			}
+			snapshot.frame[i] = value;
+		}
+		snapshot.frames++;
+		copy = snapshot;
+	}
+
+	if ( dump_file && Profiler::now() - last_dump >= METRICS_DUMP_INTERVAL ) {
+		last_dump = Profiler::now();
+		fprintf( dump_file, "%s\n", to_json( copy ).c_str() );
+		fflush( dump_file );
+	}
+}
+
+void Metrics::get( Snapshot& result )
+{
+	Glib::StaticMutex::Lock lock( snapshot_lock );
+	result = snapshot;
+}
+
+const char* Metrics::get_name( Metric metric )
+{
+	return metric_names[metric];
+}
+
+bool Metrics::start( const std::string& filename )
+{
+	finish();
+	dump_file = fopen( filename.c_str(), "a" );
+	if ( !dump_file ) {
+		fprintf( stderr, "Unable to write %s\n", filename.c_str() );
+		return false;
+	}
+	last_dump = Profiler::now();
+	return true;
+}
+
+void Metrics::finish()
+{
+	if ( !dump_file ) return;
+	fclose( dump_file );
+	dump_file = NULL;
+}
+
+std::string Metrics::to_json( const Snapshot& s )
+{
+	std::ostringstream json;
+	json << "{\"time\":" << time( NULL ) << ",\"frames\":" << s.frames;
+	json << ",\"frame\":{";
+	for ( int i = 0; i < METRICS; i++ ) json << ( i ? "," : "" ) << '"' << metric_names[i] << "\":" << s.frame[i];
+	json << "},\"total\":{";
+	for ( int i = 0; i < METRICS; i++ ) json << ( i ? "," : "" ) << '"' << metric_names[i] << "\":" << s.total[i];
+	json << "}}";
+	return json.str();
+}
+
+// Count every allocation made with new, whatever thread it is on
+void* operator new( size_t size )
+{
+	Metrics::add( METRIC_ALLOCATIONS );
+	void* p = malloc( size ? size : 1 );
+	if ( !p ) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[]( size_t size )
+{
+	return operator new( size );
+}
+
+void operator delete( void* p ) throw()
+{
+	free( p );
+}
+
+void operator delete[]( void* p ) throw()
+{
+	free( p );
+}
+
+#if __cplusplus >= 201402L
+// Sized deletes, new in C++14, end up in the same place
+void operator delete( void* p, size_t ) throw()
+{
+	free( p );
+}
+
+void operator delete[]( void* p, size_t ) throw()
+{
+	free( p );
+}
+#endif
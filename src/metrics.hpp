@@ -0,0 +1,61 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <glibmm.h>
+
+// Counts of things that have been slow before, kept all the time so
+// that a pathology in the field shows up without rebuilding
+enum Metric {
+	METRIC_NODES_VISITED,		// Scene nodes walked to draw or pick
+	METRIC_CALL_LISTS,			// glCallList calls for primitives
+	METRIC_MATERIALS,			// glMaterialfv calls
+	METRIC_LIST_REBUILDS,		// Sphere display lists compiled
+	METRIC_INVERSIONS,			// Node transforms inverted
+	METRIC_ALLOCATIONS,			// operator new calls, on every thread
+	METRIC_UNDO_BYTES,			// Held by the undo stack, a level not a count
+	METRIC_COLLISION_TESTS,		// Pairs of parts tested exactly for contact
+	METRIC_FEED_FRAMES,			// Pose feed frames read
+	METRIC_FEED_DROPPED,		// Pose feed frames merged into a later one while the ring was full
+	METRIC_FEED_STALE,			// Pose feed frames merged into a later one as they were drawn
+	METRICS
+};
+
+// Seconds between the lines written by Metrics::start
+#define METRICS_DUMP_INTERVAL 5.0
+
+// Counters any thread may add to. The render thread closes a frame at
+// each buffer swap, after which the frame's counts can be read back
+// along with totals since startup.
+class Metrics {
+public:
+	static void add( Metric metric, int n = 1 ) { g_atomic_int_add( &s_current[metric], n ); }
+	// For levels, which are not reset at the end of a frame
+	static void set( Metric metric, int value ) { g_atomic_int_set( &s_current[metric], value ); }
+
+	// Render thread only
+	static void end_frame();
+
+	struct Snapshot {
+		long frames;
+		long frame[METRICS];		// In the last frame closed
+		long long total[METRICS];	// Since startup, levels as they are now
+	};
+	static void get( Snapshot& snapshot );
+	static const char* get_name( Metric metric );
+	static bool is_level( Metric metric ) { return metric == METRIC_UNDO_BYTES; }
+
+	// Append a JSON object with a snapshot to filename every
+	// METRICS_DUMP_INTERVAL seconds, one per line, from end_frame.
+	// Returns false if the file can't be written
+	static bool start( const std::string& filename );
+	static void finish();
+
+	// One JSON object, without a newline
+	static std::string to_json( const Snapshot& snapshot );
+
+private:
+	static volatile int s_current[METRICS];
+};
+
+#endif
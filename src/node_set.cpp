@@ -0,0 +1,64 @@
+#include "node_set.hpp"
+#include <algorithm>
+
+void NodeSet::insert( NodeId id )
+{
+	if ( id / BITS >= m_words.size() ) m_words.resize( id / BITS + 1, 0 );
+	m_words[id / BITS] |= bit( id );
+}
+
+void NodeSet::erase( NodeId id )
+{
+	if ( id / BITS < m_words.size() ) m_words[id / BITS] &= ~bit( id );
+}
+
+void NodeSet::toggle( NodeId id )
+{
+	if ( contains( id ) ) {
+		erase( id );
+	} else {
+		insert( id );
+	}
+}
+
+bool NodeSet::empty() const
+{
+	for ( size_t i = 0; i < m_words.size(); i++ ) {
+		if ( m_words[i] ) return false;
+	}
+	return true;
+}
+
+size_t NodeSet::count() const
+{
+	size_t n = 0;
+	for ( size_t i = 0; i < m_words.size(); i++ ) n += __builtin_popcountll( m_words[i] );
+	return n;
+}
+
+void NodeSet::unite( const NodeSet& other )
+{
+	if ( other.m_words.size() > m_words.size() ) m_words.resize( other.m_words.size(), 0 );
+	for ( size_t i = 0; i < other.m_words.size(); i++ ) m_words[i] |= other.m_words[i];
+}
+
+void NodeSet::toggle( const NodeSet& other )
+{
+	if ( other.m_words.size() > m_words.size() ) m_words.resize( other.m_words.size(), 0 );
+	for ( size_t i = 0; i < other.m_words.size(); i++ ) m_words[i] ^= other.m_words[i];
+}
+
+NodeId NodeSet::next( NodeId after ) const
+{
+	NodeId from = after + 1;
+	size_t w = from / BITS;
+	if ( w >= m_words.size() ) return NO_NODE;
+
+	// Ignore the bits up to after in its own word
+	Word word = m_words[w] & ( ~(Word)0 << ( from % BITS ) );
+	while ( !word ) {
+		if ( ++w == m_words.size() ) return NO_NODE;
+		word = m_words[w];
+	}
+	return w * BITS + __builtin_ctzll( word );
+}
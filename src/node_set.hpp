@@ -0,0 +1,41 @@
+#ifndef NODE_SET_HPP
+#define NODE_SET_HPP
+
+#include <vector>
+#include "scene.hpp"
+
+// A set of nodes, one bit for each node ID. Whole-set operations go a
+// word of 64 nodes at a time, so they stay quick with 100k joints.
+class NodeSet {
+public:
+	bool contains( NodeId id ) const
+	{
+		return id / BITS < m_words.size() && ( m_words[id / BITS] & bit( id ) );
+	}
+	void insert( NodeId id );
+	void erase( NodeId id );
+	void toggle( NodeId id );
+
+	void clear() { m_words.clear(); }
+	bool empty() const;
+	size_t count() const;
+
+	// Everything in either set
+	void unite( const NodeSet& other );
+	// Everything in one set but not both, so with a set of every joint
+	// this inverts a selection of joints
+	void toggle( const NodeSet& other );
+
+	// Members in increasing order:
+	//   for ( NodeId id = set.next(); id != NO_NODE; id = set.next( id ) )
+	NodeId next( NodeId after = NO_NODE ) const;
+
+private:
+	typedef unsigned long long Word;
+	static const size_t BITS = 64;
+	static Word bit( NodeId id ) { return (Word)1 << ( id % BITS ); }
+
+	std::vector<Word> m_words;
+};
+
+#endif
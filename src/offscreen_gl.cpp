@@ -0,0 +1,31 @@
+#include "offscreen_gl.hpp"
+#include <GL/gl.h>
+#include <GL/glx.h>
+#include <X11/Xlib.h>
+
+bool make_offscreen_gl_context( int width, int height )
+{
+	Display* display = XOpenDisplay( NULL );
+	if ( !display ) return false;
+
+	// The same buffers the viewer asks for, less the second one
+	int attributes[] = { GLX_RGBA, GLX_DEPTH_SIZE, 16, None };
+	XVisualInfo* visual = glXChooseVisual( display, DefaultScreen( display ), attributes );
+	if ( !visual ) {
+		XCloseDisplay( display );
+		return false;
+	}
+
+	// All of it stays for the rest of the process once it is current
+	Pixmap pixmap = XCreatePixmap( display, RootWindow( display, visual->screen ), width, height, visual->depth );
+	GLXPixmap glx_pixmap = glXCreateGLXPixmap( display, visual, pixmap );
+	GLXContext context = glx_pixmap ? glXCreateContext( display, visual, NULL, False ) : NULL;
+	XFree( visual );
+	if ( context && glXMakeCurrent( display, glx_pixmap, context ) ) return true;
+
+	if ( context ) glXDestroyContext( display, context );
+	if ( glx_pixmap ) glXDestroyGLXPixmap( display, glx_pixmap );
+	XFreePixmap( display, pixmap );
+	XCloseDisplay( display );
+	return false;
+}
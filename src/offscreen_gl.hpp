@@ -0,0 +1,9 @@
+#ifndef OFFSCREEN_GL_HPP
+#define OFFSCREEN_GL_HPP
+
+// Make a GL context that draws into an offscreen pixmap current on
+// the calling thread, for drawing without a window. It still needs an
+// X display. Returns false if there is none, or no suitable visual.
+bool make_offscreen_gl_context( int width, int height );
+
+#endif
@@ -0,0 +1,466 @@
+#include "pose_feed.hpp"
+#include "profiler.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UNIX_PREFIX "unix:"
+
+// A socket address for path, false if it is too long for one
+static bool unix_address( const std::string& path, struct sockaddr_un& address )
+{
+	memset( &address, 0, sizeof( address ) );
+	address.sun_family = AF_UNIX;
+	if ( path.size() >= sizeof( address.sun_path ) ) return false;
+	strcpy( address.sun_path, path.c_str() );
+	return true;
+}
+
+static bool is_socket( const std::string& name )
+{
+	return name.compare( 0, strlen( UNIX_PREFIX ), UNIX_PREFIX ) == 0;
+}
+
+// The ring's counts go round at twice its size
+static int next_count( int count )
+{
+	return ( count + 1 ) & ( 2 * POSE_FEED_FRAMES - 1 );
+}
+
+// Frames from tail up to head
+static int frames_between( int tail, int head )
+{
+	return ( head - tail ) & ( 2 * POSE_FEED_FRAMES - 1 );
+}
+
+/*
+ * Reading
+ */
+
+PoseFeed::PoseFeed()
+	: m_head( 0 ), m_tail( 0 ), m_holding( false ), m_thread( NULL ), m_fd( -1 ), m_listen( -1 )
+{
+	m_stop[0] = m_stop[1] = -1;
+}
+
+PoseFeed::~PoseFeed()
+{
+	close();
+}
+
+bool PoseFeed::open( const std::string& source )
+{
+	close();
+
+	if ( source == "-" ) {
+		m_fd = dup( 0 );
+	} else if ( is_socket( source ) ) {
+		std::string path = source.substr( strlen( UNIX_PREFIX ) );
+		struct sockaddr_un address;
+		if ( !unix_address( path, address ) ) {
+			std::cerr << "Socket path " << path << " is too long" << std::endl;
+			return false;
+		}
+		// Whatever a previous run left there is in the way
+		unlink( path.c_str() );
+		m_listen = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if ( m_listen < 0 || bind( m_listen, (struct sockaddr*)&address, sizeof( address ) ) != 0 || listen( m_listen, 1 ) != 0 ) {
+			std::cerr << "Unable to listen on " << path << ": " << strerror( errno ) << std::endl;
+			close();
+			return false;
+		}
+		m_socket_path = path;
+	} else {
+		// Opened to write as well, a named pipe never ends when its
+		// writer goes, but waits for the next
+		struct stat info;
+		bool fifo = stat( source.c_str(), &info ) == 0 && S_ISFIFO( info.st_mode );
+		m_fd = ::open( source.c_str(), fifo ? O_RDWR : O_RDONLY );
+	}
+	if ( m_fd < 0 && m_listen < 0 ) {
+		std::cerr << "Unable to open " << source << ": " << strerror( errno ) << std::endl;
+		return false;
+	}
+	if ( pipe( m_stop ) != 0 ) {
+		std::cerr << "Unable to start the pose feed: " << strerror( errno ) << std::endl;
+		close();
+		return false;
+	}
+
+	m_thread = Glib::Thread::create( sigc::mem_fun( *this, &PoseFeed::run ), true );
+	return true;
+}
+
+void PoseFeed::close()
+{
+	if ( m_thread ) {
+		char stop = 0;
+		while ( ::write( m_stop[1], &stop, 1 ) < 0 && errno == EINTR );
+		m_thread->join();
+		m_thread = NULL;
+	}
+	for ( int i = 0; i < 2; i++ ) {
+		if ( m_stop[i] >= 0 ) ::close( m_stop[i] );
+		m_stop[i] = -1;
+	}
+	if ( m_fd >= 0 ) ::close( m_fd );
+	if ( m_listen >= 0 ) ::close( m_listen );
+	m_fd = m_listen = -1;
+	if ( !m_socket_path.empty() ) unlink( m_socket_path.c_str() );
+	m_socket_path.clear();
+}
+
+void PoseFeed::set_wake( const sigc::slot<void>& wake )
+{
+	Glib::Mutex::Lock lock( m_wake_lock );
+	m_wake = wake;
+}
+
+size_t PoseFeed::take( std::vector<Angles>& angles, double& sent, std::tr1::shared_ptr<const JointTable>& joints )
+{
+	int head = g_atomic_int_get( &m_head ), tail = m_tail;
+	if ( head == tail ) return 0;
+
+	// Later frames overwrite what earlier ones said of the same joint
+	angles.clear();
+	joints = m_frames[( head - 1 ) & ( POSE_FEED_FRAMES - 1 )].joints;
+	if ( m_merged.size() < joints->size() ) m_merged.resize( joints->size(), -1 );
+	for ( int f = tail; f != head; f = next_count( f ) ) {
+		const Frame& frame = m_frames[f & ( POSE_FEED_FRAMES - 1 )];
+		if ( frame.joints != joints ) continue;
+		for ( size_t i = 0; i < frame.angles.size(); i++ ) {
+			const Angles& joint = frame.angles[i];
+			int& merged = m_merged[joint.joint];
+			if ( merged < 0 ) {
+				merged = angles.size();
+				angles.push_back( joint );
+			} else {
+				angles[merged] = joint;
+			}
+		}
+		sent = frame.sent;
+	}
+	for ( size_t i = 0; i < angles.size(); i++ ) m_merged[angles[i].joint] = -1;
+
+	// Hand the slots back
+	g_atomic_int_set( &m_tail, head );
+	int frames = frames_between( tail, head );
+	if ( frames > 1 ) Metrics::add( METRIC_FEED_STALE, frames - 1 );
+	return frames;
+}
+
+// Wait for fd to have something to read, or with fd -1 for the held
+// frame to go out. False if the reader is to stop
+bool PoseFeed::wait( int fd )
+{
+	struct pollfd fds[2];
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = m_stop[0];
+	fds[1].events = POLLIN;
+	for ( ;; ) {
+		// With a frame held back, look for room for it every so often
+		fds[0].revents = fds[1].revents = 0;
+		int ready = poll( fds, 2, m_holding ? POSE_FEED_RETRY : -1 );
+		if ( ready < 0 ) {
+			if ( errno == EINTR ) continue;
+			return false;
+		}
+		if ( fds[1].revents ) return false;
+		flush();
+		if ( fds[0].revents || ( fd < 0 && !m_holding ) ) return true;
+	}
+}
+
+void PoseFeed::run()
+{
+	Trace::set_thread_name( "pose feed" );
+	std::vector<char> buffer( POSE_FEED_BUFFER );
+	const size_t magic = strlen( POSE_FEED_MAGIC );
+	size_t have = 0;
+	bool started = false;
+
+	for ( ;; ) {
+		// Between senders on a socket, wait for the next
+		if ( m_fd < 0 ) {
+			if ( !wait( m_listen ) ) return;
+			m_fd = accept( m_listen, NULL, NULL );
+			have = 0;
+			started = false;
+			m_table.reset();
+			continue;
+		}
+
+		if ( !wait( m_fd ) ) return;
+		ssize_t n = read( m_fd, &buffer[have], buffer.size() - have );
+		if ( n < 0 && errno == EINTR ) continue;
+		bool ended = n <= 0;
+		if ( n > 0 ) have += n;
+		double received = Profiler::now();
+
+		// Every whole frame there is now
+		size_t used = 0;
+		if ( !started && have >= magic ) {
+			if ( memcmp( &buffer[0], POSE_FEED_MAGIC, magic ) != 0 ) {
+				std::cerr << "Pose feed does not start with " << POSE_FEED_MAGIC << ", dropping it" << std::endl;
+				ended = true;
+			}
+			started = true;
+			used = magic;
+		}
+		if ( started && !ended && !m_table ) {
+			long size = read_table( &buffer[used], have - used );
+			if ( size < 0 ) {
+				std::cerr << "Pose feed joint table is corrupt, dropping the feed" << std::endl;
+				ended = true;
+			} else if ( size > 0 ) {
+				used += size;
+			} else if ( have == buffer.size() ) {
+				buffer.resize( 2 * buffer.size() );
+			}
+		}
+		while ( m_table && !ended && have - used >= POSE_FEED_HEADER_SIZE ) {
+			unsigned int count;
+			memcpy( &count, &buffer[used], 4 );
+			if ( count > POSE_FEED_JOINTS ) {
+				std::cerr << "Pose feed frame of " << count << " joints, dropping the feed" << std::endl;
+				ended = true;
+				break;
+			}
+			size_t size = POSE_FEED_HEADER_SIZE + count * POSE_FEED_ANGLES_SIZE;
+			if ( size > buffer.size() ) buffer.resize( size );
+			if ( have - used < size ) break;
+			push( &buffer[used], count, received );
+			used += size;
+		}
+		memmove( &buffer[0], &buffer[used], have - used );
+		have -= used;
+
+		if ( ended ) {
+			// Wait for the next sender on a socket, otherwise that was all
+			::close( m_fd );
+			m_fd = -1;
+			if ( m_listen < 0 ) {
+				// What is held back still has to get through
+				while ( m_holding && wait( -1 ) );
+				return;
+			}
+		}
+	}
+}
+
+void PoseFeed::push( const char* data, unsigned int count, double received )
+{
+	// Field by field, so nothing depends on the struct's padding
+	double sent;
+	memcpy( &sent, data + 4, 8 );
+	if ( !( sent > received - POSE_FEED_CLOCK_SLACK && sent <= received ) ) sent = received;
+	data += POSE_FEED_HEADER_SIZE;
+	Metrics::add( METRIC_FEED_FRAMES );
+
+	int head = m_head, tail = g_atomic_int_get( &m_tail );
+	if ( m_holding || frames_between( tail, head ) >= POSE_FEED_FRAMES ) {
+		// The render thread has fallen behind. Rather than lose the newest
+		// angles, fold them into a frame held back until there is room
+		if ( m_holding ) Metrics::add( METRIC_FEED_DROPPED );
+		if ( m_held.joints != m_table ) {
+			// What an earlier sender said is no use with this one's table
+			m_held.angles.clear();
+			m_held_index.clear();
+			m_held.joints = m_table;
+		}
+		m_held.sent = sent;
+		for ( unsigned int i = 0; i < count; i++, data += POSE_FEED_ANGLES_SIZE ) {
+			Angles joint;
+			if ( !decode( data, joint ) ) continue;
+			std::pair<std::tr1::unordered_map<unsigned int, size_t>::iterator, bool> place =
+				m_held_index.insert( std::make_pair( joint.joint, m_held.angles.size() ) );
+			if ( place.second ) {
+				m_held.angles.push_back( joint );
+			} else {
+				m_held.angles[place.first->second] = joint;
+			}
+		}
+		m_holding = true;
+		flush();
+		return;
+	}
+
+	Frame& frame = m_frames[head & ( POSE_FEED_FRAMES - 1 )];
+	frame.sent = sent;
+	frame.joints = m_table;
+	frame.angles.resize( count );
+	size_t kept = 0;
+	for ( unsigned int i = 0; i < count; i++, data += POSE_FEED_ANGLES_SIZE ) {
+		if ( decode( data, frame.angles[kept] ) ) kept++;
+	}
+	frame.angles.resize( kept );
+	publish( head );
+}
+
+// The table at the start of data, if all of it is there. Returns the
+// bytes it took, 0 if more are to come, or -1 if it is corrupt
+long PoseFeed::read_table( const char* data, size_t size )
+{
+	unsigned int count;
+	if ( size < 4 ) return 0;
+	memcpy( &count, data, 4 );
+	if ( count > POSE_FEED_JOINTS ) return -1;
+
+	// Only once it has all come, so a partial one isn't built again and again
+	size_t used = 4;
+	for ( unsigned int j = 0; j < count; j++ ) {
+		unsigned int length;
+		if ( size - used < 4 ) return 0;
+		memcpy( &length, data + used, 4 );
+		if ( length > POSE_FEED_PATH ) return -1;
+		used += 4 + length;
+		if ( used > size ) return 0;
+	}
+
+	JointTable* table = new JointTable( count );
+	used = 4;
+	for ( unsigned int j = 0; j < count; j++ ) {
+		unsigned int length;
+		memcpy( &length, data + used, 4 );
+		(*table)[j].assign( data + used + 4, length );
+		used += 4 + length;
+	}
+	m_table.reset( table );
+	return used;
+}
+
+// False for a joint that isn't in the table
+bool PoseFeed::decode( const char* data, Angles& joint ) const
+{
+	memcpy( &joint.joint, data, 4 );
+	memcpy( &joint.x, data + 4, 4 );
+	memcpy( &joint.y, data + 8, 4 );
+	return joint.joint < m_table->size();
+}
+
+void PoseFeed::flush()
+{
+	int head = m_head;
+	if ( !m_holding || frames_between( g_atomic_int_get( &m_tail ), head ) >= POSE_FEED_FRAMES ) return;
+
+	Frame& frame = m_frames[head & ( POSE_FEED_FRAMES - 1 )];
+	frame.sent = m_held.sent;
+	frame.joints = m_held.joints;
+	frame.angles.swap( m_held.angles );
+	m_held.angles.clear();
+	m_held_index.clear();
+	m_holding = false;
+	publish( head );
+}
+
+void PoseFeed::publish( int head )
+{
+	g_atomic_int_set( &m_head, next_count( head ) );
+
+	// If the render thread had taken everything before this one, it may
+	// be waiting for it
+	if ( g_atomic_int_get( &m_tail ) == head ) {
+		Glib::Mutex::Lock lock( m_wake_lock );
+		if ( !m_wake.empty() ) m_wake();
+	}
+}
+
+/*
+ * Writing
+ */
+
+PoseFeedWriter::PoseFeedWriter()
+	: m_fd( -1 )
+{
+}
+
+PoseFeedWriter::~PoseFeedWriter()
+{
+	close();
+}
+
+bool PoseFeedWriter::open( const std::string& sink, const PoseFeed::JointTable& joints )
+{
+	close();
+	if ( sink == "-" ) {
+		m_fd = dup( 1 );
+	} else if ( is_socket( sink ) ) {
+		std::string path = sink.substr( strlen( UNIX_PREFIX ) );
+		struct sockaddr_un address;
+		if ( !unix_address( path, address ) ) {
+			std::cerr << "Socket path " << path << " is too long" << std::endl;
+			return false;
+		}
+		m_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if ( m_fd >= 0 && connect( m_fd, (struct sockaddr*)&address, sizeof( address ) ) != 0 ) {
+			::close( m_fd );
+			m_fd = -1;
+		}
+	} else {
+		m_fd = ::open( sink.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	}
+	if ( m_fd < 0 ) {
+		std::cerr << "Unable to open " << sink << ": " << strerror( errno ) << std::endl;
+		return false;
+	}
+
+	// The magic and the table, in one write
+	m_buffer.assign( POSE_FEED_MAGIC, POSE_FEED_MAGIC + strlen( POSE_FEED_MAGIC ) );
+	unsigned int count = joints.size();
+	m_buffer.insert( m_buffer.end(), (const char*)&count, (const char*)&count + 4 );
+	for ( size_t j = 0; j < joints.size(); j++ ) {
+		unsigned int length = joints[j].size();
+		m_buffer.insert( m_buffer.end(), (const char*)&length, (const char*)&length + 4 );
+		m_buffer.insert( m_buffer.end(), joints[j].begin(), joints[j].end() );
+	}
+	return send( &m_buffer[0], m_buffer.size() );
+}
+
+void PoseFeedWriter::close()
+{
+	if ( m_fd >= 0 ) ::close( m_fd );
+	m_fd = -1;
+}
+
+bool PoseFeedWriter::write( const std::vector<PoseFeed::Angles>& angles )
+{
+	if ( m_fd < 0 ) return false;
+
+	unsigned int count = angles.size();
+	double sent = Profiler::now();
+	m_buffer.resize( POSE_FEED_HEADER_SIZE + count * POSE_FEED_ANGLES_SIZE );
+	char* data = &m_buffer[0];
+	memcpy( data, &count, 4 );
+	memcpy( data + 4, &sent, 8 );
+	data += POSE_FEED_HEADER_SIZE;
+	for ( unsigned int i = 0; i < count; i++, data += POSE_FEED_ANGLES_SIZE ) {
+		memcpy( data, &angles[i].joint, 4 );
+		memcpy( data + 4, &angles[i].x, 4 );
+		memcpy( data + 8, &angles[i].y, 4 );
+	}
+	return send( &m_buffer[0], m_buffer.size() );
+}
+
+bool PoseFeedWriter::send( const char* data, size_t size )
+{
+	while ( size > 0 ) {
+		ssize_t n = ::write( m_fd, data, size );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n <= 0 ) {
+			close();
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
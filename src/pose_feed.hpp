@@ -0,0 +1,157 @@
+#ifndef POSE_FEED_HPP
+#define POSE_FEED_HPP
+
+#include "scene.hpp"
+#include <glibmm.h>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include <tr1/memory>
+
+// Frames the reader may get ahead of the render thread by. Past that
+// it merges what it reads into one frame until the render thread
+// makes room. A power of two
+#define POSE_FEED_FRAMES 64
+// Milliseconds between looks for that room, with nothing more to read
+#define POSE_FEED_RETRY 1
+// Bytes read from the source at a time
+#define POSE_FEED_BUFFER 65536
+// Most joints a feed may pose. More is taken for a corrupt stream
+#define POSE_FEED_JOINTS 65536
+// Longest path of one, likewise
+#define POSE_FEED_PATH 4096
+// Seconds a frame's send time may be before it arrives. Any earlier,
+// and it was sent on some other clock
+#define POSE_FEED_CLOCK_SLACK 1.0
+
+#define POSE_FEED_MAGIC "PUPFEED2"
+#define POSE_FEED_HEADER_SIZE 12
+#define POSE_FEED_ANGLES_SIZE 12
+
+// Joint angles streamed in from another process, such as a motion
+// capture rig.
+//
+// A feed is POSE_FEED_MAGIC, a table of the joints it poses, then
+// frames. The table is an unsigned int count, then each joint's path
+// from the root as for SceneNode::find, such as "/puppet/torso/neck",
+// as an unsigned int length and that many bytes. Each frame is an
+// unsigned int count, a double for when it was sent on the
+// Profiler::now() clock, 0 if not known, then count joints, each its
+// index in the table as an unsigned int and its x and y angle in
+// degrees as floats. All in the byte order of the machine that wrote
+// it. A frame need only carry the joints that moved. Paths name the
+// same joints in any process that loads the scene, where NodeIds
+// depend on everything made before it.
+//
+// A reader thread decodes frames into a ring that it alone writes and
+// the render thread alone reads, with only the two counts shared, so
+// neither ever waits for the other. The render thread takes everything
+// there is once a frame, and of the frames that piled up since, only
+// the newest angles of each joint are kept. If it falls so far behind
+// that the ring fills, the reader does the same with what comes in
+// until there is room, so the newest pose always gets through.
+class PoseFeed {
+public:
+	struct Angles {
+		unsigned int joint;						// Index in the table
+		float x, y;
+	};
+	typedef std::vector<std::string> JointTable;
+
+	PoseFeed();
+	// Stops the reader, and waits for it
+	~PoseFeed();
+
+	// Start reading from source: "-" for stdin, unix:PATH for a socket
+	// listened on there, one sender at a time, or else a file or named
+	// pipe. A named pipe is read for as long as the feed is open,
+	// whoever opens and closes it to write. Returns false if the source
+	// can't be opened
+	bool open( const std::string& source );
+	void close();
+
+	// Called on the reader thread when a frame arrives with none left
+	// waiting, to wake whoever takes them
+	void set_wake( const sigc::slot<void>& wake );
+
+	// Whether there are frames to take
+	bool pending() const { return g_atomic_int_get( &m_head ) != m_tail; }
+
+	// The newest angles of every joint any frame since the last call
+	// carried, into angles, in the order they first appeared, when the
+	// newest of those frames was sent, and the table of its sender.
+	// Frames from a sender before that one are passed over. Returns how
+	// many frames that took in, 0 leaving the rest alone. Never blocks
+	size_t take( std::vector<Angles>& angles, double& sent, std::tr1::shared_ptr<const JointTable>& joints );
+
+private:
+	// Not copyable, the thread has a single owner
+	PoseFeed( const PoseFeed& );
+	PoseFeed& operator=( const PoseFeed& );
+
+	struct Frame {
+		double sent;							// Or when it arrived, if not on our clock
+		std::vector<Angles> angles;
+		std::tr1::shared_ptr<const JointTable> joints;	// Of the sender
+	};
+
+	// The ring. Frames from m_tail up to m_head are the render thread's,
+	// the rest the reader's. Both count modulo twice the ring's size, so
+	// they never overflow and a full ring isn't taken for an empty one
+	Frame m_frames[POSE_FEED_FRAMES];
+	volatile int m_head;						// Frames written so far
+	volatile int m_tail;						// Frames taken so far
+	std::vector<int> m_merged;					// Render thread: index into angles by joint, -1 for none
+
+	// Reader: frames merged while the ring was full
+	Frame m_held;
+	std::tr1::unordered_map<unsigned int, size_t> m_held_index;	// Into its angles
+	bool m_holding;
+	std::tr1::shared_ptr<const JointTable> m_table;	// Of the sender, empty until it has come
+
+	// Reader
+	Glib::Thread *m_thread;
+	int m_fd;									// Being read, -1 between senders on a socket
+	int m_listen;								// The socket listened on, -1 for none
+	int m_stop[2];								// Pipe written to stop the reader
+	std::string m_socket_path;					// To remove again at close
+	Glib::Mutex m_wake_lock;
+	sigc::slot<void> m_wake;
+
+	void run();
+	bool wait( int fd );
+	void push( const char* frame, unsigned int count, double received );
+	void flush();								// The held frame, if there is room
+	void publish( int head );
+	long read_table( const char* data, size_t size );
+	bool decode( const char* data, Angles& joint ) const;
+};
+
+// Writes a feed for PoseFeed to read, for a sender such as
+// puppeteer --feed-test.
+class PoseFeedWriter {
+public:
+	PoseFeedWriter();
+	~PoseFeedWriter();
+
+	// Start a feed of joints to sink, given as for PoseFeed::open: "-"
+	// for stdout, unix:PATH for a socket a PoseFeed listens on, or a
+	// file or named pipe. Returns false if it can't be opened
+	bool open( const std::string& sink, const PoseFeed::JointTable& joints );
+	void close();
+
+	// One frame, sent now. Returns false once the reader has gone
+	bool write( const std::vector<PoseFeed::Angles>& angles );
+
+private:
+	// Not copyable, the descriptor has a single owner
+	PoseFeedWriter( const PoseFeedWriter& );
+	PoseFeedWriter& operator=( const PoseFeedWriter& );
+
+	int m_fd;
+	std::vector<char> m_buffer;
+
+	bool send( const char* data, size_t size );
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include "pose_sampler.hpp"
+#include "trace.hpp"
+#include <glibmm.h>
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <unistd.h>
+
+template <class T>
+static void write_value(std::ostream& out, const T& value)
+{
+	out.write( (const char*)&value, sizeof(T) );
+}
+
+// SplitMix64, a step of which is enough to decorrelate neighbouring states
+static inline unsigned long long split_mix( unsigned long long& state )
+{
+	unsigned long long z = ( state += 0x9E3779B97F4A7C15ULL );
+	z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+	z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+	return z ^ ( z >> 31 );
+}
+
+// sin x for x in [-pi/2, pi/2], to about float precision
+static inline float sin_poly( float x )
+{
+	float x2 = x * x;
+	return x * ( 1.0f + x2 * ( -1.0f / 6.0f + x2 * ( 1.0f / 120.0f + x2 * ( -1.0f / 5040.0f +
+				 x2 * ( 1.0f / 362880.0f + x2 * ( -1.0f / 39916800.0f ) ) ) ) ) );
+}
+
+// Without a branch or a call, so a loop of them vectorizes
+static inline void sin_cos( float degrees, float& s, float& c )
+{
+	const float pi = M_PI, half_pi = M_PI / 2.0;
+
+	// Into [-180, 180], then radians
+	float turns = degrees * ( 1.0f / 360.0f );
+	degrees -= 360.0f * (int)( turns + ( turns >= 0.0f ? 0.5f : -0.5f ) );
+	float r = degrees * (float)( M_PI / 180.0 );
+
+	// Both by reflection into [-pi/2, pi/2], cos r as sin( r + pi/2 )
+	float a = r > half_pi ? pi - r : ( r < -half_pi ? -pi - r : r );
+	float b = r + half_pi;
+	b = b > half_pi ? pi - b : b;
+	s = sin_poly( a );
+	c = sin_poly( b );
+}
+
+PoseSampler::PoseSampler( SceneNode* root )
+	: m_width( 0 ), m_height( 0 )
+{
+	std::vector<NodeId> ids;
+	std::vector<Matrix4x4> offsets;
+	root->joint_tree( Matrix4x4(), -1, ids, m_above, offsets );
+
+	// Instances share joints, which get one set of angles
+	std::vector<int> index( SceneNode::id_limit(), -1 );
+	m_leaf.assign( ids.size(), 1 );
+	m_offset.resize( 12 * ids.size() );
+	for ( size_t j = 0; j < ids.size(); j++ ) {
+		JointNode* joint = JointNode::by_id( ids[j] );
+		if ( index[ids[j]] < 0 ) {
+			index[ids[j]] = m_ids.size();
+			m_ids.push_back( ids[j] );
+			m_x_min.push_back( joint->get_joint_x().min );
+			m_x_range.push_back( joint->get_joint_x().max - joint->get_joint_x().min );
+			m_y_min.push_back( joint->get_joint_y().min );
+			m_y_range.push_back( joint->get_joint_y().max - joint->get_joint_y().min );
+		}
+		m_joint.push_back( index[ids[j]] );
+		if ( m_above[j] >= 0 ) m_leaf[m_above[j]] = 0;
+
+		// The same offset with the joint at rest
+		Matrix4x4 offset = offsets[j] * joint->get_inverse() * joint->rest();
+		for ( int r = 0; r < 3; r++ ) {
+			for ( int c = 0; c < 4; c++ ) m_offset[12 * j + 4 * r + c] = offset[r][c];
+		}
+	}
+}
+
+void PoseSampler::set_projection( int width, int height )
+{
+	m_width = width;
+	m_height = height;
+}
+
+size_t PoseSampler::record_size() const
+{
+	return 2 * joints() + ( m_width > 0 ? 5 : 3 ) * places();
+}
+
+void PoseSampler::sample( unsigned long long seed, unsigned long long first, size_t count, float* records ) const
+{
+	std::vector<float> scratch;
+	for ( size_t done = 0; done < count; done += SAMPLE_BATCH ) {
+		size_t n = std::min( count - done, (size_t)SAMPLE_BATCH );
+		sample_batch( seed, first + done, n, scratch, records + done * record_size() );
+	}
+}
+
+void PoseSampler::sample_batch( unsigned long long seed, unsigned long long first, size_t count,
+								std::vector<float>& scratch, float* records ) const
+{
+	const size_t B = SAMPLE_BATCH, D = joints(), J = places(), stride = record_size();
+
+	// Sines and cosines of both angles of every joint, then a 3x4 frame
+	// for every place, each as an array across the batch
+	scratch.resize( ( 4 * D + 12 * J ) * B );
+	float *sx = &scratch[0], *cx = sx + D * B, *sy = cx + D * B, *cy = sy + D * B;
+	float *frames = cy + D * B;
+
+	// Angles, from a generator of each pose's own
+	for ( size_t i = 0; i < count; i++ ) {
+		unsigned long long state = seed ^ ( ( first + i ) * 0xD1B54A32D192ED03ULL );
+		float* record = records + i * stride;
+		for ( size_t d = 0; d < D; d++ ) {
+			unsigned long long bits = split_mix( state );
+			float x = m_x_min[d] + m_x_range[d] * ( ( bits >> 40 ) * ( 1.0f / 16777216.0f ) );
+			float y = m_y_min[d] + m_y_range[d] * ( ( ( bits >> 8 ) & 0xFFFFFF ) * ( 1.0f / 16777216.0f ) );
+			record[2 * d] = sx[d * B + i] = x;
+			record[2 * d + 1] = sy[d * B + i] = y;
+		}
+	}
+	for ( size_t d = 0; d < D; d++ ) {
+		float *ssx = sx + d * B, *scx = cx + d * B, *ssy = sy + d * B, *scy = cy + d * B;
+		for ( size_t i = 0; i < count; i++ ) {
+			sin_cos( ssx[i], ssx[i], scx[i] );
+			sin_cos( ssy[i], ssy[i], scy[i] );
+		}
+	}
+
+	// Down the tree, frame = above * offset * Rx * Ry
+	for ( size_t j = 0; j < J; j++ ) {
+		const float* o = &m_offset[12 * j];
+		float* f = frames + 12 * B * j;
+		if ( m_above[j] < 0 ) {
+			for ( int k = 0; k < 12; k++ ) std::fill( f + k * B, f + k * B + count, o[k] );
+		} else {
+			const float* p = frames + 12 * B * m_above[j];
+			for ( int r = 0; r < 3; r++ ) {
+				const float *p0 = p + ( 4 * r ) * B, *p1 = p0 + B, *p2 = p1 + B, *p3 = p2 + B;
+				for ( int c = 0; c < 4; c++ ) {
+					float* g = f + ( 4 * r + c ) * B;
+					float t = c == 3 ? 1.0f : 0.0f;
+					for ( size_t i = 0; i < count; i++ ) g[i] = p0[i] * o[c] + p1[i] * o[4 + c] + p2[i] * o[8 + c] + p3[i] * t;
+				}
+			}
+		}
+		if ( m_leaf[j] ) continue;
+
+		// Only places below this one see its rotation
+		const size_t d = m_joint[j];
+		const float *ssx = sx + d * B, *scx = cx + d * B, *ssy = sy + d * B, *scy = cy + d * B;
+		for ( int r = 0; r < 3; r++ ) {
+			float *g0 = f + ( 4 * r ) * B, *g1 = g0 + B, *g2 = g1 + B;
+			for ( size_t i = 0; i < count; i++ ) {
+				float a = g0[i], b = g1[i], c = g2[i];
+				g0[i] = a * scy[i] + ( b * ssx[i] - c * scx[i] ) * ssy[i];
+				g1[i] = b * scx[i] + c * ssx[i];
+				g2[i] = a * ssy[i] - ( b * ssx[i] - c * scx[i] ) * scy[i];
+			}
+		}
+	}
+
+	// Positions, and where they are in the window as in Viewer::selectRegion
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	const float width = m_width, height = m_height;
+	const float fy = 1.0 / tan( 20.0 * M_PI / 180.0 ), fx = m_width > 0 ? fy * height / width : 0.0f;
+	for ( size_t j = 0; j < J; j++ ) {
+		const float* f = frames + 12 * B * j;
+		const float *x = f + 3 * B, *y = f + 7 * B, *z = f + 11 * B;
+		float* position = records + 2 * D + 3 * j;
+		for ( size_t i = 0; i < count; i++ ) {
+			position[i * stride] = x[i];
+			position[i * stride + 1] = y[i];
+			position[i * stride + 2] = z[i];
+		}
+		if ( m_width <= 0 ) continue;
+
+		float* window = records + 2 * D + 3 * J + 2 * j;
+		for ( size_t i = 0; i < count; i++ ) {
+			float w = -z[i];
+			window[i * stride] = w > 0.1f ? ( 1.0f + fx * x[i] / w ) * 0.5f * width : nan;
+			window[i * stride + 1] = w > 0.1f ? ( 1.0f - fy * y[i] / w ) * 0.5f * height : nan;
+		}
+	}
+}
+
+void PoseSampler::write_header( std::ostream& out, unsigned long long poses ) const
+{
+	out.write( POSE_FILE_MAGIC, 8 );
+	write_value( out, (unsigned int)joints() );
+	write_value( out, (unsigned int)places() );
+	write_value( out, (unsigned int)std::max( m_width, 0 ) );
+	write_value( out, (unsigned int)std::max( m_height, 0 ) );
+	write_value( out, poses );
+	for ( size_t d = 0; d < joints(); d++ ) {
+		const std::string& name = SceneNode::by_id( m_ids[d] )->get_name();
+		write_value( out, (unsigned int)name.size() );
+		out.write( name.data(), name.size() );
+		write_value( out, m_x_min[d] );
+		write_value( out, m_x_min[d] + m_x_range[d] );
+		write_value( out, m_y_min[d] );
+		write_value( out, m_y_min[d] + m_y_range[d] );
+	}
+	for ( size_t j = 0; j < places(); j++ ) {
+		write_value( out, m_joint[j] );
+		write_value( out, m_above[j] );
+	}
+}
+
+// Hands out chunks of poses to the threads, and writes them out in order
+class SampleWriter {
+public:
+	SampleWriter( const PoseSampler& sampler, std::ostream& out, unsigned long long poses, unsigned long long seed )
+		: m_sampler( sampler ), m_out( out ), m_poses( poses ), m_seed( seed ),
+		  m_next( 0 ), m_written( 0 ), m_failed( false ) {}
+
+	void run()
+	{
+		const size_t stride = m_sampler.record_size();
+		std::vector<float> records( SAMPLE_CHUNK * stride ), scratch;
+		for ( ;; ) {
+			unsigned long long chunk;
+			{
+				Glib::Mutex::Lock lock( m_lock );
+				if ( m_failed || m_next * SAMPLE_CHUNK >= m_poses ) return;
+				chunk = m_next++;
+			}
+
+			unsigned long long first = chunk * SAMPLE_CHUNK;
+			size_t count = std::min( m_poses - first, (unsigned long long)SAMPLE_CHUNK );
+			{
+				TraceScope trace( "sample poses" );
+				for ( size_t done = 0; done < count; done += SAMPLE_BATCH ) {
+					m_sampler.sample_batch( m_seed, first + done, std::min( count - done, (size_t)SAMPLE_BATCH ),
+											scratch, &records[done * stride] );
+				}
+			}
+
+			// Wait for the chunks before this one to go out first
+			Glib::Mutex::Lock lock( m_lock );
+			while ( m_written != chunk && !m_failed ) m_turn.wait( m_lock );
+			if ( m_failed ) return;
+			TraceScope trace( "write poses" );
+			m_out.write( (const char*)&records[0], count * stride * sizeof(float) );
+			if ( !m_out ) m_failed = true;
+			m_written++;
+			m_turn.broadcast();
+		}
+	}
+
+	void run_worker()
+	{
+		Trace::set_thread_name( "sampler" );
+		run();
+	}
+
+	bool failed() const { return m_failed; }
+
+private:
+	const PoseSampler& m_sampler;
+	std::ostream& m_out;
+	unsigned long long m_poses, m_seed;
+	unsigned long long m_next, m_written;	// Chunks handed out and written
+	bool m_failed;
+	Glib::Mutex m_lock;
+	Glib::Cond m_turn;
+};
+
+bool PoseSampler::write( std::ostream& out, unsigned long long poses, unsigned long long seed, int threads ) const
+{
+	write_header( out, poses );
+	if ( !out ) return false;
+
+	SampleWriter writer( *this, out, poses, seed );
+	if ( threads <= 0 ) {
+		long cores = sysconf( _SC_NPROCESSORS_ONLN );
+		threads = cores > 0 ? cores : 1;
+	}
+	unsigned long long chunks = ( poses + SAMPLE_CHUNK - 1 ) / SAMPLE_CHUNK;
+	threads = std::min( (unsigned long long)threads, std::max( chunks, 1ULL ) );
+	if ( threads <= 1 || !Glib::thread_supported() ) {
+		writer.run();
+	} else {
+		// This thread takes a share of the work too
+		std::vector<Glib::Thread*> workers;
+		for ( int t = 1; t < threads; t++ ) {
+			workers.push_back( Glib::Thread::create( sigc::mem_fun( writer, &SampleWriter::run_worker ), true ) );
+		}
+		writer.run();
+		for ( size_t t = 0; t < workers.size(); t++ ) workers[t]->join();
+	}
+	out.flush();
+	return !writer.failed() && out;
+}
@@ -0,0 +1,80 @@
+#ifndef POSE_SAMPLER_HPP
+#define POSE_SAMPLER_HPP
+
+#include "scene.hpp"
+#include <ostream>
+#include <vector>
+
+// Poses worked on together, one array of each quantity across all of
+// them, so the loops over a batch have no dependencies to vectorize
+#define SAMPLE_BATCH 64
+// Poses a thread takes at a time, and writes out in one go
+#define SAMPLE_CHUNK 4096
+
+#define POSE_FILE_MAGIC "PUPPOSE1"
+
+// Random poses of a rig, every joint at angles drawn uniformly from
+// within its limits, and where that puts the joints.
+//
+// A joint at angles x, y has the transformation it had when the
+// sampler was made, with its rotation taken back off, turned x about
+// x and then y about y. For a scene fresh from its script that is just
+// the transformation the script gave it.
+//
+// Pose n of a seed is the same however the poses are split up between
+// calls and threads. Each is a record of floats: the x and y angle of
+// every joint, the position of every place a joint appears in the
+// tree, and, with a projection, where each of those is in the window.
+// Instanced joints appear more than once, with the same angles.
+//
+// A pose file is POSE_FILE_MAGIC, then as unsigned ints the number of
+// joints, places, window width and height, 0 without a projection, and
+// as an unsigned long long the number of poses. Then for every joint
+// its name, as an unsigned int length and the characters, and its
+// x and y limits as four floats; for every place the joint there and
+// the place above it, -1 for none, as ints; and then the records. All
+// in the byte order of the machine that wrote it.
+class PoseSampler {
+public:
+	PoseSampler( SceneNode* root );
+
+	// Distinct joints, and the places they appear
+	size_t joints() const { return m_ids.size(); }
+	size_t places() const { return m_joint.size(); }
+	NodeId joint( size_t d ) const { return m_ids[d]; }
+
+	// Also project the positions as Viewer would show them in a window
+	// this size, from the initial view. Points behind the eye are NaN
+	void set_projection( int width, int height );
+
+	// Floats per pose
+	size_t record_size() const;
+
+	// Poses first up to first + count of the sequence seed gives
+	void sample( unsigned long long seed, unsigned long long first, size_t count, float* records ) const;
+
+	// The header and poses records, sampled on threads threads. Returns
+	// false if out fails
+	bool write( std::ostream& out, unsigned long long poses, unsigned long long seed, int threads ) const;
+
+private:
+	// Distinct joints
+	std::vector<NodeId> m_ids;
+	std::vector<float> m_x_min, m_x_range, m_y_min, m_y_range;
+
+	// Places, in tree order, so a place always comes after the one above it
+	std::vector<int> m_joint;			// Index into the joints
+	std::vector<int> m_above;			// The place above, -1 at the top
+	std::vector<char> m_leaf;			// Nothing depends on its rotation
+	std::vector<float> m_offset;		// 3x4 from the frame above, 12 per place
+
+	int m_width, m_height;
+
+	void write_header( std::ostream& out, unsigned long long poses ) const;
+	void sample_batch( unsigned long long seed, unsigned long long first, size_t count,
+					   std::vector<float>& scratch, float* records ) const;
+
+	friend class SampleWriter;
+};
+
+#endif
@@ -1,4 +1,15 @@
 #include "primitive.hpp"
+#include "mesh.hpp"
+#include "mesh_optimize.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include <glibmm.h>
+#include <cmath>
+
+// Screen area, in pixels, we want each visible triangle to cover at least
+#define LOD_PIXELS_PER_TRIANGLE 4.0
+
+double Primitive::pixels_per_unit = 0.0;
 
 Primitive::Primitive() { changed = true; }
 
@@ -6,40 +17,154 @@ Primitive::~Primitive()
 {
 }
 
-Sphere::~Sphere()
+int Primitive::lod_count() const
+{
+	return 1;
+}
+
+size_t Primitive::lod_triangles(int) const
+{
+	return 0;
+}
+
+void Primitive::walk_gl_lod(bool picking, int) const
+{
+	walk_gl( picking );
+}
+
+double Primitive::get_radius() const
+{
+	return 1.0;
+}
+
+int Primitive::select_lod(double radius) const
+{
+	// About half the triangles face the viewer
+	double budget = 2.0 * M_PI * radius * radius / LOD_PIXELS_PER_TRIANGLE;
+	int level = 0;
+	while ( level + 1 < lod_count() && lod_triangles( level ) > budget ) level++;
+	return level;
+}
+
+// Build a unit sphere with its poles on the z axis, like gluSphere
+static void tessellate_sphere(MeshData& data, int slices, int stacks)
+{
+	data.vertices.clear();
+	data.indices.clear();
+
+	// North pole, the rings in between, then the south pole
+	GLfloat north[6] = { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f };
+	data.vertices.insert( data.vertices.end(), north, north + 6 );
+	for ( int i = 1; i < stacks; i++ ) {
+		double phi = M_PI * i / stacks;
+		for ( int j = 0; j < slices; j++ ) {
+			double theta = 2.0 * M_PI * j / slices;
+			GLfloat x = sin( theta ) * sin( phi ), y = cos( theta ) * sin( phi ), z = cos( phi );
+			GLfloat v[6] = { x, y, z, x, y, z };	// The normal of a unit sphere is the position
+			data.vertices.insert( data.vertices.end(), v, v + 6 );
+		}
+	}
+	GLfloat south[6] = { 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, -1.0f };
+	data.vertices.insert( data.vertices.end(), south, south + 6 );
+
+	GLuint last = data.vertex_count() - 1;
+	for ( int i = 0; i < stacks; i++ ) {
+		for ( int j = 0; j < slices; j++ ) {
+			int k = ( j + 1 ) % slices;
+			GLuint a = i == 0 ? 0 : 1 + ( i - 1 ) * slices + j;
+			GLuint b = i == 0 ? 0 : 1 + ( i - 1 ) * slices + k;
+			GLuint c = i == stacks - 1 ? last : 1 + i * slices + j;
+			GLuint d = i == stacks - 1 ? last : 1 + i * slices + k;
+			GLuint quad[2][3] = { { a, c, d }, { a, d, b } };
+			for ( int q = 0; q < 2; q++ ) {
+				// Skip the degenerate half of the quads at the poles
+				if ( ( q == 1 && i == 0 ) || ( q == 0 && i == stacks - 1 ) ) continue;
+
+				// Wind counter-clockwise seen from outside
+				const GLfloat* p0 = &data.vertices[6 * quad[q][0]];
+				const GLfloat* p1 = &data.vertices[6 * quad[q][1]];
+				const GLfloat* p2 = &data.vertices[6 * quad[q][2]];
+				double u[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+				double w[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+				double n[3] = { u[1] * w[2] - u[2] * w[1], u[2] * w[0] - u[0] * w[2], u[0] * w[1] - u[1] * w[0] };
+				if ( n[0] * ( p0[0] + p1[0] + p2[0] ) + n[1] * ( p0[1] + p1[1] + p2[1] ) +
+					 n[2] * ( p0[2] + p1[2] + p2[2] ) < 0.0 ) {
+					std::swap( quad[q][1], quad[q][2] );
+				}
+				data.indices.insert( data.indices.end(), quad[q], quad[q] + 3 );
+			}
+		}
+	}
+}
+
+// The unit spheres every Sphere draws, one per level of detail,
+// tessellated and optimized only once. The LOD workers and the render
+// thread both ask for them, so the first to ask builds them all under
+// the lock, and sphere_built is only set once they are done
+static Glib::StaticMutex sphere_lock = GLIBMM_STATIC_MUTEX_INIT;
+static MeshData sphere_data[SPHERE_LODS];
+static volatile gint sphere_built = 0;
+
+static const MeshData& sphere_mesh(int level)
 {
-	// Remember to delete the display list
-	glDeleteLists( mysphereID, 1 );
+	if ( !g_atomic_int_get( &sphere_built ) ) {
+		Glib::StaticMutex::Lock lock( sphere_lock );
+		if ( !sphere_built ) {
+			static const int resolution[SPHERE_LODS] = { 20, 12, 8, 6 };
+			for ( int i = 0; i < SPHERE_LODS; i++ ) {
+				tessellate_sphere( sphere_data[i], resolution[i], resolution[i] );
+				double before, after;
+				optimize_mesh( sphere_data[i], before, after );
+			}
+			g_atomic_int_set( &sphere_built, 1 );
+		}
+	}
+	return sphere_data[level];
 }
 
+// Two consecutive display lists per level: the filled sphere, then the
+// line sphere used for picked parts. Every Sphere draws the same unit
+// meshes, so they share one set, compiled by the first to be drawn.
+// Only the render thread, with the GL context, touches it
+static GLuint sphere_lists = 0;
+
+Sphere::Sphere() {}
+
 void Sphere::walk_gl(bool picking) const
 {
-	if ( changed || ( picking != old_picking ) ) {
-		// Delete any previous display list
-		glDeleteLists( mysphereID, 1 );
-		
-		// From OpenGL wiki - 2D Texture Mapping a Sphere
-		GLUquadricObj *sphere = NULL;
-		sphere = gluNewQuadric();
-		// Picked parts will be drawn using only line
-		if ( picking ) {
-			gluQuadricDrawStyle( sphere, GLU_LINE );
-		} else {
-			gluQuadricDrawStyle( sphere, GLU_FILL );
+	walk_gl_lod( picking, 0 );
+}
+
+int Sphere::lod_count() const
+{
+	return SPHERE_LODS;
+}
+
+size_t Sphere::lod_triangles(int level) const
+{
+	return sphere_mesh( level ).triangle_count();
+}
+
+void Sphere::walk_gl_lod(bool picking, int level) const
+{
+	if ( !sphere_lists ) {
+		TraceScope trace( "sphere display lists" );
+		Metrics::add( METRIC_LIST_REBUILDS );
+
+		// Making the display lists, picked parts will be drawn using only line
+		sphere_lists = glGenLists( 2 * SPHERE_LODS );
+		for ( int i = 0; i < SPHERE_LODS; i++ ) {
+			const MeshData& mesh = sphere_mesh( i );
+			glNewList( sphere_lists + 2 * i, GL_COMPILE );
+			mesh.draw( false );
+			glEndList();
+			glNewList( sphere_lists + 2 * i + 1, GL_COMPILE );
+			mesh.draw( true );
+			glEndList();
 		}
-		gluQuadricTexture(sphere, true);
-		gluQuadricNormals(sphere, GLU_SMOOTH);
-		
-		// Making a display list
-		mysphereID = glGenLists(1);
-		glNewList( mysphereID, GL_COMPILE );
-		gluSphere(sphere, 1.0, 20, 20);
-		glEndList();
-		gluDeleteQuadric( sphere );
-		changed = false;
 	}
-	glCallList(mysphereID);		// Draw Using a display list
-	old_picking = picking;		// Save whether the node was picked or not
+	glCallList( sphere_lists + 2 * level + ( picking ? 1 : 0 ) );		// Draw Using a display list
+	Metrics::add( METRIC_CALL_LISTS );
 }
 
 	void Primitive::hasChanged() {
@@ -11,18 +11,43 @@ public:
   virtual ~Primitive();
   virtual void walk_gl(bool picking) const = 0;
 	void hasChanged();
+
+	// Levels of detail, level 0 is the full resolution one. Primitives
+	// with a single level just draw it with walk_gl.
+	virtual int lod_count() const;
+	virtual size_t lod_triangles(int level) const;
+	virtual void walk_gl_lod(bool picking, int level) const;
+
+	// Radius of a sphere about the origin that contains the primitive
+	virtual double get_radius() const;
+
+	// Coarsest level that still looks right with the bounding sphere
+	// covering radius pixels on screen
+	int select_lod(double radius) const;
+
+	// Pixels covered by one unit seen at distance one, set by the viewer
+	// from its projection. Level selection is off while this is 0.
+	static void set_pixels_per_unit(double pixels) { pixels_per_unit = pixels; }
+	static double get_pixels_per_unit() { return pixels_per_unit; }
+
 protected:
 	mutable bool changed;
-	mutable bool old_picking;
+	static double pixels_per_unit;
 };
 
 
+// Tessellations used for the sphere levels of detail
+#define SPHERE_LODS 4
+
 class Sphere : public Primitive {
 public:
-  virtual ~Sphere();
+	Sphere();
   virtual void walk_gl(bool picking) const;
-private:
-	mutable GLuint mysphereID;
+
+	virtual int lod_count() const;
+	virtual size_t lod_triangles(int level) const;
+	// From display lists shared by every sphere
+	virtual void walk_gl_lod(bool picking, int level) const;
 };
 
 #endif
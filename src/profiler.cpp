@@ -0,0 +1,99 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <fstream>
+#include <time.h>
+
+bool Profiler::s_enabled = false;
+double Profiler::s_current[PROFILE_PHASES];
+double Profiler::s_history[PROFILE_PHASES][PROFILE_FRAMES];
+int Profiler::s_frames = 0;
+
+static const char* phase_names[PROFILE_PHASES] = {
+	"frame", "traversal", "material", "primitive", "picking", "undo", "ik", "collision", "ragdoll", "motion", "swap"
+};
+
+void Profiler::set_enabled( bool enabled )
+{
+	// Start over, so frames from before don't skew the statistics
+	if ( enabled && !s_enabled ) {
+		std::fill( s_current, s_current + PROFILE_PHASES, 0.0 );
+		s_frames = 0;
+	}
+	s_enabled = enabled;
+}
+
+void Profiler::end_frame()
+{
+	if ( !s_enabled ) return;
+
+	int slot = s_frames % PROFILE_FRAMES;
+	for ( int i = 0; i < PROFILE_PHASES; i++ ) {
+		s_history[i][slot] = s_current[i];
+		s_current[i] = 0.0;
+	}
+	s_frames++;
+}
+
+int Profiler::get_frames()
+{
+	return std::min( s_frames, PROFILE_FRAMES );
+}
+
+Profiler::Stats Profiler::get_stats( ProfilePhase phase )
+{
+	Stats stats = { 0.0, 0.0, 0.0, 0.0 };
+	int n = get_frames();
+	if ( n == 0 ) return stats;
+
+	double sorted[PROFILE_FRAMES];
+	std::copy( s_history[phase], s_history[phase] + n, sorted );
+	std::sort( sorted, sorted + n );
+
+	double sum = 0.0;
+	for ( int i = 0; i < n; i++ ) sum += sorted[i];
+
+	stats.min = sorted[0] * 1000.0;
+	stats.avg = sum / n * 1000.0;
+	stats.p95 = sorted[( n - 1 ) * 95 / 100] * 1000.0;
+	stats.p99 = sorted[( n - 1 ) * 99 / 100] * 1000.0;
+	return stats;
+}
+
+const char* Profiler::get_name( ProfilePhase phase )
+{
+	return phase_names[phase];
+}
+
+bool Profiler::dump( const std::string& filename )
+{
+	std::ofstream out( filename.c_str() );
+	if ( !out ) return false;
+
+	int n = get_frames();
+	out << "# " << n << " frames, times in ms" << std::endl;
+	out << "# phase min avg p95 p99" << std::endl;
+	for ( int i = 0; i < PROFILE_PHASES; i++ ) {
+		Stats stats = get_stats( ProfilePhase( i ) );
+		out << phase_names[i] << " " << stats.min << " " << stats.avg << " "
+			<< stats.p95 << " " << stats.p99 << std::endl;
+	}
+
+	// Oldest frame first
+	out << std::endl << "# frame";
+	for ( int i = 0; i < PROFILE_PHASES; i++ ) out << " " << phase_names[i];
+	out << std::endl;
+	for ( int f = s_frames - n; f < s_frames; f++ ) {
+		out << f;
+		for ( int i = 0; i < PROFILE_PHASES; i++ ) out << " " << s_history[i][f % PROFILE_FRAMES] * 1000.0;
+		out << std::endl;
+	}
+
+	return out.good();
+}
+
+double Profiler::now()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
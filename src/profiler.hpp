@@ -0,0 +1,76 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <string>
+
+// Parts of a frame the profiler keeps times for
+enum ProfilePhase {
+	PROFILE_FRAME,			// From taking the frame's input to the buffer swap
+	PROFILE_TRAVERSAL,		// Walking the scene graph, including the two below
+	PROFILE_MATERIAL,		// Applying materials
+	PROFILE_PRIMITIVE,		// Drawing primitives
+	PROFILE_PICKING,		// Selection passes
+	PROFILE_UNDO,			// Snapshotting the joints for the undo stack
+	PROFILE_IK,				// Solving for the effector being dragged
+	PROFILE_COLLISION,		// Keeping dragged joints out of contact
+	PROFILE_RAGDOLL,		// Stepping the puppet's fall
+	PROFILE_MOTION,			// Decoding and posing frames of a motion clip
+	PROFILE_SWAP,			// Swapping buffers
+	PROFILE_PHASES
+};
+
+// Number of frames the statistics are taken over
+#define PROFILE_FRAMES 256
+
+// Per-phase frame times, kept by the render thread for the frames it
+// draws. Only the render thread may use it.
+class Profiler {
+public:
+	// In milliseconds
+	struct Stats {
+		double min, avg, p95, p99;
+	};
+
+	static bool enabled() { return s_enabled; }
+	static void set_enabled( bool enabled );
+
+	// Add time spent in a phase to the current frame
+	static void add( ProfilePhase phase, double seconds ) { s_current[phase] += seconds; }
+	// Close the current frame and start on the next
+	static void end_frame();
+
+	// Over the last PROFILE_FRAMES frames, all zero if there are none
+	static Stats get_stats( ProfilePhase phase );
+	static const char* get_name( ProfilePhase phase );
+	static int get_frames();
+
+	// Write the statistics followed by each recorded frame. Returns
+	// false if the file can't be written
+	static bool dump( const std::string& filename );
+
+	// Seconds from an arbitrary start
+	static double now();
+
+private:
+	static bool s_enabled;
+	static double s_current[PROFILE_PHASES];
+	static double s_history[PROFILE_PHASES][PROFILE_FRAMES];
+	static int s_frames;		// Frames recorded, the last is at ( s_frames - 1 ) % PROFILE_FRAMES
+};
+
+// Adds the time until it goes out of scope to a phase. While the
+// profiler is disabled this costs a test of a flag.
+class ScopedTimer {
+public:
+	ScopedTimer( ProfilePhase phase )
+		: m_phase( phase ), m_start( Profiler::enabled() ? Profiler::now() : -1.0 ) {}
+	~ScopedTimer() {
+		if ( m_start >= 0.0 ) Profiler::add( m_phase, Profiler::now() - m_start );
+	}
+
+private:
+	ProfilePhase m_phase;
+	double m_start;
+};
+
+#endif
@@ -0,0 +1,1056 @@
+#include "ragdoll.hpp"
+#include "collision.hpp"
+#include "trace.hpp"
+#include <glibmm.h>
+#include <algorithm>
+#include <math.h>
+#include <unistd.h>
+
+#define TO_RADIANS ( M_PI / 180.0 )
+
+/*
+ * Quaternions, w first, and 3x3 rotations
+ */
+
+static inline void quat_mul( const double a[4], const double b[4], double out[4] )
+{
+	double w = a[0] * b[0] - a[1] * b[1] - a[2] * b[2] - a[3] * b[3];
+	double x = a[0] * b[1] + a[1] * b[0] + a[2] * b[3] - a[3] * b[2];
+	double y = a[0] * b[2] - a[1] * b[3] + a[2] * b[0] + a[3] * b[1];
+	double z = a[0] * b[3] + a[1] * b[2] - a[2] * b[1] + a[3] * b[0];
+	out[0] = w;
+	out[1] = x;
+	out[2] = y;
+	out[3] = z;
+}
+
+static inline void quat_conjugate( const double q[4], double out[4] )
+{
+	out[0] = q[0];
+	out[1] = -q[1];
+	out[2] = -q[2];
+	out[3] = -q[3];
+}
+
+static void quat_to_matrix( const double q[4], double m[3][3] )
+{
+	double w = q[0], x = q[1], y = q[2], z = q[3];
+	m[0][0] = 1.0 - 2.0 * ( y * y + z * z );
+	m[0][1] = 2.0 * ( x * y - w * z );
+	m[0][2] = 2.0 * ( x * z + w * y );
+	m[1][0] = 2.0 * ( x * y + w * z );
+	m[1][1] = 1.0 - 2.0 * ( x * x + z * z );
+	m[1][2] = 2.0 * ( y * z - w * x );
+	m[2][0] = 2.0 * ( x * z - w * y );
+	m[2][1] = 2.0 * ( y * z + w * x );
+	m[2][2] = 1.0 - 2.0 * ( x * x + y * y );
+}
+
+static void matrix_to_quat( const double m[3][3], double q[4] )
+{
+	// From the largest of the four, so nothing is divided by near zero
+	double trace = m[0][0] + m[1][1] + m[2][2];
+	if ( trace > 0.0 ) {
+		double s = 2.0 * sqrt( trace + 1.0 );
+		q[0] = 0.25 * s;
+		q[1] = ( m[2][1] - m[1][2] ) / s;
+		q[2] = ( m[0][2] - m[2][0] ) / s;
+		q[3] = ( m[1][0] - m[0][1] ) / s;
+	} else if ( m[0][0] > m[1][1] && m[0][0] > m[2][2] ) {
+		double s = 2.0 * sqrt( 1.0 + m[0][0] - m[1][1] - m[2][2] );
+		q[0] = ( m[2][1] - m[1][2] ) / s;
+		q[1] = 0.25 * s;
+		q[2] = ( m[0][1] + m[1][0] ) / s;
+		q[3] = ( m[0][2] + m[2][0] ) / s;
+	} else if ( m[1][1] > m[2][2] ) {
+		double s = 2.0 * sqrt( 1.0 + m[1][1] - m[0][0] - m[2][2] );
+		q[0] = ( m[0][2] - m[2][0] ) / s;
+		q[1] = ( m[0][1] + m[1][0] ) / s;
+		q[2] = 0.25 * s;
+		q[3] = ( m[1][2] + m[2][1] ) / s;
+	} else {
+		double s = 2.0 * sqrt( 1.0 + m[2][2] - m[0][0] - m[1][1] );
+		q[0] = ( m[1][0] - m[0][1] ) / s;
+		q[1] = ( m[0][2] + m[2][0] ) / s;
+		q[2] = ( m[1][2] + m[2][1] ) / s;
+		q[3] = 0.25 * s;
+	}
+}
+
+static inline void cross3( const double a[3], const double b[3], double out[3] )
+{
+	double x = a[1] * b[2] - a[2] * b[1];
+	double y = a[2] * b[0] - a[0] * b[2];
+	double z = a[0] * b[1] - a[1] * b[0];
+	out[0] = x;
+	out[1] = y;
+	out[2] = z;
+}
+
+static inline double dot3( const double a[3], const double b[3] )
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// v turned by the unit quaternion q
+static void quat_rotate( const double q[4], const double v[3], double out[3] )
+{
+	double t[3], u[3];
+	cross3( q + 1, v, t );
+	for ( int i = 0; i < 3; i++ ) t[i] *= 2.0;
+	cross3( q + 1, t, u );
+	for ( int i = 0; i < 3; i++ ) out[i] = v[i] + q[0] * t[i] + u[i];
+}
+
+static Matrix4x4 rigid_matrix( const double r[3][3], const double t[3] )
+{
+	Matrix4x4 m;
+	for ( int i = 0; i < 3; i++ ) {
+		for ( int j = 0; j < 3; j++ ) m[i][j] = r[i][j];
+		m[i][3] = t[i];
+	}
+	return m;
+}
+
+/*
+ * Building
+ */
+
+Ragdoll::Ragdoll()
+	: m_ground( 0.0 ), m_steps( 0 ), m_runner( NULL )
+{
+}
+
+void Ragdoll::clear()
+{
+	for ( int k = 0; k < 3; k++ ) {
+		m_x[k].clear();
+		m_v[k].clear();
+		m_w[k].clear();
+		m_old_x[k].clear();
+		m_inv_inertia[k].clear();
+	}
+	for ( int k = 0; k < 4; k++ ) {
+		m_q[k].clear();
+		m_old_q[k].clear();
+	}
+	m_inv_mass.clear();
+	m_parent.clear();
+	m_node.clear();
+	m_to_node.clear();
+	m_above_node.clear();
+	m_saved.clear();
+	m_joints.clear();
+	m_part_body.clear();
+	m_part_centre.clear();
+	m_part_shape.clear();
+	m_part_reach.clear();
+	m_part_min.clear();
+	m_part_max.clear();
+	m_ignored.clear();
+	m_islands.clear();
+	m_sorted.clear();
+	m_pairs.clear();
+	m_contacts.clear();
+	m_still.clear();
+	m_steps = 0;
+}
+
+void Ragdoll::build( SceneNode* root )
+{
+	TraceScope trace( "build ragdoll" );
+	clear();
+
+	std::vector<const SceneNode*> nodes;
+	std::vector<int> parents;
+	root->flatten( -1, nodes, parents );
+	const size_t n = nodes.size();
+
+	// A node not below a joint starts a body of its own if it holds a
+	// joint or a part. Below it, everything up to the next joints is in
+	// that body too, as is everything a joint moves up to the next
+	std::vector<char> holds( n, 0 );
+	for ( size_t i = 1; i < n; i++ ) {
+		const GeometryNode* geometry = dynamic_cast<const GeometryNode*>( nodes[i] );
+		if ( nodes[i]->is_joint() || ( geometry && geometry->get_primitive() ) ) holds[parents[i]] = 1;
+	}
+
+	std::vector<Matrix4x4> frames( n );
+	std::vector<int> body_of( n, -1 ), body_node;
+	std::vector<std::vector<double> > masses, centres, shapes;	// Per body, 1, 3 and 9 per part, in the world
+	std::vector<char> seen( SceneNode::id_limit(), 0 );
+	for ( size_t i = 0; i < n; i++ ) {
+		const SceneNode* node = nodes[i];
+		int parent = parents[i];
+		frames[i] = parent < 0 ? node->get_transform() : frames[parent] * node->get_transform();
+		const GeometryNode* geometry = dynamic_cast<const GeometryNode*>( node );
+		bool part = geometry && geometry->get_primitive();
+
+		int above = parent < 0 ? -1 : body_of[parent];
+		body_of[i] = above;
+		if ( node->is_joint() || ( above < 0 && ( holds[i] || part ) ) ) {
+			body_of[i] = body_node.size();
+			body_node.push_back( i );
+			m_parent.push_back( node->is_joint() ? above : -1 );
+			masses.push_back( std::vector<double>() );
+			centres.push_back( std::vector<double>() );
+			shapes.push_back( std::vector<double>() );
+		}
+		if ( !part || body_of[i] < 0 ) continue;
+
+		int b = body_of[i];
+		double r = geometry->get_primitive()->get_radius();
+		const double* f = frames[i].begin();
+		double det = f[0] * ( f[5] * f[10] - f[6] * f[9] ) - f[1] * ( f[4] * f[10] - f[6] * f[8] ) + f[2] * ( f[4] * f[9] - f[5] * f[8] );
+		masses[b].push_back( 4.0 / 3.0 * M_PI * fabs( det ) * r * r * r );
+		for ( int a = 0; a < 3; a++ ) {
+			centres[b].push_back( f[4 * a + 3] );
+			for ( int c = 0; c < 3; c++ ) shapes[b].push_back( f[4 * a + c] * r );
+		}
+	}
+
+	const size_t bodies = body_node.size();
+	for ( int k = 0; k < 3; k++ ) {
+		m_x[k].resize( bodies );
+		m_v[k].assign( bodies, 0.0 );
+		m_w[k].assign( bodies, 0.0 );
+		m_old_x[k].resize( bodies );
+		m_inv_inertia[k].resize( bodies );
+	}
+	for ( int k = 0; k < 4; k++ ) {
+		m_q[k].resize( bodies );
+		m_old_q[k].resize( bodies );
+	}
+	m_inv_mass.resize( bodies );
+
+	// Mass, centre and inertia of each body from its parts, as solid
+	// ellipsoids of one density, with the principal axes for its frame
+	std::vector<double> mass( bodies, 0.0 );
+	std::vector<int> island_of( bodies );
+	std::vector<double> rotations( 9 * bodies );
+	m_ground = HUGE_VAL;
+	for ( size_t b = 0, island = 0; b < bodies; b++ ) {
+		if ( m_parent[b] < 0 && b > 0 ) island++;
+		island_of[b] = island;
+
+		double centre[3] = { 0.0, 0.0, 0.0 };
+		for ( size_t p = 0; p < masses[b].size(); p++ ) {
+			mass[b] += masses[b][p];
+			for ( int a = 0; a < 3; a++ ) centre[a] += masses[b][p] * centres[b][3 * p + a];
+		}
+		const double* f = frames[body_node[b]].begin();
+		for ( int a = 0; a < 3; a++ ) centre[a] = mass[b] > 0.0 ? centre[a] / mass[b] : f[4 * a + 3];
+
+		double inertia[3][3] = { { 0.0, 0.0, 0.0 }, { 0.0, 0.0, 0.0 }, { 0.0, 0.0, 0.0 } };
+		for ( size_t p = 0; p < masses[b].size(); p++ ) {
+			const double* l = &shapes[b][9 * p];
+			double d[3], s[3][3], trace = 0.0;
+			for ( int i = 0; i < 3; i++ ) d[i] = centres[b][3 * p + i] - centre[i];
+			for ( int i = 0; i < 3; i++ ) {
+				for ( int j = 0; j < 3; j++ ) {
+					s[i][j] = ( l[3 * i] * l[3 * j] + l[3 * i + 1] * l[3 * j + 1] + l[3 * i + 2] * l[3 * j + 2] ) / 5.0 + d[i] * d[j];
+				}
+				trace += s[i][i];
+			}
+			for ( int i = 0; i < 3; i++ ) {
+				for ( int j = 0; j < 3; j++ ) inertia[i][j] += masses[b][p] * ( ( i == j ? trace : 0.0 ) - s[i][j] );
+			}
+		}
+		double axes[3][3];
+		diagonalize( inertia, axes );
+		double handedness = axes[0][0] * ( axes[1][1] * axes[2][2] - axes[1][2] * axes[2][1] )
+						  - axes[0][1] * ( axes[1][0] * axes[2][2] - axes[1][2] * axes[2][0] )
+						  + axes[0][2] * ( axes[1][0] * axes[2][1] - axes[1][1] * axes[2][0] );
+		if ( handedness < 0.0 ) {
+			for ( int i = 0; i < 3; i++ ) axes[i][2] = -axes[i][2];
+		}
+
+		double q[4];
+		matrix_to_quat( axes, q );
+		for ( int k = 0; k < 4; k++ ) m_q[k][b] = q[k];
+		for ( int k = 0; k < 3; k++ ) {
+			m_x[k][b] = centre[k];
+			m_inv_inertia[k][b] = inertia[k][k] > 0.0 ? 1.0 / inertia[k][k] : 0.0;
+		}
+		m_inv_mass[b] = mass[b] > 0.0 ? 1.0 / mass[b] : 0.0;
+		for ( int i = 0; i < 3; i++ ) {
+			for ( int j = 0; j < 3; j++ ) rotations[9 * b + 3 * i + j] = axes[i][j];
+		}
+
+		// Parts, moved into the body's frame
+		for ( size_t p = 0; p < masses[b].size(); p++ ) {
+			const double* l = &shapes[b][9 * p];
+			double shape[9], reach = 0.0;
+			for ( int i = 0; i < 3; i++ ) {
+				double along = 0.0;
+				for ( int j = 0; j < 3; j++ ) along += axes[j][i] * ( centres[b][3 * p + j] - centre[j] );
+				m_part_centre.push_back( along );
+				for ( int c = 0; c < 3; c++ ) {
+					shape[3 * i + c] = axes[0][i] * l[c] + axes[1][i] * l[3 + c] + axes[2][i] * l[6 + c];
+					reach += l[3 * i + c] * l[3 * i + c];
+				}
+			}
+			m_part_shape.insert( m_part_shape.end(), shape, shape + 9 );
+			m_part_reach.push_back( sqrt( reach ) );
+			m_part_body.push_back( b );
+			double lowest = sqrt( l[3] * l[3] + l[4] * l[4] + l[5] * l[5] );
+			m_ground = std::min( m_ground, centres[b][3 * p + 1] - lowest );
+		}
+	}
+	if ( m_ground == HUGE_VAL ) m_ground = 0.0;
+	m_ground -= RAGDOLL_DROP;
+
+	// Bodies with no parts, such as the node a generated rig hangs its
+	// joints from, weigh as much as the lightest body that has some,
+	// as a ball of the same density
+	for ( size_t b = 0; b < bodies; b++ ) {
+		if ( mass[b] > 0.0 ) continue;
+		double lightest = HUGE_VAL;
+		for ( size_t c = 0; c < bodies; c++ ) {
+			if ( island_of[c] == island_of[b] && mass[c] > 0.0 ) lightest = std::min( lightest, mass[c] );
+		}
+		if ( lightest == HUGE_VAL ) lightest = 1.0;
+		double radius = cbrt( 3.0 * lightest / ( 4.0 * M_PI ) );
+		m_inv_mass[b] = 1.0 / lightest;
+		for ( int k = 0; k < 3; k++ ) m_inv_inertia[k][b] = 1.0 / ( 0.4 * lightest * radius * radius );
+	}
+
+	// Bodies above the joints carry their nodes with them. Instances
+	// share those nodes, which go where the first place takes them
+	m_node.assign( bodies, NULL );
+	m_to_node.resize( bodies );
+	m_above_node.resize( bodies );
+	m_saved.resize( bodies );
+	for ( size_t b = 0; b < bodies; b++ ) {
+		int i = body_node[b];
+		if ( m_parent[b] >= 0 || seen[nodes[i]->get_id()] ) continue;
+		seen[nodes[i]->get_id()] = 1;
+		double r[3][3], t[3];
+		for ( int a = 0; a < 3; a++ ) {
+			for ( int c = 0; c < 3; c++ ) r[a][c] = rotations[9 * b + 3 * a + c];
+			t[a] = m_x[a][b];
+		}
+		m_node[b] = SceneNode::by_id( nodes[i]->get_id() );
+		m_to_node[b] = rigid_matrix( r, t ).invert() * frames[i];
+		m_above_node[b] = parents[i] < 0 ? Matrix4x4() : frames[parents[i]].invert();
+		m_saved[b] = nodes[i]->get_transform();
+	}
+
+	// Joints, where each body meets the one above it
+	for ( size_t b = 0; b < bodies; b++ ) {
+		if ( m_parent[b] < 0 ) continue;
+		int i = body_node[b], p = m_parent[b];
+		Joint joint;
+		joint.node = JointNode::by_id( nodes[i]->get_id() );
+		joint.first = !seen[joint.node->get_id()];
+		seen[joint.node->get_id()] = 1;
+		joint.parent = p;
+		joint.child = b;
+		joint.x_min = joint.node->get_joint_x().min * TO_RADIANS;
+		joint.x_max = joint.node->get_joint_x().max * TO_RADIANS;
+		joint.y_min = joint.node->get_joint_y().min * TO_RADIANS;
+		joint.y_max = joint.node->get_joint_y().max * TO_RADIANS;
+
+		joint.base = joint.node->rest();
+
+		double before[3][3], after[3][3];
+		rotation_of( frames[parents[i]] * joint.base, before );
+		rotation_of( frames[i], after );
+		const int ends[2] = { p, (int)b };
+		double* points[2] = { joint.parent_point, joint.child_point };
+		double* orientations[2] = { joint.parent_frame, joint.child_frame };
+		double (*turned[2])[3] = { before, after };
+		for ( int e = 0; e < 2; e++ ) {
+			const double* r = &rotations[9 * ends[e]];
+			double local[3][3];
+			for ( int a = 0; a < 3; a++ ) {
+				double offset = 0.0;
+				for ( int c = 0; c < 3; c++ ) {
+					offset += r[3 * c + a] * ( frames[i].begin()[4 * c + 3] - m_x[c][ends[e]] );
+					local[a][c] = r[a] * turned[e][0][c] + r[3 + a] * turned[e][1][c] + r[6 + a] * turned[e][2][c];
+				}
+				points[e][a] = offset;
+			}
+			matrix_to_quat( local, orientations[e] );
+		}
+		m_joints.push_back( joint );
+	}
+
+	// A body turns no more easily than a ball of its mass reaching out
+	// to its furthest joint. A light body with joints far out, solved
+	// for one joint after another, otherwise overshoots each time, and
+	// the velocities feed that back until it flies apart
+	std::vector<double> reach( bodies, 0.0 );
+	for ( size_t j = 0; j < m_joints.size(); j++ ) {
+		const Joint& joint = m_joints[j];
+		reach[joint.parent] = std::max( reach[joint.parent], dot3( joint.parent_point, joint.parent_point ) );
+		reach[joint.child] = std::max( reach[joint.child], dot3( joint.child_point, joint.child_point ) );
+	}
+	for ( size_t b = 0; b < bodies; b++ ) {
+		double least = 0.4 * reach[b] / m_inv_mass[b];
+		for ( int k = 0; k < 3; k++ ) {
+			if ( least > 0.0 ) m_inv_inertia[k][b] = std::min( m_inv_inertia[k][b], 1.0 / least );
+		}
+	}
+
+	// Every puppet is an island, from the first body above its joints
+	for ( size_t b = 0, island = 0, j = 0, part = 0; b <= bodies; b++ ) {
+		if ( b < bodies && !( m_parent[b] < 0 ) ) continue;
+		for ( ; j < m_joints.size() && island_of[m_joints[j].child] < (int)island; j++ );
+		for ( ; part < m_part_body.size() && island_of[m_part_body[part]] < (int)island; part++ );
+		if ( island == m_islands.size() ) m_islands.push_back( Island() );
+		m_islands[island].body = b;
+		m_islands[island].joint = j;
+		m_islands[island].part = part;
+		island++;
+	}
+
+	// Pairs that touch as modelled are meant to
+	m_part_min.resize( 3 * m_part_body.size() );
+	m_part_max.resize( 3 * m_part_body.size() );
+	m_sorted.resize( islands() );
+	m_pairs.resize( islands() );
+	m_contacts.resize( islands() );
+	m_still.assign( islands(), 0 );
+	for ( size_t island = 0; island < islands(); island++ ) {
+		for ( int part = m_islands[island].part; part < m_islands[island + 1].part; part++ ) m_sorted[island].push_back( part );
+		find_pairs( island, false );
+		for ( size_t c = 0; c < m_pairs[island].size(); c++ ) {
+			int a = m_pairs[island][c].first, b = m_pairs[island][c].second;
+			if ( parts_touch( a, b ) ) m_ignored.insert( key( a, b ) );
+		}
+		m_pairs[island].clear();
+	}
+}
+
+/*
+ * Stepping
+ */
+
+// Hands out islands to threads, each to run for all the steps. The
+// workers wait for the next run rather than exit, and the thread that
+// asks for a run takes a share of the work too
+class RagdollRunner {
+public:
+	RagdollRunner( Ragdoll& ragdoll ) : m_ragdoll( ragdoll ), m_steps( 0 ), m_next( 0 ), m_run( 0 ), m_busy( 0 ), m_quit( false ) {}
+
+	~RagdollRunner()
+	{
+		{
+			Glib::Mutex::Lock lock( m_lock );
+			m_quit = true;
+			m_start.broadcast();
+		}
+		for ( size_t t = 0; t < m_workers.size(); t++ ) m_workers[t]->join();
+	}
+
+	void run( int steps, int threads )
+	{
+		while ( (int)m_workers.size() < threads - 1 ) {
+			m_workers.push_back( Glib::Thread::create( sigc::mem_fun( *this, &RagdollRunner::run_worker ), true ) );
+		}
+		{
+			Glib::Mutex::Lock lock( m_lock );
+			m_steps = steps;
+			m_next = 0;
+			m_busy = m_workers.size();
+			m_run++;
+			m_start.broadcast();
+		}
+		work();
+		Glib::Mutex::Lock lock( m_lock );
+		while ( m_busy > 0 ) m_done.wait( m_lock );
+	}
+
+	void work()
+	{
+		for ( ;; ) {
+			size_t island;
+			{
+				Glib::Mutex::Lock lock( m_lock );
+				if ( m_next >= m_ragdoll.islands() ) return;
+				island = m_next++;
+			}
+			TraceScope trace( "simulate island" );
+			for ( int s = 0; s < m_steps; s++ ) m_ragdoll.step( island );
+		}
+	}
+
+	void run_worker()
+	{
+		Trace::set_thread_name( "ragdoll" );
+		long done = 0;
+		for ( ;; ) {
+			{
+				Glib::Mutex::Lock lock( m_lock );
+				while ( m_run == done && !m_quit ) m_start.wait( m_lock );
+				if ( m_quit ) return;
+				done = m_run;
+			}
+			work();
+			Glib::Mutex::Lock lock( m_lock );
+			if ( --m_busy == 0 ) m_done.signal();
+		}
+	}
+
+private:
+	Ragdoll& m_ragdoll;
+	int m_steps;
+	size_t m_next;
+	long m_run;					// Runs asked for so far
+	size_t m_busy;				// Workers yet to finish this run
+	bool m_quit;
+	std::vector<Glib::Thread*> m_workers;
+	Glib::Mutex m_lock;
+	Glib::Cond m_start, m_done;
+};
+
+Ragdoll::~Ragdoll()
+{
+	delete m_runner;
+}
+
+void Ragdoll::run( int steps, int threads )
+{
+	if ( !built() || steps <= 0 ) return;
+
+	if ( threads <= 0 ) {
+		long cores = sysconf( _SC_NPROCESSORS_ONLN );
+		threads = cores > 0 ? cores : 1;
+	}
+	threads = std::min( (size_t)threads, islands() );
+	if ( threads > 1 && Glib::thread_supported() && !m_runner ) m_runner = new RagdollRunner( *this );
+	if ( m_runner ) {
+		m_runner->run( steps, threads );
+	} else {
+		for ( size_t island = 0; island < islands(); island++ ) {
+			TraceScope trace( "simulate island" );
+			for ( int s = 0; s < steps; s++ ) step( island );
+		}
+	}
+	m_steps += steps;
+}
+
+bool Ragdoll::at_rest() const
+{
+	for ( size_t island = 0; island < m_still.size(); island++ ) {
+		if ( m_still[island] < RAGDOLL_SLEEP_STEPS ) return false;
+	}
+	return built();
+}
+
+// Count the steps the island has been still for, and start again when it moves
+void Ragdoll::note_rest( int island )
+{
+	for ( int b = m_islands[island].body; b < m_islands[island + 1].body; b++ ) {
+		double speed = m_v[0][b] * m_v[0][b] + m_v[1][b] * m_v[1][b] + m_v[2][b] * m_v[2][b];
+		double spin = m_w[0][b] * m_w[0][b] + m_w[1][b] * m_w[1][b] + m_w[2][b] * m_w[2][b];
+		if ( speed > RAGDOLL_SLEEP_SPEED * RAGDOLL_SLEEP_SPEED || spin > RAGDOLL_SLEEP_SPIN * RAGDOLL_SLEEP_SPIN ) {
+			m_still[island] = 0;
+			return;
+		}
+	}
+	m_still[island]++;
+}
+
+void Ragdoll::step( int island )
+{
+	// At rest it would stay where it is
+	if ( m_still[island] >= RAGDOLL_SLEEP_STEPS ) return;
+
+	const int first = m_islands[island].body, last = m_islands[island + 1].body;
+	const double h = RAGDOLL_STEP / RAGDOLL_SUBSTEPS, damping = 1.0 - RAGDOLL_DAMPING * RAGDOLL_STEP;
+
+	// Parts that could meet in this step, by where they are at its start
+	find_pairs( island, true );
+
+	double *x = &m_x[0][0], *y = &m_x[1][0], *z = &m_x[2][0];
+	double *vx = &m_v[0][0], *vy = &m_v[1][0], *vz = &m_v[2][0];
+	double *wx = &m_w[0][0], *wy = &m_w[1][0], *wz = &m_w[2][0];
+	double *qw = &m_q[0][0], *qx = &m_q[1][0], *qy = &m_q[2][0], *qz = &m_q[3][0];
+	double *ox = &m_old_x[0][0], *oy = &m_old_x[1][0], *oz = &m_old_x[2][0];
+	double *ow = &m_old_q[0][0], *oqx = &m_old_q[1][0], *oqy = &m_old_q[2][0], *oqz = &m_old_q[3][0];
+	for ( int b = first; b < last; b++ ) {
+		vx[b] *= damping;
+		vy[b] *= damping;
+		vz[b] *= damping;
+		wx[b] *= damping;
+		wy[b] *= damping;
+		wz[b] *= damping;
+	}
+
+	for ( int s = 0; s < RAGDOLL_SUBSTEPS; s++ ) {
+		// Move freely, falling
+		for ( int b = first; b < last; b++ ) {
+			ox[b] = x[b];
+			oy[b] = y[b];
+			oz[b] = z[b];
+			vy[b] -= RAGDOLL_GRAVITY * h;
+			x[b] += h * vx[b];
+			y[b] += h * vy[b];
+			z[b] += h * vz[b];
+		}
+		for ( int b = first; b < last; b++ ) {
+			double w = qw[b], i = qx[b], j = qy[b], k = qz[b];
+			ow[b] = w;
+			oqx[b] = i;
+			oqy[b] = j;
+			oqz[b] = k;
+			double hx = 0.5 * h * wx[b], hy = 0.5 * h * wy[b], hz = 0.5 * h * wz[b];
+			w -= hx * qx[b] + hy * qy[b] + hz * qz[b];
+			i += hx * qw[b] + hy * qz[b] - hz * qy[b];
+			j += hy * qw[b] + hz * qx[b] - hx * qz[b];
+			k += hz * qw[b] + hx * qy[b] - hy * qx[b];
+			double scale = 1.0 / sqrt( w * w + i * i + j * j + k * k );
+			qw[b] = w * scale;
+			qx[b] = i * scale;
+			qy[b] = j * scale;
+			qz[b] = k * scale;
+		}
+
+		// Then pull back into the constraints
+		solve_joints( island );
+		solve_pairs( island );
+		solve_ground( island );
+
+		// What that took is the velocity
+		for ( int b = first; b < last; b++ ) {
+			vx[b] = ( x[b] - ox[b] ) / h;
+			vy[b] = ( y[b] - oy[b] ) / h;
+			vz[b] = ( z[b] - oz[b] ) / h;
+		}
+		for ( int b = first; b < last; b++ ) {
+			// The vector part of q times the conjugate of the old q
+			double dw = qw[b] * ow[b] + qx[b] * oqx[b] + qy[b] * oqy[b] + qz[b] * oqz[b];
+			double dx = -qw[b] * oqx[b] + qx[b] * ow[b] - qy[b] * oqz[b] + qz[b] * oqy[b];
+			double dy = -qw[b] * oqy[b] + qx[b] * oqz[b] + qy[b] * ow[b] - qz[b] * oqx[b];
+			double dz = -qw[b] * oqz[b] - qx[b] * oqy[b] + qy[b] * oqx[b] + qz[b] * ow[b];
+			double scale = ( dw < 0.0 ? -2.0 : 2.0 ) / h;
+			wx[b] = dx * scale;
+			wy[b] = dy * scale;
+			wz[b] = dz * scale;
+		}
+		settle( island );
+	}
+	note_rest( island );
+}
+
+// Pushing parts apart, or out of the ground, leaves them moving apart
+// as fast as they were pushed. Take that back, so they land rather
+// than bounce
+void Ragdoll::settle( int island )
+{
+	std::vector<Contact>& contacts = m_contacts[island];
+	for ( size_t c = 0; c < contacts.size(); c++ ) {
+		const Contact& contact = contacts[c];
+		const int a = contact.a, b = contact.b;
+		double w[3], spin[3], apart = 0.0, ka[3], kb[3], total = 0.0;
+		for ( int k = 0; k < 3; k++ ) w[k] = m_w[k][b];
+		cross3( w, contact.rb, spin );
+		for ( int k = 0; k < 3; k++ ) apart += ( m_v[k][b] + spin[k] ) * contact.n[k];
+		if ( a >= 0 ) {
+			for ( int k = 0; k < 3; k++ ) w[k] = m_w[k][a];
+			cross3( w, contact.ra, spin );
+			for ( int k = 0; k < 3; k++ ) apart -= ( m_v[k][a] + spin[k] ) * contact.n[k];
+		}
+		if ( apart <= 0.0 ) continue;
+
+		double arm[3];
+		cross3( contact.rb, contact.n, arm );
+		inverse_inertia( b, arm, kb );
+		total += m_inv_mass[b] + dot3( arm, kb );
+		if ( a >= 0 ) {
+			cross3( contact.ra, contact.n, arm );
+			inverse_inertia( a, arm, ka );
+			total += m_inv_mass[a] + dot3( arm, ka );
+		}
+		if ( total <= 0.0 ) continue;
+		double impulse = apart / total;
+		for ( int k = 0; k < 3; k++ ) {
+			m_v[k][b] -= m_inv_mass[b] * impulse * contact.n[k];
+			m_w[k][b] -= impulse * kb[k];
+		}
+		if ( a >= 0 ) {
+			for ( int k = 0; k < 3; k++ ) {
+				m_v[k][a] += m_inv_mass[a] * impulse * contact.n[k];
+				m_w[k][a] += impulse * ka[k];
+			}
+		}
+	}
+	contacts.clear();
+}
+
+void Ragdoll::rotate( int body, const double v[3], double out[3], bool inverse ) const
+{
+	double q[4] = { m_q[0][body], m_q[1][body], m_q[2][body], m_q[3][body] };
+	if ( inverse ) quat_conjugate( q, q );
+	quat_rotate( q, v, out );
+}
+
+// The inverse inertia of body in the world applied to v
+void Ragdoll::inverse_inertia( int body, const double v[3], double out[3] ) const
+{
+	double local[3];
+	rotate( body, v, local, true );
+	for ( int k = 0; k < 3; k++ ) local[k] *= m_inv_inertia[k][body];
+	rotate( body, local, out, false );
+}
+
+// Turn body by the small angle about its axis
+void Ragdoll::spin( int body, const double angle[3] )
+{
+	double w = m_q[0][body], x = m_q[1][body], y = m_q[2][body], z = m_q[3][body];
+	double hx = 0.5 * angle[0], hy = 0.5 * angle[1], hz = 0.5 * angle[2];
+	double q[4] = {
+		w - ( hx * x + hy * y + hz * z ),
+		x + hx * w + hy * z - hz * y,
+		y + hy * w + hz * x - hx * z,
+		z + hz * w + hx * y - hy * x
+	};
+	double scale = 1.0 / sqrt( q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3] );
+	for ( int k = 0; k < 4; k++ ) m_q[k][body] = q[k] * scale;
+}
+
+// Move body a, at ra from its centre, and b, at rb from its, by as
+// much as their masses and inertias say, bringing the points c closer
+// along n, from a to b. -1 is the ground, which does not move
+void Ragdoll::correct( int a, int b, const double ra[3], const double rb[3], const double n[3], double c )
+{
+	double ka[3], kb[3], wa = 0.0, wb = 0.0;
+	if ( a >= 0 ) {
+		double arm[3];
+		cross3( ra, n, arm );
+		inverse_inertia( a, arm, ka );
+		wa = m_inv_mass[a] + dot3( arm, ka );
+	}
+	if ( b >= 0 ) {
+		double arm[3];
+		cross3( rb, n, arm );
+		inverse_inertia( b, arm, kb );
+		wb = m_inv_mass[b] + dot3( arm, kb );
+	}
+	if ( wa + wb <= 0.0 ) return;
+
+	double lambda = c / ( wa + wb );
+	if ( a >= 0 ) {
+		double angle[3];
+		for ( int k = 0; k < 3; k++ ) {
+			m_x[k][a] += m_inv_mass[a] * lambda * n[k];
+			angle[k] = lambda * ka[k];
+		}
+		spin( a, angle );
+	}
+	if ( b >= 0 ) {
+		double angle[3];
+		for ( int k = 0; k < 3; k++ ) {
+			m_x[k][b] -= m_inv_mass[b] * lambda * n[k];
+			angle[k] = -lambda * kb[k];
+		}
+		spin( b, angle );
+	}
+}
+
+// Turn b by angle about axis relative to a, splitting the turn between
+// them by their inertias
+void Ragdoll::turn( int a, int b, const double axis[3], double angle )
+{
+	double ka[3], kb[3];
+	inverse_inertia( a, axis, ka );
+	inverse_inertia( b, axis, kb );
+	double total = dot3( axis, ka ) + dot3( axis, kb );
+	if ( total <= 0.0 ) return;
+
+	double lambda = angle / total, spin_a[3], spin_b[3];
+	for ( int k = 0; k < 3; k++ ) {
+		spin_a[k] = -lambda * ka[k];
+		spin_b[k] = lambda * kb[k];
+	}
+	spin( a, spin_a );
+	spin( b, spin_b );
+}
+
+// The joint's frame on its parent, its frame on the child, and the
+// angles the one is turned from the other, as x, then y, then the
+// twist about z the joint should not have
+void Ragdoll::joint_angles( const Joint& joint, double& x, double& y, double& z, double frame[4], double child[4] ) const
+{
+	double p[4] = { m_q[0][joint.parent], m_q[1][joint.parent], m_q[2][joint.parent], m_q[3][joint.parent] };
+	double c[4] = { m_q[0][joint.child], m_q[1][joint.child], m_q[2][joint.child], m_q[3][joint.child] };
+	quat_mul( p, joint.parent_frame, frame );
+	quat_mul( c, joint.child_frame, child );
+
+	double back[4], relative[4], m[3][3];
+	quat_conjugate( frame, back );
+	quat_mul( back, child, relative );
+	quat_to_matrix( relative, m );
+	x = atan2( -m[1][2], m[2][2] );
+	y = asin( std::max( -1.0, std::min( 1.0, m[0][2] ) ) );
+	z = atan2( -m[0][1], m[0][0] );
+}
+
+// The joint's frame on its parent and on the child, the x axis of the
+// one and the y axis of the other, which it turns about
+void Ragdoll::joint_axes( const Joint& joint, double frame[4], double child[4], double a[3], double b[3] ) const
+{
+	double p[4] = { m_q[0][joint.parent], m_q[1][joint.parent], m_q[2][joint.parent], m_q[3][joint.parent] };
+	double c[4] = { m_q[0][joint.child], m_q[1][joint.child], m_q[2][joint.child], m_q[3][joint.child] };
+	quat_mul( p, joint.parent_frame, frame );
+	quat_mul( c, joint.child_frame, child );
+	const double ex[3] = { 1.0, 0.0, 0.0 }, ey[3] = { 0.0, 1.0, 0.0 };
+	quat_rotate( frame, ex, a );
+	quat_rotate( child, ey, b );
+}
+
+void Ragdoll::solve_joints( int island )
+{
+	for ( int j = m_islands[island].joint; j < m_islands[island + 1].joint; j++ ) {
+		const Joint& joint = m_joints[j];
+		const int p = joint.parent, c = joint.child;
+
+		// Keep the parent's x axis square to the child's y axis, which
+		// leaves the joint turning about just those two, then turn each
+		// back within its limits. Each turn is about the axis that moves
+		// just what it corrects, so corrections do not feed each other
+		double frame[4], child[4], a[3], b[3], n[3];
+		joint_axes( joint, frame, child, a, b );
+		cross3( a, b, n );
+		double s = sqrt( dot3( n, n ) );
+		if ( s > 1e-12 ) {
+			for ( int k = 0; k < 3; k++ ) n[k] /= s;
+			turn( p, c, n, RAGDOLL_RELAXATION * asin( std::max( -1.0, std::min( 1.0, dot3( a, b ) ) ) ) );
+			joint_axes( joint, frame, child, a, b );
+		}
+
+		// x is how far b is turned about a from the parent's y axis
+		double from[3], across[3];
+		const double ey[3] = { 0.0, 1.0, 0.0 }, ex[3] = { 1.0, 0.0, 0.0 };
+		quat_rotate( frame, ey, from );
+		cross3( from, b, across );
+		double x = atan2( dot3( across, a ), dot3( from, b ) );
+		double limited = std::max( joint.x_min, std::min( joint.x_max, x ) );
+		if ( limited != x ) {
+			turn( p, c, a, RAGDOLL_RELAXATION * ( limited - x ) );
+			joint_axes( joint, frame, child, a, b );
+		}
+
+		// y how far the child's x axis is turned about b from a
+		double to[3];
+		quat_rotate( child, ex, to );
+		cross3( a, to, across );
+		double y = atan2( dot3( across, b ), dot3( a, to ) );
+		limited = std::max( joint.y_min, std::min( joint.y_max, y ) );
+		if ( limited != y ) turn( p, c, b, RAGDOLL_RELAXATION * ( limited - y ) );
+
+		// Then hold the joint's origin together
+		double ra[3], rb[3], gap[3];
+		rotate( p, joint.parent_point, ra, false );
+		rotate( c, joint.child_point, rb, false );
+		for ( int k = 0; k < 3; k++ ) gap[k] = ( m_x[k][c] + rb[k] ) - ( m_x[k][p] + ra[k] );
+		double distance = sqrt( dot3( gap, gap ) );
+		if ( distance > 1e-12 ) {
+			for ( int k = 0; k < 3; k++ ) gap[k] /= distance;
+			correct( p, c, ra, rb, gap, distance );
+		}
+	}
+}
+
+// Centre and 3x3 shape of a part, in the world
+void Ragdoll::part_in_world( int part, double centre[3], double shape[9] ) const
+{
+	int b = m_part_body[part];
+	double q[4] = { m_q[0][b], m_q[1][b], m_q[2][b], m_q[3][b] }, r[3][3];
+	quat_to_matrix( q, r );
+	const double* c = &m_part_centre[3 * part];
+	const double* l = &m_part_shape[9 * part];
+	for ( int i = 0; i < 3; i++ ) {
+		centre[i] = m_x[i][b] + r[i][0] * c[0] + r[i][1] * c[1] + r[i][2] * c[2];
+		for ( int j = 0; j < 3; j++ ) shape[3 * i + j] = r[i][0] * l[j] + r[i][1] * l[3 + j] + r[i][2] * l[6 + j];
+	}
+}
+
+void Ragdoll::solve_ground( int island )
+{
+	for ( int part = m_islands[island].part; part < m_islands[island + 1].part; part++ ) {
+		double centre[3], shape[9];
+		part_in_world( part, centre, shape );
+
+		// Its lowest point, which the row of its shape for y points away from
+		const double* up = shape + 3;
+		double reach = sqrt( dot3( up, up ) );
+		if ( centre[1] - reach >= m_ground || reach <= 0.0 ) continue;
+		int b = m_part_body[part];
+		double r[3];
+		for ( int i = 0; i < 3; i++ ) r[i] = centre[i] - m_x[i][b] - dot3( shape + 3 * i, up ) / reach;
+		double depth = m_ground - ( m_x[1][b] + r[1] );
+		if ( depth <= 0.0 ) continue;
+		const double down[3] = { 0.0, -1.0, 0.0 };
+		correct( -1, b, r, r, down, depth );
+		Contact contact = { -1, b, { 0.0, 0.0, 0.0 }, { r[0], r[1], r[2] }, { 0.0, 1.0, 0.0 } };
+		m_contacts[island].push_back( contact );
+
+		// Friction takes back as much of its slide along the ground
+		// this substep as the push up allows
+		double local[3], before[3];
+		rotate( b, r, local, true );
+		double q[4] = { m_q[0][b], m_q[1][b], m_q[2][b], m_q[3][b] };
+		for ( int k = 0; k < 4; k++ ) m_q[k][b] = m_old_q[k][b];
+		rotate( b, local, before, false );
+		for ( int k = 0; k < 4; k++ ) m_q[k][b] = q[k];
+		rotate( b, local, r, false );
+		double slide[3] = { m_x[0][b] + r[0] - m_old_x[0][b] - before[0], 0.0, m_x[2][b] + r[2] - m_old_x[2][b] - before[2] };
+		double length = sqrt( dot3( slide, slide ) );
+		if ( length <= 1e-12 ) continue;
+		for ( int k = 0; k < 3; k++ ) slide[k] /= length;
+		correct( -1, b, r, r, slide, std::min( length, RAGDOLL_FRICTION * depth ) );
+	}
+}
+
+bool Ragdoll::linked( int a, int b ) const
+{
+	int p = m_part_body[a], q = m_part_body[b];
+	return p == q || m_parent[p] == q || m_parent[q] == p;
+}
+
+bool Ragdoll::parts_touch( int a, int b ) const
+{
+	double centre[3], shape[9];
+	Matrix4x4 shapes[2];
+	const int parts[2] = { a, b };
+	for ( int e = 0; e < 2; e++ ) {
+		part_in_world( parts[e], centre, shape );
+		for ( int i = 0; i < 3; i++ ) {
+			for ( int j = 0; j < 3; j++ ) shapes[e][i][j] = shape[3 * i + j];
+			shapes[e][i][3] = centre[i];
+		}
+	}
+	return ellipsoids_touch( shapes[0], shapes[1] );
+}
+
+// Sweep the island's parts along x, with how far each could move in a
+// step added on when moving, for pairs whose bounds meet
+void Ragdoll::find_pairs( int island, bool moving )
+{
+	std::vector<int>& sorted = m_sorted[island];
+	std::vector<std::pair<int, int> >& pairs = m_pairs[island];
+	for ( size_t s = 0; s < sorted.size(); s++ ) {
+		int part = sorted[s], b = m_part_body[part];
+		double centre[3], shape[9], margin = 0.0;
+		part_in_world( part, centre, shape );
+		if ( moving ) {
+			double speed = sqrt( m_v[0][b] * m_v[0][b] + m_v[1][b] * m_v[1][b] + m_v[2][b] * m_v[2][b] );
+			double spin = sqrt( m_w[0][b] * m_w[0][b] + m_w[1][b] * m_w[1][b] + m_w[2][b] * m_w[2][b] );
+			double arm = sqrt( ( centre[0] - m_x[0][b] ) * ( centre[0] - m_x[0][b] ) + ( centre[1] - m_x[1][b] ) * ( centre[1] - m_x[1][b] )
+							   + ( centre[2] - m_x[2][b] ) * ( centre[2] - m_x[2][b] ) );
+			margin = RAGDOLL_STEP * ( speed + spin * ( arm + m_part_reach[part] ) + RAGDOLL_GRAVITY * RAGDOLL_STEP );
+		}
+		for ( int k = 0; k < 3; k++ ) {
+			m_part_min[3 * part + k] = centre[k] - m_part_reach[part] - margin;
+			m_part_max[3 * part + k] = centre[k] + m_part_reach[part] + margin;
+		}
+	}
+
+	// The same sweep as CollisionWorld, keeping the order between steps
+	sweep_pairs( m_part_min, m_part_max, 0, sorted, pairs );
+	size_t kept = 0;
+	for ( size_t c = 0; c < pairs.size(); c++ ) {
+		if ( linked( pairs[c].first, pairs[c].second ) || m_ignored.count( key( pairs[c].first, pairs[c].second ) ) ) continue;
+		pairs[kept++] = pairs[c];
+	}
+	pairs.resize( kept );
+}
+
+void Ragdoll::solve_pairs( int island )
+{
+	const std::vector<std::pair<int, int> >& pairs = m_pairs[island];
+	for ( size_t c = 0; c < pairs.size(); c++ ) {
+		int a = pairs[c].first, b = pairs[c].second;
+		double ca[3], la[9], cb[3], lb[9], n[3];
+		part_in_world( a, ca, la );
+		part_in_world( b, cb, lb );
+		for ( int k = 0; k < 3; k++ ) n[k] = cb[k] - ca[k];
+		double distance = sqrt( dot3( n, n ) );
+		if ( distance >= m_part_reach[a] + m_part_reach[b] || distance <= 1e-12 ) continue;
+		if ( !parts_touch( a, b ) ) continue;
+
+		// Push apart by how much they overlap along whichever of the line
+		// between their centres and their axes they overlap least on,
+		// from the points furthest along it. The true depth is the least
+		// over every direction, and these are usually near it
+		double best[3], ta[3], tb[3], ha = 0.0, hb = 0.0, depth = 0.0;
+		for ( int k = 0; k < 3; k++ ) best[k] = n[k] / distance;
+		for ( int candidate = 0; candidate < 7; candidate++ ) {
+			double axis[3];
+			if ( candidate == 0 ) {
+				for ( int k = 0; k < 3; k++ ) axis[k] = best[k];
+			} else {
+				const double* l = candidate < 4 ? la : lb;
+				for ( int k = 0; k < 3; k++ ) axis[k] = l[3 * k + ( candidate - 1 ) % 3];
+				double length = sqrt( dot3( axis, axis ) );
+				if ( length <= 1e-12 ) continue;
+				double side = dot3( axis, n ) < 0.0 ? -length : length;
+				for ( int k = 0; k < 3; k++ ) axis[k] /= side;
+			}
+			double sa[3], sb[3];
+			for ( int k = 0; k < 3; k++ ) {
+				sa[k] = la[k] * axis[0] + la[3 + k] * axis[1] + la[6 + k] * axis[2];
+				sb[k] = lb[k] * axis[0] + lb[3 + k] * axis[1] + lb[6 + k] * axis[2];
+			}
+			double along_a = sqrt( dot3( sa, sa ) ), along_b = sqrt( dot3( sb, sb ) );
+			double overlap = along_a + along_b - dot3( axis, n );
+			if ( candidate > 0 && overlap >= depth ) continue;
+			for ( int k = 0; k < 3; k++ ) {
+				best[k] = axis[k];
+				ta[k] = sa[k];
+				tb[k] = sb[k];
+			}
+			ha = along_a;
+			hb = along_b;
+			depth = overlap;
+		}
+		if ( depth <= 0.0 || ha <= 0.0 || hb <= 0.0 ) continue;
+		int body_a = m_part_body[a], body_b = m_part_body[b];
+		double ra[3], rb[3], apart[3];
+		for ( int k = 0; k < 3; k++ ) {
+			ra[k] = ca[k] - m_x[k][body_a] + dot3( la + 3 * k, ta ) / ha;
+			rb[k] = cb[k] - m_x[k][body_b] - dot3( lb + 3 * k, tb ) / hb;
+			apart[k] = -best[k];
+		}
+		correct( body_a, body_b, ra, rb, apart, RAGDOLL_RELAXATION * depth );
+		Contact contact = { body_a, body_b, { ra[0], ra[1], ra[2] }, { rb[0], rb[1], rb[2] }, { best[0], best[1], best[2] } };
+		m_contacts[island].push_back( contact );
+	}
+}
+
+/*
+ * Back into the scene
+ */
+
+void Ragdoll::apply() const
+{
+	TraceScope trace( "pose ragdoll" );
+	for ( size_t j = 0; j < m_joints.size(); j++ ) {
+		const Joint& joint = m_joints[j];
+		if ( !joint.first ) continue;
+		double x, y, z, frame[4], child[4];
+		joint_angles( joint, x, y, z, frame, child );
+		x = std::max( joint.x_min, std::min( joint.x_max, x ) ) / TO_RADIANS;
+		y = std::max( joint.y_min, std::min( joint.y_max, y ) ) / TO_RADIANS;
+		joint.node->set_transform( joint.base * rotation_matrix( 'x', x ) * rotation_matrix( 'y', y ) );
+		joint.node->set_rotation( Vector3D( x, y, 0.0 ) );
+	}
+
+	for ( size_t b = 0; b < m_node.size(); b++ ) {
+		if ( !m_node[b] ) continue;
+		double q[4] = { m_q[0][b], m_q[1][b], m_q[2][b], m_q[3][b] }, r[3][3];
+		double t[3] = { m_x[0][b], m_x[1][b], m_x[2][b] };
+		quat_to_matrix( q, r );
+		m_node[b]->set_transform( m_above_node[b] * rigid_matrix( r, t ) * m_to_node[b] );
+	}
+}
+
+void Ragdoll::restore() const
+{
+	for ( size_t b = 0; b < m_node.size(); b++ ) {
+		if ( m_node[b] ) m_node[b]->set_transform( m_saved[b] );
+	}
+}
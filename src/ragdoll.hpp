@@ -0,0 +1,159 @@
+#ifndef RAGDOLL_HPP
+#define RAGDOLL_HPP
+
+#include "scene.hpp"
+#include <vector>
+#include <utility>
+#include <tr1/unordered_set>
+
+// Seconds of simulated time in a step. Steps are always this long, so
+// a run comes out the same however fast it is played
+#define RAGDOLL_STEP ( 1.0 / 60.0 )
+// Each step is integrated in this many pieces, with the constraints
+// solved once in each, which holds joints together better than
+// iterating over them at the full step
+#define RAGDOLL_SUBSTEPS 12
+// How much of a joint's turn past its limits, or of two parts' overlap,
+// is taken back in each substep. All of it overshoots where several
+// constraints meet on one body, and they go on fighting
+#define RAGDOLL_RELAXATION 0.5
+// Scene units a second squared. The puppets are a few units tall, and
+// fall at about the pace a person would
+#define RAGDOLL_GRAVITY 20.0
+// Height the lowest part starts above the ground
+#define RAGDOLL_DROP 1.0
+// How much of the speed along the ground a contact can take away
+#define RAGDOLL_FRICTION 0.6
+// Fraction of their speed bodies lose a second, so they come to rest
+#define RAGDOLL_DAMPING 0.2
+// An island whose bodies all stay under these speeds, in units and
+// radians a second, for this many steps has come to rest, and is not
+// stepped again
+#define RAGDOLL_SLEEP_SPEED 0.05
+#define RAGDOLL_SLEEP_SPIN 0.05
+#define RAGDOLL_SLEEP_STEPS 30
+
+// The puppets of a scene falling limp onto the ground.
+//
+// Every part moved by the same joint is one rigid body, and so is
+// everything above the joints of each puppet. Joints hold their bodies
+// together at the joint's origin and keep them turned within its x and
+// y limits, with no twist. Parts are the ellipsoids CollisionWorld
+// takes them to be, and push each other and the ground apart. Pairs
+// that CollisionWorld leaves out are left out here too.
+//
+// A puppet is an island, with nothing to do with any other, so islands
+// run whole on threads of their own. The threads are started by the
+// first run that wants them and wait between runs, so stepping every
+// frame costs no thread creation. A body's state is one array of each
+// quantity, so the loops that integrate it have no dependencies to
+// vectorize.
+class RagdollRunner;
+
+class Ragdoll {
+public:
+	Ragdoll();
+	~Ragdoll();
+
+	// Take the bodies under root, as it is posed now, at rest above a
+	// ground RAGDOLL_DROP below its lowest part
+	void build( SceneNode* root );
+	bool built() const { return !m_islands.empty(); }
+	void clear();
+
+	size_t bodies() const { return m_inv_mass.size(); }
+	size_t islands() const { return m_islands.size() - 1; }
+
+	// Go on steps steps, on up to threads threads, 0 for every core
+	void run( int steps, int threads = 1 );
+	long steps() const { return m_steps; }
+	// Whether every island has come to rest, so running changes nothing
+	bool at_rest() const;
+
+	// Pose the scene as the bodies are: joints turn to their angles, and
+	// the nodes above the joints move with their bodies
+	void apply() const;
+	// Put the nodes above the joints back where they were at build
+	void restore() const;
+
+private:
+	// Bodies, in tree order, each island's together. Orientations are
+	// quaternions with w first, and the body frame is the principal
+	// axes, so inertia is diagonal in it
+	std::vector<double> m_x[3], m_q[4], m_v[3], m_w[3];
+	std::vector<double> m_old_x[3], m_old_q[4];		// At the start of the substep
+	std::vector<double> m_inv_mass, m_inv_inertia[3];
+	std::vector<int> m_parent;						// The body above, -1 for none
+	std::vector<SceneNode*> m_node;					// The node it carries, with no body above
+	std::vector<Matrix4x4> m_to_node;				// From the body frame to that node's frame
+	std::vector<Matrix4x4> m_above_node;			// Inverse of the frame that node is in
+	std::vector<Matrix4x4> m_saved;					// That node's transformation at build
+
+	// Joints, in tree order, holding child to parent
+	struct Joint {
+		JointNode* node;
+		bool first;									// Instances after the first take its pose
+		int parent, child;
+		double parent_point[3], child_point[3];		// The joint's origin in each body frame
+		double parent_frame[4], child_frame[4];		// Its frame, before and after it turns
+		double x_min, x_max, y_min, y_max;			// Radians
+		Matrix4x4 base;								// Transformation with no turn
+	};
+	std::vector<Joint> m_joints;
+
+	// Parts, in the frame of their body, each island's together
+	std::vector<int> m_part_body;
+	std::vector<double> m_part_centre;				// 3 per part, from the body's centre
+	std::vector<double> m_part_shape;				// 3x3 per part, unit sphere to the part
+	std::vector<double> m_part_reach;				// Furthest any of it is from its centre
+	std::vector<double> m_part_min, m_part_max;		// Bounds for the step, 3 per part
+	std::tr1::unordered_set<unsigned long long> m_ignored;
+	double m_ground;
+
+	// Where each island's bodies, joints and parts start, with the ends
+	// as one more island
+	struct Island {
+		int body, joint, part;
+	};
+	std::vector<Island> m_islands;
+	std::vector<std::vector<int> > m_sorted;		// Each island's parts along x
+	std::vector<std::vector<std::pair<int, int> > > m_pairs;	// That could meet this step
+	// Points pushed apart this substep, b along n away from a, or from
+	// the ground for a of -1, each at r from its body's centre
+	struct Contact {
+		int a, b;
+		double ra[3], rb[3], n[3];
+	};
+	std::vector<std::vector<Contact> > m_contacts;
+	std::vector<int> m_still;						// Steps each island has been at rest for
+	long m_steps;
+	RagdollRunner* m_runner;						// NULL until a run wants threads
+
+	void step( int island );
+	void solve_joints( int island );
+	void solve_pairs( int island );
+	void solve_ground( int island );
+	void settle( int island );
+	void find_pairs( int island, bool moving );
+	bool linked( int a, int b ) const;
+	bool parts_touch( int a, int b ) const;
+	unsigned long long key( int a, int b ) const { return (unsigned long long)a * m_part_body.size() + b; }
+	void note_rest( int island );
+
+	void correct( int a, int b, const double ra[3], const double rb[3], const double n[3], double c );
+	void turn( int a, int b, const double axis[3], double angle );
+	void spin( int body, const double angle[3] );
+	void rotate( int body, const double v[3], double out[3], bool inverse ) const;
+	void inverse_inertia( int body, const double v[3], double out[3] ) const;
+	void part_in_world( int part, double centre[3], double shape[9] ) const;
+	void joint_axes( const Joint& joint, double frame[4], double child[4], double a[3], double b[3] ) const;
+	void joint_angles( const Joint& joint, double& x, double& y, double& z, double frame[4], double child[4] ) const;
+
+	friend class RagdollRunner;
+
+	// The runner's threads hold on to this
+	Ragdoll( const Ragdoll& );
+	Ragdoll& operator=( const Ragdoll& );
+};
+
+#endif
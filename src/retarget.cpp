@@ -0,0 +1,232 @@
+#include "retarget.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+#define TO_DEGREES ( 180.0 / M_PI )
+
+bool load_joint_map( const std::string& filename, JointMap& map )
+{
+	std::ifstream file( filename.c_str() );
+	if ( !file ) {
+		std::cerr << "Error loading " << filename << ": can't open file" << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for ( int number = 1; std::getline( file, line ); number++ ) {
+		std::string::size_type hash = line.find( '#' );
+		if ( hash != std::string::npos ) line.erase( hash );
+		std::istringstream words( line );
+		std::string name, path, extra;
+		if ( !( words >> name ) ) continue;
+		if ( !( words >> path ) || words >> extra ) {
+			std::cerr << "Error loading " << filename << ": expected a joint and a path on line " << number << std::endl;
+			return false;
+		}
+		map[name] = path;
+	}
+	return true;
+}
+
+// The world orientation every joint under root turns from, with every
+// joint at rest at its initial angles, by NodeId. Instancing puts one
+// joint on many paths, the first one found is kept
+static void rest_frames( const SceneNode* root, std::vector<NodeId>& ids, std::vector<Matrix4x4>& frames )
+{
+	std::vector<NodeId> joints;
+	std::vector<int> above;
+	std::vector<Matrix4x4> offsets;
+	root->joint_tree( Matrix4x4(), -1, joints, above, offsets );
+
+	std::vector<Matrix4x4> at_rest( joints.size() );
+	std::vector<bool> seen( SceneNode::id_limit(), false );
+	for ( size_t j = 0; j < joints.size(); j++ ) {
+		// As PoseSampler does, the joint at rest, then turned to its
+		// initial angles
+		const JointNode* joint = JointNode::by_id( joints[j] );
+		Matrix4x4 base = offsets[j] * joint->get_inverse() * joint->rest();
+		if ( above[j] >= 0 ) base = at_rest[above[j]] * base;
+		at_rest[j] = base * rotation_matrix( 'x', joint->get_joint_x().init ) * rotation_matrix( 'y', joint->get_joint_y().init );
+
+		if ( seen[joints[j]] ) continue;
+		seen[joints[j]] = true;
+		ids.push_back( joints[j] );
+		frames.push_back( at_rest[j] );
+	}
+}
+
+// r = a * b, for 3x3
+static void multiply( const double a[3][3], const double b[3][3], double r[3][3] )
+{
+	for ( int i = 0; i < 3; i++ ) {
+		for ( int j = 0; j < 3; j++ ) r[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+	}
+}
+
+static void transpose( const double a[3][3], double r[3][3] )
+{
+	for ( int i = 0; i < 3; i++ ) {
+		for ( int j = 0; j < 3; j++ ) r[i][j] = a[j][i];
+	}
+}
+
+Retarget::Retarget()
+{
+}
+
+void Retarget::clear()
+{
+	m_names.clear();
+	m_frame.clear();
+	m_rest.clear();
+	for ( int k = 0; k < 9; k++ ) m_turn[k].clear();
+	m_source.clear();
+	m_target.clear();
+}
+
+int Retarget::add_source( const std::string& name, const double frame[3][3], const double rest[3][3] )
+{
+	m_names.push_back( name );
+	for ( int i = 0; i < 3; i++ ) {
+		for ( int j = 0; j < 3; j++ ) {
+			m_frame.push_back( frame[i][j] );
+			m_rest.push_back( rest[j][i] );
+		}
+	}
+
+	// At rest, until told otherwise
+	for ( int k = 0; k < 9; k++ ) m_turn[k].push_back( k % 4 == 0 ? 1.0f : 0.0f );
+	return m_names.size() - 1;
+}
+
+void Retarget::add_sources( const SceneNode* root, std::vector<NodeId>& joints )
+{
+	std::vector<NodeId> ids;
+	std::vector<Matrix4x4> frames;
+	rest_frames( root, ids, frames );
+	for ( size_t i = 0; i < ids.size(); i++ ) {
+		const JointNode* joint = JointNode::by_id( ids[i] );
+		joints.push_back( ids[i] );
+		double frame[3][3], rest[3][3];
+		rotation_of( frames[i], frame );
+		rotation_of( rotation_matrix( 'x', joint->get_joint_x().init ) * rotation_matrix( 'y', joint->get_joint_y().init ), rest );
+		add_source( joint->get_name(), frame, rest );
+	}
+}
+
+size_t Retarget::build( const SceneNode* root, const JointMap& map )
+{
+	m_source.clear();
+	m_target.clear();
+	for ( int k = 0; k < 9; k++ ) m_a[k].clear();
+	for ( int k = 0; k < 3; k++ ) m_b[k].clear();
+	m_x_min.clear();
+	m_x_max.clear();
+	m_y_min.clear();
+	m_y_max.clear();
+
+	// Only joints under root may be targets, whatever else glob finds
+	std::vector<NodeId> ids;
+	std::vector<Matrix4x4> frames;
+	rest_frames( root, ids, frames );
+	std::vector<int> place( SceneNode::id_limit(), -1 );
+	for ( size_t i = 0; i < ids.size(); i++ ) place[ids[i]] = i;
+
+	size_t found = 0;
+	for ( size_t s = 0; s < m_names.size(); s++ ) {
+		JointMap::const_iterator mapped = map.find( m_names[s] );
+		std::vector<NodeId> matches;
+		SceneNode::glob( mapped == map.end() ? m_names[s] : mapped->second, root->get_scope(), matches );
+
+		const double (*source_frame)[3] = (const double (*)[3])&m_frame[9 * s];
+		size_t before = m_target.size();
+		for ( size_t i = 0; i < matches.size(); i++ ) {
+			if ( matches[i] >= place.size() || place[matches[i]] < 0 ) continue;
+			const JointNode* joint = JointNode::by_id( matches[i] );
+			if ( !joint ) continue;
+
+			// From the source frame to the target frame, and the target's
+			// turn at rest on top of that
+			double frame[3][3], inverse[3][3], to_target[3][3], rest[3][3], a[3][3];
+			rotation_of( frames[place[matches[i]]], frame );
+			transpose( frame, inverse );
+			multiply( inverse, source_frame, to_target );
+			rotation_of( rotation_matrix( 'x', joint->get_joint_x().init ) * rotation_matrix( 'y', joint->get_joint_y().init ), rest );
+			multiply( rest, to_target, a );
+
+			m_source.push_back( s );
+			m_target.push_back( matches[i] );
+			for ( int k = 0; k < 9; k++ ) m_a[k].push_back( a[k / 3][k % 3] );
+			for ( int k = 0; k < 3; k++ ) m_b[k].push_back( to_target[2][k] );
+			m_x_min.push_back( joint->get_joint_x().min );
+			m_x_max.push_back( joint->get_joint_x().max );
+			m_y_min.push_back( joint->get_joint_y().min );
+			m_y_max.push_back( joint->get_joint_y().max );
+		}
+		if ( m_target.size() > before ) found++;
+	}
+
+	for ( int k = 0; k < 3; k++ ) m_u[k].resize( m_target.size() );
+	m_x.resize( m_target.size() );
+	m_y.resize( m_target.size() );
+	return found;
+}
+
+void Retarget::set_rotation( int source, const double r[3][3] )
+{
+	// The turn from rest, rest inverted times r
+	const double (*rest)[3] = (const double (*)[3])&m_rest[9 * source];
+	double turn[3][3];
+	multiply( rest, r, turn );
+	for ( int k = 0; k < 9; k++ ) m_turn[k][source] = turn[k / 3][k % 3];
+}
+
+void Retarget::set_angles( int source, double x, double y )
+{
+	double r[3][3];
+	rotation_of( rotation_matrix( 'x', x ) * rotation_matrix( 'y', y ), r );
+	set_rotation( source, r );
+}
+
+void Retarget::run()
+{
+	// The target turns as the source does, seen from the world. Only the
+	// last column of its rotation matters for x then y,
+	// a * turn * b, with b the target's z axis in the source frame
+	const size_t n = m_target.size();
+	const int* source = n ? &m_source[0] : NULL;
+	float* u0 = n ? &m_u[0][0] : NULL;
+	float* u1 = n ? &m_u[1][0] : NULL;
+	float* u2 = n ? &m_u[2][0] : NULL;
+	const float* b0 = n ? &m_b[0][0] : NULL;
+	const float* b1 = n ? &m_b[1][0] : NULL;
+	const float* b2 = n ? &m_b[2][0] : NULL;
+	for ( size_t r = 0; r < n; r++ ) {
+		int s = source[r];
+		u0[r] = m_turn[0][s] * b0[r] + m_turn[1][s] * b1[r] + m_turn[2][s] * b2[r];
+		u1[r] = m_turn[3][s] * b0[r] + m_turn[4][s] * b1[r] + m_turn[5][s] * b2[r];
+		u2[r] = m_turn[6][s] * b0[r] + m_turn[7][s] * b1[r] + m_turn[8][s] * b2[r];
+	}
+
+	// Everything from here is row by row, so vectorizes
+	for ( size_t r = 0; r < n; r++ ) {
+		float v0 = u0[r], v1 = u1[r], v2 = u2[r];
+		u0[r] = m_a[0][r] * v0 + m_a[1][r] * v1 + m_a[2][r] * v2;
+		u1[r] = m_a[3][r] * v0 + m_a[4][r] * v1 + m_a[5][r] * v2;
+		u2[r] = m_a[6][r] * v0 + m_a[7][r] * v1 + m_a[8][r] * v2;
+	}
+	for ( size_t r = 0; r < n; r++ ) {
+		float x = atan2f( -u1[r], u2[r] ) * (float)TO_DEGREES;
+		float y = asinf( std::max( -1.0f, std::min( 1.0f, u0[r] ) ) ) * (float)TO_DEGREES;
+		m_x[r] = std::max( m_x_min[r], std::min( m_x_max[r], x ) );
+		m_y[r] = std::max( m_y_min[r], std::min( m_y_max[r], y ) );
+	}
+}
+
+void Retarget::apply() const
+{
+	for ( size_t r = 0; r < m_target.size(); r++ ) JointNode::by_id( m_target[r] )->set_angles( m_x[r], m_y[r] );
+}
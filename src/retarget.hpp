@@ -0,0 +1,76 @@
+#ifndef RETARGET_HPP
+#define RETARGET_HPP
+
+#include "scene.hpp"
+#include <string>
+#include <vector>
+#include <map>
+
+// Names of the joints a clip was authored on, to the scene paths, as
+// SceneNode::glob takes them, of the joints they pose
+typedef std::map<std::string, std::string> JointMap;
+
+// Read a map from a file of a joint name and a scene path to a line,
+// with # starting a comment. Returns false if it can't be read
+bool load_joint_map( const std::string& filename, JointMap& map );
+
+// Poses the joints of one rig from those of another, which need not
+// share their hierarchy, names or rest pose.
+//
+// Each source joint poses the joints under the target's root its name
+// finds, or that a map gives for it, so a pattern can pose the same
+// joint of every puppet in a crowd. Whatever turn a source joint makes
+// from its rest pose, seen from the world, its targets make from
+// theirs. That is then taken apart into angles about x and y, dropping
+// any twist, and clamped to the target's limits.
+//
+// All that depends only on the two rigs is worked out once by build,
+// into a table with a row for every target, one array per quantity.
+// A frame is then a flat pass down the rows with no lookups or
+// branches, and a crowd is just more rows.
+class Retarget {
+public:
+	Retarget();
+
+	// A joint of the rig clips are authored on, by its rotation at rest
+	// and the world orientation it turns from there. Both are the
+	// identity for a BVH joint. Returns its index
+	int add_source( const std::string& name, const double frame[3][3], const double rest[3][3] );
+	// Every joint of the puppet under root, at rest at its initial
+	// angles, and its NodeId into joints, in the order of their indices
+	void add_sources( const SceneNode* root, std::vector<NodeId>& joints );
+	size_t sources() const { return m_names.size(); }
+	void clear();
+
+	// Find the targets of each source joint among the joints under root,
+	// and work out the table. Returns how many source joints found any
+	size_t build( const SceneNode* root, const JointMap& map );
+	size_t targets() const { return m_target.size(); }
+
+	// Source joint's rotation from its parent this frame, as a matrix or
+	// as a puppet's joint turns, about x then y
+	void set_rotation( int source, const double r[3][3] );
+	void set_angles( int source, double x, double y );
+
+	// Work out the angles of every target from the sources
+	void run();
+	// Pose the targets as the last run worked out
+	void apply() const;
+
+private:
+	// Sources
+	std::vector<std::string> m_names;
+	std::vector<double> m_frame, m_rest;			// 3x3 each, rest inverted
+	std::vector<float> m_turn[9];					// From rest this frame, one array per element
+
+	// The table
+	std::vector<int> m_source;
+	std::vector<NodeId> m_target;
+	std::vector<float> m_a[9];						// Target's rest times source frame to target frame
+	std::vector<float> m_b[3];						// Target's z axis in the source frame
+	std::vector<float> m_x_min, m_x_max, m_y_min, m_y_max;
+	std::vector<float> m_u[3];						// Scratch for run
+	std::vector<float> m_x, m_y;					// Degrees, from run
+};
+
+#endif
@@ -1,34 +1,260 @@
 #include "scene.hpp"
+#include "profiler.hpp"
+#include "metrics.hpp"
+#include "node_set.hpp"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <fnmatch.h>
+#include <cstdlib>
+#include <tr1/unordered_map>
 
 #ifndef TO_RADIAN
 #define TO_RADIAN M_PI / 180.0
 #endif
 
+// The first chunk is always there, for NO_NODE
+static SceneNode* first_chunk[REGISTRY_CHUNK];
+SceneNode** SceneNode::s_registry[REGISTRY_CHUNKS] = { first_chunk };
+volatile gint SceneNode::s_limit = 1;
+
+// Guards making and deleting nodes and the name index, readers of the
+// registry go without
+static Glib::StaticMutex registry_lock = GLIBMM_STATIC_MUTEX_INIT;
+// Numbers of deleted nodes, to give out again
+static std::vector<NodeId> free_ids;
+// The next number never given out, which may be ahead of s_limit
+// while nodes are being made
+static NodeId next_id = 1;
+// Where the nodes this thread makes are recorded, if anywhere
+static __thread std::vector<NodeId>* recorded_nodes = NULL;
+
+// The scope the nodes this thread makes go in, and the last given out
+static __thread unsigned int thread_scope = NO_SCOPE;
+static unsigned int last_scope = NO_SCOPE;
+
+// IDs of the nodes with each name, in the order they were made
+typedef std::tr1::unordered_map<std::string, std::vector<NodeId> > NameIndex;
+static NameIndex name_index;
+
+NodeId SceneNode::reserve_id()
+{
+	Glib::StaticMutex::Lock lock( registry_lock );
+	if ( !free_ids.empty() ) {
+		NodeId id = free_ids.back();
+		free_ids.pop_back();
+		return id;
+	}
+	NodeId id = next_id;
+	if ( ( id >> REGISTRY_CHUNK_BITS ) >= REGISTRY_CHUNKS ) {
+		std::cerr << "Too many scene nodes, at most " << REGISTRY_CHUNKS * REGISTRY_CHUNK << std::endl;
+		abort();
+	}
+	SceneNode**& chunk = s_registry[id >> REGISTRY_CHUNK_BITS];
+	if ( !chunk ) chunk = new SceneNode*[REGISTRY_CHUNK]();
+	next_id++;
+	return id;
+}
+
+void SceneNode::publish()
+{
+	Glib::StaticMutex::Lock lock( registry_lock );
+	s_registry[m_id >> REGISTRY_CHUNK_BITS][m_id & ( REGISTRY_CHUNK - 1 )] = this;
+	// Only now can another thread find the number
+	if ( m_id >= (NodeId)s_limit ) g_atomic_int_set( &s_limit, m_id + 1 );
+	if ( recorded_nodes ) recorded_nodes->push_back( m_id );
+	name_index[m_name].push_back( m_id );
+}
+
+void SceneNode::record_nodes(std::vector<NodeId>* made)
+{
+	recorded_nodes = made;
+}
+
+unsigned int SceneNode::enter_scope()
+{
+	Glib::StaticMutex::Lock lock( registry_lock );
+	thread_scope = ++last_scope;
+	return thread_scope;
+}
+
+void SceneNode::leave_scope()
+{
+	thread_scope = NO_SCOPE;
+}
+
+unsigned int SceneNode::current_scope()
+{
+	return thread_scope;
+}
+
+void SceneNode::destroy(const std::vector<NodeId>& ids)
+{
+	std::vector<bool> doomed( id_limit(), false );
+	for ( size_t i = 0; i < ids.size(); i++ ) doomed[ids[i]] = true;
+	// Children going too are let go of first, so no node is touched
+	// after it is deleted
+	for ( size_t i = 0; i < ids.size(); i++ ) {
+		SceneNode* node = by_id( ids[i] );
+		for ( ChildList::iterator it = node->m_children.begin(); it != node->m_children.end(); ) {
+			if ( doomed[(*it)->m_id] ) it = node->m_children.erase( it );
+			else it++;
+		}
+	}
+	for ( size_t i = 0; i < ids.size(); i++ ) delete by_id( ids[i] );
+}
+
 SceneNode::SceneNode(const std::string& name)
-	: m_name(name)
+	: m_id(reserve_id()), m_name(name), m_scope(thread_scope), m_parents(0)
 {
 	rotation = Vector3D();
 	changed = true;				// The normal has to be calculated for the first time
+	publish();
+}
+
+SceneNode::SceneNode(const std::string& name, Unpublished)
+	: m_id(reserve_id()), m_name(name), m_scope(thread_scope), m_parents(0)
+{
+	rotation = Vector3D();
+	changed = true;
+}
+
+SceneNode::SceneNode(const SceneNode& other)
+	: rotation(other.rotation), m_id(reserve_id()), m_name(other.m_name),
+	  m_scope(thread_scope), m_trans(other.m_trans), m_invtrans(other.m_invtrans),
+	  m_parents(0), changed(other.changed)
+{
+	publish();
+}
+
+SceneNode::SceneNode(const SceneNode& other, Unpublished)
+	: rotation(other.rotation), m_id(reserve_id()), m_name(other.m_name),
+	  m_scope(thread_scope), m_trans(other.m_trans), m_invtrans(other.m_invtrans),
+	  m_parents(0), changed(other.changed)
+{
 }
 
 SceneNode::~SceneNode()
 {
+	for ( ChildList::iterator it = m_children.begin(); it != m_children.end(); it++ ) (*it)->m_parents--;
+
+	Glib::StaticMutex::Lock lock( registry_lock );
+	s_registry[m_id >> REGISTRY_CHUNK_BITS][m_id & ( REGISTRY_CHUNK - 1 )] = NULL;
+	free_ids.push_back( m_id );
+
+	// A node whose constructor threw was never published
+	NameIndex::iterator named = name_index.find(m_name);
+	if (named == name_index.end()) return;
+	std::vector<NodeId>& ids = named->second;
+	std::vector<NodeId>::iterator it = std::find(ids.begin(), ids.end(), m_id);
+	if (it != ids.end()) ids.erase(it);
+	if (ids.empty()) name_index.erase(named);
+}
+
+void SceneNode::mark_subtree(std::vector<bool>& reached) const
+{
+	if (reached[m_id]) return;
+	reached[m_id] = true;
+	for (ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++) {
+		(*it)->mark_subtree(reached);
+	}
+}
+
+// Add the nodes in scope out of those listed, under the registry lock
+static void add_in_scope(const std::vector<NodeId>& listed, unsigned int scope, std::vector<NodeId>& ids)
+{
+	for (size_t i = 0; i < listed.size(); i++) {
+		if (SceneNode::by_id(listed[i])->get_scope() == scope) ids.push_back(listed[i]);
+	}
+}
+
+void SceneNode::find_all(const std::string& name, unsigned int scope, std::vector<NodeId>& ids)
+{
+	Glib::StaticMutex::Lock lock( registry_lock );
+	ids.clear();
+	NameIndex::const_iterator it = name_index.find(name);
+	if (it != name_index.end()) add_in_scope(it->second, scope, ids);
+}
+
+void SceneNode::glob(const std::string& path, unsigned int scope, std::vector<NodeId>& ids)
+{
+	ids.clear();
+
+	std::vector<std::string> names;
+	std::string::size_type start = 0;
+	while (start <= path.size()) {
+		std::string::size_type slash = std::min(path.find('/', start), path.size());
+		if (slash > start) names.push_back(path.substr(start, slash - start));
+		start = slash + 1;
+	}
+	if (names.empty()) return;
+
+	// The first name comes from the index, straight away unless it is a pattern
+	Glib::StaticMutex::Lock lock( registry_lock );
+	if (names[0].find_first_of("*?[\\") == std::string::npos) {
+		NameIndex::const_iterator it = name_index.find(names[0]);
+		if (it != name_index.end()) add_in_scope(it->second, scope, ids);
+	} else {
+		for (NameIndex::const_iterator it = name_index.begin(); it != name_index.end(); it++) {
+			if (fnmatch(names[0].c_str(), it->first.c_str(), 0) == 0) add_in_scope(it->second, scope, ids);
+		}
+	}
+	// Numbers are given out again, so the order made is not the order of number
+	std::sort(ids.begin(), ids.end());
+	if (path[0] == '/') {
+		std::vector<NodeId> roots;
+		for (size_t i = 0; i < ids.size(); i++) {
+			if (by_id(ids[i])->m_parents == 0) roots.push_back(ids[i]);
+		}
+		ids.swap(roots);
+	}
+
+	// The rest from the children of what matched the name before
+	for (size_t n = 1; n < names.size() && !ids.empty(); n++) {
+		std::vector<NodeId> matches;
+		for (size_t i = 0; i < ids.size(); i++) {
+			const ChildList& children = by_id(ids[i])->m_children;
+			for (ChildList::const_iterator it = children.begin(); it != children.end(); it++) {
+				if (fnmatch(names[n].c_str(), (*it)->m_name.c_str(), 0) == 0) matches.push_back((*it)->m_id);
+			}
+		}
+		// Shared subtrees are reached more than once
+		std::sort(matches.begin(), matches.end());
+		matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+		ids.swap(matches);
+	}
+}
+
+SceneNode* SceneNode::find(const std::string& path, unsigned int scope)
+{
+	std::vector<NodeId> ids;
+	glob(path, scope, ids);
+	return ids.empty() ? NULL : by_id(ids[0]);
+}
+
+void SceneNode::walk_gl(const Matrix4x4& frame, bool picking) const
+{
+	Metrics::add( METRIC_NODES_VISITED );
+	// Walk through the children, each in our frame with its own transformation on top
+	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
+		(*it)->walk_gl( frame * (*it)->get_transform(), picking ); 			// Walk down the hierachy 
+	}
+}
+
+SceneNode* SceneNode::clone() const
+{
+	SceneNode* copy = new SceneNode( *this );
+	clone_children( copy );
+	return copy;
 }
 
-void SceneNode::walk_gl(bool picking) const
+void SceneNode::clone_children(SceneNode* copy) const
 {
-	// Walk through the child and apply the transformation
-	// REMEMBER!!! OpenGL matrix is column-major, so transpose our matrix before multiply
+	copy->m_children.clear();
 	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
-		glMatrixMode( GL_MODELVIEW );
-		glPushMatrix();
-		glMultMatrixd( get_transform().transpose().begin() ); 				// Apply the transformation 
-		(*it)->walk_gl(picking); 											// Walk down the hierachy 
-		glPopMatrix();
+		copy->add_child( (*it)->clone() );
 	}
-	
+	copy->changed = true;
 }
 
 void SceneNode::rotate(char axis, double angle) 
@@ -36,40 +262,26 @@ void SceneNode::rotate(char axis, double angle)
 #ifdef DEBUG1
 	std::cerr << "Stub: Rotate " << m_name << " around " << axis << " by " << angle << std::endl;
 #endif
-	Matrix4x4 r;
-	double angle_radian = TO_RADIAN * angle;
 	switch ( axis ) {
 	case 'x':
 		rotation[0] += angle;
 		if ( rotation[0] > 360.0 ) rotation[0] -= 360.0;
 		if ( rotation[0] < -360.0 ) rotation[0] += 360.0;
-		r[1][1] = cos( angle_radian );
-		r[1][2] = -sin( angle_radian );
-		r[2][1] = sin( angle_radian );
-		r[2][2] = cos( angle_radian);
 		break;
 	case 'y':
 		rotation[1] += angle;
 		if ( rotation[1] > 360.0 ) rotation[1] -= 360.0;
 		if ( rotation[1] < -360.0 ) rotation[1] += 360.0;
-		r[0][0] = cos( angle_radian );
-		r[0][2] = sin( angle_radian );
-		r[2][0] = -sin( angle_radian );
-		r[2][2] = cos( angle_radian );
 		break;
 	case 'z':
-		r[0][0] = cos( angle_radian );
-		r[0][1] = -sin( angle_radian );
-		r[1][0] = sin( angle_radian );
-		r[1][1] = cos( angle_radian );
 		break;
 	default:
 		std::cerr << "Error while rotating" << std::endl;
-		break;
+		return;
 	}
 
 	// Apply the rotation
-	set_transform( m_trans * r );
+	set_transform( m_trans * rotation_matrix( axis, angle ), rotation_matrix( axis, -angle ) * m_invtrans );
 
 	// Indicate the node has changed
 	hasChanged();
@@ -83,13 +295,9 @@ void SceneNode::scale(const Vector3D& amount)
 #ifdef DEBUG1
 	std::cerr << "Stub: Scale " << m_name << " by " << amount << std::endl;
 #endif
-	Matrix4x4 s;
-	s[0][0] = amount[0];
-	s[1][1] = amount[1];
-	s[2][2] = amount[2];
-  
 	// Apply scaling
-	set_transform( m_trans * s );
+	Vector3D inverse( 1.0 / amount[0], 1.0 / amount[1], 1.0 / amount[2] );
+	set_transform( m_trans * scaling_matrix( amount ), scaling_matrix( inverse ) * m_invtrans );
 
 	// Indicate the node has changed
 	hasChanged();
@@ -100,63 +308,225 @@ void SceneNode::translate(const Vector3D& amount)
 #ifdef DEBUG1
 	std::cerr << "Stub: Translate " << m_name << " by " << amount << std::endl;
 #endif
-	Matrix4x4 t;
-	t[0][3] = amount[0];
-	t[1][3] = amount[1];
-	t[2][3] = amount[2];
-
 	// Apply translation
-	set_transform( m_trans * t );
+	set_transform( m_trans * translation_matrix( amount ), translation_matrix( -amount ) * m_invtrans );
 
 	// Indicate the node has changed
 	hasChanged();
 }
 
+void SceneNode::apply_transform(const Matrix4x4& m, const Matrix4x4& inverse, const Vector3D& angles)
+{
+	set_transform( m_trans * m, inverse * m_invtrans );
+	for ( int i = 0; i < 2; i++ ) {
+		rotation[i] += angles[i];
+		if ( rotation[i] > 360.0 ) rotation[i] -= 360.0;
+		if ( rotation[i] < -360.0 ) rotation[i] += 360.0;
+	}
+	hasChanged();
+}
+
+void hash_matrix(unsigned long long& hash, const Matrix4x4& m)
+{
+	const double* values = m.begin();
+	for ( int i = 0; i < 16; i++ ) {
+		double value = values[i] == 0.0 ? 0.0 : values[i];
+		const unsigned char* bytes = (const unsigned char*)&value;
+		for ( size_t b = 0; b < sizeof( double ); b++ ) hash = ( hash ^ bytes[b] ) * 1099511628211ULL;
+	}
+}
+
+void SceneNode::hash_pose( unsigned long long& hash ) const
+{
+	hash_matrix( hash, m_trans );
+	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
+		(*it)->hash_pose( hash );
+	}
+}
+
+void SceneNode::set_transform(const Matrix4x4& m)
+{
+	m_trans = m;
+	m_invtrans = m.invert();
+	Metrics::add( METRIC_INVERSIONS );
+}
+
+Matrix4x4 rotation_matrix(char axis, double angle)
+{
+	Matrix4x4 r;
+	double angle_radian = TO_RADIAN * angle;
+	switch ( axis ) {
+	case 'x':
+		r[1][1] = cos( angle_radian );
+		r[1][2] = -sin( angle_radian );
+		r[2][1] = sin( angle_radian );
+		r[2][2] = cos( angle_radian);
+		break;
+	case 'y':
+		r[0][0] = cos( angle_radian );
+		r[0][2] = sin( angle_radian );
+		r[2][0] = -sin( angle_radian );
+		r[2][2] = cos( angle_radian );
+		break;
+	case 'z':
+		r[0][0] = cos( angle_radian );
+		r[0][1] = -sin( angle_radian );
+		r[1][0] = sin( angle_radian );
+		r[1][1] = cos( angle_radian );
+		break;
+	default:
+		break;
+	}
+	return r;
+}
+
+Matrix4x4 scaling_matrix(const Vector3D& amount)
+{
+	Matrix4x4 s;
+	s[0][0] = amount[0];
+	s[1][1] = amount[1];
+	s[2][2] = amount[2];
+	return s;
+}
+
+Matrix4x4 translation_matrix(const Vector3D& amount)
+{
+	Matrix4x4 t;
+	t[0][3] = amount[0];
+	t[1][3] = amount[1];
+	t[2][3] = amount[2];
+	return t;
+}
+
 bool SceneNode::is_joint() const
 {
 	return false;
 }
 
-void SceneNode::findJoints( std::map<unsigned int, Info> &sj ) {
+bool SceneNode::is_geometry() const
+{
+	return false;
+}
+
+void SceneNode::findJoints( std::vector<NodeId> &joints ) const {
+	std::vector<bool> seen( id_limit(), false );
+	find_joints( joints, seen );
+}
+
+void SceneNode::find_joints( std::vector<NodeId>& joints, std::vector<bool>& seen ) const {
+	// A shared subtree gives the same joints every time it is reached
+	if ( seen[m_id] ) return;
+	seen[m_id] = true;
+	if ( this->is_joint() ) joints.push_back( m_id );
+	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
+		(*it)->find_joints( joints, seen );
+	}
+}
+
+void SceneNode::joint_origins( const Matrix4x4& parent, std::vector<NodeId>& ids,
+							   std::vector<float>& x, std::vector<float>& y, std::vector<float>& z ) const {
+	// The same frame walk_gl draws children in
+	Matrix4x4 frame = parent * m_trans;
+	if ( this->is_joint() ) {
+		ids.push_back( m_id );
+		x.push_back( frame[0][3] );
+		y.push_back( frame[1][3] );
+		z.push_back( frame[2][3] );
+	}
+	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
+		(*it)->joint_origins( frame, ids, x, y, z );
+	}
+}
+
+void SceneNode::joint_tree( const Matrix4x4& parent, int above, std::vector<NodeId>& joints,
+							std::vector<int>& aboves, std::vector<Matrix4x4>& offsets ) const {
+	Matrix4x4 frame = parent * m_trans;
+	if ( this->is_joint() ) {
+		joints.push_back( m_id );
+		aboves.push_back( above );
+		offsets.push_back( frame );
+		above = joints.size() - 1;
+		frame = Matrix4x4();
+	}
+	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
+		(*it)->joint_tree( frame, above, joints, aboves, offsets );
+	}
+}
+
+void SceneNode::flatten( int parent, std::vector<const SceneNode*>& nodes, std::vector<int>& parents ) const {
+	nodes.push_back( this );
+	parents.push_back( parent );
+	parent = nodes.size() - 1;
+	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
+		(*it)->flatten( parent, nodes, parents );
+	}
+}
+
+bool SceneNode::find_path( NodeId id, std::vector<SceneNode*>& path ) {
+	path.push_back( this );
+	if ( m_id == id ) return true;
 	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
-		if ( this->is_joint() ) {
-			Info temp;
-			temp.old_m_trans = get_transform();
-			temp.old_rotation = rotation;
-			sj.insert( std::pair<unsigned int, Info>( (unsigned int)this, temp ) );
+		if ( (*it)->find_path( id, path ) ) return true;
+	}
+	path.pop_back();
+	return false;
+}
+
+void SceneNode::select_subtrees( NodeSet& selection, bool below ) const {
+	if ( this->is_joint() ) {
+		if ( below ) {
+			selection.insert( m_id );
+		} else {
+			below = selection.contains( m_id );
 		}
-		(*it)->findJoints( sj );
+	}
+	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
+		(*it)->select_subtrees( selection, below );
 	}
 }
 
 JointNode::JointNode(const std::string& name)
-	: SceneNode(name)
+	: SceneNode(name, UNPUBLISHED), m_rest_kept(false)
 {
 	picked = false;
+	publish();
+}
+
+JointNode::JointNode(const JointNode& other)
+	: SceneNode(other, UNPUBLISHED), m_joint_x(other.m_joint_x), m_joint_y(other.m_joint_y),
+	  m_rest(other.m_rest), m_rest_kept(other.m_rest_kept)
+{
+	picked = false;
+	publish();
 }
 
 JointNode::~JointNode()
 {
 }
 
-void JointNode::walk_gl(bool picking) const
+void JointNode::walk_gl(const Matrix4x4& frame, bool picking) const
 {
-	// Walk through the child and apply the transformation
-	// REMEMBER!!! OpenGL matrix is column-major, so transpose our matrix before multiply
-	glPushName( (unsigned int)this ); // Using the address of the node as name for easy retrieval
+	Metrics::add( METRIC_NODES_VISITED );
+	// Walk through the children, each in our frame with its own transformation on top
+	glPushName( m_id ); // Using the ID of the node as name for easy retrieval
 	for ( ChildList::const_iterator it = m_children.begin(); it != m_children.end(); it++ ) {
-		glPushMatrix();
-		glMultMatrixd( get_transform().transpose().begin() ); // Apply the transformation
+		Matrix4x4 child = frame * (*it)->get_transform();
 		if ( picking && !( (*it)->is_joint() ) ) {			  // Only apply the picking if our next node is not a joint
-			(*it)->walk_gl( picked );
+			(*it)->walk_gl( child, picked );
 		} else {
-			(*it)->walk_gl( picking );						  // Walk down the hierachy 
+			(*it)->walk_gl( child, picking );				  // Walk down the hierachy 
 		}
-		glPopMatrix();
 	}
 	glPopName();
 }
 
+JointNode* JointNode::clone() const
+{
+	JointNode* copy = new JointNode( *this );
+	clone_children( copy );
+	return copy;
+}
+
 bool JointNode::is_joint() const
 {
 	return true;
@@ -202,30 +572,144 @@ void JointNode::checkLimits() {
 	}	
 }
 
+Matrix4x4 JointNode::rest() const {
+	if ( m_rest_kept ) return m_rest;
+	return m_trans * rotation_matrix( 'y', -rotation[1] ) * rotation_matrix( 'x', -rotation[0] );
+}
+
+void JointNode::keep_rest() {
+	if ( m_rest_kept ) return;
+	m_rest = rest();
+	m_rest_kept = true;
+}
+
+void JointNode::rotate_limited(double x, double y) {
+	// From rest to the new angles, not x and y on top of the last turn,
+	// so the transformation is always the one the angles say
+	set_angles( rotation[0] + x, rotation[1] + y );
+}
+
+void JointNode::set_angles(double x, double y) {
+	x = std::max( m_joint_x.min, std::min( m_joint_x.max, x ) );
+	y = std::max( m_joint_y.min, std::min( m_joint_y.max, y ) );
+	if ( x == rotation[0] && y == rotation[1] ) return;
+
+	// From the rest transformation, so turns build up no error
+	keep_rest();
+	set_transform( m_rest * rotation_matrix( 'x', x ) * rotation_matrix( 'y', y ) );
+	set_rotation( Vector3D( x, y, 0.0 ) );
+	hasChanged();
+}
+
+// Angle from a to b in degrees, between -180 and 180
+static double angle_between( double a, double b )
+{
+	double angle = ( b - a ) / ( TO_RADIAN );
+	if ( angle > 180.0 ) angle -= 360.0;
+	if ( angle < -180.0 ) angle += 360.0;
+	return angle;
+}
+
+void JointNode::turn_towards(const Point3D& below, const Point3D& towards) {
+	// Too close to an axis, turning about it does nothing useful
+	const double epsilon = 1e-9;
+
+	// Both in the frame before the y turn, which x turns the point in
+	Point3D point = rotation_matrix( 'y', rotation[1] ) * below;
+	Point3D target = rotation_matrix( 'y', rotation[1] ) * towards;
+
+	// Turning about x moves the point around the yz plane
+	double x = 0.0;
+	if ( point[1] * point[1] + point[2] * point[2] > epsilon && target[1] * target[1] + target[2] * target[2] > epsilon ) {
+		x = angle_between( atan2( point[2], point[1] ), atan2( target[2], target[1] ) );
+		x = std::max( m_joint_x.min, std::min( m_joint_x.max, rotation[0] + x ) ) - rotation[0];
+	}
+
+	// Then about y, from the frame turning about x left us in, around the zx plane
+	Point3D turned = rotation_matrix( 'x', -x ) * target;
+	double y = 0.0;
+	if ( point[2] * point[2] + point[0] * point[0] > epsilon && turned[2] * turned[2] + turned[0] * turned[0] > epsilon ) {
+		y = angle_between( atan2( point[0], point[2] ), atan2( turned[0], turned[2] ) );
+	}
+
+	rotate_limited( x, y );
+}
+
+// What geometry is drawn with until it is given a material of its own
+static PhongMaterial default_material( Colour( 0.7, 0.7, 0.7 ), Colour( 0.0, 0.0, 0.0 ), 10.0 );
+
 GeometryNode::GeometryNode(const std::string& name, Primitive* primitive)
-	: SceneNode(name),
+	: SceneNode(name, UNPUBLISHED),
+	  m_material(&default_material),
 	  m_primitive(primitive)
 {
+	publish();
+}
+
+GeometryNode::GeometryNode(const GeometryNode& other)
+	: SceneNode(other, UNPUBLISHED),
+	  m_material(other.m_material),
+	  m_primitive(other.m_primitive)
+{
+	publish();
+}
+
+void GeometryNode::set_material(Material* material)
+{
+	m_material = material ? material : &default_material;
 }
 
 GeometryNode::~GeometryNode()
 {
 }
 
-void GeometryNode::walk_gl(bool picking) const
+int GeometryNode::select_lod(const Matrix4x4& frame) const
+{
+	double pixels_per_unit = Primitive::get_pixels_per_unit();
+	if ( pixels_per_unit <= 0.0 || m_primitive->lod_count() <= 1 ) return 0;
+
+	// Our origin and axes in eye space are the last column and the others
+	double depth = -frame[2][3];
+	if ( depth <= 0.0 ) return 0;
+
+	// The longest axis bounds how far the primitive is stretched
+	double scale = 0.0;
+	for ( int c = 0; c < 3; c++ ) {
+		scale = std::max( scale, frame[0][c] * frame[0][c] + frame[1][c] * frame[1][c] + frame[2][c] * frame[2][c] );
+	}
+	scale = sqrt( scale );
+
+	return m_primitive->select_lod( pixels_per_unit * scale * m_primitive->get_radius() / depth );
+}
+
+GeometryNode* GeometryNode::clone() const
 {
+	// Copying the pointers is what shares the primitive and the material
+	GeometryNode* copy = new GeometryNode( *this );
+	clone_children( copy );
+	return copy;
+}
+
+bool GeometryNode::is_geometry() const
+{
+	return true;
+}
+
+void GeometryNode::walk_gl(const Matrix4x4& frame, bool picking) const
+{
+	Metrics::add( METRIC_NODES_VISITED );
 	// Draw the actual sphere
-	// REMEMBER!!! OpenGL matrix is column-major, so transpose our matrix before multiply
-	glPushMatrix();
-	glMultMatrixd( get_transform().transpose().begin() );
-	glPushName( (unsigned int)this );	// Use the address of the node as it's name for easy retrieval
-	m_material->apply_gl();				// Apply material
-	if ( changed ) {
-		m_primitive->hasChanged();		// If the primitive has changed, inform.
-		changed = false;
-	}
-	m_primitive->walk_gl(picking);		// Apply primitive
+	// REMEMBER!!! OpenGL matrix is column-major, so transpose our matrix before loading it
+	glLoadMatrixd( frame.transpose().begin() );
+	glPushName( m_id );	// Use the ID of the node as it's name for easy retrieval
+	{
+		ScopedTimer timer( PROFILE_MATERIAL );
+		m_material->apply_gl();			// Apply material
+	}
+	{
+		ScopedTimer timer( PROFILE_PRIMITIVE );
+		m_primitive->walk_gl_lod(picking, select_lod(frame));	// Apply primitive
+	}
 	glPopName();
-	glPopMatrix();
 }
  
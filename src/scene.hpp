@@ -5,23 +5,101 @@
 #include "algebra.hpp"
 #include "primitive.hpp"
 #include "material.hpp"
-#include <map>
+#include <vector>
+#include <glibmm.h>
+
+// Every node is numbered when it is made, from 1, and picking,
+// selection and the undo stack know it by that number. The number of
+// a deleted node goes to the next node made, so numbers stay dense
+// however many nodes come and go; hold on to one no longer than to
+// its node.
+typedef unsigned int NodeId;
+#define NO_NODE 0
+
+// Each import makes its nodes in a scope of its own, and names are
+// only looked up within one scope, so a scene never finds nodes of
+// another. Nodes made outside any import are in NO_SCOPE
+#define NO_SCOPE 0
+
+// The registry is allocated a chunk at a time and a chunk never moves,
+// which caps the number of nodes at REGISTRY_CHUNKS * REGISTRY_CHUNK
+#define REGISTRY_CHUNK_BITS 12
+#define REGISTRY_CHUNK ( 1 << REGISTRY_CHUNK_BITS )
+#define REGISTRY_CHUNKS 4096
+
+class NodeSet;
 
 class SceneNode {
 public:
 	SceneNode(const std::string& name);
+	// Copies get a number of their own, and no children
+	SceneNode(const SceneNode& other);
 	virtual ~SceneNode();
 
-	virtual void walk_gl(bool picking = false) const;
+	NodeId get_id() const { return m_id; }
+
+	// The node numbered id, NULL if there is none. Any thread may look
+	// nodes up while another makes them: the registry only grows by
+	// whole chunks, and a number is published after its node is stored.
+	static SceneNode* by_id(NodeId id)
+	{
+		return id < id_limit() ? s_registry[id >> REGISTRY_CHUNK_BITS][id & ( REGISTRY_CHUNK - 1 )] : NULL;
+	}
+	// One more than the highest number published so far
+	static NodeId id_limit() { return g_atomic_int_get( &s_limit ); }
+
+	// Append the number of every node this thread makes to made, until
+	// called again with NULL, so an import knows what it made
+	static void record_nodes(std::vector<NodeId>* made);
+
+	// Delete the nodes numbered ids, which may be each other's children
+	static void destroy(const std::vector<NodeId>& ids);
+
+	// A scope no node is in yet, for the nodes this thread makes from
+	// now on until leave_scope
+	static unsigned int enter_scope();
+	static void leave_scope();
+	// The scope this thread is making nodes in
+	static unsigned int current_scope();
+	unsigned int get_scope() const { return m_scope; }
+
+	// Set reached for every node in this subtree
+	void mark_subtree(std::vector<bool>& reached) const;
+
+	// Every node in scope named name, in the order they were made.
+	// Names are hashed as nodes are made and deleted, so this takes no
+	// search
+	static void find_all(const std::string& name, unsigned int scope, std::vector<NodeId>& ids);
+
+	// Nodes in scope down a path of names separated by '/', in order of
+	// number. Each name may be a glob pattern as for fnmatch(3).
+	// A path starting with '/' starts from a node with no parent,
+	// otherwise from anywhere, so "arm*/hand" is every node named hand
+	// under a node whose name starts with arm. Instancing shares
+	// subtrees, so one node may be on many paths. Safe while another
+	// thread makes nodes, though not while it changes the same tree.
+	static void glob(const std::string& path, unsigned int scope, std::vector<NodeId>& ids);
+
+	// The first node glob finds, NULL if there is none
+	static SceneNode* find(const std::string& path, unsigned int scope);
+
+	// Draw this subtree. frame is the modelview to draw this node in,
+	// its own transformation included; it is carried down on the CPU
+	// and only loaded into OpenGL where there is geometry to draw
+	virtual void walk_gl(const Matrix4x4& frame, bool picking = false) const;
+
+	// Deep copy of the hierarchy below this node. Primitives and
+	// materials are shared with the original rather than copied.
+	virtual SceneNode* clone() const;
 
 	const Matrix4x4& get_transform() const { return m_trans; }
 	const Matrix4x4& get_inverse() const { return m_invtrans; }
   
-	void set_transform(const Matrix4x4& m)
-	{
-		m_trans = m;
-		m_invtrans = m.invert();
-	}
+	// The inverse is always kept up to date with the transformation, so
+	// reading it never changes the node. Pass it in when it is known:
+	// the calls below build it from the inverses of their steps, so a
+	// scene script issuing many transforms never inverts a matrix
+	void set_transform(const Matrix4x4& m);
 
 	void set_transform(const Matrix4x4& m, const Matrix4x4& i)
 	{
@@ -32,24 +110,38 @@ public:
 	void add_child(SceneNode* child)
 	{
 		m_children.push_back(child);
+		child->m_parents++;
 	}
 
 	void remove_child(SceneNode* child)
 	{
+		size_t before = m_children.size();
 		m_children.remove(child);
+		child->m_parents -= before - m_children.size();
 	}
 
+	// False for the top of a tree
+	bool has_parent() const { return m_parents > 0; }
+
 	// Callbacks to be implemented.
 	// These will be called from Lua.
 	void rotate(char axis, double angle);
 	void scale(const Vector3D& amount);
 	void translate(const Vector3D& amount);
 
+	// Post-multiply an already composed transformation and its inverse,
+	// with the x and y angles it contains. Nothing is clamped, so this is
+	// not for joints: rotate checks a joint's limits after every step,
+	// and gr.transform takes joints through the calls above one by one
+	void apply_transform(const Matrix4x4& m, const Matrix4x4& inverse, const Vector3D& angles);
+
 	// Returns true if and only if this node is a JointNode
 	virtual bool is_joint() const;
+	// Likewise for a GeometryNode
+	virtual bool is_geometry() const;
 
 	// Return name of the node
-	std::string get_name() { return m_name; }
+	const std::string& get_name() const { return m_name; }
 
 	// Rotation variables for checking limits
 	Vector3D rotation;
@@ -67,8 +159,35 @@ public:
 
 	const Vector3D& get_rotation() const { return rotation; }
 
-	// Finding all joint nodes for reset in viewer
-	void findJoints( std::map<unsigned int, Info> &sj );
+	// Add the IDs of every joint in this subtree, in tree order. A
+	// joint instancing shares is added once, where it is first reached
+	void findJoints( std::vector<NodeId> &joints ) const;
+
+	// Add where the origin of every joint in this subtree ends up
+	// through parent, in tree order, one array per coordinate
+	void joint_origins( const Matrix4x4& parent, std::vector<NodeId>& ids,
+						std::vector<float>& x, std::vector<float>& y, std::vector<float>& z ) const;
+
+	// Add every joint in this subtree, in tree order, with the index in
+	// joints of the joint above it, or above if there is none, and its
+	// transformation from that joint's frame, or from parent's
+	void joint_tree( const Matrix4x4& parent, int above, std::vector<NodeId>& joints,
+					 std::vector<int>& aboves, std::vector<Matrix4x4>& offsets ) const;
+
+	// Add every node in this subtree, in tree order, with the index in
+	// nodes of its parent, or parent for this one
+	void flatten( int parent, std::vector<const SceneNode*>& nodes, std::vector<int>& parents ) const;
+
+	// Add every joint below a joint in selection to it
+	void select_subtrees( NodeSet& selection, bool below = false ) const;
+
+	// Add the nodes from here down to the first node numbered id found,
+	// depth first. Returns false, adding nothing, if it isn't below here
+	bool find_path( NodeId id, std::vector<SceneNode*>& path );
+
+	// Fold the transformations of this subtree into an FNV-1a hash, in
+	// tree order, to tell whether two runs left the scene the same
+	void hash_pose( unsigned long long& hash ) const;
 
 	// Inform the node to recalculate its normal
 	void hasChanged() { changed = true; }
@@ -76,8 +195,9 @@ public:
 protected:
   
 	// Useful for picking
-	int m_id;
+	NodeId m_id;
 	std::string m_name;
+	unsigned int m_scope;
 
 	// Transformations
 	Matrix4x4 m_trans;
@@ -86,57 +206,140 @@ protected:
 	// Hierarchy
 	typedef std::list<SceneNode*> ChildList;
 	ChildList m_children;
+	int m_parents;					// Nodes this is a child of
 
 	// Identify whether the node has been changed for a new display list
 	mutable bool changed;
 
+	// Give copy its own clones of our children
+	void clone_children(SceneNode* copy) const;
+
+	// Subclasses construct through these, and call publish() as the
+	// last thing their own constructors do, so no thread finds a node
+	// that is still being made
+	enum Unpublished { UNPUBLISHED };
+	SceneNode(const std::string& name, Unpublished);
+	SceneNode(const SceneNode& other, Unpublished);
+	// Store this node under its number and index it by name
+	void publish();
+
+private:
+	// Chunks of nodes indexed by ID, the first entry stands for NO_NODE.
+	// Only changed under the registry lock in scene.cpp
+	static SceneNode** s_registry[REGISTRY_CHUNKS];
+	static volatile gint s_limit;
+
+	// A free number for a node being made, which nothing finds until
+	// the node is published
+	static NodeId reserve_id();
+
+	void find_joints( std::vector<NodeId>& joints, std::vector<bool>& seen ) const;
+
+	// Assigning would leave two nodes with one number
+	SceneNode& operator=(const SceneNode&);
 };
 
+// Build the elementary transformations used by the node callbacks
+Matrix4x4 rotation_matrix(char axis, double angle);
+Matrix4x4 scaling_matrix(const Vector3D& amount);
+Matrix4x4 translation_matrix(const Vector3D& amount);
+
+// Fold the elements of m into an FNV-1a hash. Equal values hash the
+// same, so -0.0 is hashed as 0.0
+void hash_matrix(unsigned long long& hash, const Matrix4x4& m);
+
 class JointNode : public SceneNode {
 public:
 	JointNode(const std::string& name);
+	// Copies start out unselected
+	JointNode(const JointNode& other);
 	virtual ~JointNode();
 
-	virtual void walk_gl(bool bicking = false) const;
+	virtual void walk_gl(const Matrix4x4& frame, bool bicking = false) const;
+
+	virtual JointNode* clone() const;
 
 	virtual bool is_joint() const;
 
 	void set_joint_x(double min, double init, double max);
 	void set_joint_y(double min, double init, double max);
 
-	void set_pick();
-	bool get_pick();
-
 	struct JointRange {
 		double min, init, max;
 	};
+	const JointRange& get_joint_x() const { return m_joint_x; }
+	const JointRange& get_joint_y() const { return m_joint_y; }
+
+	void set_pick();
+	void set_pick( bool pick ) { picked = pick; }
+	bool get_pick();
+
+	// The joint numbered id, NULL if that node is not a joint
+	static JointNode* by_id(NodeId id)
+	{
+		SceneNode* node = SceneNode::by_id(id);
+		return node && node->is_joint() ? (JointNode*)node : NULL;
+	}
 
 	void checkLimits(); 		// Check the limits of x and y angle
 
+	// Add x and y to the angles in one step, stopping at the limits
+	void rotate_limited(double x, double y);
+
+	// Turn to x and y degrees, clamped to the limits, whatever the
+	// joint was turned to before
+	void set_angles(double x, double y);
+
+	// The transformation at angles 0, 0 that every pose is rest * Rx * Ry
+	// on. Turns made one after another don't add up the way their
+	// angles do, so it can't be found from the transformation once the
+	// joint has been posed: it is kept from just before the first turn,
+	// and until then is the transformation with the angles taken off
+	Matrix4x4 rest() const;
+
+	// Rotate, within the limits, to bring a point below us as close to
+	// the direction of target as turning about x and then y can. Both
+	// are in our frame, after our transformation
+	void turn_towards(const Point3D& point, const Point3D& target);
+
 protected:
 	JointRange m_joint_x, m_joint_y;
 	bool picked;                    // Inidicate whether the joint is picked or not
+	Matrix4x4 m_rest;
+	bool m_rest_kept;
+
+	// Keep the rest transformation, if it isn't already, before posing
+	void keep_rest();
 };
 
 class GeometryNode : public SceneNode {
 public:
 	GeometryNode(const std::string& name,
 				 Primitive* primitive);
+	GeometryNode(const GeometryNode& other);
 	virtual ~GeometryNode();
 
-	virtual void walk_gl(bool picking = false) const;
+	virtual void walk_gl(const Matrix4x4& frame, bool picking = false) const;
+
+	virtual GeometryNode* clone() const;
+
+	virtual bool is_geometry() const;
 
 	const Material* get_material() const;
 	Material* get_material();
 
-	void set_material(Material* material)
-	{
-		m_material = material;
-	}
+	// Geometry is drawn in a plain grey until it is given a material,
+	// and given NULL goes back to it
+	void set_material(Material* material);
+
+	const Primitive* get_primitive() const { return m_primitive; }
 
 protected:
 	Material* m_material;
 	Primitive* m_primitive;
+
+	// Level of detail of the primitive for its size on screen, drawn in frame
+	int select_lod(const Matrix4x4& frame) const;
 };
 
 #endif
@@ -0,0 +1,49 @@
+#include "scene_loader.hpp"
+#include "trace.hpp"
+
+SceneLoader::SceneLoader( const std::string& filename )
+	: m_filename( filename ), m_thread( NULL ), m_scene( NULL ), m_done( 0 )
+{
+}
+
+SceneLoader::~SceneLoader()
+{
+	if ( m_thread ) {
+		cancel();
+		m_thread->join();
+	}
+}
+
+void SceneLoader::start()
+{
+	m_thread = Glib::Thread::create( sigc::mem_fun( *this, &SceneLoader::run ), true );
+}
+
+void SceneLoader::cancel()
+{
+	g_atomic_int_set( &m_progress.cancel, 1 );
+}
+
+bool SceneLoader::done() const
+{
+	return g_atomic_int_get( &m_done );
+}
+
+void SceneLoader::run()
+{
+	Trace::set_thread_name( "loader" );
+	m_scene = import_lua( m_filename, &m_progress );
+	// Publishes m_scene along with it
+	g_atomic_int_set( &m_done, 1 );
+}
+
+const std::vector<SceneNode*>& SceneLoader::lock_preview()
+{
+	m_progress.lock.lock();
+	return m_progress.preview;
+}
+
+void SceneLoader::unlock_preview()
+{
+	m_progress.lock.unlock();
+}
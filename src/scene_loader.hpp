@@ -0,0 +1,45 @@
+#ifndef SCENE_LOADER_HPP
+#define SCENE_LOADER_HPP
+
+#include <string>
+#include <glibmm.h>
+#include "scene_lua.hpp"
+
+// Imports a scene on a thread of its own, so that the window can come
+// up straight away while a large script is still running.
+class SceneLoader {
+public:
+	SceneLoader( const std::string& filename );
+	// Cancels the import if it is still running, and waits for it
+	~SceneLoader();
+
+	void start();
+	void cancel();
+
+	// True once the import has finished, whether it worked or not
+	bool done() const;
+	double fraction() const { return m_progress.fraction(); }
+
+	// The imported scene, NULL if the import failed. Only valid once done
+	SceneNode* get_scene() const { return m_scene; }
+
+	// Get at the trees of the scene built so far, waiting for the import
+	// to let go of them. Call unlock_preview() when done with them.
+	const std::vector<SceneNode*>& lock_preview();
+	void unlock_preview();
+
+private:
+	// Not copyable, the thread has a single owner
+	SceneLoader( const SceneLoader& );
+	SceneLoader& operator=( const SceneLoader& );
+
+	void run();
+
+	std::string m_filename;
+	ImportProgress m_progress;
+	Glib::Thread *m_thread;
+	SceneNode *m_scene;
+	volatile int m_done;
+};
+
+#endif
@@ -41,6 +41,13 @@
 #include <cstring>
 #include <cstdio>
 #include "lua488.hpp"
+#include "mesh.hpp"
+#include "mesh_lod.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include <vector>
+#include <algorithm>
 
 // Uncomment the following line to enable debugging messages
 // #define GRLUA_ENABLE_DEBUG
@@ -72,12 +79,52 @@ struct gr_node_ud {
   SceneNode* node;
 };
 
+// Every mesh loaded by the current import, so their levels of detail
+// can be built together once the script has run.
+static std::vector<Mesh*> imported_meshes;
+
+// Every node the current import made, in order, so a failed import
+// can be thrown away.
+static std::vector<NodeId> import_made;
+
+// Progress of the current import, when someone is watching it, where
+// in import_made the nodes not in the preview yet start, and when it
+// last let go of the scene.
+static ImportProgress* import_progress = 0;
+static size_t import_unseen = 0;
+static double import_released = 0.0;
+
 // The "userdata" type for a material. Objects of this type will be
 // allocated by Lua to represent materials.
 struct gr_material_ud {
   Material* material;
 };
 
+// Wrap an existing node in a new "gr.node" userdata and leave it on
+// top of the stack.
+static void gr_push_node(lua_State* L, SceneNode* node)
+{
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = node;
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+}
+
+// Read a row-major matrix out of the flat array at index idx, starting
+// at element first. A stride of 16 reads a full 4x4 matrix, a stride
+// of 12 reads a 3x4 matrix whose last row is taken to be 0 0 0 1.
+static Matrix4x4 gr_read_matrix(lua_State* L, int idx, int first, int stride)
+{
+  Matrix4x4 m;
+  for (int i = 0; i < stride; i++) {
+    lua_rawgeti(L, idx, first + i);
+    m[i / 4][i % 4] = luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+  }
+  return m;
+}
+
 // Create a node
 extern "C"
 int gr_node_cmd(lua_State* L)
@@ -151,6 +198,60 @@ int gr_sphere_cmd(lua_State* L)
   return 1;
 }
 
+// Create a new node that refers to an existing subtree rather than
+// copying it:
+//   gr.instance(node [, name])
+// The instance node is called name, or the target's name followed by
+// "_instance", never the target's own, so a path through it names one
+// node or the other and not both. This is shared-pose instancing: the subtree, joints included, is
+// shared by every instance of it, so only the instance node's own
+// transformation differs between them. Picking or turning a joint in
+// one instance turns it in all of them. Use node:clone() instead when
+// the copy must be posed independently.
+extern "C"
+int gr_instance_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_node_ud* targetdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, targetdata != 0, 1, "Node expected");
+
+  SceneNode* target = targetdata->node;
+  std::string name = lua_isnoneornil(L, 2) ? target->get_name() + "_instance" : luaL_checkstring(L, 2);
+
+  SceneNode* node = new SceneNode(name);
+  node->add_child(target);
+
+  gr_push_node(L, node);
+
+  return 1;
+}
+
+// Create a mesh node from an OBJ or binary PLY file
+extern "C"
+int gr_mesh_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+  
+  const char* name = luaL_checkstring(L, 1);
+  const char* filename = luaL_checkstring(L, 2);
+
+  Mesh* mesh = import_mesh(filename);
+  if (!mesh) {
+    return luaL_error(L, "Unable to load mesh %s", filename);
+  }
+  imported_meshes.push_back(mesh);
+  data->node = new GeometryNode(name, mesh);
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
 // Create a material
 extern "C"
 int gr_material_cmd(lua_State* L)
@@ -207,6 +308,97 @@ int gr_node_add_child_cmd(lua_State* L)
   return 0;
 }
 
+// Create a whole batch of children of a node in one call:
+//   parent:add_children(kind, names [, matrices [, material]])
+// kind is 'node' or 'sphere', names an array of N names and matrices
+// an optional flat array of N row-major 4x4 or 3x4 matrices. The
+// material, if any, is given to every sphere, otherwise they are drawn
+// in the default grey until given one. Returns an array of the new
+// nodes.
+extern "C"
+int gr_node_add_children_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  SceneNode* self = selfdata->node;
+
+  const char* kind = luaL_checkstring(L, 2);
+  bool sphere = std::strcmp(kind, "sphere") == 0;
+  luaL_argcheck(L, sphere || std::strcmp(kind, "node") == 0, 2, "'node' or 'sphere' expected");
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  int count = luaL_getn(L, 3);
+
+  int stride = 0;
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    int n = luaL_getn(L, 4);
+    if (n == 16 * count) {
+      stride = 16;
+    } else if (n == 12 * count) {
+      stride = 12;
+    }
+    luaL_argcheck(L, stride != 0, 4, "One 4x4 or 3x4 matrix per name expected");
+  }
+
+  Material* material = 0;
+  if (!lua_isnoneornil(L, 5)) {
+    luaL_argcheck(L, sphere, 5, "Only spheres take a material");
+    gr_material_ud* matdata = (gr_material_ud*)luaL_checkudata(L, 5, "gr.material");
+    luaL_argcheck(L, matdata != 0, 5, "Material expected");
+    material = matdata->material;
+  }
+
+  lua_createtable(L, count, 0);
+  int result = lua_gettop(L);
+
+  // All the spheres of one batch share a single primitive
+  Sphere* primitive = sphere && count > 0 ? new Sphere() : 0;
+
+  for (int i = 1; i <= count; i++) {
+    lua_rawgeti(L, 3, i);
+    const char* name = luaL_checkstring(L, -1);
+
+    SceneNode* child;
+    if (sphere) {
+      GeometryNode* geometry = new GeometryNode(name, primitive);
+      geometry->set_material(material);
+      child = geometry;
+    } else {
+      child = new SceneNode(name);
+    }
+    lua_pop(L, 1);
+
+    if (stride) {
+      child->set_transform(gr_read_matrix(L, 4, (i - 1) * stride + 1, stride));
+    }
+    self->add_child(child);
+
+    gr_push_node(L, child);
+    lua_rawseti(L, result, i);
+  }
+
+  return 1;
+}
+
+// Deep copy a node and everything below it. The copies share the
+// primitives and materials of the original.
+extern "C"
+int gr_node_clone_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  gr_push_node(L, selfdata->node->clone());
+
+  return 1;
+}
+
 // Set a node's material
 extern "C"
 int gr_node_set_material_cmd(lua_State* L)
@@ -300,6 +492,210 @@ int gr_node_rotate_cmd(lua_State* L)
   return 0;
 }
 
+// Replace a node's transformation with a row-major 4x4 matrix, given
+// as a flat array of 16 numbers, or a 3x4 matrix given as 12 numbers.
+extern "C"
+int gr_node_set_matrix_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  SceneNode* self = selfdata->node;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int n = luaL_getn(L, 2);
+  luaL_argcheck(L, n == 16 || n == 12, 2, "4x4 or 3x4 matrix expected");
+
+  self->set_transform(gr_read_matrix(L, 2, 1, n));
+  self->hasChanged();
+
+  return 0;
+}
+
+// One step of a gr.transform sequence: 't'ranslate, 'r'otate or 's'cale
+struct gr_transform_op {
+  char kind;
+  char axis;
+  double values[3];
+};
+
+// Apply one sequence of transformations to a whole list of nodes:
+//   gr.transform(nodes, {{'translate', x, y, z}, {'rotate', 'x', angle},
+//                        {'scale', x, y, z}, ...})
+// Every node ends up as if the same calls had been made on each of
+// them. The sequence is composed into a single matrix and inverse once,
+// which are then post-multiplied onto every node that isn't a joint.
+// Joints check their limits after every rotation, so the steps are
+// made on them one at a time, as the calls would.
+extern "C"
+int gr_transform_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  Matrix4x4 m, inverse;
+  Vector3D angles;
+  std::vector<gr_transform_op> steps;
+
+  int ops = luaL_getn(L, 2);
+  for (int i = 1; i <= ops; i++) {
+    lua_rawgeti(L, 2, i);
+    luaL_argcheck(L, lua_istable(L, -1), 2, "Array of operations expected");
+    int op = lua_gettop(L);
+
+    lua_rawgeti(L, op, 1);
+    const char* name = lua_tostring(L, -1);
+    luaL_argcheck(L, name != 0, 2, "Operation name expected");
+
+    if (std::strcmp(name, "rotate") == 0) {
+      lua_rawgeti(L, op, 2);
+      const char* axis_string = lua_tostring(L, -1);
+      luaL_argcheck(L, axis_string
+                    && std::strlen(axis_string) == 1, 2, "Single character expected");
+      char axis = std::tolower(axis_string[0]);
+      luaL_argcheck(L, axis >= 'x' && axis <= 'z', 2, "Axis must be x, y or z");
+
+      lua_rawgeti(L, op, 3);
+      luaL_argcheck(L, lua_isnumber(L, -1), 2, "Angle expected");
+      double angle = lua_tonumber(L, -1);
+
+      m = m * rotation_matrix(axis, angle);
+      inverse = rotation_matrix(axis, -angle) * inverse;
+      if (axis != 'z') {
+        angles[axis - 'x'] += angle;
+      }
+
+      gr_transform_op step = { 'r', axis, { angle, 0.0, 0.0 } };
+      steps.push_back(step);
+    } else {
+      bool scale = std::strcmp(name, "scale") == 0;
+      luaL_argcheck(L, scale || std::strcmp(name, "translate") == 0, 2,
+                    "Operation must be translate, rotate or scale");
+
+      double values[3];
+      for (int j = 0; j < 3; j++) {
+        lua_rawgeti(L, op, j + 2);
+        luaL_argcheck(L, lua_isnumber(L, -1), 2, "Three numbers expected");
+        values[j] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+      }
+
+      Vector3D amount(values[0], values[1], values[2]);
+      if (scale) {
+        m = m * scaling_matrix(amount);
+        inverse = scaling_matrix(Vector3D(1.0 / values[0], 1.0 / values[1], 1.0 / values[2])) * inverse;
+      } else {
+        m = m * translation_matrix(amount);
+        inverse = translation_matrix(-amount) * inverse;
+      }
+
+      gr_transform_op step = { scale ? 's' : 't', 0, { values[0], values[1], values[2] } };
+      steps.push_back(step);
+    }
+
+    lua_settop(L, op - 1);
+  }
+
+  int count = luaL_getn(L, 1);
+  for (int i = 1; i <= count; i++) {
+    lua_rawgeti(L, 1, i);
+    gr_node_ud* data = (gr_node_ud*)luaL_checkudata(L, -1, "gr.node");
+    luaL_argcheck(L, data != 0, 1, "Array of nodes expected");
+    SceneNode* node = data->node;
+    if (!node->is_joint()) {
+      node->apply_transform(m, inverse, angles);
+    } else {
+      for (size_t s = 0; s < steps.size(); s++) {
+        const gr_transform_op& step = steps[s];
+        Vector3D amount(step.values[0], step.values[1], step.values[2]);
+        if (step.kind == 'r') {
+          node->rotate(step.axis, step.values[0]);
+        } else if (step.kind == 's') {
+          node->scale(amount);
+        } else {
+          node->translate(amount);
+        }
+      }
+    }
+    lua_pop(L, 1);
+  }
+
+  return 0;
+}
+
+// Look a node up by name or path among the nodes this import has
+// made, see SceneNode::glob. Returns nil if there is none
+//   local neck = gr.find('neck_joint')
+//   local hand = gr.find('/puppet/left_arm*/hand')
+extern "C"
+int gr_find_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  SceneNode* node = SceneNode::find(luaL_checkstring(L, 1), SceneNode::current_scope());
+  if (node) {
+    gr_push_node(L, node);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// Every node this import made down a path of glob patterns, as an
+// array in order of number
+//   for _, finger in ipairs(gr.glob('hand*/finger*_joint')) do ... end
+extern "C"
+int gr_glob_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  std::vector<NodeId> ids;
+  SceneNode::glob(luaL_checkstring(L, 1), SceneNode::current_scope(), ids);
+
+  lua_createtable(L, ids.size(), 0);
+  for (size_t i = 0; i < ids.size(); i++) {
+    gr_push_node(L, SceneNode::by_id(ids[i]));
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+// Read the runtime counters, as a table laid out like the lines
+// Metrics::start writes:
+//   { frames = n, frame = { nodes_visited = ..., ... }, total = { ... } }
+extern "C"
+int gr_metrics_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  Metrics::Snapshot snapshot;
+  Metrics::get(snapshot);
+
+  lua_newtable(L);
+  lua_pushnumber(L, snapshot.frames);
+  lua_setfield(L, -2, "frames");
+
+  lua_newtable(L);
+  for (int i = 0; i < METRICS; i++) {
+    lua_pushnumber(L, snapshot.frame[i]);
+    lua_setfield(L, -2, Metrics::get_name(Metric(i)));
+  }
+  lua_setfield(L, -2, "frame");
+
+  lua_newtable(L);
+  for (int i = 0; i < METRICS; i++) {
+    lua_pushnumber(L, snapshot.total[i]);
+    lua_setfield(L, -2, Metrics::get_name(Metric(i)));
+  }
+  lua_setfield(L, -2, "total");
+
+  return 1;
+}
+
 // Garbage collection function for lua.
 extern "C"
 int gr_node_gc_cmd(lua_State* L)
@@ -328,7 +724,13 @@ static const luaL_reg grlib_functions[] = {
   {"node", gr_node_cmd},
   {"joint", gr_joint_cmd},
   {"sphere", gr_sphere_cmd},
+  {"mesh", gr_mesh_cmd},
   {"material", gr_material_cmd},
+  {"transform", gr_transform_cmd},
+  {"instance", gr_instance_cmd},
+  {"metrics", gr_metrics_cmd},
+  {"find", gr_find_cmd},
+  {"glob", gr_glob_cmd},
   {0, 0}
 };
 
@@ -347,17 +749,109 @@ static const luaL_reg grlib_functions[] = {
 static const luaL_reg grlib_node_methods[] = {
   {"__gc", gr_node_gc_cmd},
   {"add_child", gr_node_add_child_cmd},
+  {"add_children", gr_node_add_children_cmd},
+  {"clone", gr_node_clone_cmd},
   {"set_material", gr_node_set_material_cmd},
   {"scale", gr_node_scale_cmd},
   {"rotate", gr_node_rotate_cmd},
   {"translate", gr_node_translate_cmd},
+  {"set_matrix", gr_node_set_matrix_cmd},
   {0, 0}
 };
 
-// This function calls the lua interpreter to do the actual importing
-SceneNode* import_lua(const std::string& filename)
+// Bring the preview up to date, under its lock. Every node that is
+// nobody's child is the top of a tree the script is building
+static void gr_update_preview(ImportProgress* progress)
+{
+  std::vector<SceneNode*>& preview = progress->preview;
+  size_t kept = 0;
+  for (size_t i = 0; i < preview.size(); i++) {
+    if (!preview[i]->has_parent()) {
+      preview[kept++] = preview[i];
+    }
+  }
+  preview.resize(kept);
+
+  for (size_t i = import_unseen; i < import_made.size(); i++) {
+    SceneNode* node = SceneNode::by_id(import_made[i]);
+    if (!node->has_parent()) {
+      preview.push_back(node);
+    }
+  }
+  import_unseen = import_made.size();
+}
+
+// Throw away everything a failed import made. Called with the lock
+// held, as the preview may show some of it
+static void gr_abandon_import(lua_State* L, ImportProgress* progress)
+{
+  if (progress) {
+    progress->preview.clear();
+  }
+  import_progress = 0;
+  lua_close(L);
+
+  SceneNode::record_nodes(0);
+  SceneNode::leave_scope();
+  SceneNode::destroy(import_made);
+  import_made.clear();
+  imported_meshes.clear();
+}
+
+// Run every IMPORT_HOOK_COUNT instructions of the script when the
+// import is being watched
+static void gr_count_hook(lua_State* L, lua_Debug* ar)
+{
+  ImportProgress* progress = import_progress;
+
+  if (lua_getinfo(L, "l", ar) && ar->currentline > g_atomic_int_get(&progress->line)) {
+    g_atomic_int_set(&progress->line, std::min(ar->currentline, (int)progress->lines));
+  }
+
+  // Give whoever draws the preview a chance at the scene, now and then
+  if (Profiler::now() - import_released >= IMPORT_PREVIEW_INTERVAL) {
+    gr_update_preview(progress);
+    progress->lock.unlock();
+    Glib::Thread::yield();
+    progress->lock.lock();
+    import_released = Profiler::now();
+  }
+
+  if (g_atomic_int_get(&progress->cancel)) {
+    luaL_error(L, "cancelled");
+  }
+}
+
+// This function calls the lua interpreter to do the actual importing.
+// If progress is given, it is kept up to date as the script runs and
+// its lock is held whenever the import is changing the scene.
+SceneNode* import_lua(const std::string& filename, ImportProgress* progress)
 {
   GRLUA_DEBUG("Importing scene from " << filename);
+  TraceScope trace("import_lua");
+
+  if (progress) {
+    // Progress is measured in lines of the script
+    MappedFile script;
+    int lines = 1;
+    if (script.open(filename)) {
+      lines += std::count(script.begin(), script.end(), '\n');
+    }
+    g_atomic_int_set(&progress->lines, lines);
+    g_atomic_int_set(&progress->line, 0);
+  }
+  // Nobody else sees the scene when there is no progress to share
+  Glib::Mutex unshared;
+  Glib::Mutex::Lock lock(progress ? progress->lock : unshared);
+  import_progress = progress;
+  import_made.clear();
+  import_unseen = 0;
+  SceneNode::record_nodes(&import_made);
+  SceneNode::enter_scope();
+  import_released = Profiler::now();
+  if (progress) {
+    progress->preview.clear();
+  }
   
   // Start a lua interpreter
   lua_State* L = lua_open();
@@ -382,10 +876,33 @@ SceneNode* import_lua(const std::string& filename)
   // Load the gr functions
   luaL_openlib(L, "gr", grlib_functions, 0);
 
+  // Let scenes require Lua libraries kept next to them
+  std::string::size_type slash = filename.find_last_of('/');
+  std::string dir = (slash == std::string::npos) ? "." : filename.substr(0, slash);
+  lua_getglobal(L, "package");
+  lua_pushstring(L, (dir + "/?.lua;").c_str());
+  lua_getfield(L, -2, "path");
+  lua_concat(L, 2);
+  lua_setfield(L, -2, "path");
+  lua_pop(L, 1);
+
+  imported_meshes.clear();
+
+  if (progress) {
+    lua_sethook(L, gr_count_hook, LUA_MASKCOUNT, IMPORT_HOOK_COUNT);
+  }
+
   GRLUA_DEBUG("Parsing the scene");
   // Now parse the actual scene
-  if (luaL_loadfile(L, filename.c_str()) || lua_pcall(L, 0, 1, 0)) {
+  double start = Profiler::now();
+  bool failed = luaL_loadfile(L, filename.c_str()) || lua_pcall(L, 0, 1, 0);
+  lua_sethook(L, 0, 0, 0);
+  if (Trace::enabled()) {
+    Trace::add(failed ? "run script (failed)" : "run script", start, Profiler::now());
+  }
+  if (failed) {
     std::cerr << "Error loading " << filename << ": " << lua_tostring(L, -1) << std::endl;
+    gr_abandon_import(L, progress);
     return 0;
   }
 
@@ -395,11 +912,48 @@ SceneNode* import_lua(const std::string& filename)
   gr_node_ud* data = (gr_node_ud*)luaL_checkudata(L, -1, "gr.node");
   if (!data) {
     std::cerr << "Error loading " << filename << ": Must return the root node." << std::endl;
+    gr_abandon_import(L, progress);
     return 0;
   }
 
   // Store it
   SceneNode* node = data->node;
+  SceneNode::record_nodes(0);
+  SceneNode::leave_scope();
+
+  // From now on only the scene the script returned is drawn, and the
+  // levels of detail are put in place under the lock as they are ready
+  if (progress) {
+    progress->preview.assign(1, node);
+  }
+
+  // Whatever the script made but left out of the scene goes, so that
+  // looking names up later finds only what is in it
+  std::vector<bool> reached(SceneNode::id_limit(), false);
+  node->mark_subtree(reached);
+  std::vector<NodeId> unused;
+  for (size_t i = 0; i < import_made.size(); i++) {
+    if (!reached[import_made[i]]) {
+      unused.push_back(import_made[i]);
+    }
+  }
+  SceneNode::destroy(unused);
+  import_made.clear();
+  lock.release();
+
+  GRLUA_DEBUG("Building levels of detail");
+
+  // The levels are cached next to the scene, as <scene file>.lod
+  {
+    TraceScope trace("build lods");
+    build_mesh_lods(imported_meshes, filename + ".lod", progress ? &progress->lock : 0);
+  }
+  imported_meshes.clear();
+
+  if (progress) {
+    g_atomic_int_set(&progress->line, progress->lines);
+  }
+  import_progress = 0;
 
   GRLUA_DEBUG("Closing the interpreter");
   
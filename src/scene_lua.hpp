@@ -2,8 +2,40 @@
 #define SCENE_LUA_HPP
 
 #include <string>
+#include <vector>
+#include <glibmm.h>
 #include "scene.hpp"
 
-SceneNode* import_lua(const std::string& filename);
+// How often, in seconds, an import being watched lets go of the scene
+// so that the part built so far can be drawn
+#define IMPORT_PREVIEW_INTERVAL 0.05
+// Lua instructions run between looks at the clock
+#define IMPORT_HOOK_COUNT 1000
+
+// Shared with whoever is watching an import run on another thread.
+// The importer holds lock whenever the script may be changing the
+// scene, and lets go of it every IMPORT_PREVIEW_INTERVAL so that the
+// part of the scene built so far can be drawn. line, lines and cancel
+// are read and written with g_atomic_int_* so they never wait on the
+// lock.
+struct ImportProgress {
+  ImportProgress() : line(0), lines(1), cancel(0) {}
+
+  // How far through the script the import is, from 0 to 1
+  double fraction() const
+  {
+    return double(g_atomic_int_get(&line)) / g_atomic_int_get(&lines);
+  }
+
+  Glib::Mutex lock;
+  // Under lock, the tops of the trees the script has made so far. The
+  // one it returns is among them, and once it has returned, the only one
+  std::vector<SceneNode*> preview;
+  volatile int line;    // Furthest line of the script run so far
+  volatile int lines;   // Lines in the script
+  volatile int cancel;  // Set to make the import fail at the next line
+};
+
+SceneNode* import_lua(const std::string& filename, ImportProgress* progress = 0);
 
 #endif
@@ -0,0 +1,122 @@
+#ifndef TEXT_PARSE_HPP
+#define TEXT_PARSE_HPP
+
+#include <cstring>
+#include <cmath>
+
+// Parsing text in place from a MappedFile, for the mesh and motion
+// importers. The mapped file isn't null terminated, so everything works
+// on a [p, end) range and advances p past what it consumed.
+
+static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+inline const char* skip_space(const char* p, const char* end)
+{
+	while ( p < end && is_space( *p ) ) p++;
+	return p;
+}
+
+// Past spaces and line ends both
+inline const char* skip_blank(const char* p, const char* end)
+{
+	while ( p < end && ( is_space( *p ) || *p == '\n' ) ) p++;
+	return p;
+}
+
+inline const char* skip_line(const char* p, const char* end)
+{
+	const char* nl = (const char*)memchr( p, '\n', end - p );
+	return nl ? nl + 1 : end;
+}
+
+inline bool parse_float(const char*& p, const char* end, float& value)
+{
+	const char* s = p;
+	bool negative = false;
+	if ( s < end && ( *s == '-' || *s == '+' ) ) {
+		negative = *s == '-';
+		s++;
+	}
+
+	// Keep the first 19 significant digits, that is all a 64 bit integer holds
+	unsigned long long mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+	for ( ; s < end && is_digit( *s ); s++, any = true ) {
+		if ( digits < 19 ) {
+			mantissa = mantissa * 10 + ( *s - '0' );
+			if ( mantissa ) digits++;
+		} else {
+			exponent++;
+		}
+	}
+	if ( s < end && *s == '.' ) {
+		for ( s++; s < end && is_digit( *s ); s++, any = true ) {
+			if ( digits < 19 ) {
+				mantissa = mantissa * 10 + ( *s - '0' );
+				if ( mantissa ) digits++;
+				exponent--;
+			}
+		}
+	}
+	if ( !any ) return false;
+
+	if ( s < end && ( *s == 'e' || *s == 'E' ) ) {
+		const char* e = s + 1;
+		bool negative_exponent = false;
+		if ( e < end && ( *e == '-' || *e == '+' ) ) {
+			negative_exponent = *e == '-';
+			e++;
+		}
+		if ( e < end && is_digit( *e ) ) {
+			int n = 0;
+			for ( ; e < end && is_digit( *e ); e++ ) {
+				if ( n < 10000 ) n = n * 10 + ( *e - '0' );
+			}
+			exponent += negative_exponent ? -n : n;
+			s = e;
+		}
+	}
+
+	double v = (double)mantissa;
+	if ( exponent < 0 ) {
+		v = exponent >= -22 ? v / powers_of_ten[-exponent] : v * pow( 10.0, exponent );
+	} else if ( exponent > 0 ) {
+		v = exponent <= 22 ? v * powers_of_ten[exponent] : v * pow( 10.0, exponent );
+	}
+	value = negative ? -v : v;
+	p = s;
+	return true;
+}
+
+inline bool parse_int(const char*& p, const char* end, long& value)
+{
+	const char* s = p;
+	bool negative = false;
+	if ( s < end && ( *s == '-' || *s == '+' ) ) {
+		negative = *s == '-';
+		s++;
+	}
+	if ( s >= end || !is_digit( *s ) ) return false;
+
+	long v = 0;
+	for ( ; s < end && is_digit( *s ); s++ ) v = v * 10 + ( *s - '0' );
+	value = negative ? -v : v;
+	p = s;
+	return true;
+}
+
+#endif
@@ -0,0 +1,155 @@
+#include "trace.hpp"
+#include <glibmm.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+
+namespace {
+
+struct TraceEvent {
+	const char* name;
+	double start, end;
+};
+
+// One per thread that is recording. Only that thread writes to it,
+// head is published atomically after each event.
+struct TraceRing {
+	int tid;
+	const char* thread_name;
+	volatile int head;			// Where the next event goes
+	volatile int full;			// Once head has gone all the way round
+	TraceEvent events[TRACE_EVENTS_PER_THREAD];
+};
+
+// Every ring, and those whose threads have exited. Only locked when a
+// thread records its first event or exits
+Glib::StaticMutex rings_lock = GLIBMM_STATIC_MUTEX_INIT;
+std::vector<TraceRing*> rings;
+std::vector<TraceRing*> free_rings;
+
+__thread TraceRing* thread_ring = NULL;
+
+// Has its destructor hand the ring back when the thread exits
+pthread_key_t ring_key;
+pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+void release_ring( void* ring )
+{
+	Glib::StaticMutex::Lock lock( rings_lock );
+	free_rings.push_back( (TraceRing*)ring );
+}
+
+void make_ring_key()
+{
+	pthread_key_create( &ring_key, release_ring );
+}
+
+TraceRing* get_ring()
+{
+	if ( !thread_ring ) {
+		pthread_once( &ring_key_once, make_ring_key );
+		{
+			Glib::StaticMutex::Lock lock( rings_lock );
+			if ( !free_rings.empty() ) {
+				thread_ring = free_rings.back();
+				free_rings.pop_back();
+			} else {
+				thread_ring = new TraceRing;
+				thread_ring->thread_name = NULL;
+				thread_ring->head = 0;
+				thread_ring->full = 0;
+				thread_ring->tid = rings.size() + 1;
+				rings.push_back( thread_ring );
+			}
+		}
+		pthread_setspecific( ring_key, thread_ring );
+	}
+	return thread_ring;
+}
+
+// Names are identifiers and phrases from the source, but keep the
+// JSON valid whatever they are
+void write_string( std::ostream& out, const char* s )
+{
+	out << '"';
+	for ( ; *s; s++ ) {
+		if ( *s == '"' || *s == '\\' ) out << '\\';
+		if ( (unsigned char)*s >= ' ' ) out << *s;
+	}
+	out << '"';
+}
+
+}
+
+bool Trace::s_enabled = false;
+std::string Trace::s_filename;
+
+void Trace::start( const std::string& filename )
+{
+	s_filename = filename;
+	s_enabled = true;
+}
+
+void Trace::set_thread_name( const char* name )
+{
+	if ( s_enabled ) get_ring()->thread_name = name;
+}
+
+void Trace::add( const char* name, double start, double end )
+{
+	TraceRing* ring = get_ring();
+	int head = ring->head;
+	TraceEvent& event = ring->events[head];
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	if ( head == TRACE_EVENTS_PER_THREAD - 1 ) g_atomic_int_set( &ring->full, 1 );
+	g_atomic_int_set( &ring->head, ( head + 1 ) & ( TRACE_EVENTS_PER_THREAD - 1 ) );
+}
+
+bool Trace::finish()
+{
+	if ( !s_enabled ) return true;
+	s_enabled = false;
+
+	std::ofstream out( s_filename.c_str() );
+	if ( !out ) {
+		std::cerr << "Unable to write trace " << s_filename << std::endl;
+		return false;
+	}
+
+	Glib::StaticMutex::Lock lock( rings_lock );
+	int pid = getpid();
+	bool first = true;
+	out << "{\"traceEvents\":[" << std::endl;
+	for ( size_t r = 0; r < rings.size(); r++ ) {
+		TraceRing* ring = rings[r];
+		if ( ring->thread_name ) {
+			out << ( first ? "" : ",\n" ) << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+				<< ",\"tid\":" << ring->tid << ",\"args\":{\"name\":";
+			write_string( out, ring->thread_name );
+			out << "}}";
+			first = false;
+		}
+
+		// Oldest first, from head once the ring has gone round
+		int head = g_atomic_int_get( &ring->head );
+		bool full = g_atomic_int_get( &ring->full );
+		int count = full ? TRACE_EVENTS_PER_THREAD : head;
+		for ( int i = 0; i < count; i++ ) {
+			const TraceEvent& event = ring->events[( ( full ? head : 0 ) + i ) & ( TRACE_EVENTS_PER_THREAD - 1 )];
+			out << ( first ? "" : ",\n" ) << "{\"name\":";
+			write_string( out, event.name );
+			out << ",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << ring->tid
+				<< ",\"ts\":" << std::fixed << event.start * 1e6
+				<< ",\"dur\":" << ( event.end - event.start ) * 1e6 << "}";
+			first = false;
+		}
+	}
+	out << std::endl << "]}" << std::endl;
+
+	std::cout << "Wrote trace " << s_filename << std::endl;
+	return out.good();
+}
@@ -0,0 +1,55 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <string>
+#include "profiler.hpp"
+
+// Events kept for each thread. Once a thread has made this many, each
+// new event replaces its oldest. A power of two
+#define TRACE_EVENTS_PER_THREAD 65536
+
+// Records timed events for the Chrome trace viewer (chrome://tracing
+// or ui.perfetto.dev). Each thread writes to a ring of its own without
+// taking any locks, so tracing can be left on for a whole session.
+// When a thread exits its ring goes to the next thread to start, events
+// and all, so threads that come and go, like the LOD workers of each
+// import, share a trace thread and never hold more rings than ran at once.
+class Trace {
+public:
+	// Start recording, to be written to filename by finish()
+	static void start( const std::string& filename );
+	// Write everything recorded as Trace Event JSON. Returns false if
+	// the file can't be written. Threads still recording may lose the
+	// events they are writing while this runs
+	static bool finish();
+
+	static bool enabled() { return s_enabled; }
+
+	// Name the calling thread in the trace
+	static void set_thread_name( const char* name );
+
+	// A complete event, times in seconds from Profiler::now(). The
+	// name must outlive the trace, a string literal is best
+	static void add( const char* name, double start, double end );
+
+private:
+	static bool s_enabled;
+	static std::string s_filename;
+};
+
+// Records an event from construction until it goes out of scope.
+// While tracing is off this costs a test of a flag.
+class TraceScope {
+public:
+	TraceScope( const char* name )
+		: m_name( name ), m_start( Trace::enabled() ? Profiler::now() : -1.0 ) {}
+	~TraceScope() {
+		if ( m_start >= 0.0 ) Trace::add( m_name, m_start, Profiler::now() );
+	}
+
+private:
+	const char* m_name;
+	double m_start;
+};
+
+#endif
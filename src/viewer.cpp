@@ -1,6 +1,12 @@
 #include "viewer.hpp"
 #include "algebra.hpp"
+#include "trace.hpp"
 #include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <ctime>
+#include <fstream>
 #include <math.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
@@ -29,7 +35,7 @@ Viewer::Viewer()
 	add_events(Gdk::BUTTON1_MOTION_MASK    |
 			   Gdk::BUTTON2_MOTION_MASK    |
 			   Gdk::BUTTON3_MOTION_MASK    |
-			   Gdk::BUTTON_PRESS_MASK      | 
+			   Gdk::BUTTON_PRESS_MASK      |
 			   Gdk::BUTTON_RELEASE_MASK    |
 			   Gdk::VISIBILITY_NOTIFY_MASK |
 			   Gdk::POINTER_MOTION_MASK );
@@ -44,110 +50,183 @@ Viewer::~Viewer()
 
 void Viewer::invalidate()
 {
-	// Force a rerender
-	Gtk::Allocation allocation = get_allocation();
-	get_window()->invalidate_rect( allocation, false);
+	// Wake the render thread up for a new frame
+	Glib::Mutex::Lock lock( m_input_lock );
+	publish();
 }
 
-void Viewer::on_realize()
+void Viewer::publish()
 {
-	// Do some OpenGL setup.
-	// First, let the base class do whatever it needs to
-	Gtk::GL::DrawingArea::on_realize();
-  
-	Glib::RefPtr<Gdk::GL::Drawable> gldrawable = get_gl_drawable();
-  
-	if (!gldrawable)
-		return;
-
-	if (!gldrawable->gl_begin(get_gl_context()))
-		return;
-
-	glShadeModel(GL_SMOOTH);
-	glClearColor( 0.4, 0.4, 0.4, 0.0 );
-	//glEnable(GL_DEPTH_TEST);
-
-	gldrawable->gl_end();
+	// Take a snapshot of the view as the UI sees it right now
+	m_ui->camera = m_rotate * m_translate;
+	m_ui->width = width;
+	m_ui->height = height;
+	m_ui->mode = mode;
+	m_ui->circle = circle;
+	m_ui->z_buf = z_buf;
+	m_ui->bf_cull = bf_cull;
+	m_ui->ff_cull = ff_cull;
+	m_ui->profiler = profiler;
+	m_ui->contact = contact;
+	m_ui->ragdoll = ragdoll;
+	m_ui->playing = playing;
+	m_ui->region = m_region;
+	m_ui->dirty = true;
+	m_input_cond.signal();
 }
 
-bool Viewer::on_expose_event(GdkEventExpose* event)
+void Viewer::record( InputEvent::Kind kind, int arg, double x, double y )
 {
-	Glib::RefPtr<Gdk::GL::Drawable> gldrawable = get_gl_drawable();
+	if ( m_recorder ) m_recorder->record( kind, arg, x, y );
+}
 
-	if (!gldrawable) return false;
+void Viewer::set_recorder( InputRecorder* recorder )
+{
+	m_recorder = recorder;
 
-	if (!gldrawable->gl_begin(get_gl_context()))
-		return false;
+	// Replays start from the size the window has now
+	if ( m_recorder ) record( InputEvent::CONFIGURE, 0, width, height );
+}
 
-	// Set up for perspective drawing 
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glViewport(0, 0, get_width(), get_height());
-	gluPerspective(40.0, (GLfloat)get_width()/(GLfloat)get_height(), 0.1, 1000.0);
+void Viewer::replay( const InputEvent& event )
+{
+	GdkEventConfigure configure;
+	GdkEventButton button;
+	GdkEventMotion motion;
+	memset( &configure, 0, sizeof( configure ) );
+	memset( &button, 0, sizeof( button ) );
+	memset( &motion, 0, sizeof( motion ) );
+	button.button = event.arg;
+	button.x = motion.x = event.x;
+	button.y = motion.y = event.y;
+
+	switch ( event.kind ) {
+	case InputEvent::CONFIGURE:
+		configure.width = event.x;
+		configure.height = event.y;
+		on_configure_event( &configure );
+		break;
+	case InputEvent::PRESS:
+		on_button_press_event( &button );
+		break;
+	case InputEvent::RELEASE:
+		on_button_release_event( &button );
+		break;
+	case InputEvent::MOTION:
+		on_motion_notify_event( &motion );
+		break;
+	case InputEvent::MODE:
+		setMode( Viewer::Modes( event.arg ) );
+		break;
+	case InputEvent::OPTION:
+		setOption( Viewer::Options( event.arg ) );
+		break;
+	case InputEvent::RESET:
+		reset( Viewer::Reset( event.arg ) );
+		break;
+	case InputEvent::UNDO:
+		undo();
+		break;
+	case InputEvent::REDO:
+		redo();
+		break;
+	case InputEvent::SELECT:
+		select( Viewer::Select( event.arg ) );
+		break;
+	case InputEvent::SEEK:
+		seek( int( event.x ) );
+		break;
+	}
+}
 
-	// change to model view for drawing
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+void Viewer::stamp( guint32 time, LatencyKind kind )
+{
+	InputStamp input;
+	input.time = m_input_clock.event_time( time, Profiler::now() );
+	input.kind = kind;
 
-	// Clear framebuffer
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	Glib::Mutex::Lock lock( m_input_lock );
+	m_ui->inputs.push_back( input );
+}
 
-	// Set up lighting
+void Viewer::feed_arrived()
+{
+	// Nothing new for the UI's buffer, the render loop looks at the
+	// feed itself
+	Glib::Mutex::Lock lock( m_input_lock );
+	m_input_cond.signal();
+}
 
+void Viewer::post( Request::Kind kind, double x, double y )
+{
+	Request r;
+	r.kind = kind;
+	r.x = x;
+	r.y = y;
+	post( r );
+}
 
-	// Process options
-	if ( z_buf ) {
-		glEnable( GL_DEPTH_TEST );
-	} else {
-		glDisable( GL_DEPTH_TEST );
-	}
-	if ( bf_cull ) {
-		glEnable( GL_CULL_FACE );
-		glCullFace(GL_BACK);
-	} else if ( ff_cull ) {
-		glEnable( GL_CULL_FACE );
-		glCullFace(GL_FRONT);
+void Viewer::post( const Request& request )
+{
+	Glib::Mutex::Lock lock( m_input_lock );
+	std::vector<Request>& requests = m_ui->requests;
+
+	// Rotations in a row add up, the render thread only needs the total
+	if ( request.kind == Request::ROTATE && !requests.empty() && requests.back().kind == Request::ROTATE ) {
+		requests.back().x += request.x;
+		requests.back().y += request.y;
+	} else if ( request.kind == Request::IK_DRAG && !requests.empty() && requests.back().kind == Request::IK_DRAG ) {
+		// Only the latest place the effector was dragged to matters
+		requests.back() = request;
 	} else {
-		glDisable( GL_CULL_FACE );
+		requests.push_back( request );
 	}
+	publish();
+}
 
-	// Draw stuff
-	draw_puppet( mode == Viewer::JOINTS );
+void Viewer::on_realize()
+{
+	// Do some OpenGL setup.
+	// First, let the base class do whatever it needs to
+	Gtk::GL::DrawingArea::on_realize();
+
+	// The GL context belongs to the render thread from now on, so we
+	// never make it current here
+	m_quit = false;
+	m_render_thread = Glib::Thread::create( sigc::mem_fun( *this, &Viewer::render_loop ), true );
+}
 
-	if ( circle && mode != Viewer::JOINTS ) draw_trackball_circle();
+void Viewer::on_unrealize()
+{
+	{
+		Glib::Mutex::Lock lock( m_input_lock );
+		m_quit = true;
+		m_input_cond.signal();
+	}
 
-	// Swap the contents of the front and back buffers so we see what we
-	// just drew. This should only be done if double buffering is enabled.
-	gldrawable->swap_buffers();
+	// The render thread may be waiting for the GDK lock we hold
+	gdk_threads_leave();
+	m_render_thread->join();
+	gdk_threads_enter();
+	m_render_thread = NULL;
+	if ( m_feed ) m_feed->set_wake( sigc::slot<void>() );
 
-	gldrawable->gl_end();
+	Gtk::GL::DrawingArea::on_unrealize();
+}
 
+bool Viewer::on_expose_event(GdkEventExpose* event)
+{
+	invalidate();
 	return true;
 }
 
 bool Viewer::on_configure_event(GdkEventConfigure* event)
 {
-	Glib::RefPtr<Gdk::GL::Drawable> gldrawable = get_gl_drawable();
-
-	if (!gldrawable) return false;
-  
-	if (!gldrawable->gl_begin(get_gl_context()))
-		return false;
-
-	// Set up perspective projection, using current size and aspect
-	// ratio of display
-
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glViewport(0, 0, event->width, event->height);
-	gluPerspective(40.0, (GLfloat)event->width/(GLfloat)event->height, 0.1, 1000.0);
-
-	// Reset to modelview matrix mode
-  
-	glMatrixMode(GL_MODELVIEW);
-
-	gldrawable->gl_end();
-
+	// The projection is set up from this size on the next frame
+	width = event->width;
+	height = event->height;
+	record( InputEvent::CONFIGURE, 0, width, height );
+	invalidate();
 	return true;
 }
 
@@ -156,13 +235,20 @@ bool Viewer::on_button_press_event(GdkEventButton* event)
 #ifdef DEBUG1
 	std::cerr << "Stub: Button " << event->button << " pressed" << std::endl;
 #endif
+	record( InputEvent::PRESS, event->button, event->x, event->y );
 	if ( event->button == 1 ) button1_pressed = true;
 	if ( event->button == 2 ) button2_pressed = true;
 	if ( event->button == 3 ) button3_pressed = true;
 
-	// Start picking joints
-	if ( mode == Viewer::JOINTS ) {
-		if ( event->button == 1 ) selectMode( event->x, event->y );
+	// Start picking joints, or dragging out a region to select
+	if ( mode == Viewer::JOINTS && event->button == 1 ) {
+		m_region.assign( 1, Point2D( event->x, event->y ) );
+	}
+
+	// Grab whatever is under the pointer to drag it about
+	if ( mode == Viewer::IK && event->button == 1 ) {
+		stamp( event->time, LATENCY_PICK );
+		post( Request::IK_GRAB, event->x, event->y );
 	}
 	old_x = event->x;
 	old_y = event->y;
@@ -174,28 +260,28 @@ bool Viewer::on_button_release_event(GdkEventButton* event)
 #ifdef DEBUG1
 	std::cerr << "Stub: Button " << event->button << " released" << std::endl;
 #endif
+	record( InputEvent::RELEASE, event->button, event->x, event->y );
 	// If B2 or B3 was held down, update action stack
-	if ( mode == Viewer::JOINTS && ( button2_pressed || button3_pressed ) ) {
-		// Update action stack
-		std::map<JointNode*, Info> sj;
-		// Save all joints and their transformation
-		for( std::map<unsigned int, Info>::iterator it = allJoints.begin(); it != allJoints.end(); it++ ) {
-			Info temp;
-			JointNode *node = (JointNode *)((*it).first);
-			temp.old_m_trans = node->get_transform();
-			temp.old_rotation = node->get_rotation();
-			sj.insert( std::pair<JointNode*, Info>( node, temp ) );
+	if ( mode == Viewer::JOINTS && ( button2_pressed || button3_pressed ) ) post( Request::RECORD );
+
+	// A click picks, a drag selects everything in the region
+	if ( event->button == 1 && !m_region.empty() ) {
+		Request r;
+		r.kind = Request::PICK;
+		r.x = m_region[0][0];
+		r.y = m_region[0][1];
+		for ( size_t i = 1; i < m_region.size(); i++ ) {
+			if ( fabs( m_region[i][0] - r.x ) >= DRAG_PIXELS || fabs( m_region[i][1] - r.y ) >= DRAG_PIXELS ) {
+				r.kind = Request::SELECT_REGION;
+				r.region = m_region;
+				break;
+			}
 		}
-
-		// If the action pointer is not pointing the top, clear anything above the pointer and add the new action
-		if ( action_it != actionStack.begin() ) actionStack.erase( actionStack.begin(), action_it );
-
-		// Insert the new entry
-		Action temp;
-		temp.joints = sj;
-		actionStack.push_front( temp ); 
-		action_it = actionStack.begin(); // Remember to update the action pointer
+		m_region.clear();
+		stamp( event->time, LATENCY_PICK );
+		post( r );
 	}
+	if ( mode == Viewer::IK && event->button == 1 && button1_pressed ) post( Request::IK_RELEASE );
 
 	if ( event->button == 1 ) button1_pressed = false;
 	if ( event->button == 2 ) button2_pressed = false;
@@ -212,23 +298,42 @@ bool Viewer::on_motion_notify_event(GdkEventMotion* event)
 #ifdef DEBUG1
 	std::cerr << "Stub: Motion at " << event->x << ", " << event->y << std::endl;
 #endif
-	double angle = 1.0;
-	double dis = 1.0;
+	double x = 0.0, y = 0.0;
+	record( InputEvent::MOTION, 0, event->x, event->y );
 	switch( mode ) {
 	case Viewer::POS_ORIENT:
 		vPerformTransfo( old_x, event->x, old_y, event->y );
+		stamp( event->time, LATENCY_MOTION );
+		invalidate();
 		break;
 	case Viewer::JOINTS:
-		// Rotate the selected joints
-		for( std::list<JointNode *>::iterator it = selectedJoints.begin(); it != selectedJoints.end(); it++ ) {
-			if ( abs( event->y - old_y ) >= dis ) {
-				double sign = ( ( event->y - old_y ) > 0 ? 1 : -1 );
-				if ( button2_pressed ) (*it)->rotate( 'x', sign * angle );
-			}
-			if ( abs( event->x - old_x ) >= dis ) {
-				double sign = ( ( event->x - old_x ) > 0 ? 1 : -1 );
-				if ( button3_pressed ) (*it)->rotate( 'y', sign * angle );
+		if ( button1_pressed && !m_region.empty() ) {
+			Point2D start = m_region[0];
+			if ( lasso ) {
+				m_region.push_back( Point2D( event->x, event->y ) );
+			} else {
+				m_region.resize( 4 );
+				m_region[1] = Point2D( event->x, start[1] );
+				m_region[2] = Point2D( event->x, event->y );
+				m_region[3] = Point2D( start[0], event->y );
 			}
+			stamp( event->time, LATENCY_MOTION );
+			invalidate();
+		}
+
+		// Rotate the selected joints by how far the mouse moved, however
+		// many events that took. post() adds up everything between frames
+		if ( button2_pressed ) x = ( event->y - old_y ) * SENS_JOINT;
+		if ( button3_pressed ) y = ( event->x - old_x ) * SENS_JOINT;
+		if ( x != 0.0 || y != 0.0 ) {
+			stamp( event->time, LATENCY_MOTION );
+			post( Request::ROTATE, x, y );
+		}
+		break;
+	case Viewer::IK:
+		if ( button1_pressed ) {
+			stamp( event->time, LATENCY_MOTION );
+			post( Request::IK_DRAG, event->x, event->y );
 		}
 		break;
 	default:
@@ -240,18 +345,295 @@ bool Viewer::on_motion_notify_event(GdkEventMotion* event)
 	return true;
 }
 
-void Viewer::draw_trackball_circle()
+void Viewer::render_loop()
+{
+	Trace::set_thread_name( "render" );
+
+	// Make the context current in this thread, for the rest of its life
+	gdk_threads_enter();
+	Glib::RefPtr<Gdk::GL::Drawable> gldrawable = get_gl_drawable();
+	bool ready = gldrawable && gldrawable->gl_begin(get_gl_context());
+	gdk_threads_leave();
+	if ( !ready ) return;
+
+	setup_gl();
+
+	for ( ;; ) {
+		{
+			Glib::Mutex::Lock lock( m_input_lock );
+			while ( !m_ui->dirty && !m_quit && !m_ik_solving && !m_clip_playing && !( m_feed && m_feed->pending() ) ) {
+				if ( !m_simulating ) {
+					m_input_cond.wait( m_input_lock );
+					continue;
+				}
+				// Falling in real time, there is nothing to draw until
+				// the next step is due
+				double wait = m_sim_clock + RAGDOLL_STEP - Profiler::now();
+				if ( !m_realtime || wait <= 0.0 ) break;
+				Glib::TimeVal until;
+				until.assign_current_time();
+				until.add_microseconds( long( wait * 1e6 ) + 1 );
+				m_input_cond.timed_wait( m_input_lock, until );
+			}
+			if ( m_quit ) break;
+			if ( m_ui->dirty ) {
+				swap_input();
+			} else {
+				// Only here to go on solving, falling, playing or following
+				// the feed, with the input we already had
+				m_render->requests.clear();
+				m_render->inputs.clear();
+			}
+		}
+
+		Profiler::set_enabled( m_render->profiler );
+		bool drawn;
+		{
+			ScopedTimer timer( PROFILE_FRAME );
+			TraceScope trace( "frame" );
+			drawn = draw_input();
+			if ( drawn ) {
+				// Swap the contents of the front and back buffers so we see what we
+				// just drew. This should only be done if double buffering is enabled.
+				ScopedTimer swap_timer( PROFILE_SWAP );
+				TraceScope swap_trace( "swap buffers" );
+				gdk_threads_enter();
+				gldrawable->swap_buffers();
+				gdk_threads_leave();
+
+				// Wait for the swap to complete, so that latencies cover the
+				// whole frame. The next frame could not draw until then anyway
+				glFinish();
+			}
+		}
+		// A frame with nothing to draw into still did its work, so it is
+		// counted, there is just nothing new on screen
+		if ( drawn ) frame_shown();
+		Metrics::end_frame();
+		Profiler::end_frame();
+	}
+
+	log_latency();
+	gdk_threads_enter();
+	if ( m_font_base ) glDeleteLists( m_font_base, 128 );
+	gldrawable->gl_end();
+	gdk_threads_leave();
+}
+
+void Viewer::setup_gl()
+{
+	glShadeModel(GL_SMOOTH);
+	glClearColor( 0.4, 0.4, 0.4, 0.0 );
+	//glEnable(GL_DEPTH_TEST);
+}
+
+void Viewer::swap_input()
+{
+	// Take the filled in buffer, and give the UI the one we are done with
+	std::swap( m_ui, m_render );
+	m_ui->requests.clear();
+	m_ui->inputs.clear();
+	m_ui->dirty = false;
+}
+
+bool Viewer::draw_input()
+{
+	for ( size_t i = 0; i < m_render->requests.size(); i++ ) process( m_render->requests[i] );
+	if ( m_ik_solving ) {
+		ScopedTimer timer( PROFILE_IK );
+		m_ik_solving = !m_ik.solve( m_render->camera, m_ik_target, m_ik_budget );
+	}
+	playClip();
+	applyFeed();
+	simulate();
+	if ( m_render->width <= 0 || m_render->height <= 0 ) return false;
+
+	render_frame( *m_render );
+	return true;
+}
+
+void Viewer::startHeadless()
+{
+	// Replays have to end in the same pose however fast they run
+	m_ik_budget = 0.0;
+	m_realtime = false;
+	setup_gl();
+}
+
+void Viewer::drawHeadless()
+{
+	{
+		Glib::Mutex::Lock lock( m_input_lock );
+		if ( !m_ui->dirty ) return;
+		swap_input();
+	}
+	if ( draw_input() ) {
+		glFinish();
+		frame_shown();
+		Metrics::end_frame();
+	}
+}
+
+void Viewer::frame_shown()
+{
+	double now = Profiler::now();
+	const std::vector<InputStamp>& inputs = m_render->inputs;
+	for ( size_t i = 0; i < inputs.size(); i++ ) m_latency[inputs[i].kind].add( now - inputs[i].time );
+}
+
+void Viewer::log_latency()
+{
+	if ( m_latency[LATENCY_MOTION].count() == 0 && m_latency[LATENCY_PICK].count() == 0 && m_latency[LATENCY_FEED].count() == 0 ) return;
+
+	std::ofstream log( LATENCY_LOG_FILE, std::ios::app );
+	if ( !log ) {
+		std::cerr << "Unable to write " << LATENCY_LOG_FILE << std::endl;
+		return;
+	}
+	time_t now = time( NULL );
+	log << "Session ending " << ctime( &now );
+	m_latency[LATENCY_MOTION].print( log, "motion" );
+	m_latency[LATENCY_PICK].print( log, "pick" );
+	if ( m_latency[LATENCY_FEED].count() > 0 ) m_latency[LATENCY_FEED].print( log, "feed" );
+	log << std::endl;
+}
+
+unsigned long long Viewer::poseChecksum() const
+{
+	// FNV-1a over the world transformation and every node's
+	unsigned long long hash = 14695981039346656037ULL;
+	hash_matrix( hash, m_rotate * m_translate );
+	if ( m_scene ) m_scene->hash_pose( hash );
+	return hash;
+}
+
+void Viewer::process( const Request& request )
+{
+	// Nothing can be done to the puppet until it has loaded
+	if ( !m_scene && request.kind != Request::LOADED ) return;
+
+	switch ( request.kind ) {
+	case Request::ROTATE:
+		if ( m_render->contact ) {
+			rotateJointsApart( request.x, request.y );
+		} else {
+			rotateJoints( request.x, request.y );
+		}
+		break;
+	case Request::PICK:
+		selectMode( request.x, request.y );
+		break;
+	case Request::SELECT_REGION:
+		selectRegion( request.region );
+		break;
+	case Request::SELECT:
+		selectJoints( Viewer::Select( request.x ) );
+		break;
+	case Request::IK_GRAB:
+		grabEffector( request.x, request.y );
+		break;
+	case Request::IK_DRAG:
+		dragEffector( request.x, request.y );
+		break;
+	case Request::IK_RELEASE:
+		releaseEffector();
+		break;
+	case Request::RECORD:
+		recordAction();
+		break;
+	case Request::UNDO:
+		undoJoints();
+		break;
+	case Request::REDO:
+		redoJoints();
+		break;
+	case Request::RESET_JOINTS:
+		resetJoints();
+		break;
+	case Request::LOADED:
+		m_scene = root;
+		findJoints();
+		// Contact is judged against the pose the scene was made in
+		m_collision.build( m_scene );
+		if ( m_clip && m_clip->bind( m_scene ) == 0 ) std::cerr << "No joint of the clip is in the scene" << std::endl;
+		// The feed's joints are found again in the new scene
+		m_feed_table.reset();
+		break;
+	case Request::SEEK:
+		if ( m_clip && m_scene && request.x >= 0 && request.x < m_clip->frames() ) {
+			// Playing goes on from here
+			showClipFrame( int( request.x ) );
+			m_clip_clock = Profiler::now();
+		}
+		break;
+	case Request::DUMP_PROFILE:
+		if ( Profiler::dump( PROFILE_DUMP_FILE ) ) {
+			std::cout << "Wrote " << Profiler::get_frames() << " frames of timing to " << PROFILE_DUMP_FILE << std::endl;
+		} else {
+			std::cerr << "Unable to write " << PROFILE_DUMP_FILE << std::endl;
+		}
+		break;
+	}
+}
+
+void Viewer::render_frame( const FrameInput& frame )
+{
+	// Set up for perspective drawing
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glViewport(0, 0, frame.width, frame.height);
+	gluPerspective(40.0, (GLfloat)frame.width/(GLfloat)frame.height, 0.1, 1000.0);
+
+	// Let the primitives choose their level of detail from the same projection
+	Primitive::set_pixels_per_unit( frame.height / ( 2.0 * tan( 20.0 * M_PI / 180.0 ) ) );
+
+	// change to model view for drawing
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	// Clear framebuffer
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// Set up lighting
+
+
+	// Process options
+	if ( frame.z_buf ) {
+		glEnable( GL_DEPTH_TEST );
+	} else {
+		glDisable( GL_DEPTH_TEST );
+	}
+	if ( frame.bf_cull ) {
+		glEnable( GL_CULL_FACE );
+		glCullFace(GL_BACK);
+	} else if ( frame.ff_cull ) {
+		glEnable( GL_CULL_FACE );
+		glCullFace(GL_FRONT);
+	} else {
+		glDisable( GL_CULL_FACE );
+	}
+
+	// Draw stuff
+	{
+		ScopedTimer timer( PROFILE_TRAVERSAL );
+		TraceScope trace( "draw puppet" );
+		draw_puppet( frame.mode == Viewer::JOINTS, frame.camera );
+	}
+
+	if ( frame.circle && frame.mode == Viewer::POS_ORIENT ) draw_trackball_circle( frame.width, frame.height );
+	if ( !frame.region.empty() ) draw_region( frame.region, frame.width, frame.height );
+	if ( frame.profiler ) draw_profile( frame.width, frame.height );
+}
+
+void Viewer::draw_trackball_circle( int current_width, int current_height )
 {
-	int current_width = get_width();
-	int current_height = get_height();
-  
 	// Set up for orthogonal drawing to draw a circle on screen.
 	// You'll want to make the rest of the function conditional on
 	// whether or not we want to draw the circle this time around.
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
 	glViewport(0, 0, current_width, current_height);
-	glOrtho(0.0, (float)current_width, 
+	glOrtho(0.0, (float)current_width,
 			0.0, (float)current_height, -0.1, 0.1);
 
 	// change to model view for drawing
@@ -260,11 +642,11 @@ void Viewer::draw_trackball_circle()
 	// Reset modelview matrix
 	glLoadIdentity();
 
-	// draw a circle for use with the trackball 
+	// draw a circle for use with the trackball
 	glDisable(GL_LIGHTING);
 	glEnable(GL_LINE_SMOOTH);
 	glColor3f(1.0, 1.0, 1.0);
-	double radius = current_width < current_height ? 
+	double radius = current_width < current_height ?
 		(float)current_width * 0.25 : (float)current_height * 0.25;
 	glTranslated((float)current_width * 0.5, (float)current_height * 0.5, 0);
 	glBegin(GL_LINE_LOOP);
@@ -278,24 +660,143 @@ void Viewer::draw_trackball_circle()
 	glDisable(GL_LINE_SMOOTH);
 }
 
+void Viewer::draw_region( const std::vector<Point2D>& region, int current_width, int current_height )
+{
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glViewport(0, 0, current_width, current_height);
+	glOrtho(0.0, (float)current_width,
+			0.0, (float)current_height, -0.1, 0.1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	// The region is in window coordinates, which start at the top
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glColor3f(1.0, 1.0, 0.0);
+	glBegin(GL_LINE_LOOP);
+	for ( size_t i = 0; i < region.size(); i++ ) glVertex2f( region[i][0], current_height - region[i][1] );
+	glEnd();
+	glColor3f(0.0, 0.0, 0.0);
+}
+
+void Viewer::draw_profile( int current_width, int current_height )
+{
+	// Bitmap font, made the first time it is needed
+	if ( !m_font_base ) {
+		m_font_base = glGenLists( 128 );
+		gdk_threads_enter();
+		Gdk::GL::Font::use_pango_font( Pango::FontDescription( "Monospace 9" ), 0, 128, m_font_base );
+		gdk_threads_leave();
+	}
+
+	// Draw in window coordinates, on top of everything
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glViewport(0, 0, current_width, current_height);
+	glOrtho(0.0, (float)current_width,
+			0.0, (float)current_height, -0.1, 0.1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glColor3f(1.0, 1.0, 1.0);
+	glListBase( m_font_base );
+
+	char line[128];
+	int y = current_height;
+	snprintf( line, sizeof( line ), "%-10s %7s %7s %7s %7s  (ms, %d frames)", "", "min", "avg", "p95", "p99", Profiler::get_frames() );
+	for ( int i = -1; i < PROFILE_PHASES; i++ ) {
+		if ( i >= 0 ) {
+			Profiler::Stats stats = Profiler::get_stats( ProfilePhase( i ) );
+			snprintf( line, sizeof( line ), "%-10s %7.3f %7.3f %7.3f %7.3f", Profiler::get_name( ProfilePhase( i ) ),
+					  stats.min, stats.avg, stats.p95, stats.p99 );
+		}
+		y -= 14;
+		glRasterPos2i( 8, y );
+		glCallLists( strlen( line ), GL_UNSIGNED_BYTE, line );
+	}
+
+	// Input latency over the session so far
+	const char* names[LATENCY_KINDS] = { "motion", "pick", "feed" };
+	long events = m_latency[LATENCY_MOTION].count() + m_latency[LATENCY_PICK].count() + m_latency[LATENCY_FEED].count();
+	snprintf( line, sizeof( line ), "%-10s %7s %7s %7s %7s  (ms, %ld events)", "latency", "p50", "p90", "p99", "max", events );
+	for ( int i = -1; i < LATENCY_KINDS; i++ ) {
+		if ( i >= 0 ) {
+			const LatencyHistogram& latency = m_latency[i];
+			snprintf( line, sizeof( line ), "%-10s %7.2f %7.2f %7.2f %7.2f", names[i], latency.percentile( 50 ) * 1e3,
+					  latency.percentile( 90 ) * 1e3, latency.percentile( 99 ) * 1e3, latency.max() * 1e3 );
+		}
+		y -= 14;
+		glRasterPos2i( 8, y );
+		glCallLists( strlen( line ), GL_UNSIGNED_BYTE, line );
+	}
+	glColor3f(0.0, 0.0, 0.0);
+}
+
 void Viewer::initialize() {
 	button1_pressed = button2_pressed = button3_pressed = false;
-	circle = z_buf = bf_cull = ff_cull = false;
+	circle = z_buf = bf_cull = ff_cull = profiler = lasso = contact = ragdoll = playing = false;
+	mode = Viewer::POS_ORIENT;
+	old_x = old_y = 0;
+	width = height = 0;
+
+	// Both input buffers start out empty
+	m_ui = &m_buffers[0];
+	m_render = &m_buffers[1];
+	m_ui->dirty = m_render->dirty = false;
+	m_quit = false;
+	m_loader = NULL;
+	m_feed = NULL;
+	m_render_thread = NULL;
+	m_scene = NULL;
+	m_font_base = 0;
+	m_recorder = NULL;
+	m_ik_depth = 0.0;
+	m_ik_solving = false;
+	m_ik_budget = IK_BUDGET;
+	m_simulating = false;
+	m_realtime = true;
+	m_sim_clock = 0.0;
+	m_clip = NULL;
+	m_clip_shown = 0;
+	m_clip_frame = 0;
+	m_clip_playing = false;
+	m_clip_clock = 0.0;
+}
+
+void Viewer::set_loader( SceneLoader* loader ) {
+	m_loader = loader;
+}
+
+void Viewer::loaded() {
+	post( Request::LOADED );
+}
+
+void Viewer::set_clip( BvhClip* clip ) {
+	Glib::Mutex::Lock lock( m_input_lock );
+	m_clip = clip;
+}
 
+void Viewer::set_feed( PoseFeed* feed ) {
+	{
+		Glib::Mutex::Lock lock( m_input_lock );
+		m_feed = feed;
+	}
+	// Not under m_input_lock, which the wake takes inside the feed's lock
+	if ( feed ) feed->set_wake( sigc::mem_fun( *this, &Viewer::feed_arrived ) );
+}
+
+void Viewer::findJoints() {
 	// Action stack for reseting the joints
 	// This entry should never be removed from the action stack list and is always the last entry in the list
-	root->findJoints( allJoints );
-	std::map<JointNode*, Info> sj;
-	for( std::map<unsigned int, Info>::iterator it = allJoints.begin(); it != allJoints.end(); it++ ) {
+	m_scene->findJoints( allJoints );
 #ifdef DEBUG1
-		std::cout << ((JointNode *)((*it).first))->get_name() << std::endl;
+	for( size_t i = 0; i < allJoints.size(); i++ ) std::cout << JointNode::by_id( allJoints[i] )->get_name() << std::endl;
 #endif
-		sj.insert( std::pair<JointNode*, Info>( (JointNode *)((*it).first), (*it).second));
-	}
-	Action first;
-	first.joints = sj;
-	actionStack.push_back( first );
-	action_it = actionStack.begin(); // Remember to set the action pointer
+	for( size_t i = 0; i < allJoints.size(); i++ ) m_joints.insert( allJoints[i] );
+	action_it = actionStack.begin();
+	recordAction();
 }
 
 void Viewer::setOption( Viewer::Options option ) {
@@ -313,19 +814,38 @@ void Viewer::setOption( Viewer::Options option ) {
 	case Viewer::FRONT_CULL:
 		ff_cull = !ff_cull;
 		break;
+	case Viewer::PROFILER:
+		profiler = !profiler;
+		break;
+	case Viewer::LASSO:
+		lasso = !lasso;
+		break;
+	case Viewer::CONTACT:
+		contact = !contact;
+		break;
+	case Viewer::RAGDOLL:
+		ragdoll = !ragdoll;
+		break;
+	case Viewer::PLAY:
+		playing = !playing;
+		break;
 	default:
 		std::cerr << "Unknown options" << std::endl;
-		break;
+		return;
 	}
+	record( InputEvent::OPTION, option );
+	invalidate();
 }
 
 void Viewer::setMode( Viewer::Modes mode ) {
 	this->mode = mode;
+	record( InputEvent::MODE, mode );
+	invalidate();
 }
 
 void Viewer::reset( Viewer::Reset r ) {
 	bool all = false;
-	std::list<Action>::reverse_iterator it = actionStack.rbegin();
+	record( InputEvent::RESET, r );
 	switch ( r ) {
 	case Viewer::ALL:
 		all = true;
@@ -337,61 +857,202 @@ void Viewer::reset( Viewer::Reset r ) {
 		m_rotate = Matrix4x4();
 		if ( !all ) break;
 	case Viewer::JOINTS_R:
-		// Reset all joints using the last entry in aciton stack
-		action_it = actionStack.end();
-		action_it--;
-		for( std::map<JointNode*, Info>::iterator it = (*action_it).joints.begin(); it != (*action_it).joints.end(); it++ ) {
-			((*it).first)->set_transform( (*it).second.old_m_trans );
-			((*it).first)->set_rotation( (*it).second.old_rotation );
-			if ( ((*it).first)->get_pick() ) ((*it).first)->set_pick(); // Unpick all joints
-		}
-		// Clear action stack expect the reset entry
-		actionStack.erase( actionStack.begin(), action_it );
-		action_it = actionStack.begin();
-
-		// Don't forget to clear the current selected joint list
-		selectedJoints.clear();
+		post( Request::RESET_JOINTS );
 		break;
 	default:
 		std::cerr << "Unknown reset options?!" << std::endl;
 		break;
 	}
+	invalidate();
 }
 
-void Viewer::draw_puppet( bool picking ) {
-	/*	Still wondering why can't I use push and pop matrix :(
-		glMatrixMode( GL_MODELVIEW );
-		glPushMatrix();
-		glLoadIdentity();
-		// Apply world transformation
-		glMultMatrixd( m_rotate.begin() );
-		glMultMatrixd( m_translate.begin() ); */
-	root->set_transform( root->get_transform() * m_rotate * m_translate );
-	root->walk_gl( picking );	
-	invalidate();							// Remember to redraw
-	root->set_transform( root->get_transform() * ( m_rotate * m_translate ).invert() );
-	//	glPopMatrix();
+void Viewer::dumpProfile() {
+	post( Request::DUMP_PROFILE );
 }
 
-void Viewer::selectMode( int x, int y ) {
-	GLint *viewport = new GLint[4];	
-	glSelectBuffer( BUFFER_SIZE, pickBuffer ); 	/* initialize pick buffer */
+void Viewer::undo() {
+	record( InputEvent::UNDO );
+	post( Request::UNDO );
+}
+
+void Viewer::redo() {
+	record( InputEvent::REDO );
+	post( Request::REDO );
+}
+
+void Viewer::select( Viewer::Select s ) {
+	record( InputEvent::SELECT, s );
+	post( Request::SELECT, s );
+}
+
+void Viewer::seek( int frame ) {
+	record( InputEvent::SEEK, 0, frame );
+	post( Request::SEEK, frame );
+}
+
+/*
+ * Everything from here to the trackball code runs on the render thread
+ */
+
+void Viewer::rotateJoints( double x, double y ) {
+	// Rotate the selected joints
+	for( NodeId id = m_selection.next(); id != NO_NODE; id = m_selection.next( id ) ) {
+		JointNode::by_id( id )->rotate_limited( x, y );
+	}
+}
+
+static void restore_joints( const std::vector<NodeId>& joints, const std::vector<SceneNode::Info>& saved ) {
+	for( size_t j = 0; j < joints.size(); j++ ) {
+		JointNode *node = JointNode::by_id( joints[j] );
+		node->set_transform( saved[j].old_m_trans );
+		node->set_rotation( saved[j].old_rotation );
+	}
+}
+
+void Viewer::rotateJointsApart( double x, double y ) {
+	ScopedTimer timer( PROFILE_COLLISION );
+	TraceScope trace( "rotate apart" );
+
+	// Parts that touch already may go on touching
+	m_collision.update();
+	std::vector<CollisionWorld::Contact> before = m_collision.contacts();
+	std::vector<NodeId> joints;
+	std::vector<Info> saved;
+	for( NodeId id = m_selection.next(); id != NO_NODE; id = m_selection.next( id ) ) {
+		JointNode *node = JointNode::by_id( id );
+		Info info;
+		info.old_m_trans = node->get_transform();
+		info.old_rotation = node->get_rotation();
+		joints.push_back( id );
+		saved.push_back( info );
+	}
+
+	// From here on only the selected joints turn
+	rotateJoints( x, y );
+	m_collision.update( joints );
+	if ( !m_collision.new_contact( before ) ) return;
+
+	// Find how much of the turn there is room for, by halving
+	double room = 0.0, step = 0.5;
+	for ( int i = 0; i < CONTACT_STEPS; i++, step *= 0.5 ) {
+		restore_joints( joints, saved );
+		rotateJoints( x * ( room + step ), y * ( room + step ) );
+		m_collision.update( joints );
+		if ( !m_collision.new_contact( before ) ) room += step;
+	}
+	restore_joints( joints, saved );
+	if ( room > 0.0 ) rotateJoints( x * room, y * room );
+	m_collision.update( joints );
+}
+
+void Viewer::recordAction() {
+	ScopedTimer timer( PROFILE_UNDO );
+	TraceScope trace( "record action" );
+	// If the action pointer is not pointing the top, clear anything above the pointer and add the new action
+	if ( action_it != actionStack.begin() ) actionStack.erase( actionStack.begin(), action_it );
+
+	// Save all joints and their transformation in a new entry
+	actionStack.push_front( Action() );
+	std::vector<Info>& joints = actionStack.front().joints;
+	joints.resize( allJoints.size() );
+	for( size_t i = 0; i < allJoints.size(); i++ ) {
+		JointNode *node = JointNode::by_id( allJoints[i] );
+		joints[i].old_m_trans = node->get_transform();
+		joints[i].old_rotation = node->get_rotation();
+	}
+	action_it = actionStack.begin(); // Remember to update the action pointer
+	count_undo_bytes();
+}
+
+void Viewer::count_undo_bytes() {
+	size_t joints = 0;
+	for( std::list<Action>::const_iterator it = actionStack.begin(); it != actionStack.end(); it++ ) joints += (*it).joints.capacity();
+	Metrics::set( METRIC_UNDO_BYTES, joints * sizeof( Info ) + actionStack.size() * sizeof( Action ) );
+}
+
+void Viewer::restoreAction( const Action& action ) {
+	for( size_t i = 0; i < allJoints.size(); i++ ) {
+		JointNode *node = JointNode::by_id( allJoints[i] );
+		node->set_transform( action.joints[i].old_m_trans );
+		node->set_rotation( action.joints[i].old_rotation );
+	}
+}
+
+void Viewer::resetJoints() {
+	TraceScope trace( "reset joints" );
+	// Reset all joints using the last entry in aciton stack
+	action_it = actionStack.end();
+	action_it--;
+	restoreAction( *action_it );
+	for( size_t i = 0; i < allJoints.size(); i++ ) {
+		JointNode *node = JointNode::by_id( allJoints[i] );
+		if ( node->get_pick() ) node->set_pick(); // Unpick all joints
+	}
+	// Clear action stack expect the reset entry
+	actionStack.erase( actionStack.begin(), action_it );
+	action_it = actionStack.begin();
+	count_undo_bytes();
+
+	// Don't forget to clear the current selected joint list
+	m_selection.clear();
+}
+
+void Viewer::draw_puppet( bool picking, const Matrix4x4& camera ) {
+	// The world transformation goes through the root. Geometry loads its
+	// own modelview, so put back the one it is drawn from
+	glPushMatrix();
+	if ( m_scene ) {
+		m_scene->walk_gl( m_scene->get_transform() * camera, picking );
+	} else if ( m_loader ) {
+		// While loading, draw as much as the loader has built
+		const std::vector<SceneNode*>& preview = m_loader->lock_preview();
+		for ( size_t i = 0; i < preview.size(); i++ ) {
+			preview[i]->walk_gl( preview[i]->get_transform() * camera, picking );
+		}
+		m_loader->unlock_preview();
+	}
+	glPopMatrix();
+}
+
+int Viewer::pick( int x, int y ) {
+	if ( m_scene ) {
+		return selectionPass( pickBuffer, BUFFER_SIZE, x, y, m_render->width, m_render->height,
+							  m_render->camera, std::vector<SceneNode*>( 1, m_scene ) );
+	}
+	if ( !m_loader ) return 0;
+	// While loading, pick from as much as the loader has built
+	int hits = selectionPass( pickBuffer, BUFFER_SIZE, x, y, m_render->width, m_render->height,
+							  m_render->camera, m_loader->lock_preview() );
+	m_loader->unlock_preview();
+	return hits;
+}
+
+int Viewer::selectionPass( GLuint* buffer, GLsizei size, int x, int y, int width, int height,
+						   const Matrix4x4& camera, const std::vector<SceneNode*>& scenes ) {
+	GLint viewport[4];
+	glSelectBuffer( size, buffer ); 		/* initialize pick buffer */
 	glGetIntegerv( GL_VIEWPORT, viewport ); 	/* set up pick view */
 
 	// Initialize name stack
 	glRenderMode( GL_SELECT );
 	glInitNames();
-	glPushName( -1 );
+	glPushName( NO_NODE );
 
 	// Save old projective matrix and set up a new one
 	glMatrixMode(GL_PROJECTION);
 	glPushMatrix();
 	glLoadIdentity();
 
-	// Draw scene with appropriate name stack
+	// Draw scene with appropriate name stack, as draw_puppet does
 	gluPickMatrix( x, viewport[3]-y, 1, 1, viewport );
-	gluPerspective( 40.0, (GLfloat)get_width()/(GLfloat)get_height(), 0.1, 1000.0 );
-	draw_puppet(false);
+	gluPerspective( 40.0, (GLfloat)width/(GLfloat)height, 0.1, 1000.0 );
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	glPushMatrix();
+	for ( size_t i = 0; i < scenes.size(); i++ ) {
+		scenes[i]->walk_gl( scenes[i]->get_transform() * camera, false );
+	}
+	glPopMatrix();
 
 	// Restore projective matrix
 	glMatrixMode(GL_PROJECTION);
@@ -403,15 +1064,35 @@ void Viewer::selectMode( int x, int y ) {
 #ifdef DEBUG1
 	std::cout << "Number of hits: " << hits << std::endl;
 #endif
-	// Process the hits
-	pickJoints( hits );
+	return hits;
 }
 
-void Viewer::pickJoints( int hits ) {
+void Viewer::selectMode( int x, int y ) {
+	ScopedTimer timer( PROFILE_PICKING );
+	TraceScope trace( "pick" );
+	pickJoints( pick( x, y ) );
+}
+
+NodeId Viewer::pickedNode( const GLuint* buffer, int hits ) {
+	// The last name of a hit is the node that was drawn, min z the second element
+	const GLuint *offset = buffer;
+	NodeId node = NO_NODE;
+	GLuint nearest = 0;
+	for( int i = 0; i < hits; i += 1 ) {
+		unsigned int numNames = offset[0];
+		if ( numNames > 0 && offset[2 + numNames] != NO_NODE && ( node == NO_NODE || offset[1] < nearest ) ) {
+			node = offset[2 + numNames];
+			nearest = offset[1];
+		}
+		offset += 3 + numNames;
+	}
+	return node;
+}
+
+JointNode* Viewer::pickedJoint( const GLuint* buffer, int hits ) {
 	// NOTE: elements in the buffer are varies in group size, with first as number of names
-	GLuint *offset = ( GLuint * )pickBuffer;
+	const GLuint *offset = buffer;
 	unsigned int numNames = 0;
-	SceneNode *invalid = (SceneNode *)0xffffffff;
 	JointNode *joint = NULL;
 	// Number of hits
 	for( int i = 0; i < hits; i += 1 ) {
@@ -424,10 +1105,9 @@ void Viewer::pickJoints( int hits ) {
 		offset += 3;			// Skip the min z and max z value
 		// Number of names
 		for ( unsigned int j = 0; j < numNames; j += 1 ) {
-			SceneNode *node = (SceneNode *)(*offset);
-			/* Weird place where I will get invalide JointNode pointer, so have to explictly check if the
-			   JointNode pointer is valid or not */ 
-			if ( node != invalid ) {
+			// NO_NODE at the bottom of the name stack finds nothing
+			SceneNode *node = SceneNode::by_id( *offset );
+			if ( node ) {
 #ifdef DEBUG1
 				std::cout << "Joint Name: " << node->get_name() << std::endl;
 #endif
@@ -436,23 +1116,249 @@ void Viewer::pickJoints( int hits ) {
 			offset += 1;
 		}
 	}
+	return joint;
+}
+
+void Viewer::pickJoints( int hits ) {
 	// We only keep the joint that is at the bottom of the hierarchy
+	JointNode *joint = pickedJoint( pickBuffer, hits );
 	if ( joint != NULL ) {
 #ifdef DEBUG1
 		std::cout << "Picked Joint: " << joint->get_name() << std::endl;			
 #endif			
 		joint->set_pick();
-		if ( joint->get_pick() ) {
-			selectedJoints.push_back( joint ); // Add new joint to list of selected joints 
-		} else {			
-			selectedJoints.remove( joint );    // Remove joint from selected list 
+		m_selection.toggle( joint->get_id() );
+
+	}
+}
+
+void Viewer::selectRegion( const std::vector<Point2D>& region ) {
+	ScopedTimer timer( PROFILE_PICKING );
+	TraceScope trace( "select region" );
+
+	// Where every joint is, through the same camera draw_puppet uses
+	std::vector<NodeId> ids;
+	std::vector<float> x, y, z;
+	ids.reserve( allJoints.size() );
+	x.reserve( allJoints.size() );
+	y.reserve( allJoints.size() );
+	z.reserve( allJoints.size() );
+	Matrix4x4 saved = m_scene->get_transform(), saved_inverse = m_scene->get_inverse();
+	m_scene->set_transform( saved * m_render->camera );
+	m_scene->joint_origins( Matrix4x4(), ids, x, y, z );
+	m_scene->set_transform( saved, saved_inverse );
+
+	// Project them all into the window in one pass, as gluPerspective
+	// in render_frame would. Anything behind the near plane ends up
+	// far off screen
+	const float width = m_render->width, height = m_render->height;
+	const float fy = 1.0 / tan( 20.0 * M_PI / 180.0 ), fx = fy * height / width;
+	const size_t n = ids.size();
+	for ( size_t i = 0; i < n; i++ ) {
+		float w = z[i] < -0.1f ? -z[i] : 0.0f;
+		x[i] = w > 0.0f ? ( 1.0f + fx * x[i] / w ) * 0.5f * width : -1e30f;
+		y[i] = w > 0.0f ? ( 1.0f - fy * y[i] / w ) * 0.5f * height : -1e30f;
+	}
+
+	// Then test them against the polygon, by the even-odd rule, after
+	// its bounding box
+	float left = region[0][0], right = left, top = region[0][1], bottom = top;
+	for ( size_t j = 1; j < region.size(); j++ ) {
+		left = std::min( left, (float)region[j][0] );
+		right = std::max( right, (float)region[j][0] );
+		top = std::min( top, (float)region[j][1] );
+		bottom = std::max( bottom, (float)region[j][1] );
+	}
+	for ( size_t i = 0; i < n; i++ ) {
+		if ( x[i] < left || x[i] > right || y[i] < top || y[i] > bottom ) continue;
+		bool inside = false;
+		for ( size_t j = 0, k = region.size() - 1; j < region.size(); k = j++ ) {
+			double xj = region[j][0], yj = region[j][1], xk = region[k][0], yk = region[k][1];
+			if ( ( yj > y[i] ) != ( yk > y[i] ) && x[i] < xj + ( y[i] - yj ) * ( xk - xj ) / ( yk - yj ) ) inside = !inside;
 		}
+		if ( inside ) m_selection.insert( ids[i] );
+	}
+	showSelection();
+}
 
+void Viewer::selectJoints( Viewer::Select s ) {
+	TraceScope trace( "select" );
+	switch ( s ) {
+	case Viewer::SELECT_ALL:
+		m_selection = m_joints;
+		break;
+	case Viewer::SELECT_NONE:
+		m_selection.clear();
+		break;
+	case Viewer::SELECT_INVERT:
+		m_selection.toggle( m_joints );
+		break;
+	case Viewer::SELECT_SUBTREE:
+		m_scene->select_subtrees( m_selection );
+		break;
 	}
-	invalidate();
+	showSelection();
 }
 
-void Viewer::undo() {
+void Viewer::showSelection() {
+	for( size_t i = 0; i < allJoints.size(); i++ ) {
+		JointNode::by_id( allJoints[i] )->set_pick( m_selection.contains( allJoints[i] ) );
+	}
+}
+
+void Viewer::grabEffector( int x, int y ) {
+	TraceScope trace( "grab effector" );
+	int hits;
+	{
+		ScopedTimer timer( PROFILE_PICKING );
+		hits = pick( x, y );
+	}
+	m_ik_solving = false;
+	NodeId id = pickedNode( pickBuffer, hits );
+	if ( id == NO_NODE || !m_ik.attach( m_scene, id ) ) {
+		m_ik.detach();
+		return;
+	}
+
+	// It is dragged about in the plane facing the viewer that it starts in
+	m_ik_target = m_ik.effector( m_render->camera );
+	m_ik_depth = -m_ik_target[2];
+}
+
+void Viewer::dragEffector( int x, int y ) {
+	if ( !m_ik.attached() || m_ik_depth <= 0.0 ) return;
+
+	// Back from the window into eye coordinates at the effector's depth,
+	// undoing gluPerspective in render_frame
+	const double fy = 1.0 / tan( 20.0 * M_PI / 180.0 ), fx = fy * m_render->height / m_render->width;
+	m_ik_target = Point3D( ( 2.0 * x / m_render->width - 1.0 ) * m_ik_depth / fx,
+						   ( 1.0 - 2.0 * y / m_render->height ) * m_ik_depth / fy,
+						   -m_ik_depth );
+	m_ik_solving = true;
+}
+
+void Viewer::releaseEffector() {
+	// Wherever the chain got to goes on the action stack, like a drag
+	// with button 2 or 3, unless a click left every joint where it was
+	if ( m_ik.attached() && m_ik.moved() ) recordAction();
+	m_ik.detach();
+	m_ik_solving = false;
+}
+
+void Viewer::simulate() {
+	if ( !m_scene || ( !m_render->ragdoll && !m_ragdoll.built() ) ) return;
+	ScopedTimer timer( PROFILE_RAGDOLL );
+	TraceScope trace( "ragdoll" );
+	double now = Profiler::now();
+
+	if ( !m_render->ragdoll ) {
+		// Put back what the undo stack does not cover, and keep the
+		// joints where they fell as a pose that can be undone
+		m_ragdoll.restore();
+		m_ragdoll.clear();
+		recordAction();
+		m_simulating = false;
+		return;
+	}
+	if ( !m_ragdoll.built() ) {
+		// From whatever pose the puppet is in now
+		m_ragdoll.build( m_scene );
+		m_simulating = true;
+		m_sim_clock = now;
+		return;
+	}
+	if ( m_ragdoll.at_rest() ) {
+		// Lying still, there are no more frames to draw until it is let go
+		m_simulating = false;
+		return;
+	}
+
+	int steps = 1;
+	if ( m_realtime ) {
+		steps = int( ( now - m_sim_clock ) / RAGDOLL_STEP );
+		if ( steps > RAGDOLL_CATCH_UP ) {
+			steps = RAGDOLL_CATCH_UP;
+			m_sim_clock = now;
+		} else {
+			m_sim_clock += steps * RAGDOLL_STEP;
+		}
+	}
+	if ( steps <= 0 ) return;
+	m_ragdoll.run( steps, 0 );
+	m_ragdoll.apply();
+}
+
+void Viewer::applyFeed() {
+	// Taken even before the puppet has loaded, so the ring never fills
+	// with frames nobody will draw
+	double sent;
+	std::tr1::shared_ptr<const PoseFeed::JointTable> table;
+	if ( !m_feed || !m_feed->take( m_feed_angles, sent, table ) ) return;
+	if ( !m_scene ) return;
+	TraceScope trace( "feed" );
+
+	// Find the sender's joints by path, once for each sender and scene
+	if ( table != m_feed_table ) {
+		m_feed_table = table;
+		m_feed_joints.assign( table->size(), NO_NODE );
+		for ( size_t j = 0; j < table->size(); j++ ) {
+			SceneNode* node = SceneNode::find( (*table)[j], m_scene->get_scope() );
+			if ( node && node->is_joint() ) m_feed_joints[j] = node->get_id();
+		}
+	}
+
+	for ( size_t i = 0; i < m_feed_angles.size(); i++ ) {
+		JointNode* joint = JointNode::by_id( m_feed_joints[m_feed_angles[i].joint] );
+		if ( joint ) joint->set_angles( m_feed_angles[i].x, m_feed_angles[i].y );
+	}
+
+	// From when the newest frame was sent to when it is on screen
+	InputStamp input;
+	input.time = sent;
+	input.kind = LATENCY_FEED;
+	m_render->inputs.push_back( input );
+}
+
+void Viewer::playClip() {
+	if ( !m_clip || !m_scene || m_clip->frames() == 0 || ( !m_render->playing && !m_clip_playing ) ) return;
+	double now = Profiler::now();
+
+	if ( !m_render->playing ) {
+		// Keep the frame it stopped on as a pose that can be undone
+		recordAction();
+		m_clip_playing = false;
+		return;
+	}
+	if ( !m_clip_playing ) {
+		m_clip_playing = true;
+		m_clip_clock = now;
+		showClipFrame( m_clip_frame );
+		return;
+	}
+
+	// When drawing falls behind, the frames in between are skipped
+	// without being decoded
+	int frames = 1;
+	if ( m_realtime ) {
+		frames = int( ( now - m_clip_clock ) / m_clip->frame_time() );
+		m_clip_clock += frames * m_clip->frame_time();
+	}
+	if ( frames <= 0 ) return;
+	showClipFrame( ( m_clip_frame + frames ) % m_clip->frames() );
+}
+
+void Viewer::showClipFrame( int frame ) {
+	ScopedTimer timer( PROFILE_MOTION );
+	TraceScope trace( "motion" );
+
+	// A frame cut off the end of the file leaves the pose as it was
+	m_clip_frame = frame;
+	m_clip->pose( frame );
+	g_atomic_int_set( &m_clip_shown, frame );
+}
+
+void Viewer::undoJoints() {
+	TraceScope trace( "undo" );
 	action_it++;				// Move pointer down by one entry
 	// If action pointer is at the bottom of the stack pointing at the reset entry, nothing to undo
 	if ( action_it == actionStack.end() || actionStack.size() == 1 ) {
@@ -461,13 +1367,11 @@ void Viewer::undo() {
 		return;
 	}
 	// Restore
-	for( std::map<JointNode*, Info>::iterator it = (*action_it).joints.begin(); it != (*action_it).joints.end(); it++ ) {
-		((*it).first)->set_transform( (*it).second.old_m_trans );
-		((*it).first)->set_rotation( (*it).second.old_rotation );
-	}
+	restoreAction( *action_it );
 }
 
-void Viewer::redo() {
+void Viewer::redoJoints() {
+	TraceScope trace( "redo" );
 	action_it--;				// Move pointer up by one entry
 	// If action pointer is at the top of stack or if the stack only contains the reset entry, nothing to redo
 	if ( action_it == actionStack.end() || actionStack.size() == 1 ) {
@@ -475,11 +1379,7 @@ void Viewer::redo() {
 		action_it++;
 		return;
 	}
-	for( std::map<JointNode*, Info>::iterator it = (*action_it).joints.begin(); it != (*action_it).joints.end(); it++ ) {
-		((*it).first)->set_transform( (*it).second.old_m_trans );
-		((*it).first)->set_rotation( (*it).second.old_rotation );
-	}
-	invalidate();
+	restoreAction( *action_it );
 }
 
 /****************************************************************
@@ -684,8 +1584,8 @@ void Viewer::vPerformTransfo(float fOldX, float fNewX, float fOldY, float fNewY)
 {
     float  fRotVecX, fRotVecY, fRotVecZ;
     Matrix4x4 mNewMat;
-	float nWinWidth = (float)get_width();
-	float nWinHeight = (float)get_height();
+	float nWinWidth = (float)width;
+	float nWinHeight = (float)height;
 
     /*
      * Track ball rotations are being used.
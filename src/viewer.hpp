@@ -5,20 +5,60 @@
 #include <gtkglmm.h>
 #include "scene_lua.hpp"
 #include "scene.hpp"
+#include "scene_loader.hpp"
+#include "profiler.hpp"
+#include "input_record.hpp"
+#include "latency.hpp"
+#include "metrics.hpp"
+#include "node_set.hpp"
+#include "ik.hpp"
+#include "collision.hpp"
+#include "ragdoll.hpp"
+#include "pose_feed.hpp"
+#include "bvh.hpp"
 #include <list>
-#include <map>
+#include <vector>
 
 // Constants from event.h for world rotation and translation
 #define SENS_PANX 30.0
 #define SENS_PANY 23.0
 #define SENS_ZOOM 35.0
 
+// Degrees a selected joint turns for each pixel the mouse moves
+#define SENS_JOINT 0.5
+
+// Pixels button 1 has to be dragged to select a region instead of
+// picking under the pointer
+#define DRAG_PIXELS 4
+
+// Halvings of a joint drag that would bring parts into contact, to
+// find how far it can go with the CONTACT option
+#define CONTACT_STEPS 6
+
+// Seconds the inverse kinematics solver may take out of each frame.
+// Whatever it has not done by then it goes on with in the next
+#define IK_BUDGET 0.004
+
+// Most ragdoll steps a frame takes to catch up with the clock. Frames
+// slower than that slow the fall down rather than getting slower still
+#define RAGDOLL_CATCH_UP 4
+
 // Size of buffer
 #define BUFFER_SIZE 512
 
+// Where Options > Dump Timing writes the profiler's statistics
+#define PROFILE_DUMP_FILE "profile.txt"
+
+// Where the input latency of each session is appended when it ends
+#define LATENCY_LOG_FILE "latency.log"
+
 extern SceneNode *root;			// Puppet
 
 // The "main" OpenGL widget
+//
+// All OpenGL work and everything that touches the puppet happens on a
+// render thread of its own. The GTK event handlers only turn input
+// into requests for it, so a slow frame never holds up the UI.
 class Viewer : public Gtk::GL::DrawingArea {
 public:
 	Viewer();
@@ -26,18 +66,49 @@ public:
 
 	// A useful function that forces this widget to rerender. If you
 	// want to render a new frame, do not call on_expose_event
-	// directly. Instead call this, which will cause an on_expose_event
-	// call when the time is right.
+	// directly. Instead call this, which will wake the render thread
+	// up when the time is right.
 	void invalidate();
 
 	// Public modes
-	enum Modes { POS_ORIENT, JOINTS };
+	enum Modes { POS_ORIENT, JOINTS, IK };
 	void setMode( Viewer::Modes mode );
 
 	// Public options
-	enum Options { CIRCLE, Z_BUFFER, BACK_CULL, FRONT_CULL };
+	enum Options { CIRCLE, Z_BUFFER, BACK_CULL, FRONT_CULL, PROFILER, LASSO, CONTACT, RAGDOLL, PLAY };
 	void setOption( Viewer::Options option );
 
+	// Write the profiler's statistics to PROFILE_DUMP_FILE
+	void dumpProfile();
+
+	// Write all input from here on to recorder, or stop if it is NULL
+	void set_recorder( InputRecorder* recorder );
+	// Act on a recorded event as when it first happened
+	void replay( const InputEvent& event );
+
+	// Drawing without the widget, for replays. After startHeadless()
+	// every drawHeadless() draws a frame from whatever input there has
+	// been since the last, into the GL context current on the calling
+	// thread, and waits for it to finish.
+	void startHeadless();
+	void drawHeadless();
+
+	// Hash of the puppet's pose and the world transformation, for
+	// checking that two runs ended up in the same place. Only call it
+	// from the thread that draws
+	unsigned long long poseChecksum() const;
+
+	// A selection pass into buffer, under window position x, y of a
+	// width by height view, drawing scenes through camera into the
+	// current viewport. Returns the hits
+	static int selectionPass( GLuint* buffer, GLsizei size, int x, int y, int width, int height,
+							  const Matrix4x4& camera, const std::vector<SceneNode*>& scenes );
+	// The joint lowest in the hierarchy among the hits of a selection
+	// pass, NULL if no joint was hit
+	static JointNode* pickedJoint( const GLuint* buffer, int hits );
+	// The node drawn nearest the viewer among the hits, NO_NODE if none
+	static NodeId pickedNode( const GLuint* buffer, int hits );
+
 	// Public reset options
 	enum Reset { POS, ORIENT, JOINTS_R, ALL };
 	void reset( Viewer::Reset r );
@@ -45,7 +116,29 @@ public:
 	// Public undo and redo options
 	void undo();
 	void redo();
-  
+
+	// Public selection operations, on top of picking and dragging out
+	// a box, or a lasso with the LASSO option, in joint mode
+	enum Select { SELECT_ALL, SELECT_NONE, SELECT_INVERT, SELECT_SUBTREE };
+	void select( Viewer::Select s );
+
+	// Draw the scene from loader as it is built. Call before the
+	// widget is realized
+	void set_loader( SceneLoader* loader );
+	// Start posing the puppet in root, once it has finished loading
+	void loaded();
+	// Pose the joints as feed says, every frame, as well as from the UI.
+	// Feed must outlive the widget
+	void set_feed( PoseFeed* feed );
+	// Pose the joints from clip, playing with the PLAY option and at
+	// whatever frame seek() asks for. Clip must outlive the widget, and
+	// is only used from the thread that draws
+	void set_clip( BvhClip* clip );
+	// Show a frame of the clip
+	void seek( int frame );
+	// The frame of the clip shown last, for a timeline to follow
+	int clipFrame() const { return g_atomic_int_get( &m_clip_shown ); }
+
 protected:
 
 	// Events we implement
@@ -56,6 +149,8 @@ protected:
 
 	// Called when GL is first initialized
 	virtual void on_realize();
+	// Called when the window is going away
+	virtual void on_unrealize();
 	// Called when our window needs to be redrawn
 	virtual bool on_expose_event(GdkEventExpose* event);
 	// Called when the window is resized
@@ -67,13 +162,6 @@ protected:
 	// Called when the mouse moves
 	virtual bool on_motion_notify_event(GdkEventMotion* event);
 
-	// Draw a circle for the trackball, with OpenGL commands.
-	// Assumes the context for the viewer is active.
-	void draw_trackball_circle();
-
-	// Draw puppet
-	void draw_puppet( bool picking );
-
 	// Copy of the code for trackball from trackball.h and event.h
 	void vCalcRotVec(float fNewX, float fNewY,
 	                 float fOldX, float fOldY,
@@ -83,28 +171,165 @@ protected:
 	void vPerformTransfo(float fOldX, float fNewX, float fOldY, float fNewY);
 	void vTranslate(float fTrans, char cAxis, Matrix4x4 &mMat);
 
+private:
+	// Something the UI asks the render thread to do to the puppet
+	struct Request {
+		enum Kind { ROTATE, PICK, SELECT_REGION, SELECT, IK_GRAB, IK_DRAG, IK_RELEASE, RECORD, UNDO, REDO, RESET_JOINTS, LOADED, DUMP_PROFILE, SEEK } kind;
+		double x, y;			// Degrees about x and y for ROTATE, window position for PICK and IK_*, Select for SELECT, frame for SEEK
+		std::vector<Point2D> region;	// Window polygon for SELECT_REGION
+	};
+
+	// Input whose latency is measured, from the event's timestamp to
+	// the end of the buffer swap that first shows its effect
+	enum LatencyKind { LATENCY_MOTION, LATENCY_PICK, LATENCY_FEED, LATENCY_KINDS };
+	struct InputStamp {
+		double time;						// On the Profiler::now() clock
+		LatencyKind kind;
+	};
+
+	// Everything the render thread needs for one frame. The UI thread
+	// fills one in while the render thread works from the other, and
+	// they are swapped when the render thread starts a frame.
+	struct FrameInput {
+		Matrix4x4 camera;					// World rotation and translation
+		int width, height;
+		Viewer::Modes mode;
+		bool circle, z_buf, bf_cull, ff_cull, profiler;
+		bool contact;						// Joint drags stop where parts touch
+		bool ragdoll;						// The puppet falls limp
+		bool playing;						// The clip plays
+		std::vector<Point2D> region;		// Being dragged out, in window coordinates
+		std::vector<Request> requests;		// In the order they were made
+		std::vector<InputStamp> inputs;		// Input that went into this frame
+		bool dirty;							// Anything new since the last swap
+	};
+
+	// UI thread: hand work to the render thread
+	void post( Request::Kind kind, double x = 0.0, double y = 0.0 );
+	void post( const Request& request );
+	void publish();						// Caller holds m_input_lock
+	void record( InputEvent::Kind kind, int arg = 0, double x = 0.0, double y = 0.0 );
+	void stamp( guint32 time, LatencyKind kind );
+	void feed_arrived();				// On the feed's reader thread
+
+	// Render thread
+	void render_loop();
+	void setup_gl();
+	void swap_input();					// Caller holds m_input_lock
+	bool draw_input();					// False if there is nowhere to draw yet
+	void process( const Request& request );
+	void render_frame( const FrameInput& frame );
+	void frame_shown();					// After the frame from m_render is on screen
+	void log_latency();
+
+	// Draw a circle for the trackball, with OpenGL commands.
+	// Assumes the context for the viewer is active.
+	void draw_trackball_circle( int width, int height );
+
+	// Draw the outline of the region being selected
+	void draw_region( const std::vector<Point2D>& region, int width, int height );
+
+	// Draw the profiler's statistics over the top left of the frame
+	void draw_profile( int width, int height );
+
+	// Draw puppet, or as much of it as has been loaded
+	void draw_puppet( bool picking, const Matrix4x4& camera );
+
 	// Joint Selection
-	void selectMode( int x, int y ); 	// Start selecting parts 
+	int pick( int x, int y );			// Selection pass under a window position, returns the hits
+	void selectMode( int x, int y ); 	// Start selecting parts
 	void pickJoints( int hits );		// Pick out the joint
-  
-private:
+	void selectRegion( const std::vector<Point2D>& region );
+	void selectJoints( Viewer::Select s );
+	void showSelection();				// Make the joints' picked flags match m_selection
+
+	// Dragging an end effector about in IK mode
+	void grabEffector( int x, int y );
+	void dragEffector( int x, int y );
+	void releaseEffector();
+
+	// Letting the puppet fall with the RAGDOLL option
+	void simulate();
+
+	// Posing the joints from the feed
+	void applyFeed();
+
+	// Posing the joints from the clip with the PLAY option
+	void playClip();
+	void showClipFrame( int frame );
+
+	// Joint posing and the action stack
+	void findJoints();
+	void rotateJoints( double x, double y );
+	void rotateJointsApart( double x, double y );	// As far as they go before parts touch
+	void recordAction();
+	void count_undo_bytes();
+	void undoJoints();
+	void redoJoints();
+	void resetJoints();
+
 	// Action structure
 	typedef SceneNode::Info Info;
 	struct Action {
-		std::map<JointNode*, Info> joints;
+		std::vector<Info> joints;		// The joints in allJoints, in the same order
 	};
+	void restoreAction( const Action& action );
 
-	bool button1_pressed, button2_pressed, button3_pressed;	// Multi-press button 
+	// Owned by the UI thread
+	bool button1_pressed, button2_pressed, button3_pressed;	// Multi-press button
 	bool circle, z_buf, bf_cull, ff_cull;                   // Circle, z-buffer, backface cull and frontface cull
+	bool profiler;                                          // Profiler overlay
+	bool lasso;                                             // Drag out a lasso instead of a box
+	bool contact;                                           // Stop joint drags at contact
+	bool ragdoll;                                           // Let the puppet fall
+	bool playing;                                           // Play the clip
+	std::vector<Point2D> m_region;                          // Region being dragged out with button 1
 	Viewer::Modes mode;                                     // Mode
 	Matrix4x4 m_rotate, m_translate;                        // Matrix for world rotation and translation
-	int old_x, old_y;                                       // Old position of x and y
+	double old_x, old_y;                                    // Old position of x and y
+	int width, height;                                      // Size of the window
+	InputRecorder *m_recorder;                              // Where input is recorded to, if anywhere
+
+	// Shared between the threads, guarded by m_input_lock
+	Glib::Mutex m_input_lock;
+	Glib::Cond m_input_cond;                                // Signalled when there is a new frame to draw
+	FrameInput m_buffers[2];
+	FrameInput *m_ui, *m_render;                            // Which buffer each thread owns
+	bool m_quit;
+	SceneLoader *m_loader;                                  // Set before the render thread starts
+	PoseFeed *m_feed;                                       // NULL for none
+	BvhClip *m_clip;                                        // NULL for none
+	volatile int m_clip_shown;                              // Written by the render thread alone
+
+	// Owned by the render thread
+	Glib::Thread *m_render_thread;
+	SceneNode *m_scene;                                     // The puppet, NULL until it has loaded
 	GLuint pickBuffer[BUFFER_SIZE];
-	std::list<Action> actionStack;                          // Undo/Redo stack 
+	GLuint m_font_base;                                     // Display lists for the ASCII characters, 0 until needed
+	std::list<Action> actionStack;                          // Undo/Redo stack
 	std::list<Action>::iterator action_it;                  // Action stack iterator
-	std::list<JointNode *> selectedJoints;                  // Selected Joints
-	std::map<unsigned int, Info> allJoints;					// Map that constains all the joints
-	
+	NodeSet m_selection;                                    // Selected Joints
+	std::vector<NodeId> allJoints;                          // All the joints, in tree order
+	NodeSet m_joints;                                       // The same joints as a set
+	LatencyHistogram m_latency[LATENCY_KINDS];              // For the whole session
+	InputClock m_input_clock;                               // Only used by the UI thread
+	CollisionWorld m_collision;                             // Built from the rest pose when the scene loads
+	IKChain m_ik;                                           // From the root to the grabbed effector
+	double m_ik_depth;                                      // Distance in front of the eye the effector is dragged at
+	Point3D m_ik_target;                                    // Where it is being dragged to, in eye coordinates
+	bool m_ik_solving;                                      // Not there yet, keep drawing frames
+	double m_ik_budget;                                     // IK_BUDGET, or 0 for no limit
+	Ragdoll m_ragdoll;                                      // Built from the pose the puppet is in when it starts
+	bool m_simulating;                                      // Falling and not yet at rest, keep drawing frames
+	bool m_realtime;                                        // Step with the clock, rather than once a frame
+	double m_sim_clock;                                     // When the ragdoll has been stepped up to
+	std::vector<PoseFeed::Angles> m_feed_angles;            // Taken from the feed this frame
+	std::tr1::shared_ptr<const PoseFeed::JointTable> m_feed_table; // The one m_feed_joints was found from
+	std::vector<NodeId> m_feed_joints;                      // For each joint of the table, NO_NODE for none here
+	int m_clip_frame;                                       // Of the clip, shown last
+	bool m_clip_playing;                                    // Playing, keep drawing frames
+	double m_clip_clock;                                    // When the clip has been played up to
+
 	void initialize();
 };
 